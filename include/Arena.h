@@ -0,0 +1,36 @@
+/**
+ * A bump-pointer allocator for the temporaries of one frame.
+ *
+ * @author Benji Northrop
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 32
+
+typedef struct ArenaBlock ArenaBlock;
+
+/**
+ * Memory handed out by bumping a pointer through one block and given back all at once by
+ * arena_reset. When the block runs out a new one is chained on; the next reset frees the chain
+ * and replaces it with a single block big enough for everything the frame used, so after the
+ * first few frames a reset and the allocations of a frame never touch the heap.
+ */
+typedef struct Arena
+{
+    char *base;        // the block being allocated from
+    size_t size, used; // its size and the bytes handed out from it
+    char *last;        // the most recent allocation, which arena_grow can extend in place
+    ArenaBlock *full;  // blocks filled since the last reset, freed by arena_reset
+    size_t total;      // bytes handed out since the last reset, over all the blocks
+} Arena;
+
+Arena *arena_create(size_t size);
+void *arena_alloc(Arena *a, size_t n);
+void *arena_grow(Arena *a, void *p, size_t oldN, size_t newN);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+#endif // ARENA_H
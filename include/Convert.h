@@ -0,0 +1,21 @@
+/**
+ * Conversion between float color channels and packed 8-bit Pixels, for image_write and
+ * image_read, and from Pixels to YCbCr for video output.
+ *
+ * @author Benji Northrop
+ */
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "ppmIO.h"
+
+// sRGB encoding looks floats up in a table of this many steps over [0, 1]
+#define CONVERT_SRGB_STEPS 4096
+
+void convert_toPixels(Pixel *dst, const float *r, const float *g, const float *b, int stride, int n, int srgb);
+void convert_fromPixels(float *r, float *g, float *b, int stride, const Pixel *src, int n, int srgb);
+void convert_encodePixels(Pixel *dst, const Pixel *src, int n);
+void convert_yuv420Rows(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v, const Pixel *row0, const Pixel *row1, int cols);
+void convert_setSIMD(int enable);
+
+#endif // CONVERT_H
@@ -18,6 +18,13 @@ typedef enum ShadeMethod
     ShadePhong
 } ShadeMethod;
 
+typedef enum ZCompare
+{
+    ZCompareGreater,  // draw where 1/z is nearer than the depth buffer, the default
+    ZCompareEqual,    // draw only where 1/z matches the depth buffer, for the pass after a pre-pass
+    ZCompareDepthOnly // write the nearer 1/z to the depth buffer without touching the colors
+} ZCompare;
+
 typedef struct DrawState
 {
     Color color;
@@ -27,10 +34,16 @@ typedef struct DrawState
     float surfaceCoeff;
     ShadeMethod shade;
     int zBufferFlag;
+    int deferred; // 1 to defer ShadePhong lighting to one pass over the G-buffer
+    int threads;  // threads module_draw rasterizes tiles with, 0 or 1 to draw serially
+    ZCompare zCompare;
+    int depthPrepass; // 1 for module_draw to lay down depth first, then shade Gouraud/Phong once per pixel
+    int occlusionCull; // 1 for module_draw to skip sub-modules whose bounding box is hidden by the depth buffer
     Point viewer;
 } DrawState;
 
 DrawState *drawstate_create(void);
+void drawstate_init(DrawState *ds);
 void drawstate_setColor(DrawState *s, Color c);
 void drawstate_setBody(DrawState *s, Color c);
 void drawstate_setSurface(DrawState *s, Color c);
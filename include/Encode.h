@@ -0,0 +1,25 @@
+/**
+ * Built-in QOI and PNG encoders for image_write.
+ *
+ * @author Benji Northrop
+ */
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include "Image.h"
+
+/**
+ * The file formats image_write can produce, chosen from the extension of the file name.
+ */
+typedef enum EncodeFormat
+{
+    EncodePPM, // binary P6, the default for any other extension
+    EncodeQOI, // the Quite OK Image format: lossless, a single fast pass
+    EncodePNG  // 8-bit RGB PNG, compressed with the deflate of Encode.c
+} EncodeFormat;
+
+EncodeFormat encode_format(char *filename);
+int encode_qoi(Image *src, char *filename);
+int encode_png(Image *src, char *filename);
+
+#endif // ENCODE_H
@@ -0,0 +1,48 @@
+/**
+ * Asynchronous, multi-buffered writing of animation frames.
+ *
+ * @author Benji Northrop
+ */
+#ifndef FRAMESINK_H
+#define FRAMESINK_H
+
+#include <pthread.h>
+#include "Image.h"
+#include "Video.h"
+
+#define FRAMESINK_MAX_IMAGES 16
+
+/**
+ * Writes the frames of an animation on a background thread. The frames are rendered into a small
+ * pool of images: framesink_image hands out one that is free, and framesink_submit gives it back
+ * to be written as the next frame, to its own file or appended to a VideoStream, then reset and
+ * returned to the pool. When every image is waiting to be written, framesink_image blocks until
+ * the writer catches up.
+ */
+typedef struct FrameSink
+{
+    char pattern[MAX_FILENAME_LENGTH]; // printf format of the file names, given the frame number
+    VideoStream *video;                // the stream frames are appended to instead, or NULL
+    Image *images[FRAMESINK_MAX_IMAGES];
+    int nImages;
+    Image *free[FRAMESINK_MAX_IMAGES]; // images ready to render into
+    int nFree;
+    Image *queue[FRAMESINK_MAX_IMAGES]; // submitted images, oldest first
+    int frame[FRAMESINK_MAX_IMAGES];    // the frame number of each submitted image
+    int head, nQueued;
+    int nextFrame;
+    int done; // set by framesink_free to stop the writer
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signaled when an image is submitted or the sink is closing
+    pthread_cond_t ready; // signaled when an image returns to the pool
+    pthread_t writer;
+} FrameSink;
+
+FrameSink *framesink_create(char *pattern, int rows, int cols, int nImages);
+FrameSink *framesink_createVideo(VideoStream *vs, int nImages);
+Image *framesink_image(FrameSink *fs);
+void framesink_submit(FrameSink *fs, Image *src);
+void framesink_finish(FrameSink *fs);
+void framesink_free(FrameSink *fs);
+
+#endif // FRAMESINK_H
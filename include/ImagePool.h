@@ -0,0 +1,31 @@
+/**
+ * A pool of allocated images for code that creates and frees scratch images repeatedly.
+ *
+ * @author Benji Northrop
+ */
+#ifndef IMAGEPOOL_H
+#define IMAGEPOOL_H
+
+#include <pthread.h>
+#include "Image.h"
+
+/**
+ * Images given back to the pool, kept allocated to be handed out again to a request for the same
+ * size and format. An image is not cleared when it comes back; imagepool_get resets it, which only
+ * rewrites the tiles that were drawn into (see DirtyTiles).
+ */
+typedef struct ImagePool
+{
+    Image **images;
+    int nImages, maxImages;
+    pthread_mutex_t lock;
+} ImagePool;
+
+ImagePool *imagepool_create(void);
+Image *imagepool_get(ImagePool *pool, int rows, int cols, ImageLayout layout);
+Image *imagepool_getFormat(ImagePool *pool, int rows, int cols, ImageLayout layout, ImageDepth depth, ImageColor color);
+void imagepool_put(ImagePool *pool, Image *src);
+void imagepool_clear(ImagePool *pool);
+void imagepool_free(ImagePool *pool);
+
+#endif // IMAGEPOOL_H
@@ -41,4 +41,5 @@ void lighting_add(Lighting *l, LightType type, Color *c, Vector *dir, Point *pos
 void lighting_shading(Lighting *l, Vector *N, Vector *V, Point *p, Color *Cb,
                       Color *Cs, float s, int oneSided, Color *c);
 void lighting_shadingSingle(Light *l, Vector *N, Vector *V, Point *p, Color *Cb, Color *Cs, float s, int oneSided, Color *c);
+void lighting_shadeGBuffer(Lighting *l, Image *src, Point *viewer);
 #endif // LIGHTING_H
@@ -0,0 +1,43 @@
+/**
+ * An indexed triangle mesh, whose vertices are shared by the triangles that use them.
+ *
+ * @author Benji Northrop
+ */
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdio.h>
+#include "Color.h"
+#include "Point.h"
+#include "Vector.h"
+
+/**
+ * Triangles given as three indices into one array of vertices. A vertex has a position, a unit
+ * normal, and optionally a color; if the mesh has colors, each vertex is lit with its color as
+ * the body color under ShadeGouraud, in place of the DrawState body color.
+ */
+typedef struct Mesh
+{
+    int nVertex, maxVertex;
+    Point *vertex;
+    Vector *normal;
+    Color *color; // NULL, or one color per vertex
+    int nTriangle, maxTriangle;
+    int *index; // 3 * nTriangle vertex indices
+    int oneSided;
+    int zBuffer;
+} Mesh;
+
+Mesh *mesh_create(void);
+void mesh_init(Mesh *m);
+void mesh_clear(Mesh *m);
+void mesh_free(Mesh *m);
+void mesh_copy(Mesh *to, Mesh *from);
+int mesh_addVertex(Mesh *m, Point *p, Vector *n, Color *c);
+void mesh_addTriangle(Mesh *m, int a, int b, int c);
+void mesh_setSided(Mesh *m, int oneSided);
+void mesh_zBuffer(Mesh *m, int flag);
+void mesh_calculateNormals(Mesh *m);
+void mesh_print(Mesh *m, FILE *fp);
+
+#endif // MESH_H
@@ -11,6 +11,7 @@
 #include "Lighting.h"
 #include "Line.h"
 #include "Matrix.h"
+#include "Mesh.h"
 #include "Point.h"
 #include "Polyline.h"
 #include "Polygon.h"
@@ -18,6 +19,18 @@
 #include "Fractals.h"
 #include "View3D.h"
 
+// how many frames (module_draw calls) a sub-module found visible by occlusion culling is drawn
+// before it is tested again
+#define OCCLUSION_REUSE_FRAMES 8
+
+// the longest edge, in pixels, that the LOD chains of module_sphereLOD and module_cylinderLOD let
+// a curved surface show on the screen
+#define LOD_EDGE_PIXELS 8.0
+
+// the fraction by which the projected size must pass a level's threshold for the built-in LOD
+// chains to switch to it, so an object at the threshold does not flicker between levels
+#define LOD_HYSTERESIS 0.1
+
 /**
  * typedef enum to support polymorphism in what type of object the Element node holds.
  */
@@ -29,6 +42,8 @@ typedef enum ObjectType
     ObjPoint,
     ObjPolyline,
     ObjPolygon,
+    ObjMesh,
+    ObjInstances,
     ObjIdentity,
     ObjMatrix,
     ObjColor,
@@ -36,9 +51,63 @@ typedef enum ObjectType
     ObjSurfaceColor,
     ObjSurfaceCoeff,
     ObjLight,
-    ObjModule
+    ObjModule,
+    ObjLOD
 } ObjectType;
 
+/**
+ * The material fields of a DrawState: those in effect where a primitive of a compiled module is
+ * drawn, or those a mesh instance is drawn with.
+ */
+typedef struct DrawMaterial
+{
+    Color color;
+    Color body;
+    Color surface;
+    float surfaceCoeff;
+} DrawMaterial;
+
+/**
+ * Copies of one mesh, each drawn with its own transform and material, made by module_meshInstances.
+ * The vertices are stored once for all the copies.
+ */
+typedef struct MeshInstances
+{
+    Mesh mesh;
+    int nInstance;
+    Matrix *xform;              // the transform of each copy, applied before the module's own
+    DrawMaterial *material;     // the material of each copy, or NULL for the DrawState's
+    Point boundsMin, boundsMax; // bounding box of the mesh, for culling each copy
+} MeshInstances;
+
+/**
+ * The level an LOD last drew at one place in the module hierarchy, that is, for one chain of
+ * elements leading from the module given to module_draw to the ObjLOD element.
+ */
+typedef struct LODState
+{
+    unsigned long long path; // hash of the chain of elements, 0 for an empty slot
+    unsigned stamp;          // the module_draw call that picked level
+    int level;
+} LODState;
+
+/**
+ * Versions of one object at decreasing detail, made by module_lod. module_draw draws the finest
+ * level whose threshold the object's projected size reaches.
+ */
+typedef struct LOD
+{
+    int nLevel;
+    void **level;       // the Modules, from the finest to the coarsest
+    double *minSize;    // the projected size in pixels at or above which each level is drawn
+    double hysteresis;  // the fraction the size must pass a threshold by to switch levels
+    int own;            // 1 if deleting the element deletes the levels
+    LODState *state;    // open addressed table of the level drawn at each place, by path
+    int nState;         // the slots in use
+    int maxState;       // the slots in the table, a power of two or 0
+    unsigned drawn[2];  // the two module_draw calls that drew the LOD last, the latest second
+} LOD;
+
 /**
  * This union allows polymorphism when storing a type of object in an Element node.
  */
@@ -49,11 +118,14 @@ typedef union Object
     Line line;
     Polyline polyline;
     Polygon polygon;
+    Mesh mesh;
+    MeshInstances instances;
     Matrix matrix;
     Color color;
     float coeff;
     void *module;
     Light light;
+    LOD lod;
 } Object;
 
 /**
@@ -64,6 +136,8 @@ typedef struct Element
     ObjectType type;
     Object obj;
     void *next;
+    int visibleFrames;     // ObjModule only: frames left before occlusion culling tests it again
+    unsigned visibleStamp; // ObjModule only: the module_draw call that last set or counted visibleFrames
 } Element;
 
 /**
@@ -71,10 +145,51 @@ typedef struct Element
  */
 typedef struct Module
 {
-    Element *head; // pointer to the head of the linked list
-    Element *tail; // keep around a pointer to the last object
+    Element *head;              // pointer to the head of the linked list
+    Element *tail;              // keep around a pointer to the last object
+    unsigned boundsStamp;       // the bounds counter in Module.c when the fields below were computed, 0 for never
+    int solid;                  // 1 if everything the module draws is a depth-tested polygon
+    Point boundsMin, boundsMax; // bounding box of what the module draws, in its own coordinates
 } Module;
 
+/**
+ * One primitive of a compiled module. Its vertices are the nVertex entries of the DrawList
+ * arrays from first on.
+ */
+typedef struct DrawItem
+{
+    ObjectType type; // ObjPolygon, ObjPolyline, ObjLine, ObjPoint, or ObjBezier
+    int first, nVertex;
+    int material; // index of its DrawMaterial
+    int zBuffer;
+    int oneSided;   // polygons only
+    int colored;    // polygons only: 1 if it has vertex colors of its own
+    int bodyColors; // polygons only: 1 if its vertex colors are the body colors to light, as for a Mesh
+} DrawItem;
+
+/**
+ * A module hierarchy flattened by module_compile into the primitives it draws, in drawing order,
+ * with every vertex already in world coordinates and every material resolved. Drawing it from a
+ * new VTM is a single loop over the items that allocates nothing (except for the polygons handed
+ * to a TileRenderer, which keeps its own copies).
+ */
+typedef struct DrawList
+{
+    DrawItem *item;
+    int nItem, maxItem;
+    DrawMaterial *material;
+    int nMaterial, maxMaterial;
+    Point *vertex;       // world coordinates of the vertices of every item, item after item
+    Point *vertex3D;     // polygons: the world vertices as the shading interpolates them
+    Vector *normal;      // polygons: world unit normals, lit for Gouraud shading
+    Vector *normalPhong; // polygons: the normals interpolated for Phong shading
+    Color *color;        // polygons: the vertex colors of colored polygons and of meshes
+    int nVertex, maxVertex;
+    Point *screen;       // the screen coordinates of the item being drawn
+    Color *shade;        // the Gouraud colors of the polygon being drawn
+    int maxItemVertex;   // the size of screen and shade
+} DrawList;
+
 Element *element_create(void);
 Element *element_init(ObjectType type, void *obj);
 void element_delete(Element *e);
@@ -87,12 +202,21 @@ void module_point(Module *md, Point *p);
 void module_line(Module *md, Line *p);
 void module_polyline(Module *md, Polyline *p);
 void module_polygon(Module *md, Polygon *p);
+void module_mesh(Module *md, Mesh *m);
+void module_meshInstances(Module *md, Mesh *m, int n, Matrix *xform, DrawMaterial *material);
+void module_lod(Module *md, int n, Module **levels, double *minSize, double hysteresis);
 void module_identity(Module *md);
 void module_translate2D(Module *md, double tx, double ty);
 void module_scale2D(Module *md, double sx, double sy);
 void module_rotateZ(Module *md, double cth, double sth);
 void module_shear2D(Module *md, double shx, double shy);
 void module_draw(Module *md, Matrix *VTM, Matrix *GTM, DrawState *ds, Lighting *lighting, Image *src);
+void module_freeFrameArena(void);
+void module_invalidateBounds(Module *md);
+DrawList *module_compile(Module *md, Matrix *GTM, DrawState *ds);
+void drawlist_draw(DrawList *dl, Matrix *VTM, DrawState *ds, Lighting *lighting, Image *src);
+void drawlist_free(DrawList *dl);
+void drawlist_mesh(DrawList *dl, Mesh *mesh);
 // 3D Module Functions
 void module_translate(Module *md, double tx, double ty, double tz);
 void module_scale(Module *md, double sx, double sy, double sz);
@@ -103,8 +227,13 @@ void module_cube(Module *md, int solid);
 void module_cylinder(Module *md, int sides);
 void module_pyramid(Module *md, int sides);
 void module_sphere(Module *md, int resolution);
+void module_cylinderMesh(Module *md, int sides);
+void module_sphereMesh(Module *md, int resolution);
+void module_cylinderLOD(Module *md, int sides);
+void module_sphereLOD(Module *md, int resolution);
 void module_buildHeightMap(Module *md, DrawState *ds, int oldRows, int oldCols, double prevMap[oldRows][oldCols], int count, int maxIterations, double roughness);
 void module_terrain(Module *md, DrawState *ds, int iterations, double roughness);
+void module_terrainMesh(Module *md, int iterations, double roughness);
 void module_fractalTriangle(Module *md, Point *A, Point *B, Point *C, int s, double r);
 void module_color(Module *md, Color *c);
 void module_bodyColor(Module *md, Color *c);
@@ -4,6 +4,13 @@
 #include "Vector.h"
 #include "DrawState.h"
 #include "Lighting.h"
+#include "Arena.h"
+
+// Fixed point rasterization snaps screen coordinates to 1/POLYGON_SUBPIXEL of a pixel (28.4).
+// Polygons with a vertex more than POLYGON_FIXED_RANGE pixels from the origin are filled in
+// floating point instead, which keeps every edge function exact.
+#define POLYGON_SUBPIXEL 16
+#define POLYGON_FIXED_RANGE 131072.0
 
 typedef struct Polygon
 {
@@ -15,6 +22,7 @@ typedef struct Polygon
     Vector *normal;
     Vector *normalPhong;
     int zBuffer;
+    Arena *arena; // allocates the arrays when set; polygon_clear then leaves them to the arena
 } Polygon;
 
 // Constructors
@@ -42,6 +50,12 @@ void polygon_draw(Polygon *p, Image *src, Color c);
 void polygon_drawFill(Polygon *p, Image *src, Color c);
 void polygon_drawFillB(Polygon *p, Image *src, Color c);
 void polygon_drawShade(Polygon *p, Image *src, DrawState *ds, Lighting *l);
+void polygon_drawShadeClip(Polygon *p, Image *src, DrawState *ds, Lighting *l, int r0, int c0, int r1, int c1, int material);
+void polygon_drawTriangle(Polygon *p, Image *src, DrawState *ds, Lighting *l, int r0, int c0, int r1, int c1, int material);
+void polygon_setSIMD(int flag);
+void polygon_setTriangleFill(int flag);
+void polygon_setFixedPoint(int flag);
+int polygon_getFixedPoint(void);
 void polygon_shade(Polygon *p, DrawState *ds, Lighting *l);
 
 #endif // POLYGON_H
@@ -2,12 +2,14 @@
 
 #define POLYLINE_H
 #include "Point.h"
+#include "Arena.h"
 
 typedef struct Polyline
 {
     int zBuffer;   // default true (1), determine if use zBuffer
     int numVertex; // Num of vertices
     Point *vertex; // Vertex info
+    Arena *arena;  // allocates the vertex list when set; polyline_clear then leaves it to the arena
 } Polyline;
 
 // Constructors / Setters
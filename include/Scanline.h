@@ -3,14 +3,25 @@
 
 #include "Polygon.h"
 #include "Image.h"
-#include "list.h"
 #include "DrawState.h"
 #include "Color.h"
 
-static int compYStart(const void *a, const void *b);
-static int compXIntersect(const void *a, const void *b);
-static Edge *makeEdgeRec(Point start, Point end, Image *src, Color c0, Color c1, Point p1, Point p2, Vector n1, Vector n2, int oneSided);
-static LinkedList *setupEdgeList(Polygon *p, Image *src);
-static void fillScan(int scan, LinkedList *active, Image *src, Color c);
-static int processEdgeList(LinkedList *edges, Image *src, DrawState *ds, Lighting *light);
+typedef struct tEdge Edge;
+typedef struct EdgeTable EdgeTable;
+typedef void (*SpanFunc)(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+
+static void edgeTable_reserve(EdgeTable *et, int nEdges, int nBuckets);
+static void activeInsert(EdgeTable *et, Edge *edge);
+static void activeSort(EdgeTable *et);
+static Edge *makeEdgeRec(EdgeTable *et, Point start, Point end, Image *src, Color c0, Color c1, Point p1, Point p2, Vector n1, Vector n2, int oneSided);
+static int setupEdgeList(EdgeTable *et, Polygon *p, Image *src);
+static int spanColumns(EdgeTable *et, Edge *p1, Edge *p2, int *start, int *end);
+static void spanConstant(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+static void spanDepth(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+static void spanGouraud(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+static void spanPhong(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+static void spanGBuffer(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+static SpanFunc selectSpan(DrawState *ds, Lighting *l, Image *src);
+static void fillScan(int scan, EdgeTable *et, Image *src, SpanFunc span, DrawState *ds, Lighting *l);
+static int processEdgeList(EdgeTable *et, Image *src, DrawState *ds, Lighting *light);
 #endif // SCANLINE_H
@@ -0,0 +1,59 @@
+/**
+ * Tile-binned, multithreaded polygon rasterization for module_draw.
+ *
+ * @author Benji Northrop
+ */
+#ifndef TILES_H
+#define TILES_H
+
+#include "Arena.h"
+#include "DrawState.h"
+#include "Image.h"
+#include "Lighting.h"
+#include "Polygon.h"
+
+#define TILE_SIZE 64
+#define MAX_TILE_THREADS 64
+
+/**
+ * A polygon waiting to be rasterized, with the DrawState it was submitted with.
+ */
+typedef struct TileCommand
+{
+    Polygon poly;
+    DrawState ds;
+    int material; // G-buffer material for deferred Phong, -1 otherwise
+} TileCommand;
+
+/**
+ * The commands that touch one tile, as indices into the command list in submission order.
+ */
+typedef struct TileBin
+{
+    int *cmd;
+    int nCmd, maxCmd;
+} TileBin;
+
+/**
+ * Collects the transformed polygons of a frame, bins them by the TILE_SIZE x TILE_SIZE tiles
+ * their bounding boxes overlap, and rasterizes the tiles in parallel. Each tile draws its
+ * polygons in submission order, so the image matches drawing the polygons one at a time.
+ */
+typedef struct TileRenderer
+{
+    Image *src;
+    Lighting *lighting;
+    int nThreads;
+    int tilesX, tilesY;
+    TileBin *bins;
+    TileCommand *cmds;
+    int nCmds, maxCmds;
+    Arena *arena; // holds the bins and commands for the frame when set, instead of the heap
+} TileRenderer;
+
+void tiles_begin(TileRenderer *tr, Image *src, Lighting *lighting, int nThreads, Arena *arena);
+void tiles_polygon(TileRenderer *tr, Polygon *p, DrawState *ds);
+void tiles_flush(TileRenderer *tr);
+void tiles_end(TileRenderer *tr);
+
+#endif // TILES_H
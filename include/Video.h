@@ -0,0 +1,39 @@
+/**
+ * Streaming output of animation frames to a single Y4M or raw RGB file or pipe.
+ *
+ * @author Benji Northrop
+ */
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <stdio.h>
+#include "Image.h"
+
+/**
+ * The container of a VideoStream.
+ */
+typedef enum VideoFormat
+{
+    VideoY4M, // YUV4MPEG2 with 4:2:0 BT.601 chroma, which encoders such as ffmpeg read from a pipe
+    VideoRGB  // headerless packed 8-bit RGB frames, one after another
+} VideoFormat;
+
+/**
+ * An open stream the frames of one animation are appended to. Every frame has the size the stream
+ * was opened with.
+ */
+typedef struct VideoStream
+{
+    FILE *fp;
+    int closeFile; // 0 when fp is stdout
+    VideoFormat format;
+    int rows, cols;
+    int frames;          // frames written so far
+    unsigned char *yuv;  // a Y4M frame: the Y plane, then Cb, then Cr
+} VideoStream;
+
+VideoStream *video_open(char *filename, VideoFormat format, int rows, int cols, int fps);
+void video_write(VideoStream *vs, Image *src);
+void video_close(VideoStream *vs);
+
+#endif // VIDEO_H
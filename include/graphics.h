@@ -1,16 +1,22 @@
 #include "alphaMask.h"
+#include "Arena.h"
 #include "Bezier.h"
 #include "Circle.h"
 #include "Color.h"
+#include "Convert.h"
 #include "DrawState.h"
 #include "Ellipse.h"
+#include "Encode.h"
 #include "Fractals.h"
 #include "FPixel.h"
+#include "FrameSink.h"
 #include "Image.h"
+#include "ImagePool.h"
 #include "Lighting.h"
 #include "Line.h"
 #include "list.h"
 #include "Matrix.h"
+#include "Mesh.h"
 #include "Module.h"
 #include "Noise.h"
 #include "Point.h"
@@ -18,7 +24,9 @@
 #include "Polyline.h"
 #include "ppmIO.h"
 #include "RayTracer.h"
+#include "Tiles.h"
 #include "Vector.h"
+#include "Video.h"
 #include "View2D.h"
 #include "plyRead.h"
 #include "View3D.h"
@@ -6,27 +6,269 @@
 #include "ppmIO.h"
 #define MAX_FILENAME_LENGTH 255
 
+/**
+ * The surface properties a deferred pixel is lit with.
+ */
+typedef struct Material
+{
+    Color body;
+    Color surface;
+    float surfaceCoeff;
+    int oneSided;
+} Material;
+
+/**
+ * Geometry buffer for deferred shading. Holds, per pixel, the depth the
+ * attributes were written at, the interpolated normal and 3D point, and
+ * an index into the material table (-1 where nothing was drawn). The fills
+ * write it only while active is set, which module_draw does for the length
+ * of a deferred pass; at other times ShadePhong lights pixels directly.
+ */
+typedef struct GBuffer
+{
+    float *z;
+    float *normal;   // 3 floats per pixel
+    float *position; // 3 floats per pixel
+    int *material;
+    Material *materials;
+    int nMaterials;
+    int maxMaterials;
+    int active; // 1 while module_draw rasterizes a deferred pass into it
+} GBuffer;
+
+// HiZ tiles are (1 << HIZ_SHIFT) pixels on a side
+#define HIZ_SHIFT 3
+
+// ImageLayoutTiled tiles are (1 << IMAGE_TILE_SHIFT) pixels on a side
+#define IMAGE_TILE_SHIFT 3
+
+/**
+ * How the channels of an Image are laid out in memory.
+ */
+typedef enum ImageLayout
+{
+    ImageLayoutRows,        // FPixel rows through data, with separate a and z arrays (the default)
+    ImageLayoutPlanar,      // a 64-byte aligned plane per channel: r, g, b, a, z
+    ImageLayoutInterleaved, // r, g, b, z, a of a pixel together, so a z-tested write touches one line
+    ImageLayoutTiled        // 8x8 tiles stored one after another, row-major inside each tile
+} ImageLayout;
+
+/**
+ * How the z channel of an Image stores 1/z. The fixed point formats store the unsigned normalized
+ * depth 1 - z = 1 - 1/(1/z), which grows toward the viewer like 1/z does and is 0 at the reset
+ * value 1/z = 1, so a z-test compares stored integers with the same greater-than as the floats.
+ */
+typedef enum ImageDepth
+{
+    ImageDepthFloat, // a float per pixel holding 1/z (the default)
+    ImageDepth16,    // 16-bit unorm
+    ImageDepth24     // 24-bit unorm packed into 3 bytes
+} ImageDepth;
+
+/**
+ * How the color channels of an Image are stored. ImageColor8 renders straight into the packed
+ * 8-bit Pixels writePPM takes, a quarter of the color bytes of the floats, with each channel
+ * clamped and rounded on the store exactly as image_write converts the floats.
+ */
+typedef enum ImageColor
+{
+    ImageColorFloat, // a float per channel (the default)
+    ImageColor8      // a Pixel of unsigned chars, in storage index order
+} ImageColor;
+
+#define IMAGE_DEPTH16_MAX 65535u
+#define IMAGE_DEPTH24_MAX 16777215u
+
+/**
+ * Where the pixels of one image row are, for code that walks a row in any layout. Pixel c of the
+ * row is at index IMAGE_ROW_INDEX(v, c), and its red value is at v->r[index * v->cs].
+ */
+typedef struct ImageRow
+{
+    float *r, *g, *b, *z;
+    int cs, zs; // floats from one index to the next in the color and z channels
+    int tiled;
+    ImageDepth depth;
+    unsigned short *z16;  // the z channel of ImageDepth16, NULL otherwise
+    unsigned char *z24;   // the z channel of ImageDepth24, 3 bytes a pixel, NULL otherwise
+    Pixel *pix;           // the colors of ImageColor8, NULL otherwise
+} ImageRow;
+
+#define IMAGE_ROW_INDEX(v, c) ((v)->tiled ? (((c) >> IMAGE_TILE_SHIFT) << (2 * IMAGE_TILE_SHIFT)) + ((c) & ((1 << IMAGE_TILE_SHIFT) - 1)) : (c))
+
+/**
+ * Quantizes 1/z to a fixed point depth with the largest value max.
+ */
+static inline unsigned image_depthQuantize(float zinv, unsigned max)
+{
+    float d = 1.0f - 1.0f / zinv;
+    if (!(d > 0.0f)) // also catches 1/z <= 0
+        return 0;
+    if (d >= 1.0f)
+        return max;
+    return (unsigned)(d * (float)max + 0.5f);
+}
+
+/**
+ * The 1/z a fixed point depth with the largest value max stands for.
+ */
+static inline float image_depthValue(unsigned q, unsigned max)
+{
+    return 1.0f / (1.0f - (float)q / (float)max);
+}
+
+/**
+ * The 1/z the z channel ends up holding after storing zinv in the depth format.
+ */
+static inline float image_depthRound(ImageDepth depth, float zinv)
+{
+    switch (depth)
+    {
+    case ImageDepth16:
+        return image_depthValue(image_depthQuantize(zinv, IMAGE_DEPTH16_MAX), IMAGE_DEPTH16_MAX);
+    case ImageDepth24:
+        return image_depthValue(image_depthQuantize(zinv, IMAGE_DEPTH24_MAX), IMAGE_DEPTH24_MAX);
+    default:
+        return zinv;
+    }
+}
+
+/**
+ * The z-test of the span fills: tests 1/z of zinv against pixel index k of the row (from
+ * IMAGE_ROW_INDEX), and stores it if the pixel passes. The test is nearer than the z channel or,
+ * with equal set, exactly what is there. Called with a constant depth the switch compiles away.
+ * @return 1 if the pixel passes
+ */
+static inline __attribute__((always_inline)) int image_rowDepthTest(ImageRow *v, int k, float zinv, int equal, ImageDepth depth)
+{
+    unsigned q, old;
+    unsigned char *p;
+
+    switch (depth)
+    {
+    case ImageDepth16:
+        q = image_depthQuantize(zinv, IMAGE_DEPTH16_MAX);
+        old = v->z16[k];
+        if (equal ? q != old : q <= old)
+            return 0;
+        v->z16[k] = (unsigned short)q;
+        return 1;
+    case ImageDepth24:
+        q = image_depthQuantize(zinv, IMAGE_DEPTH24_MAX);
+        p = &(v->z24[3 * k]);
+        old = p[0] | (p[1] << 8) | ((unsigned)p[2] << 16);
+        if (equal ? q != old : q <= old)
+            return 0;
+        p[0] = q & 0xff;
+        p[1] = (q >> 8) & 0xff;
+        p[2] = q >> 16;
+        return 1;
+    default:
+        if (equal ? zinv != v->z[k * v->zs] : !(zinv > v->z[k * v->zs]))
+            return 0;
+        v->z[k * v->zs] = zinv;
+        return 1;
+    }
+}
+
+/**
+ * A color channel value as ImageColor8 stores it: the conversion of float_to_uc.
+ */
+static inline unsigned char image_colorByte(float val)
+{
+    if (val < 0)
+        val = 0;
+    else if (val > 1)
+        val = 1;
+    return (unsigned char)(val * 255 + .5);
+}
+
+/**
+ * Stores a color at pixel index k of the row (from IMAGE_ROW_INDEX), in whichever color format
+ * the row has.
+ */
+static inline __attribute__((always_inline)) void image_rowSetColor(ImageRow *v, int k, float r, float g, float b)
+{
+    if (v->pix)
+    {
+        v->pix[k].r = image_colorByte(r);
+        v->pix[k].g = image_colorByte(g);
+        v->pix[k].b = image_colorByte(b);
+        return;
+    }
+    v->r[k * v->cs] = r;
+    v->g[k * v->cs] = g;
+    v->b[k * v->cs] = b;
+}
+
+/**
+ * Hierarchical z for early rejection. For each 8x8 tile of the z channel it holds the farthest
+ * depth (the smallest 1/z) in the tile. Depth only ever gets nearer, so a stored value stays a
+ * safe bound after more drawing; a tile is marked dirty when it is drawn into and its value is
+ * recomputed the next time a polygon test needs it.
+ */
+typedef struct HiZ
+{
+    float *z;
+    unsigned char *dirty;
+    int rows, cols; // tiles down and across
+} HiZ;
+
+/**
+ * The 8x8 tiles, on the HiZ grid, written since the last image_reset. A tile that is not set
+ * still holds the reset values, so image_reset only rewrites the tiles that are, and the cost of
+ * a clear follows what was drawn rather than the size of the image.
+ */
+typedef struct DirtyTiles
+{
+    unsigned char *tile; // one flag per tile
+    unsigned char *row;  // one flag per row of tiles, set when any tile in the row is
+} DirtyTiles;
+
 typedef struct
 {
-    FPixel **data;
+    FPixel **data; // ImageLayoutRows only, NULL otherwise
     int rows;
     int cols;
-    float *a;
-    float *z;
+    float *a; // ImageLayoutRows only, NULL otherwise
+    float *z; // ImageLayoutRows with ImageDepthFloat only, NULL otherwise
     float maxval;
     char filename[MAX_FILENAME_LENGTH];
+    GBuffer *gbuffer; // NULL unless deferred shading is used
+    HiZ hiz;
+    DirtyTiles dirty;
+    ImageLayout layout;
+    float *plane[5]; // channels r, g, b, a, z of the pixel at index 0; r, g, b are NULL unless
+                     // ImageColorFloat and z is NULL unless ImageDepthFloat
+    int stride[5];   // floats from one pixel index to the next in each channel
+    int nPixels;     // pixel indices in storage, more than rows * cols when tiles are padded
+    int tileCols;    // ImageLayoutTiled tiles across
+    float *buf;      // storage of the layouts other than ImageLayoutRows
+    ImageDepth depth;
+    unsigned short *z16; // z channel of ImageDepth16, in storage index order
+    unsigned char *z24;  // z channel of ImageDepth24, 3 bytes a pixel in storage index order
+    ImageColor color;
+    Pixel *pix; // colors of ImageColor8, in storage index order
+    Pixel *out; // the Pixels image_pixels converts into, kept from one call to the next
 } Image;
 
 // Constructors / Deconstructor
 Image *image_create(int rows, int cols);
+Image *image_createLayout(int rows, int cols, ImageLayout layout);
+Image *image_createFormat(int rows, int cols, ImageLayout layout, ImageDepth depth, ImageColor color);
 void image_free(Image *src);
 void image_init(Image *src);
 int image_alloc(Image *src, int rows, int cols);
+int image_allocLayout(Image *src, int rows, int cols, ImageLayout layout);
+int image_allocFormat(Image *src, int rows, int cols, ImageLayout layout, ImageDepth depth, ImageColor color);
 void image_dealloc(Image *src);
 
 // input/output
 Image *image_read(char *filename);
 int image_write(Image *src, char *filename);
+Pixel *image_pixels(Image *src);
+void image_pixelRow(Image *src, int r, Pixel *row);
+void image_setSRGB(int srgb);
 
 // Access
 FPixel image_getf(Image *src, int r, int c);
@@ -39,6 +281,9 @@ void image_setf(Image *src, int r, int c, FPixel val);
 void image_setc(Image *src, int r, int c, int b, float val);
 void image_seta(Image *src, int r, int c, float val);
 void image_setz(Image *src, int r, int c, float val);
+int image_zTest(Image *src, int r, int c, double val);
+int image_index(Image *src, int r, int c);
+void image_row(Image *src, int r, ImageRow *v);
 
 // Utility
 void image_reset(Image *src);
@@ -48,4 +293,18 @@ void image_fillrgb(Image *src, float r, float g, float b);
 void image_filla(Image *src, float a);
 void image_fillz(Image *src, float z);
 
+// Hierarchical z
+void image_hizMark(Image *src, int r, int c0, int c1);
+int image_hizOccluded(Image *src, int r0, int c0, int r1, int c1, float zinv);
+
+// Dirty tiles
+void image_touch(Image *src, int r, int c0, int c1);
+void image_touchAll(Image *src);
+
+// Deferred shading
+void image_allocGBuffer(Image *src);
+void image_freeGBuffer(Image *src);
+void image_clearGBuffer(Image *src);
+int image_gbufferMaterial(Image *src, Color *body, Color *surface, float surfaceCoeff, int oneSided);
+
 #endif // IMAGE_H
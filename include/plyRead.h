@@ -2,4 +2,11 @@
 
 #define PLYREAD_H
 
+#include "Color.h"
+#include "Mesh.h"
+#include "Polygon.h"
+
+int readPLY(char filename[], int *nPolygons, Polygon **plist, Color **clist, int estNormals);
+int readPLYMesh(char filename[], Mesh *mesh, int estNormals);
+
 #endif // PLYREAD_H
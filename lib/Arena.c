@@ -0,0 +1,196 @@
+/**
+ * A bump-pointer allocator for the temporaries of one frame.
+ *
+ * module_draw copies every polygon it draws, and the copy used to make five trips through malloc
+ * and free, with the tile renderer's bins and command list allocated and freed again around each
+ * frame. Nothing allocated while drawing outlives the frame, so all of it comes from an Arena
+ * instead: an allocation is a pointer bump, freeing is a no-op, and arena_reset at the start of
+ * the next frame gives everything back at once.
+ *
+ * An Arena is not locked; each thread that draws uses its own.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Arena.h"
+
+#define ARENA_DEFAULT_SIZE (256 * 1024)
+
+/*
+ * The header in front of each block, padded so the block's memory starts ARENA_ALIGN aligned.
+ */
+struct ArenaBlock
+{
+    ArenaBlock *next;
+};
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * Rounds a size up to a multiple of ARENA_ALIGN.
+ */
+static size_t arena_round(size_t n)
+{
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/**
+ * Allocates a block with room for size bytes after its header.
+ *
+ * @param size The usable size, a multiple of ARENA_ALIGN.
+ * @return Pointer to the usable memory of the block.
+ */
+static char *arena_block(size_t size)
+{
+    ArenaBlock *b = (ArenaBlock *)aligned_alloc(ARENA_ALIGN, ARENA_HEADER + size);
+    if (!b)
+    {
+        fprintf(stderr, "Unable to allocate an arena block\n");
+        exit(-1);
+    }
+    b->next = NULL;
+    return (char *)b + ARENA_HEADER;
+}
+
+/**
+ * Returns the header of the block whose memory starts at base.
+ */
+static ArenaBlock *arena_header(char *base)
+{
+    return (ArenaBlock *)(base - ARENA_HEADER);
+}
+
+/**
+ * Creates an arena.
+ *
+ * @param size The size of the first block in bytes, or 0 for a default. The arena grows past it
+ * as needed.
+ * @return Pointer to the new Arena.
+ */
+Arena *arena_create(size_t size)
+{
+    Arena *a = (Arena *)malloc(sizeof(Arena));
+    if (!a)
+    {
+        fprintf(stderr, "Unable to allocate an arena\n");
+        exit(-1);
+    }
+    a->size = arena_round(size ? size : ARENA_DEFAULT_SIZE);
+    a->base = arena_block(a->size);
+    a->used = 0;
+    a->last = NULL;
+    a->full = NULL;
+    a->total = 0;
+    return a;
+}
+
+/**
+ * Allocates n bytes, aligned to ARENA_ALIGN. The memory is not cleared, and stays valid until
+ * the next arena_reset.
+ *
+ * @param a Pointer to the Arena.
+ * @param n The number of bytes.
+ * @return Pointer to the memory.
+ */
+void *arena_alloc(Arena *a, size_t n)
+{
+    char *p;
+
+    n = arena_round(n);
+    if (a->used + n > a->size)
+    {
+        // keep the full block until the reset and continue in one at least twice its size
+        arena_header(a->base)->next = a->full;
+        a->full = arena_header(a->base);
+        a->size = 2 * a->size > n ? 2 * a->size : n;
+        a->base = arena_block(a->size);
+        a->used = 0;
+    }
+    p = a->base + a->used;
+    a->used += n;
+    a->total += n;
+    a->last = p;
+    return p;
+}
+
+/**
+ * Grows an allocation from the arena to newN bytes, like realloc. The most recent allocation is
+ * extended in place when the block has room; anything else is copied to new memory, and the old
+ * memory is not reused until the reset.
+ *
+ * @param a Pointer to the Arena.
+ * @param p Pointer to the memory from arena_alloc or arena_grow, or NULL.
+ * @param oldN The size p was allocated with.
+ * @param newN The size needed.
+ * @return Pointer to the memory, holding the first oldN bytes of p.
+ */
+void *arena_grow(Arena *a, void *p, size_t oldN, size_t newN)
+{
+    void *q;
+
+    if (!p)
+        return arena_alloc(a, newN);
+    oldN = arena_round(oldN);
+    newN = arena_round(newN);
+    if (newN <= oldN)
+        return p;
+    if ((char *)p == a->last && a->used + (newN - oldN) <= a->size)
+    {
+        a->used += newN - oldN;
+        a->total += newN - oldN;
+        return p;
+    }
+    q = arena_alloc(a, newN);
+    memcpy(q, p, oldN);
+    return q;
+}
+
+/**
+ * Gives back everything allocated from the arena. If the arena had to chain on blocks since the
+ * last reset, they are freed and replaced by one block with room for all of it and half again,
+ * so a frame that allocates the same amount next time fits without growing.
+ *
+ * @param a Pointer to the Arena.
+ */
+void arena_reset(Arena *a)
+{
+    ArenaBlock *b, *next;
+
+    if (a->full)
+    {
+        for (b = a->full; b; b = next)
+        {
+            next = b->next;
+            free(b);
+        }
+        free(arena_header(a->base));
+        a->full = NULL;
+        a->size = arena_round(a->total + a->total / 2);
+        a->base = arena_block(a->size);
+    }
+    a->used = 0;
+    a->last = NULL;
+    a->total = 0;
+}
+
+/**
+ * Frees an arena and all of its blocks.
+ *
+ * @param a Pointer to the Arena.
+ */
+void arena_free(Arena *a)
+{
+    ArenaBlock *b, *next;
+
+    if (!a)
+        return;
+    for (b = a->full; b; b = next)
+    {
+        next = b->next;
+        free(b);
+    }
+    free(arena_header(a->base));
+    free(a);
+}
@@ -0,0 +1,492 @@
+/**
+ * Conversion between float color channels and packed 8-bit Pixels.
+ *
+ * Floats are clamped to [0, 1], scaled, and rounded exactly like float_to_uc, so a converted
+ * image is the same as one converted a channel at a time. With sRGB on, the clamped value picks
+ * one of CONVERT_SRGB_STEPS + 1 entries of an encoding table instead. Bytes go back to floats
+ * through a 256-entry table, which for linear color holds the values uc_to_float returns.
+ *
+ * Rows of Pixels also convert to the 4:2:0 YCbCr of video streams, 16 pixels at a time with SSE2.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "Convert.h"
+
+// The SIMD kernels are built for x86 with gcc/clang and chosen at runtime
+// from the CPU features. Everywhere else only the scalar kernel exists.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_SIMD 1
+#include <immintrin.h>
+#else
+#define CONVERT_SIMD 0
+#endif
+
+// pixels gathered from a strided layout for each call of a kernel
+#define CONVERT_CHUNK 64
+
+_Static_assert(sizeof(Pixel) == 3, "a Pixel array must be packed r, g, b bytes");
+
+typedef void (*ConvertKernel)(unsigned char *dst, const float *src, int n, int srgb);
+
+static int convertSIMD = -1; // the SIMD level of the CPU, -1 until detected
+static int convertEnable = 1;
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+static unsigned char srgbEncode[CONVERT_SRGB_STEPS + 1];
+static unsigned char srgbEncode8[256];
+static float linearDecode[256];
+static float srgbDecode[256];
+
+/**
+ * The sRGB transfer function.
+ * @param v linear intensity in [0, 1]
+ * @return the encoded value in [0, 1]
+ */
+static double convert_srgbFromLinear(double v)
+{
+    return v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+/**
+ * The inverse of the sRGB transfer function.
+ * @param v encoded value in [0, 1]
+ * @return the linear intensity in [0, 1]
+ */
+static double convert_linearFromSRGB(double v)
+{
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+/**
+ * Fills in the lookup tables. Run once, the first time a conversion needs them.
+ */
+static void convert_buildTables(void)
+{
+    int i;
+
+    for (i = 0; i <= CONVERT_SRGB_STEPS; i++)
+        srgbEncode[i] = (unsigned char)(255.0 * convert_srgbFromLinear((double)i / CONVERT_SRGB_STEPS) + 0.5);
+    for (i = 0; i < 256; i++)
+    {
+        linearDecode[i] = (float)i / 255;
+        srgbDecode[i] = (float)convert_linearFromSRGB(i / 255.0);
+        srgbEncode8[i] = (unsigned char)(255.0 * convert_srgbFromLinear(i / 255.0) + 0.5);
+    }
+}
+
+/**
+ * Converts n floats to bytes, one at a time.
+ * @param dst the bytes to write
+ * @param src the floats to read
+ * @param n the number of floats
+ * @param srgb non-zero to encode through the sRGB table
+ */
+static void convert_flatScalar(unsigned char *dst, const float *src, int n, int srgb)
+{
+    float scale = srgb ? CONVERT_SRGB_STEPS : 255;
+    float v;
+    int i, q;
+
+    for (i = 0; i < n; i++)
+    {
+        v = src[i];
+        if (!(v > 0)) // also catches NaN
+            v = 0;
+        else if (v > 1)
+            v = 1;
+        // the .5 is added in double, as in float_to_uc
+        q = (int)(v * scale + .5);
+        dst[i] = srgb ? srgbEncode[q] : (unsigned char)q;
+    }
+}
+
+#if CONVERT_SIMD
+
+/**
+ * Stores 16 rounded values as bytes: saturating packs for linear color, table lookups for sRGB.
+ */
+__attribute__((target("sse2"), always_inline)) static inline void convert_store16(unsigned char *dst, __m128i q0, __m128i q1, __m128i q2, __m128i q3, int srgb)
+{
+    int idx[16] __attribute__((aligned(16)));
+    int j;
+
+    if (!srgb)
+    {
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3)));
+        return;
+    }
+    _mm_store_si128((__m128i *)&idx[0], q0);
+    _mm_store_si128((__m128i *)&idx[4], q1);
+    _mm_store_si128((__m128i *)&idx[8], q2);
+    _mm_store_si128((__m128i *)&idx[12], q3);
+    for (j = 0; j < 16; j++)
+        dst[j] = srgbEncode[idx[j]];
+}
+
+/**
+ * Clamps and scales 4 floats and rounds them the way convert_flatScalar does.
+ */
+__attribute__((target("sse2"), always_inline)) static inline __m128i convert_round4(__m128 v, __m128 scale)
+{
+    __m128d half = _mm_set1_pd(0.5);
+    __m128i lo, hi;
+
+    // max returns 0 for NaN
+    v = _mm_mul_ps(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f)), scale);
+    lo = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(v), half));
+    hi = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), half));
+    return (_mm_unpacklo_epi64(lo, hi));
+}
+
+/**
+ * convert_flatScalar 16 floats at a time with SSE2.
+ */
+__attribute__((target("sse2"))) static void convert_flatSSE(unsigned char *dst, const float *src, int n, int srgb)
+{
+    __m128 scale = _mm_set1_ps(srgb ? CONVERT_SRGB_STEPS : 255.0f);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        convert_store16(dst + i,
+                        convert_round4(_mm_loadu_ps(src + i), scale),
+                        convert_round4(_mm_loadu_ps(src + i + 4), scale),
+                        convert_round4(_mm_loadu_ps(src + i + 8), scale),
+                        convert_round4(_mm_loadu_ps(src + i + 12), scale), srgb);
+    }
+    convert_flatScalar(dst + i, src + i, n - i, srgb);
+}
+
+/**
+ * Clamps and scales 8 floats and rounds them the way convert_flatScalar does, into two halves.
+ */
+__attribute__((target("avx2"), always_inline)) static inline void convert_round8(__m256 v, __m256 scale, __m128i *lo, __m128i *hi)
+{
+    __m256d half = _mm256_set1_pd(0.5);
+
+    v = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f)), scale);
+    *lo = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), half));
+    *hi = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), half));
+}
+
+/**
+ * convert_flatScalar 16 floats at a time with AVX2.
+ */
+__attribute__((target("avx2"))) static void convert_flatAVX2(unsigned char *dst, const float *src, int n, int srgb)
+{
+    __m256 scale = _mm256_set1_ps(srgb ? CONVERT_SRGB_STEPS : 255.0f);
+    __m128i q0, q1, q2, q3;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        convert_round8(_mm256_loadu_ps(src + i), scale, &q0, &q1);
+        convert_round8(_mm256_loadu_ps(src + i + 8), scale, &q2, &q3);
+        convert_store16(dst + i, q0, q1, q2, q3, srgb);
+    }
+    // the tail is a sibling call, which gcc leaves without a vzeroupper; SSE code after a dirty
+    // upper half of the ymm registers runs several times slower
+    _mm256_zeroupper();
+    convert_flatScalar(dst + i, src + i, n - i, srgb);
+}
+
+#endif // CONVERT_SIMD
+
+/**
+ * Turns the SIMD conversion kernels on (non-zero, the default) or off (0). The kernels are only
+ * used when the CPU supports them; the output is the same either way.
+ * @param enable whether to use the SIMD kernels
+ */
+void convert_setSIMD(int enable)
+{
+    convertEnable = enable;
+}
+
+/**
+ * Returns the widest float to byte kernel the CPU supports, and builds the tables the first time.
+ */
+static ConvertKernel convert_kernel(void)
+{
+    int simd = __atomic_load_n(&convertSIMD, __ATOMIC_RELAXED);
+
+    pthread_once(&tableOnce, convert_buildTables);
+    if (simd < 0)
+    {
+        simd = 0;
+#if CONVERT_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            simd = 2;
+        else if (__builtin_cpu_supports("sse2"))
+            simd = 1;
+#endif
+        __atomic_store_n(&convertSIMD, simd, __ATOMIC_RELAXED);
+    }
+    if (!convertEnable)
+        return (convert_flatScalar);
+#if CONVERT_SIMD
+    if (simd == 2)
+        return (convert_flatAVX2);
+    if (simd == 1)
+        return (convert_flatSSE);
+#endif
+    return (convert_flatScalar);
+}
+
+/**
+ * Converts n pixels of float color to Pixels. Pixel i takes its channels from r[i * stride],
+ * g[i * stride], and b[i * stride].
+ * @param dst the Pixels to write
+ * @param r the red channel of the first pixel
+ * @param g the green channel of the first pixel
+ * @param b the blue channel of the first pixel
+ * @param stride floats from one pixel to the next in each channel
+ * @param n the number of pixels
+ * @param srgb non-zero to encode the linear floats as sRGB
+ */
+void convert_toPixels(Pixel *dst, const float *r, const float *g, const float *b, int stride, int n, int srgb)
+{
+    ConvertKernel flat = convert_kernel();
+    float tmp[3 * CONVERT_CHUNK];
+    int i, j, m;
+
+    // packed FPixels are already in the channel order of a Pixel
+    if (stride == 3 && g == r + 1 && b == r + 2)
+    {
+        flat((unsigned char *)dst, r, 3 * n, srgb);
+        return;
+    }
+    for (i = 0; i < n; i += m)
+    {
+        m = n - i < CONVERT_CHUNK ? n - i : CONVERT_CHUNK;
+        for (j = 0; j < m; j++)
+        {
+            tmp[3 * j] = r[(i + j) * stride];
+            tmp[3 * j + 1] = g[(i + j) * stride];
+            tmp[3 * j + 2] = b[(i + j) * stride];
+        }
+        flat((unsigned char *)(dst + i), tmp, 3 * m, srgb);
+    }
+}
+
+/**
+ * Converts n Pixels to float color, the reverse of convert_toPixels.
+ * @param r the red channel of the first pixel
+ * @param g the green channel of the first pixel
+ * @param b the blue channel of the first pixel
+ * @param stride floats from one pixel to the next in each channel
+ * @param src the Pixels to read
+ * @param n the number of pixels
+ * @param srgb non-zero to decode the bytes from sRGB to linear floats
+ */
+void convert_fromPixels(float *r, float *g, float *b, int stride, const Pixel *src, int n, int srgb)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    const float *lut;
+    int i;
+
+    pthread_once(&tableOnce, convert_buildTables);
+    lut = srgb ? srgbDecode : linearDecode;
+    if (stride == 3 && g == r + 1 && b == r + 2)
+    {
+        for (i = 0; i < 3 * n; i++)
+            r[i] = lut[s[i]];
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        r[i * stride] = lut[s[3 * i]];
+        g[i * stride] = lut[s[3 * i + 1]];
+        b[i * stride] = lut[s[3 * i + 2]];
+    }
+}
+
+/**
+ * sRGB encodes n Pixels of linear 8-bit color.
+ * @param dst the Pixels to write, which may be src
+ * @param src the Pixels to read
+ * @param n the number of pixels
+ */
+void convert_encodePixels(Pixel *dst, const Pixel *src, int n)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char *d = (unsigned char *)dst;
+    int i;
+
+    pthread_once(&tableOnce, convert_buildTables);
+    for (i = 0; i < 3 * n; i++)
+        d[i] = srgbEncode8[s[i]];
+}
+
+/*
+ * RGB to YCbCr with the integer BT.601 coefficients for studio swing, the default input of video
+ * encoders: Y in [16, 235] and Cb, Cr in [16, 240]. Right shifts of negative values are
+ * arithmetic, as in the SIMD kernel.
+ */
+#define CONVERT_Y(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define CONVERT_U(r, g, b) (((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define CONVERT_V(r, g, b) (((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+/**
+ * A chunk of two rows of Pixels split into planes: r, g, b of the first row, then of the second.
+ * One spare column holds a copy of the last pixel when a chunk has an odd number.
+ */
+typedef struct ConvertRows
+{
+    unsigned char c[6][CONVERT_CHUNK + 1];
+} ConvertRows;
+
+/**
+ * Converts pixels [i, m) of a chunk, m even, to luma and 2x2 averaged chroma, one pixel at a time.
+ * Only the luma of pixels before n is stored.
+ */
+static void convert_yuvScalar(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v, ConvertRows *in, int i, int n, int m)
+{
+    int r, g, b;
+
+    for (; i < m; i += 2)
+    {
+        y0[i] = CONVERT_Y(in->c[0][i], in->c[1][i], in->c[2][i]);
+        if (y1)
+            y1[i] = CONVERT_Y(in->c[3][i], in->c[4][i], in->c[5][i]);
+        if (i + 1 < n)
+        {
+            y0[i + 1] = CONVERT_Y(in->c[0][i + 1], in->c[1][i + 1], in->c[2][i + 1]);
+            if (y1)
+                y1[i + 1] = CONVERT_Y(in->c[3][i + 1], in->c[4][i + 1], in->c[5][i + 1]);
+        }
+        r = (in->c[0][i] + in->c[0][i + 1] + in->c[3][i] + in->c[3][i + 1] + 2) >> 2;
+        g = (in->c[1][i] + in->c[1][i + 1] + in->c[4][i] + in->c[4][i + 1] + 2) >> 2;
+        b = (in->c[2][i] + in->c[2][i + 1] + in->c[5][i] + in->c[5][i + 1] + 2) >> 2;
+        u[i / 2] = CONVERT_U(r, g, b);
+        v[i / 2] = CONVERT_V(r, g, b);
+    }
+}
+
+#if CONVERT_SIMD
+
+/**
+ * The luma of 16 pixels from their r, g, b bytes. The weighted sum fits in 16 unsigned bits.
+ */
+__attribute__((target("sse2"), always_inline)) static inline __m128i convert_luma16(const unsigned char *r, const unsigned char *g, const unsigned char *b)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i vr = _mm_loadu_si128((const __m128i *)r);
+    __m128i vg = _mm_loadu_si128((const __m128i *)g);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+    __m128i y[2];
+    int h;
+
+    for (h = 0; h < 2; h++)
+    {
+        __m128i r16 = h ? _mm_unpackhi_epi8(vr, zero) : _mm_unpacklo_epi8(vr, zero);
+        __m128i g16 = h ? _mm_unpackhi_epi8(vg, zero) : _mm_unpacklo_epi8(vg, zero);
+        __m128i b16 = h ? _mm_unpackhi_epi8(vb, zero) : _mm_unpacklo_epi8(vb, zero);
+        __m128i s = _mm_add_epi16(_mm_mullo_epi16(r16, _mm_set1_epi16(66)), _mm_mullo_epi16(g16, _mm_set1_epi16(129)));
+        s = _mm_add_epi16(s, _mm_add_epi16(_mm_mullo_epi16(b16, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+        y[h] = _mm_add_epi16(_mm_srli_epi16(s, 8), _mm_set1_epi16(16));
+    }
+    return (_mm_packus_epi16(y[0], y[1]));
+}
+
+/**
+ * The 2x2 averages of one channel over 16 columns of two rows, as 8 16-bit values.
+ */
+__attribute__((target("sse2"), always_inline)) static inline __m128i convert_average8(const unsigned char *p0, const unsigned char *p1)
+{
+    __m128i mask = _mm_set1_epi16(0xff);
+    __m128i a = _mm_loadu_si128((const __m128i *)p0);
+    __m128i b = _mm_loadu_si128((const __m128i *)p1);
+    __m128i s = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8)),
+                              _mm_add_epi16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8)));
+    return (_mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(2)), 2));
+}
+
+/**
+ * One chroma channel of 8 averaged pixels, kr * r + kg * g + kb * b scaled and offset.
+ */
+__attribute__((target("sse2"), always_inline)) static inline __m128i convert_chroma8(__m128i r, __m128i g, __m128i b, short kr, short kg, short kb)
+{
+    __m128i s = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+    s = _mm_add_epi16(s, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)), _mm_set1_epi16(128)));
+    s = _mm_add_epi16(_mm_srai_epi16(s, 8), _mm_set1_epi16(128));
+    return (_mm_packus_epi16(s, s));
+}
+
+/**
+ * convert_yuvScalar 16 pixels at a time with SSE2.
+ */
+__attribute__((target("sse2"))) static void convert_yuvSSE(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v, ConvertRows *in, int n, int m)
+{
+    __m128i r, g, b;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(y0 + i), convert_luma16(&in->c[0][i], &in->c[1][i], &in->c[2][i]));
+        if (y1)
+            _mm_storeu_si128((__m128i *)(y1 + i), convert_luma16(&in->c[3][i], &in->c[4][i], &in->c[5][i]));
+        r = convert_average8(&in->c[0][i], &in->c[3][i]);
+        g = convert_average8(&in->c[1][i], &in->c[4][i]);
+        b = convert_average8(&in->c[2][i], &in->c[5][i]);
+        _mm_storel_epi64((__m128i *)(u + i / 2), convert_chroma8(r, g, b, -38, -74, 112));
+        _mm_storel_epi64((__m128i *)(v + i / 2), convert_chroma8(r, g, b, 112, -94, -18));
+    }
+    convert_yuvScalar(y0, y1, u, v, in, i, n, m);
+}
+
+#endif // CONVERT_SIMD
+
+/**
+ * Converts a pair of rows of Pixels to 4:2:0 YCbCr: the luma of both rows and one chroma sample
+ * for every 2x2 block, the average of its pixels. For an odd number of columns the last block
+ * repeats the last column; for the last row of an odd number of rows, pass that row as both
+ * rows and y1 as NULL.
+ * @param y0 the luma of the first row, cols bytes
+ * @param y1 the luma of the second row, cols bytes, or NULL to skip it
+ * @param u the Cb samples, (cols + 1) / 2 bytes
+ * @param v the Cr samples, (cols + 1) / 2 bytes
+ * @param row0 the first row
+ * @param row1 the second row
+ * @param cols the number of pixels in a row
+ */
+void convert_yuv420Rows(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v, const Pixel *row0, const Pixel *row1, int cols)
+{
+    ConvertRows in;
+    int simd, i, j, n, m;
+
+    convert_kernel();
+    simd = convertEnable ? __atomic_load_n(&convertSIMD, __ATOMIC_RELAXED) : 0;
+    for (i = 0; i < cols; i += n)
+    {
+        n = cols - i < CONVERT_CHUNK ? cols - i : CONVERT_CHUNK;
+        for (j = 0; j < n; j++)
+        {
+            in.c[0][j] = row0[i + j].r;
+            in.c[1][j] = row0[i + j].g;
+            in.c[2][j] = row0[i + j].b;
+            in.c[3][j] = row1[i + j].r;
+            in.c[4][j] = row1[i + j].g;
+            in.c[5][j] = row1[i + j].b;
+        }
+        m = n;
+        if (m & 1)
+        {
+            for (j = 0; j < 6; j++)
+                in.c[j][m] = in.c[j][m - 1];
+            m++;
+        }
+#if CONVERT_SIMD
+        if (simd)
+        {
+            convert_yuvSSE(y0 + i, y1 ? y1 + i : NULL, u + i / 2, v + i / 2, &in, n, m);
+            continue;
+        }
+#endif
+        convert_yuvScalar(y0 + i, y1 ? y1 + i : NULL, u + i / 2, v + i / 2, &in, 0, n, m);
+    }
+}
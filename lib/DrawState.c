@@ -14,9 +14,26 @@
 DrawState *drawstate_create(void)
 {
     DrawState *ds = (DrawState *)malloc(sizeof(DrawState));
+    drawstate_init(ds);
+    return ds;
+}
+
+/**
+ * Initializes every field of an existing DrawState to the defaults drawstate_create gives, for
+ * DrawStates that live on the stack.
+ *
+ * @param ds: Pointer to the DrawState structure.
+ */
+void drawstate_init(DrawState *ds)
+{
     Color White;
     Point p;
 
+    if (!ds)
+    {
+        fprintf(stderr, "Invalid pointer to drawstate_init\n");
+        exit(-1);
+    }
     color_set(&White, 1, 1, 1);
     point_set(&p, 0, 0, 0, 1);
     color_copy(&(ds->body), &White);
@@ -26,9 +43,12 @@ DrawState *drawstate_create(void)
     ds->surfaceCoeff = 0.0;
     ds->shade = ShadeFrame;
     ds->zBufferFlag = 0;
+    ds->deferred = 0;
+    ds->threads = 0;
+    ds->zCompare = ZCompareGreater;
+    ds->depthPrepass = 0;
+    ds->occlusionCull = 0;
     ds->viewer = p;
-
-    return ds;
 }
 
 /**
@@ -115,5 +135,10 @@ void drawstate_copy(DrawState *to, DrawState *from)
     to->surfaceCoeff = from->surfaceCoeff;
     to->shade = from->shade;
     to->zBufferFlag = from->zBufferFlag;
+    to->deferred = from->deferred;
+    to->threads = from->threads;
+    to->zCompare = from->zCompare;
+    to->depthPrepass = from->depthPrepass;
+    to->occlusionCull = from->occlusionCull;
     point_copy(&(to->viewer), &(from->viewer));
 }
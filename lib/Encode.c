@@ -0,0 +1,734 @@
+/**
+ * Built-in QOI and PNG encoders for image_write.
+ *
+ * Both encoders stream the image: each row is converted to Pixels the way image_pixels converts
+ * the whole image, encoded, and written before the next, so an image is never held a second time
+ * at full size. QOI is a single pass of run, index, and difference codes and is the fastest way
+ * to write a lossless frame. PNG rows are filtered with the filter that leaves the smallest
+ * residuals and compressed with the deflate below: greedy LZ77 over a 32K window with hash
+ * chains, coded with the fixed Huffman tables of RFC 1951, so no zlib is needed.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "Encode.h"
+
+// stdio buffer of an output file
+#define ENCODE_BUFFER (1 << 16)
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_MAX_RUN 62
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_HASH_BITS 15
+// the hash chain candidates tried for a match at each position
+#define DEFLATE_CHAIN 16
+// the window of history followed by input not yet compressed
+#define DEFLATE_INPUT (4 * DEFLATE_WINDOW)
+// the bytes of a row filtered between checks of whether the filter has already lost
+#define ENCODE_FILTER_BLOCK 512
+// the largest IDAT chunk written
+#define PNG_CHUNK (1 << 16)
+
+/**
+ * The state of a deflate stream written to the IDAT chunks of a PNG file.
+ */
+typedef struct Deflate
+{
+    FILE *fp;
+    unsigned char in[DEFLATE_INPUT]; // in[pos - DEFLATE_WINDOW, pos) is the window
+    int len;                         // the bytes in in
+    int pos;                         // the next byte to compress
+    int base;                        // the stream offset of in[0]
+    int head[1 << DEFLATE_HASH_BITS]; // stream offset of the last position with each hash, or -1
+    int prev[DEFLATE_WINDOW];         // the previous position with the same hash as an offset
+    unsigned int adlerA, adlerB;      // Adler-32 of the uncompressed stream
+    unsigned long long bits;          // bits not yet written, the first in the lowest bit
+    int nBits;
+    unsigned char out[PNG_CHUNK]; // compressed bytes of the next IDAT chunk
+    int nOut;
+} Deflate;
+
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+static unsigned int crcTable[256];
+static unsigned short fixedCode[288]; // the fixed literal/length codes, bit-reversed
+static unsigned char fixedLength[288];
+static unsigned short lengthSymbol[DEFLATE_MAX_MATCH + 1];
+static unsigned char distanceSymbol[DEFLATE_WINDOW + 1];
+
+static const unsigned short lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/**
+ * Reverses the low n bits of a code, since deflate sends Huffman codes from the top bit down.
+ * @param code the code
+ * @param n its length in bits
+ * @return the reversed code
+ */
+static unsigned int encode_reverse(unsigned int code, int n)
+{
+    unsigned int r = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        r = (r << 1) | ((code >> i) & 1);
+    return r;
+}
+
+/**
+ * Fills in the CRC and deflate tables. Run once, the first time a PNG is written.
+ */
+static void encode_buildTables(void)
+{
+    unsigned int c;
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+    {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+
+    // RFC 1951 3.2.6
+    for (i = 0; i < 288; i++)
+    {
+        if (i < 144)
+            fixedLength[i] = 8, c = 0x30 + i;
+        else if (i < 256)
+            fixedLength[i] = 9, c = 0x190 + i - 144;
+        else if (i < 280)
+            fixedLength[i] = 7, c = i - 256;
+        else
+            fixedLength[i] = 8, c = 0xc0 + i - 280;
+        fixedCode[i] = encode_reverse(c, fixedLength[i]);
+    }
+    for (k = 0; k < 29; k++)
+        for (i = lengthBase[k]; i < (k < 28 ? lengthBase[k + 1] : DEFLATE_MAX_MATCH + 1); i++)
+            lengthSymbol[i] = k;
+    for (k = 0; k < 30; k++)
+        for (i = distanceBase[k]; i < (k < 29 ? distanceBase[k + 1] : DEFLATE_WINDOW + 1); i++)
+            distanceSymbol[i] = k;
+}
+
+/**
+ * Returns the format image_write uses for a file name: QOI for .qoi, PNG for .png, in any case,
+ * and PPM for everything else.
+ * @param filename the file name
+ * @return the EncodeFormat
+ */
+EncodeFormat encode_format(char *filename)
+{
+    char *ext = filename ? strrchr(filename, '.') : NULL;
+
+    if (ext && strcasecmp(ext, ".qoi") == 0)
+        return EncodeQOI;
+    if (ext && strcasecmp(ext, ".png") == 0)
+        return EncodePNG;
+    return EncodePPM;
+}
+
+/**
+ * Opens a file to encode into, or stdout for an empty name, like writePPM.
+ * @param filename the file name
+ * @return the FILE, or NULL if it could not be opened
+ */
+static FILE *encode_open(char *filename)
+{
+    FILE *fp;
+
+    if (filename == NULL || filename[0] == 0)
+        return stdout;
+    fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, ENCODE_BUFFER);
+    return fp;
+}
+
+/**
+ * Writes a 32-bit value most significant byte first, as both formats store them.
+ * @param dst the four bytes to write
+ * @param v the value
+ */
+static void encode_put32(unsigned char *dst, unsigned int v)
+{
+    dst[0] = v >> 24;
+    dst[1] = v >> 16;
+    dst[2] = v >> 8;
+    dst[3] = v;
+}
+
+/**
+ * Writes an image as QOI: 8-bit RGB, sRGB with linear alpha. Returns 0 on success.
+ * @param src the image
+ * @param filename the output file name
+ * @return 0 if successful, -1 if the file could not be opened
+ */
+int encode_qoi(Image *src, char *filename)
+{
+    Pixel index[64], px, prevPx = {0, 0, 0};
+    Pixel *row;
+    unsigned char *out, header[14];
+    FILE *fp;
+    int r, c, n, run = 0, h;
+    signed char dr, dg, db;
+
+    if (!src || !filename)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+    if ((fp = encode_open(filename)) == NULL)
+        return -1;
+
+    // a pixel codes to at most 4 bytes, and the end marker is 8 more
+    row = (Pixel *)malloc(sizeof(Pixel) * src->cols);
+    out = (unsigned char *)malloc(4 * src->cols + 8);
+    if (row == NULL || out == NULL)
+    {
+        fprintf(stderr, "Encoder allocation failed\n");
+        exit(-1);
+    }
+    // the index starts out transparent black, which no opaque pixel matches: an empty slot must
+    // not pass for opaque black, so the one slot black hashes to holds a color that hashes elsewhere
+    memset(index, 0, sizeof(index));
+    index[(255 * 11) % 64].r = 255;
+
+    memcpy(header, "qoif", 4);
+    encode_put32(header + 4, src->cols);
+    encode_put32(header + 8, src->rows);
+    header[12] = 3;
+    header[13] = 0;
+    fwrite(header, 1, sizeof(header), fp);
+
+    // every pixel is opaque, so the alpha of the format only shows up in the index hash
+    for (r = 0; r < src->rows; r++)
+    {
+        image_pixelRow(src, r, row);
+        n = 0;
+        for (c = 0; c < src->cols; c++)
+        {
+            px = row[c];
+            if (px.r == prevPx.r && px.g == prevPx.g && px.b == prevPx.b)
+            {
+                // runs carry on across rows
+                if (++run == QOI_MAX_RUN)
+                {
+                    out[n++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0)
+            {
+                out[n++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            h = (px.r * 3 + px.g * 5 + px.b * 7 + 255 * 11) % 64;
+            if (index[h].r == px.r && index[h].g == px.g && index[h].b == px.b)
+            {
+                out[n++] = QOI_OP_INDEX | h;
+            }
+            else
+            {
+                index[h] = px;
+                dr = px.r - prevPx.r;
+                dg = px.g - prevPx.g;
+                db = px.b - prevPx.b;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    out[n++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+                }
+                else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7)
+                {
+                    out[n++] = QOI_OP_LUMA | (dg + 32);
+                    out[n++] = (dr - dg + 8) << 4 | (db - dg + 8);
+                }
+                else
+                {
+                    out[n++] = QOI_OP_RGB;
+                    out[n++] = px.r;
+                    out[n++] = px.g;
+                    out[n++] = px.b;
+                }
+            }
+            prevPx = px;
+        }
+        if (r == src->rows - 1)
+        {
+            if (run > 0)
+                out[n++] = QOI_OP_RUN | (run - 1);
+            memset(out + n, 0, 7);
+            out[n + 7] = 1;
+            n += 8;
+        }
+        fwrite(out, 1, n, fp);
+    }
+
+    if (fp != stdout)
+        fclose(fp);
+    else
+        fflush(fp);
+    free(row);
+    free(out);
+    return 0;
+}
+
+/**
+ * Updates a CRC-32 with more bytes.
+ * @param crc the CRC so far, starting from 0
+ * @param data the bytes
+ * @param n the number of bytes
+ * @return the CRC including the bytes
+ */
+static unsigned int encode_crc(unsigned int crc, const unsigned char *data, int n)
+{
+    int i;
+
+    crc = ~crc;
+    for (i = 0; i < n; i++)
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/**
+ * Writes a PNG chunk: length, type, data, and the CRC of the type and data.
+ * @param fp the file
+ * @param type the four character chunk type
+ * @param data the data
+ * @param n the bytes of data
+ */
+static void encode_chunk(FILE *fp, const char *type, const unsigned char *data, int n)
+{
+    unsigned char word[4];
+    unsigned int crc;
+
+    encode_put32(word, n);
+    fwrite(word, 1, 4, fp);
+    fwrite(type, 1, 4, fp);
+    fwrite(data, 1, n, fp);
+    crc = encode_crc(encode_crc(0, (const unsigned char *)type, 4), data, n);
+    encode_put32(word, crc);
+    fwrite(word, 1, 4, fp);
+}
+
+/**
+ * Appends a compressed byte to the next IDAT chunk, writing the chunk once it is full.
+ * @param d the deflate stream
+ * @param byte the byte
+ */
+static inline void deflate_putByte(Deflate *d, unsigned char byte)
+{
+    d->out[d->nOut++] = byte;
+    if (d->nOut == PNG_CHUNK)
+    {
+        encode_chunk(d->fp, "IDAT", d->out, d->nOut);
+        d->nOut = 0;
+    }
+}
+
+/**
+ * Appends bits to the stream, the lowest first.
+ * @param d the deflate stream
+ * @param value the bits
+ * @param n the number of bits, at most 32
+ */
+static inline void deflate_putBits(Deflate *d, unsigned int value, int n)
+{
+    d->bits |= (unsigned long long)value << d->nBits;
+    d->nBits += n;
+    while (d->nBits >= 8)
+    {
+        deflate_putByte(d, d->bits & 0xff);
+        d->bits >>= 8;
+        d->nBits -= 8;
+    }
+}
+
+/**
+ * Appends a literal byte or length symbol with its fixed Huffman code.
+ * @param d the deflate stream
+ * @param sym the symbol, 0 to 287
+ */
+static inline void deflate_putSymbol(Deflate *d, int sym)
+{
+    deflate_putBits(d, fixedCode[sym], fixedLength[sym]);
+}
+
+/**
+ * Appends a match of the previous bytes.
+ * @param d the deflate stream
+ * @param length the length of the match, 3 to 258
+ * @param distance how far back the match starts, 1 to 32768
+ */
+static void deflate_putMatch(Deflate *d, int length, int distance)
+{
+    int k = lengthSymbol[length];
+    int j = distanceSymbol[distance];
+
+    deflate_putSymbol(d, 257 + k);
+    if (lengthExtra[k])
+        deflate_putBits(d, length - lengthBase[k], lengthExtra[k]);
+    // the fixed distance codes are the 5-bit symbol numbers
+    deflate_putBits(d, encode_reverse(j, 5), 5);
+    if (distanceExtra[j])
+        deflate_putBits(d, distance - distanceBase[j], distanceExtra[j]);
+}
+
+/**
+ * Returns the hash chain of the three bytes at p.
+ * @param p the bytes
+ * @return the hash
+ */
+static inline unsigned int deflate_hash(const unsigned char *p)
+{
+    return ((unsigned int)(p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/**
+ * Adds the position i of the input to its hash chain.
+ * @param d the deflate stream
+ * @param i the index into in, with at least DEFLATE_MIN_MATCH bytes from it
+ */
+static inline void deflate_insert(Deflate *d, int i)
+{
+    unsigned int h = deflate_hash(d->in + i);
+    int at = d->base + i;
+
+    d->prev[at & (DEFLATE_WINDOW - 1)] = d->head[h];
+    d->head[h] = at;
+}
+
+/**
+ * Compresses the input from pos. Unless the stream is ending, the last DEFLATE_MAX_MATCH bytes
+ * wait for more input, so that every match is as long as it could be.
+ * @param d the deflate stream
+ * @param final non-zero to compress everything
+ */
+static void deflate_compress(Deflate *d, int final)
+{
+    unsigned char *in = d->in;
+    int limit = final ? d->len : d->len - DEFLATE_MAX_MATCH;
+    int pos = d->pos;
+    int at, cand, next, chain, best, bestDist, maxLen, l, p, i;
+
+    while (pos < limit)
+    {
+        best = 0;
+        bestDist = 0;
+        if (pos + DEFLATE_MIN_MATCH <= d->len)
+        {
+            at = d->base + pos;
+            maxLen = d->len - pos < DEFLATE_MAX_MATCH ? d->len - pos : DEFLATE_MAX_MATCH;
+            cand = d->head[deflate_hash(in + pos)];
+            for (chain = DEFLATE_CHAIN; chain > 0 && cand >= 0 && at - cand <= DEFLATE_WINDOW; chain--)
+            {
+                p = cand - d->base;
+                // a candidate can only beat the best so far if it matches one byte further
+                if (in[p + best] == in[pos + best])
+                {
+                    for (l = 0; l < maxLen && in[p + l] == in[pos + l]; l++)
+                        ;
+                    if (l > best)
+                    {
+                        best = l;
+                        bestDist = at - cand;
+                        if (l == maxLen)
+                            break;
+                    }
+                }
+                next = d->prev[cand & (DEFLATE_WINDOW - 1)];
+                if (next >= cand)
+                    break;
+                cand = next;
+            }
+        }
+
+        if (best >= DEFLATE_MIN_MATCH)
+        {
+            deflate_putMatch(d, best, bestDist);
+            for (i = pos; i < pos + best && i + DEFLATE_MIN_MATCH <= d->len; i++)
+                deflate_insert(d, i);
+            pos += best;
+        }
+        else
+        {
+            deflate_putSymbol(d, in[pos]);
+            if (pos + DEFLATE_MIN_MATCH <= d->len)
+                deflate_insert(d, pos);
+            pos++;
+        }
+    }
+    d->pos = pos;
+}
+
+/**
+ * Appends uncompressed bytes to the stream, compressing whatever no longer fits in the input.
+ * @param d the deflate stream
+ * @param data the bytes
+ * @param n the number of bytes
+ */
+static void deflate_write(Deflate *d, const unsigned char *data, int n)
+{
+    unsigned int a = d->adlerA, b = d->adlerB;
+    int i, k, drop;
+
+    // Adler-32, reduced before the sums can overflow
+    for (i = 0; i < n; i += 5552)
+    {
+        for (k = i; k < n && k < i + 5552; k++)
+        {
+            a += data[k];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    d->adlerA = a;
+    d->adlerB = b;
+
+    while (n > 0)
+    {
+        if (d->len == DEFLATE_INPUT)
+        {
+            deflate_compress(d, 0);
+            // keep a window of history in front of the input still waiting
+            drop = d->pos - DEFLATE_WINDOW;
+            if (drop > 0)
+            {
+                memmove(d->in, d->in + drop, d->len - drop);
+                d->base += drop;
+                d->pos -= drop;
+                d->len -= drop;
+            }
+        }
+        k = DEFLATE_INPUT - d->len < n ? DEFLATE_INPUT - d->len : n;
+        memcpy(d->in + d->len, data, k);
+        d->len += k;
+        data += k;
+        n -= k;
+    }
+}
+
+/**
+ * Returns the Paeth predictor of a byte from its left, upper, and upper left neighbors.
+ * @param a the left byte
+ * @param b the upper byte
+ * @param c the upper left byte
+ * @return whichever of a, b, and c is closest to a + b - c
+ */
+static inline int encode_paeth(int a, int b, int c)
+{
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/**
+ * Filters a row with one PNG filter type, giving up once the residuals add up to limit.
+ * @param dst the filter type byte followed by the filtered row
+ * @param cur the row
+ * @param prev the row above, zeros for the first row
+ * @param n the bytes of the row
+ * @param type the filter type, 0 to 4
+ * @param limit the cost at which to stop
+ * @return the sum of the residuals as signed bytes, at least limit if it stopped early
+ */
+__attribute__((always_inline)) static inline unsigned long encode_filter(unsigned char *dst, const unsigned char *cur, const unsigned char *prev, int n, int type, unsigned long limit)
+{
+    unsigned long cost = 0;
+    unsigned char v;
+    int i, k, end;
+
+    dst[0] = type;
+    dst++;
+    // the first pixel has no left neighbor, which the filters take as zero
+    for (i = 0; i < 3 && i < n; i++)
+    {
+        v = type == 0 || type == 1 ? cur[i] : type == 3 ? cur[i] - prev[i] / 2 : cur[i] - prev[i];
+        dst[i] = v;
+        cost += v < 128 ? v : 256 - v;
+    }
+    // the rest goes in blocks without branches, checking the limit between them
+    for (k = 3; k < n && cost < limit; k = end)
+    {
+        end = n - k < ENCODE_FILTER_BLOCK ? n : k + ENCODE_FILTER_BLOCK;
+        for (i = k; i < end; i++)
+        {
+            switch (type)
+            {
+            case 0:
+                v = cur[i];
+                break;
+            case 1:
+                v = cur[i] - cur[i - 3];
+                break;
+            case 2:
+                v = cur[i] - prev[i];
+                break;
+            case 3:
+                v = cur[i] - (cur[i - 3] + prev[i]) / 2;
+                break;
+            default:
+                v = cur[i] - encode_paeth(cur[i - 3], prev[i], prev[i - 3]);
+                break;
+            }
+            dst[i] = v;
+            cost += v < 128 ? v : 256 - v;
+        }
+    }
+    return cost;
+}
+
+/**
+ * Picks the PNG filter for a row that leaves the smallest residuals, the heuristic of the PNG
+ * specification.
+ * @param buf two scratch rows of n + 1 bytes, the filter type byte and the filtered row
+ * @param cur the row
+ * @param prev the row above, zeros for the first row
+ * @param n the bytes of the row
+ * @return whichever of buf holds the filtered row
+ */
+static unsigned char *encode_filterRow(unsigned char *buf[2], const unsigned char *cur, const unsigned char *prev, int n)
+{
+    unsigned long cost, bestCost = ~0ul;
+    int type, best = 0;
+
+    for (type = 0; type < 5; type++)
+    {
+        // encode_filter is inlined with a constant type, so its switch drops out of the loop
+        switch (type)
+        {
+        case 0:
+            cost = encode_filter(buf[!best], cur, prev, n, 0, bestCost);
+            break;
+        case 1:
+            cost = encode_filter(buf[!best], cur, prev, n, 1, bestCost);
+            break;
+        case 2:
+            cost = encode_filter(buf[!best], cur, prev, n, 2, bestCost);
+            break;
+        case 3:
+            cost = encode_filter(buf[!best], cur, prev, n, 3, bestCost);
+            break;
+        default:
+            cost = encode_filter(buf[!best], cur, prev, n, 4, bestCost);
+            break;
+        }
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            best = !best;
+        }
+    }
+    return buf[best];
+}
+
+/**
+ * Writes an image as an 8-bit RGB PNG. Returns 0 on success.
+ * @param src the image
+ * @param filename the output file name
+ * @return 0 if successful, -1 if the file could not be opened
+ */
+int encode_png(Image *src, char *filename)
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13];
+    unsigned char *cur, *prev, *filtered[2], *swap;
+    Deflate *d;
+    FILE *fp;
+    int r, n;
+
+    if (!src || !filename)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+    if ((fp = encode_open(filename)) == NULL)
+        return -1;
+    n = 3 * src->cols;
+    pthread_once(&tableOnce, encode_buildTables);
+
+    d = (Deflate *)malloc(sizeof(Deflate));
+    cur = (unsigned char *)malloc(n);
+    prev = (unsigned char *)calloc(n, 1);
+    filtered[0] = (unsigned char *)malloc(n + 1);
+    filtered[1] = (unsigned char *)malloc(n + 1);
+    if (d == NULL || cur == NULL || prev == NULL || filtered[0] == NULL || filtered[1] == NULL)
+    {
+        fprintf(stderr, "Encoder allocation failed\n");
+        exit(-1);
+    }
+    d->fp = fp;
+    d->len = d->pos = d->base = 0;
+    memset(d->head, 0xff, sizeof(d->head));
+    d->adlerA = 1;
+    d->adlerB = 0;
+    d->bits = 0;
+    d->nBits = 0;
+    d->nOut = 0;
+
+    fwrite(signature, 1, sizeof(signature), fp);
+    encode_put32(ihdr, src->cols);
+    encode_put32(ihdr + 4, src->rows);
+    ihdr[8] = 8;  // bits per channel
+    ihdr[9] = 2;  // RGB
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // not interlaced
+    encode_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+    // the zlib header, then the whole image as one final block with fixed codes
+    deflate_putByte(d, 0x78);
+    deflate_putByte(d, 0x01);
+    deflate_putBits(d, 1, 1);
+    deflate_putBits(d, 1, 2);
+    for (r = 0; r < src->rows; r++)
+    {
+        image_pixelRow(src, r, (Pixel *)cur);
+        deflate_write(d, encode_filterRow(filtered, cur, prev, n), n + 1);
+        swap = prev;
+        prev = cur;
+        cur = swap;
+    }
+    deflate_compress(d, 1);
+    deflate_putSymbol(d, 256);
+    if (d->nBits > 0)
+        deflate_putBits(d, 0, 8 - d->nBits);
+    deflate_putByte(d, d->adlerB >> 8);
+    deflate_putByte(d, d->adlerB);
+    deflate_putByte(d, d->adlerA >> 8);
+    deflate_putByte(d, d->adlerA);
+    if (d->nOut > 0)
+        encode_chunk(fp, "IDAT", d->out, d->nOut);
+    encode_chunk(fp, "IEND", NULL, 0);
+
+    if (fp != stdout)
+        fclose(fp);
+    else
+        fflush(fp);
+    free(d);
+    free(cur);
+    free(prev);
+    free(filtered[0]);
+    free(filtered[1]);
+    return 0;
+}
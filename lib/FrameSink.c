@@ -0,0 +1,216 @@
+/**
+ * Asynchronous, multi-buffered writing of animation frames.
+ *
+ * An animation loop that renders a frame, writes it, and resets the image leaves the renderer idle
+ * for the whole conversion and write. A FrameSink overlaps the two: the loop asks for an image,
+ * draws into it, and submits it, and a writer thread writes and resets the submitted images in the
+ * order they came in while the loop draws the next frame into another image of the pool. With the
+ * default two images this is double buffering; more images absorb frames that take uneven time.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FrameSink.h"
+
+/**
+ * Body of the writer thread: writes submitted images until the sink is freed.
+ *
+ * @param arg Pointer to the FrameSink.
+ * @return NULL
+ */
+static void *framesink_writer(void *arg)
+{
+    FrameSink *fs = (FrameSink *)arg;
+    char filename[MAX_FILENAME_LENGTH + 32];
+    Image *src;
+    int frame;
+
+    pthread_mutex_lock(&(fs->lock));
+    for (;;)
+    {
+        while (fs->nQueued == 0 && !fs->done)
+            pthread_cond_wait(&(fs->wake), &(fs->lock));
+        if (fs->nQueued == 0)
+            break;
+        src = fs->queue[fs->head];
+        frame = fs->frame[fs->head];
+        pthread_mutex_unlock(&(fs->lock));
+
+        // the image belongs to the writer until it is back in the pool
+        if (fs->video)
+        {
+            video_write(fs->video, src);
+        }
+        else
+        {
+            snprintf(filename, sizeof(filename), fs->pattern, frame);
+            image_write(src, filename);
+        }
+        image_reset(src);
+
+        pthread_mutex_lock(&(fs->lock));
+        fs->head = (fs->head + 1) % FRAMESINK_MAX_IMAGES;
+        fs->nQueued--;
+        fs->free[fs->nFree++] = src;
+        pthread_cond_broadcast(&(fs->ready));
+    }
+    pthread_mutex_unlock(&(fs->lock));
+    return NULL;
+}
+
+/**
+ * Creates a FrameSink with a pool of nImages images of the given size and starts its writer.
+ *
+ * @param pattern The printf format of the file names, with one int conversion for the frame
+ * number, e.g. "sphere-frame%03d.ppm".
+ * @param rows The rows of the frames.
+ * @param cols The columns of the frames.
+ * @param nImages The images in the pool, from 2 to FRAMESINK_MAX_IMAGES; other values are clamped.
+ * @return Pointer to the new FrameSink.
+ */
+FrameSink *framesink_create(char *pattern, int rows, int cols, int nImages)
+{
+    FrameSink *fs;
+    int i;
+
+    if (!pattern)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+    fs = (FrameSink *)malloc(sizeof(FrameSink));
+    if (fs == NULL)
+    {
+        fprintf(stderr, "Error creating the frame sink\n");
+        exit(-1);
+    }
+
+    strncpy(fs->pattern, pattern, MAX_FILENAME_LENGTH - 1);
+    fs->pattern[MAX_FILENAME_LENGTH - 1] = 0;
+    fs->video = NULL;
+    nImages = nImages < 2 ? 2 : nImages;
+    nImages = nImages > FRAMESINK_MAX_IMAGES ? FRAMESINK_MAX_IMAGES : nImages;
+    fs->nImages = nImages;
+    fs->nFree = 0;
+    for (i = 0; i < nImages; i++)
+    {
+        fs->images[i] = image_create(rows, cols);
+        fs->free[fs->nFree++] = fs->images[i];
+    }
+    fs->head = 0;
+    fs->nQueued = 0;
+    fs->nextFrame = 0;
+    fs->done = 0;
+    pthread_mutex_init(&(fs->lock), NULL);
+    pthread_cond_init(&(fs->wake), NULL);
+    pthread_cond_init(&(fs->ready), NULL);
+    if (pthread_create(&(fs->writer), NULL, framesink_writer, fs) != 0)
+    {
+        fprintf(stderr, "Error starting the frame writer\n");
+        exit(-1);
+    }
+    return fs;
+}
+
+/**
+ * Creates a FrameSink like framesink_create that appends the frames to a stream instead of
+ * writing a file for each. The images have the size of the stream, which stays open after
+ * framesink_free and is closed by the caller.
+ *
+ * @param vs Pointer to an open VideoStream.
+ * @param nImages The images in the pool, from 2 to FRAMESINK_MAX_IMAGES; other values are clamped.
+ * @return Pointer to the new FrameSink.
+ */
+FrameSink *framesink_createVideo(VideoStream *vs, int nImages)
+{
+    FrameSink *fs;
+
+    if (!vs)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+    fs = framesink_create("", vs->rows, vs->cols, nImages);
+    fs->video = vs;
+    return fs;
+}
+
+/**
+ * Returns an image of the pool to render the next frame into. The image holds the reset values,
+ * like a new image. If every image is waiting to be written, waits for the writer to finish one.
+ *
+ * @param fs Pointer to the FrameSink.
+ * @return Pointer to the Image, owned by the caller until framesink_submit.
+ */
+Image *framesink_image(FrameSink *fs)
+{
+    Image *src;
+
+    pthread_mutex_lock(&(fs->lock));
+    while (fs->nFree == 0)
+        pthread_cond_wait(&(fs->ready), &(fs->lock));
+    src = fs->free[--fs->nFree];
+    pthread_mutex_unlock(&(fs->lock));
+    return src;
+}
+
+/**
+ * Hands a finished frame to the writer. The image is written to the file name of the next frame
+ * number, reset, and put back in the pool, so the caller must not use it after this call.
+ *
+ * @param fs Pointer to the FrameSink.
+ * @param src Pointer to an Image from framesink_image.
+ */
+void framesink_submit(FrameSink *fs, Image *src)
+{
+    int tail;
+
+    pthread_mutex_lock(&(fs->lock));
+    tail = (fs->head + fs->nQueued) % FRAMESINK_MAX_IMAGES;
+    fs->queue[tail] = src;
+    fs->frame[tail] = fs->nextFrame++;
+    fs->nQueued++;
+    pthread_cond_signal(&(fs->wake));
+    pthread_mutex_unlock(&(fs->lock));
+}
+
+/**
+ * Waits until every submitted frame has been written.
+ *
+ * @param fs Pointer to the FrameSink.
+ */
+void framesink_finish(FrameSink *fs)
+{
+    pthread_mutex_lock(&(fs->lock));
+    while (fs->nQueued > 0)
+        pthread_cond_wait(&(fs->ready), &(fs->lock));
+    pthread_mutex_unlock(&(fs->lock));
+}
+
+/**
+ * Writes the frames still waiting, stops the writer, and frees the sink and its images.
+ *
+ * @param fs Pointer to the FrameSink.
+ */
+void framesink_free(FrameSink *fs)
+{
+    int i;
+
+    if (!fs)
+        return;
+    pthread_mutex_lock(&(fs->lock));
+    fs->done = 1;
+    pthread_cond_signal(&(fs->wake));
+    pthread_mutex_unlock(&(fs->lock));
+    pthread_join(fs->writer, NULL);
+
+    for (i = 0; i < fs->nImages; i++)
+        image_free(fs->images[i]);
+    pthread_mutex_destroy(&(fs->lock));
+    pthread_cond_destroy(&(fs->wake));
+    pthread_cond_destroy(&(fs->ready));
+    free(fs);
+}
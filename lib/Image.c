@@ -9,8 +9,60 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
 #include "Image.h"
 #include "Color.h"
+#include "Convert.h"
+#include "Encode.h"
+
+// image_read and image_write convert on one more thread for every this many pixels
+#define IMAGE_CONVERT_GRAIN (1 << 18)
+#define IMAGE_CONVERT_THREADS 8
+
+// pixel buffers of at least this many bytes are aligned to and padded out to whole huge pages
+#define IMAGE_HUGE_PAGE (1 << 21)
+
+static void image_hizFill(Image *src, float z);
+static void image_fillRange(Image *src, int k, int i0, int i1, float val);
+static void image_clearTiles(Image *src, int tr, int tc0, int tc1);
+static float image_zLoad(Image *src, int i);
+static void image_zStore(Image *src, int i, float zinv);
+static void image_zFill(Image *src, int i0, int i1, float zinv);
+static float image_colorLoad(Image *src, int k, int i);
+static void image_colorStore(Image *src, int k, int i, float val);
+
+// channel k of the pixel at storage index i
+#define IMAGE_PIXEL(src, k, i) ((src)->plane[k][(i) * (src)->stride[k]])
+
+// whether image_write encodes and image_read decodes sRGB
+static int imageSRGB = 0;
+
+/**
+ * Allocates a pixel buffer of size bytes, aligned to 64 bytes so every row of a plane that starts
+ * on one starts on a cache line. A buffer of a huge page or more is aligned to huge pages and,
+ * where the system has transparent huge pages, advised to use them, which saves most of the TLB
+ * misses of walking a large framebuffer. The buffer is freed with free.
+ * @param size the number of bytes
+ * @return the buffer, or NULL if it could not be allocated
+ */
+static void *image_allocBuffer(size_t size)
+{
+    size_t align = size >= IMAGE_HUGE_PAGE ? IMAGE_HUGE_PAGE : 64;
+    void *p;
+
+    size = (size + align - 1) & ~(align - 1);
+    p = aligned_alloc(align, size);
+#ifdef MADV_HUGEPAGE
+    if (p && align == IMAGE_HUGE_PAGE)
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
 
 /**
  * Allocates an Image structure and initializes
@@ -22,6 +74,35 @@
  * the operation fails.
  */
 Image *image_create(int rows, int cols)
+{
+    return image_createLayout(rows, cols, ImageLayoutRows);
+}
+
+/**
+ * Allocates an Image structure laid out in memory as layout says, and
+ * initializes the top level fields like image_create.
+ * @param rows the number of rows in the image
+ * @param cols the number of cols in the image
+ * @param layout the memory layout of the channels
+ * @return a pointer to the allocated Image structure.
+ */
+Image *image_createLayout(int rows, int cols, ImageLayout layout)
+{
+    return image_createFormat(rows, cols, layout, ImageDepthFloat, ImageColorFloat);
+}
+
+/**
+ * Allocates an Image structure laid out in memory as layout says, with the z channel in the
+ * depth format and the color channels in the color format, and initializes the top level fields
+ * like image_create.
+ * @param rows the number of rows in the image
+ * @param cols the number of cols in the image
+ * @param layout the memory layout of the channels
+ * @param depth the format of the z channel
+ * @param color the format of the color channels
+ * @return a pointer to the allocated Image structure.
+ */
+Image *image_createFormat(int rows, int cols, ImageLayout layout, ImageDepth depth, ImageColor color)
 {
     // allocate the struct
     Image *src = (Image *)malloc(sizeof(Image));
@@ -39,7 +120,7 @@ Image *image_create(int rows, int cols)
         exit(-1);
     }
 
-    int alloc = image_alloc(src, rows, cols);
+    int alloc = image_allocFormat(src, rows, cols, layout, depth, color);
     if (alloc != 0)
     {
         fprintf(stderr, "Something failed in the alloc\n");
@@ -68,6 +149,28 @@ void image_init(Image *src)
     src->z = NULL;
     src->maxval = 1;
     src->filename[0] = 0;
+    src->gbuffer = NULL;
+    src->hiz.z = NULL;
+    src->hiz.dirty = NULL;
+    src->hiz.rows = 0;
+    src->hiz.cols = 0;
+    src->dirty.tile = NULL;
+    src->dirty.row = NULL;
+    src->layout = ImageLayoutRows;
+    src->depth = ImageDepthFloat;
+    src->z16 = NULL;
+    src->z24 = NULL;
+    src->color = ImageColorFloat;
+    src->pix = NULL;
+    src->out = NULL;
+    src->buf = NULL;
+    src->nPixels = 0;
+    src->tileCols = 0;
+    for (int k = 0; k < 5; k++)
+    {
+        src->plane[k] = NULL;
+        src->stride[k] = 0;
+    }
 };
 
 /**
@@ -75,6 +178,7 @@ void image_init(Image *src)
  * given rows and columns and initializes the image data to appropriate values,
  * such as 0.0 for RGB and 1.0 for A and Z.
  * This function should free existing memory if rows and cols are both non-zero.
+ * The image uses the default ImageLayoutRows layout.
  *
  * @param src pointer to the Image
  * @param rows the number of rows to allocate
@@ -82,6 +186,42 @@ void image_init(Image *src)
  * @return 0 if the operation is successful. Returns a non-zero value if the operation fails.
  */
 int image_alloc(Image *src, int rows, int cols)
+{
+    return image_allocLayout(src, rows, cols, ImageLayoutRows);
+}
+
+/**
+ * Allocates space for the image data like image_alloc, laid out in memory as layout says.
+ * ImageLayoutRows keeps the data, a, and z fields; the other layouts keep every channel in one
+ * 64-byte aligned buffer and leave those fields NULL, so code that touches pixels has to go
+ * through the accessors, image_index, or image_row.
+ *
+ * @param src pointer to the Image
+ * @param rows the number of rows to allocate
+ * @param cols the number of cols to allocate
+ * @param layout the memory layout of the channels
+ * @return 0 if the operation is successful. Returns a non-zero value if the operation fails.
+ */
+int image_allocLayout(Image *src, int rows, int cols, ImageLayout layout)
+{
+    return image_allocFormat(src, rows, cols, layout, ImageDepthFloat, ImageColorFloat);
+}
+
+/**
+ * Allocates space for the image data like image_allocLayout, with the z channel in the depth
+ * format. The fixed point formats keep z in z16 or z24, in storage index order, and leave the
+ * z field and z plane NULL; image_getz and image_setz convert to and from 1/z. ImageColor8
+ * likewise keeps the colors in pix and leaves the data field and color planes NULL.
+ *
+ * @param src pointer to the Image
+ * @param rows the number of rows to allocate
+ * @param cols the number of cols to allocate
+ * @param layout the memory layout of the channels
+ * @param depth the format of the z channel
+ * @param color the format of the color channels
+ * @return 0 if the operation is successful. Returns a non-zero value if the operation fails.
+ */
+int image_allocFormat(Image *src, int rows, int cols, ImageLayout layout, ImageDepth depth, ImageColor color)
 {
     if (!src)
     {
@@ -103,44 +243,184 @@ int image_alloc(Image *src, int rows, int cols)
     src->rows = rows;
     src->cols = cols;
     src->maxval = 1.0;
+    src->layout = layout;
+    src->depth = depth;
+    src->color = color;
+    src->nPixels = rows * cols;
+    src->tileCols = 0;
+    for (int k = 0; k < 5; k++)
+    {
+        src->plane[k] = NULL;
+        src->stride[k] = 0;
+    }
+
+    if (layout == ImageLayoutRows && color == ImageColor8)
+    {
+        // just the a channel and a float z channel
+        src->a = (float *)image_allocBuffer(sizeof(float) * (rows * cols + 1));
+        src->z = NULL;
+        if (depth == ImageDepthFloat)
+            src->z = (float *)image_allocBuffer(sizeof(float) * (rows * cols + 1));
+        if (src->a == NULL || (src->z == NULL && depth == ImageDepthFloat))
+        {
+            fprintf(stderr, "Data allocation failed\n");
+            return -1;
+        }
+        src->plane[3] = src->a;
+        src->plane[4] = src->z;
+        src->stride[3] = 1;
+        src->stride[4] = src->z ? 1 : 0;
+    }
+    else if (layout == ImageLayoutRows)
+    {
+        // Allocate the row pointers, a channel, and z channel arrays
+        src->data = (FPixel **)malloc(sizeof(FPixel *) * (rows + 1));
 
-    // Allocate the row pointers, a channel, and z channel arrays
-    src->data = (FPixel **)malloc(sizeof(FPixel *) * rows);
+        // Check for old data, free and reinitialize if applicable
+        if (src->a)
+            free(src->a);
+        src->a = (float *)image_allocBuffer(sizeof(float) * (rows * cols + 1));
+        if (src->z)
+            free(src->z);
+        src->z = NULL;
+        if (depth == ImageDepthFloat)
+            src->z = (float *)image_allocBuffer(sizeof(float) * (rows * cols + 1));
+        if (src->data == NULL || src->a == NULL || (src->z == NULL && depth == ImageDepthFloat))
+        {
+            fprintf(stderr, "Data allocation failed\n");
+            return -1;
+        }
 
-    // Check for old data, free and reinitialize if applicable
-    if (src->a)
-        free(src->a);
-    src->a = (float *)malloc(sizeof(float) * rows * cols);
-    if (src->z)
-        free(src->z);
-    src->z = (float *)malloc(sizeof(float) * rows * cols);
-    if (src->data == NULL || src->a == NULL || src->z == NULL)
+        // Allocate the 1D array in the first row
+        src->data[0] = (FPixel *)image_allocBuffer(sizeof(FPixel) * (rows * cols + 1));
+        if (src->data[0] == NULL)
+        {
+            fprintf(stderr, "1D Array allocation failed\n");
+            return -1;
+        }
+
+        // Set the row pointers to the appropriate row
+        for (int i = 1; i < rows; i++)
+        {
+            src->data[i] = &(src->data[0][i * cols]);
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            src->plane[k] = &(src->data[0][0].rgb[k]);
+            src->stride[k] = 3;
+        }
+        src->plane[3] = src->a;
+        src->plane[4] = src->z;
+        src->stride[3] = 1;
+        src->stride[4] = src->z ? 1 : 0;
+    }
+    else
     {
-        fprintf(stderr, "Data allocation failed\n");
-        return -1;
+        // whole tiles, so every tile is the same size
+        int tile = 1 << IMAGE_TILE_SHIFT;
+        if (layout == ImageLayoutTiled)
+        {
+            src->tileCols = (cols + tile - 1) >> IMAGE_TILE_SHIFT;
+            src->nPixels = src->tileCols * ((rows + tile - 1) >> IMAGE_TILE_SHIFT) * tile * tile;
+        }
+        // planes start on 64-byte boundaries; fixed point z and 8-bit color are kept apart
+        int n = (src->nPixels + 15) & ~15;
+        int nc = color == ImageColorFloat ? 3 : 0;
+        int nz = depth == ImageDepthFloat ? 1 : 0;
+        int nf = nc + 1 + nz;
+        src->buf = (float *)image_allocBuffer(sizeof(float) * nf * (n + 16));
+        if (src->buf == NULL)
+        {
+            fprintf(stderr, "Data allocation failed\n");
+            return -1;
+        }
+
+        for (int k = 0; k < 5; k++)
+        {
+            if ((k < 3 && !nc) || (k == 4 && !nz))
+                continue;
+            switch (layout)
+            {
+            case ImageLayoutPlanar:
+                // r, g, b, a, z
+                src->plane[k] = src->buf + (k < 3 ? k : nc + k - 3) * n;
+                src->stride[k] = 1;
+                break;
+            case ImageLayoutInterleaved:
+                // r, g, b, z, a: the z-test reads the float right after the color
+                src->plane[k] = src->buf + (k < 3 ? k : (k == 4 ? nc : nc + nz));
+                src->stride[k] = nf;
+                break;
+            default:
+                // tiled FPixels, then the a and z planes in the same tile order
+                src->plane[k] = k < 3 ? src->buf + k : src->buf + (nc + k - 3) * n;
+                src->stride[k] = k < 3 ? 3 : 1;
+                break;
+            }
+        }
     }
 
-    // Allocate the 1D array in the first row
-    src->data[0] = (FPixel *)malloc(sizeof(FPixel) * rows * cols);
-    if (src->data[0] == NULL)
+    // 8-bit color starts black
+    if (color == ImageColor8)
     {
-        fprintf(stderr, "1D Array allocation failed\n");
+        src->pix = (Pixel *)image_allocBuffer(sizeof(Pixel) * (src->nPixels + 1));
+        if (src->pix == NULL)
+        {
+            fprintf(stderr, "Color allocation failed\n");
+            return -1;
+        }
+        memset(src->pix, 0, sizeof(Pixel) * (src->nPixels + 1));
     }
 
-    // Set the row pointers to the appropriate row
-    for (int i = 1; i < rows; i++)
-    {
-        src->data[i] = &(src->data[0][i * cols]);
+    // fixed point depth starts at 0, the reset value
+    if (depth == ImageDepth16)
+        src->z16 = (unsigned short *)calloc(src->nPixels + 1, sizeof(unsigned short));
+    else if (depth == ImageDepth24)
+        src->z24 = (unsigned char *)calloc(3 * src->nPixels + 1, 1);
+    if ((depth == ImageDepth16 && src->z16 == NULL) || (depth == ImageDepth24 && src->z24 == NULL))
+    {
+        fprintf(stderr, "Depth allocation failed\n");
+        return -1;
     }
 
     // Initialize the pixel values in the array
-    for (int i = 0; i < rows * cols; i++)
+    for (int i = 0; i < src->nPixels; i++)
     {
-        src->data[0][i].rgb[0] = 0;
-        src->data[0][i].rgb[1] = 0;
-        src->data[0][i].rgb[2] = 0;
-        src->a[i] = 1.0;
-        src->z[i] = 1.0;
+        if (color == ImageColorFloat)
+        {
+            IMAGE_PIXEL(src, 0, i) = 0;
+            IMAGE_PIXEL(src, 1, i) = 0;
+            IMAGE_PIXEL(src, 2, i) = 0;
+        }
+        IMAGE_PIXEL(src, 3, i) = 1.0;
+        if (depth == ImageDepthFloat)
+            IMAGE_PIXEL(src, 4, i) = 1.0;
+    }
+
+    // one HiZ tile per 8x8 block of pixels, rounding up at the edges
+    free(src->hiz.z);
+    free(src->hiz.dirty);
+    src->hiz.rows = (rows + (1 << HIZ_SHIFT) - 1) >> HIZ_SHIFT;
+    src->hiz.cols = (cols + (1 << HIZ_SHIFT) - 1) >> HIZ_SHIFT;
+    src->hiz.z = (float *)malloc(sizeof(float) * (src->hiz.rows * src->hiz.cols + 1));
+    src->hiz.dirty = (unsigned char *)malloc(src->hiz.rows * src->hiz.cols + 1);
+    if (src->hiz.z == NULL || src->hiz.dirty == NULL)
+    {
+        fprintf(stderr, "HiZ allocation failed\n");
+        return -1;
+    }
+    image_hizFill(src, 1.0);
+
+    // a new image holds the reset values everywhere
+    free(src->dirty.tile);
+    free(src->dirty.row);
+    src->dirty.tile = (unsigned char *)calloc(src->hiz.rows * src->hiz.cols + 1, 1);
+    src->dirty.row = (unsigned char *)calloc(src->hiz.rows + 1, 1);
+    if (src->dirty.tile == NULL || src->dirty.row == NULL)
+    {
+        fprintf(stderr, "Dirty tile allocation failed\n");
+        return -1;
     }
 
     return 0;
@@ -154,7 +434,7 @@ void image_free(Image *src)
 {
     if (src)
     {
-        if (src->data)
+        if (src->data || src->buf || src->a)
         {
             // Dealloc and free all of the internal data
             image_dealloc(src);
@@ -186,12 +466,254 @@ void image_dealloc(Image *src)
             free(src->a);
         if (src->z)
             free(src->z);
+        free(src->buf);
+        free(src->z16);
+        free(src->z24);
+        free(src->pix);
+        free(src->out);
+        free(src->hiz.z);
+        free(src->hiz.dirty);
+        free(src->dirty.tile);
+        free(src->dirty.row);
+        image_freeGBuffer(src);
     }
     // Reset the fields of the image
     image_init(src);
     return;
 };
 
+/**
+ * Converts n pixels, from storage index i on, between the color channels of the image and pix.
+ * @param src the image
+ * @param pix the Pixels to write or read
+ * @param i the first storage index
+ * @param n the number of pixels
+ * @param toPixels non-zero to convert the image to pix, zero for the reverse
+ */
+static void image_convertRun(Image *src, Pixel *pix, int i, int n, int toPixels)
+{
+    if (src->pix)
+    {
+        // 8-bit color is stored as it is written; there are no spare bits to decode sRGB into
+        if (toPixels && imageSRGB)
+            convert_encodePixels(pix, src->pix + i, n);
+        else if (toPixels)
+            memcpy(pix, src->pix + i, sizeof(Pixel) * n);
+        else
+            memcpy(src->pix + i, pix, sizeof(Pixel) * n);
+    }
+    else if (toPixels)
+        convert_toPixels(pix, &IMAGE_PIXEL(src, 0, i), &IMAGE_PIXEL(src, 1, i), &IMAGE_PIXEL(src, 2, i), src->stride[0], n, imageSRGB);
+    else
+        convert_fromPixels(&IMAGE_PIXEL(src, 0, i), &IMAGE_PIXEL(src, 1, i), &IMAGE_PIXEL(src, 2, i), src->stride[0], pix, n, imageSRGB);
+}
+
+/**
+ * Converts row r between the color channels of the image and row, a Pixel per column.
+ * @param src the image
+ * @param row the Pixels to write or read
+ * @param r the row index
+ * @param toPixels non-zero to convert the image to row, zero for the reverse
+ */
+static void image_convertRow(Image *src, Pixel *row, int r, int toPixels)
+{
+    int tile = 1 << IMAGE_TILE_SHIFT;
+    int c, n;
+
+    if (src->layout != ImageLayoutTiled)
+    {
+        image_convertRun(src, row, image_index(src, r, 0), src->cols, toPixels);
+        return;
+    }
+    // a tiled row is a run in each tile it crosses
+    for (c = 0; c < src->cols; c += n)
+    {
+        n = src->cols - c < tile ? src->cols - c : tile;
+        image_convertRun(src, row + c, image_index(src, r, c), n, toPixels);
+    }
+}
+
+/**
+ * A band of rows for one thread of image_convert.
+ */
+typedef struct ImageConvertJob
+{
+    Image *src;
+    Pixel *pix; // the whole image in row order
+    int r0, r1;
+    int toPixels;
+} ImageConvertJob;
+
+/**
+ * Converts the rows [r0, r1) of a job. Untiled layouts store the rows one after another, so the
+ * band is a single run of storage indices.
+ * @param arg the ImageConvertJob
+ * @return NULL
+ */
+static void *image_convertRows(void *arg)
+{
+    ImageConvertJob *job = (ImageConvertJob *)arg;
+    Image *src = job->src;
+    int r;
+
+    if (src->layout != ImageLayoutTiled)
+    {
+        image_convertRun(src, job->pix + job->r0 * src->cols, image_index(src, job->r0, 0), (job->r1 - job->r0) * src->cols, job->toPixels);
+        return NULL;
+    }
+    for (r = job->r0; r < job->r1; r++)
+        image_convertRow(src, job->pix + r * src->cols, r, job->toPixels);
+    return NULL;
+}
+
+/**
+ * Converts the whole image between its color channels and pix, a Pixel per pixel in row order.
+ * Large images are split into bands of rows converted on their own threads.
+ * @param src the image
+ * @param pix the Pixels to write or read
+ * @param toPixels non-zero to convert the image to pix, zero for the reverse
+ */
+static void image_convert(Image *src, Pixel *pix, int toPixels)
+{
+    ImageConvertJob job[IMAGE_CONVERT_THREADS];
+    pthread_t thread[IMAGE_CONVERT_THREADS];
+    int started[IMAGE_CONVERT_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = src->rows * src->cols / IMAGE_CONVERT_GRAIN + 1;
+    int t;
+
+    n = n < IMAGE_CONVERT_THREADS ? n : IMAGE_CONVERT_THREADS;
+    n = cpus > 0 && n > cpus ? (int)cpus : n;
+    n = n > src->rows ? src->rows : n;
+    for (t = 0; t < n; t++)
+    {
+        job[t].src = src;
+        job[t].pix = pix;
+        job[t].r0 = (int)((long)src->rows * t / n);
+        job[t].r1 = (int)((long)src->rows * (t + 1) / n);
+        job[t].toPixels = toPixels;
+    }
+
+    // the calling thread converts the first band, and any band a thread could not start for
+    for (t = 1; t < n; t++)
+    {
+        started[t] = pthread_create(&thread[t], NULL, image_convertRows, &job[t]) == 0;
+        if (!started[t])
+            image_convertRows(&job[t]);
+    }
+    if (n > 0)
+        image_convertRows(&job[0]);
+    for (t = 1; t < n; t++)
+    {
+        if (started[t])
+            pthread_join(thread[t], NULL);
+    }
+}
+
+/**
+ * Converts row r of the image to Pixels the way image_pixels converts the whole image, for
+ * encoders that stream an image a row at a time.
+ * @param src the image
+ * @param r the row index
+ * @param row the cols Pixels to write
+ */
+void image_pixelRow(Image *src, int r, Pixel *row)
+{
+    if (!src || !row)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+    image_convertRow(src, row, r, 1);
+}
+
+/**
+ * Sets whether image_write encodes the linear colors of an image as sRGB, and image_read decodes
+ * sRGB files to linear colors (non-zero), or both keep the values as they are (0, the default).
+ * @param srgb whether to convert to and from sRGB
+ */
+void image_setSRGB(int srgb)
+{
+    imageSRGB = srgb;
+}
+
+/**
+ * Skips the whitespace and comments in front of the next number of a PPM header and reads it.
+ * @param p the position in the header, advanced past the number
+ * @param end the end of the file
+ * @return the number, or -1 if the header ends first
+ */
+static int image_headerNumber(const unsigned char **p, const unsigned char *end)
+{
+    int v = 0;
+
+    while (*p < end && (isspace(**p) || **p == '#'))
+    {
+        if (**p == '#')
+            while (*p < end && **p != '\n')
+                (*p)++;
+        else
+            (*p)++;
+    }
+    if (*p == end || !isdigit(**p))
+        return -1;
+    while (*p < end && isdigit(**p) && v < (1 << 24))
+        v = v * 10 + *(*p)++ - '0';
+    return v;
+}
+
+/**
+ * Reads a binary PPM by mapping the file and converting the pixels straight out of the mapping,
+ * so the file is read once and no copy of it is made.
+ * @param filename the file name
+ * @return the image, or NULL if the file cannot be mapped, e.g. because it is a pipe
+ */
+static Image *image_readMapped(char *filename)
+{
+    const unsigned char *map, *p, *end;
+    struct stat st;
+    Image *src = NULL;
+    int fd, rows, cols, colors;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    map = (const unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    p = map;
+    end = map + st.st_size;
+    if (st.st_size < 2 || p[0] != 'P' || p[1] != '6')
+    {
+        fprintf(stderr, "not a ppm!\n");
+        exit(1);
+    }
+    p += 2;
+    cols = image_headerNumber(&p, end);
+    rows = image_headerNumber(&p, end);
+    colors = image_headerNumber(&p, end);
+    // a single whitespace character separates the header from the pixels
+    if (cols > 0 && rows > 0 && colors > 0 && p < end && isspace(*p) && end - (p + 1) >= (long)rows * cols * 3)
+    {
+        src = image_create(rows, cols);
+        image_convert(src, (Pixel *)(p + 1), 0);
+    }
+    munmap((void *)map, st.st_size);
+    if (src == NULL)
+    {
+        fprintf(stderr, "Failed to read the file\n");
+        exit(-1);
+    }
+    return src;
+}
+
 /**
  * reads a PPM image from the given filename. An optional extension is to
  *  determine the image type from the filename and permit the use of different
@@ -212,6 +734,13 @@ Image *image_read(char *filename)
     Pixel *temp;
     int rows, cols, colors;
 
+    // a regular file is mapped; stdin and pipes go through readPPM
+    if (filename[0] && (src = image_readMapped(filename)) != NULL)
+    {
+        image_touchAll(src);
+        return src;
+    }
+
     temp = readPPM(&rows, &cols, &colors, filename);
     if (!temp)
     {
@@ -220,21 +749,16 @@ Image *image_read(char *filename)
     }
 
     src = image_create(rows, cols);
-
-    for (int i = 0; i < rows * cols; i++)
-    {
-        src->data[0][i].rgb[0] = uc_to_float(temp[i].r);
-        src->data[0][i].rgb[1] = uc_to_float(temp[i].g);
-        src->data[0][i].rgb[2] = uc_to_float(temp[i].b);
-    }
+    image_convert(src, temp, 0);
+    image_touchAll(src);
 
     free(temp);
     return src;
 }
 /**
- * Writes a PPM image to the given filename. Returns 0 on success.
- * Optionally, you can look at the filename extension and write different
- * file types.
+ * Writes an image to the given filename. Returns 0 on success.
+ * The filename extension picks the file type: .qoi and .png are encoded by
+ * Encode.c a row at a time, and anything else is written as a PPM.
  * @param src the image to write
  * @param filename the output filename
  * @return 0 if successful
@@ -247,27 +771,55 @@ int image_write(Image *src, char *filename)
         exit(-1);
     }
 
-    Pixel *temp;
-    int rows, cols, colors;
-
-    colors = float_to_uc(src->maxval);
-    rows = src->rows;
-    cols = src->cols;
+    switch (encode_format(filename))
+    {
+    case EncodeQOI:
+        return encode_qoi(src, filename);
+    case EncodePNG:
+        return encode_png(src, filename);
+    default:
+        break;
+    }
+    // one fwrite of the converted image goes straight to write(); mapping the output instead costs
+    // a page fault for every page written, which is slower
+    writePPM(image_pixels(src), src->rows, src->cols, float_to_uc(src->maxval), filename);
 
-    temp = (Pixel *)malloc(sizeof(Pixel) * rows * cols);
+    return 0;
+};
 
-    for (int i = 0; i < rows * cols; i++)
+/**
+ * Returns the colors of the image as an array of Pixels in row order, converted the way
+ * image_write writes them. The array belongs to the image: it is the 8-bit color itself for an
+ * untiled ImageColor8 image without sRGB, and otherwise a buffer the image keeps from one call
+ * to the next, so it is only valid until the image is converted again, changed, or freed.
+ * @param src the image
+ * @return the rows * cols Pixels
+ */
+Pixel *image_pixels(Image *src)
+{
+    if (!src)
     {
-        temp[i].r = float_to_uc(src->data[0][i].rgb[0]);
-        temp[i].g = float_to_uc(src->data[0][i].rgb[1]);
-        temp[i].b = float_to_uc(src->data[0][i].rgb[2]);
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
     }
 
-    writePPM(temp, rows, cols, colors, filename);
-    free(temp);
+    // untiled 8-bit color is already the Pixel array writePPM takes
+    if (src->pix && src->layout != ImageLayoutTiled && !imageSRGB)
+        return src->pix;
 
-    return 0;
-};
+    // the conversion buffer is kept for the next write of the image
+    if (src->out == NULL)
+    {
+        src->out = (Pixel *)malloc(sizeof(Pixel) * (src->rows * src->cols + 1));
+        if (src->out == NULL)
+        {
+            fprintf(stderr, "Output allocation failed\n");
+            exit(-1);
+        }
+    }
+    image_convert(src, src->out, 1);
+    return src->out;
+}
 
 // Setters and getters
 /**
@@ -289,7 +841,12 @@ FPixel image_getf(Image *src, int r, int c)
       FPixel empty = {{0.0, 0.0, 0.0}};
         return empty; // If the image set is out of the image, early return
     }
-    return src->data[r][c];
+    FPixel pixel;
+    int k = image_index(src, r, c);
+    pixel.rgb[0] = image_colorLoad(src, 0, k);
+    pixel.rgb[1] = image_colorLoad(src, 1, k);
+    pixel.rgb[2] = image_colorLoad(src, 2, k);
+    return pixel;
 };
 
 /**
@@ -311,7 +868,7 @@ float image_getc(Image *src, int r, int c, int b)
     {
         return 0.0; // If the image set is out of the image, early return
     }
-    return src->data[r][c].rgb[b];
+    return image_colorLoad(src, b, image_index(src, r, c));
 };
 
 /**
@@ -328,7 +885,11 @@ float image_geta(Image *src, int r, int c)
         fprintf(stderr, "Invalid pointer provided\n");
         exit(-1);
     }
-    return src->a[r * src->rows + c];
+    if (r < 0 || c < 0 || r >= src->rows || c >= src->cols)
+    {
+        return 0.0; // If the image get is out of the image, early return
+    }
+    return IMAGE_PIXEL(src, 3, image_index(src, r, c));
 };
 /**
  * Gets the z channel value from a specific pixel
@@ -344,7 +905,11 @@ float image_getz(Image *src, int r, int c)
         fprintf(stderr, "Invalid pointer provided\n");
         exit(-1);
     }
-    return src->z[r * src->rows + c];
+    if (r < 0 || c < 0 || r >= src->rows || c >= src->cols)
+    {
+        return 0.0; // If the image get is out of the image, early return
+    }
+    return image_zLoad(src, image_index(src, r, c));
 };
 
 /**
@@ -368,21 +933,23 @@ void image_setf(Image *src, int r, int c, FPixel val)
     {
         return; // If the image set is out of the image, early return
     }
+    int k = image_index(src, r, c);
     for (int i = 0; i < 3; i++)
     {
         if (val.rgb[i] < 0)
         {
-            src->data[r][c].rgb[i] = 0;
+            image_colorStore(src, i, k, 0);
         }
         else if (val.rgb[i] > src->maxval)
         {
-            src->data[r][c].rgb[i] = src->maxval;
+            image_colorStore(src, i, k, src->maxval);
         }
         else
         {
-            src->data[r][c].rgb[i] = val.rgb[i];
+            image_colorStore(src, i, k, val.rgb[i]);
         }
     }
+    image_touch(src, r, c, c + 1);
 };
 
 /**
@@ -415,7 +982,8 @@ void image_setc(Image *src, int r, int c, int b, float val)
     {
         val = 1;
     }
-    src->data[r][c].rgb[b] = val;
+    image_colorStore(src, b, image_index(src, r, c), val);
+    image_touch(src, r, c, c + 1);
 };
 
 /**
@@ -446,7 +1014,8 @@ void image_seta(Image *src, int r, int c, float val)
     {
         val = 1;
     }
-    src->a[r * src->rows + c] = val;
+    IMAGE_PIXEL(src, 3, image_index(src, r, c)) = val;
+    image_touch(src, r, c, c + 1);
 };
 
 /**
@@ -473,9 +1042,65 @@ void image_setz(Image *src, int r, int c, float val)
     {
         val = 0.0;
     }
-    src->z[r * src->rows + c] = val;
+    int i = image_index(src, r, c);
+    image_zStore(src, i, val);
+    val = image_zLoad(src, i);
+
+    // the value may be farther than the tile's, so lower the tile right away
+    int t = (r >> HIZ_SHIFT) * src->hiz.cols + (c >> HIZ_SHIFT);
+    if (val < src->hiz.z[t])
+        src->hiz.z[t] = val;
+    src->hiz.dirty[t] = 1;
+    image_touch(src, r, c, c + 1);
 };
 
+/**
+ * The z-test of the line and point drawing: if 1/z of val is nearer than what the z channel
+ * holds at (r, c), compared in the image's depth format, stores it like image_setz.
+ * @param src the image
+ * @param r the row index
+ * @param c the col index
+ * @param val the 1/z to test
+ * @return 1 if the pixel passed and val was stored, 0 otherwise
+ */
+int image_zTest(Image *src, int r, int c, double val)
+{
+    if (!src)
+    {
+        fprintf(stderr, "Null pointer provided\n");
+        exit(-1);
+    }
+
+    if (r < 0 || c < 0 || r >= src->rows || c >= src->cols)
+    {
+        return 0;
+    }
+
+    int i = image_index(src, r, c);
+    unsigned char *p;
+    unsigned q;
+    switch (src->depth)
+    {
+    case ImageDepth16:
+        q = image_depthQuantize(val, IMAGE_DEPTH16_MAX);
+        if (q <= src->z16[i])
+            return 0;
+        break;
+    case ImageDepth24:
+        q = image_depthQuantize(val, IMAGE_DEPTH24_MAX);
+        p = &(src->z24[3 * i]);
+        if (q <= (p[0] | (p[1] << 8) | ((unsigned)p[2] << 16)))
+            return 0;
+        break;
+    default:
+        if (!(val > IMAGE_PIXEL(src, 4, i)))
+            return 0;
+        break;
+    }
+    image_setz(src, r, c, val);
+    return 1;
+}
+
 /**
  * Sets the color of a pixel in an image to a color.
  * @param src The image
@@ -496,9 +1121,11 @@ void image_setColor(Image *src, int r, int c, Color val)
         return; // If the image set is out of the image, early return
     }
 
-    src->data[r][c].rgb[0] = val.c[0];
-    src->data[r][c].rgb[1] = val.c[1];
-    src->data[r][c].rgb[2] = val.c[2];
+    int k = image_index(src, r, c);
+    image_colorStore(src, 0, k, val.c[0]);
+    image_colorStore(src, 1, k, val.c[1]);
+    image_colorStore(src, 2, k, val.c[2]);
+    image_touch(src, r, c, c + 1);
 }
 
 /**
@@ -522,16 +1149,18 @@ Color image_getColor(Image *src, int r, int c)
     }
 
     Color color;
-    color.c[0] = src->data[r][c].rgb[0];
-    color.c[1] = src->data[r][c].rgb[1];
-    color.c[2] = src->data[r][c].rgb[2];
+    int k = image_index(src, r, c);
+    color.c[0] = image_colorLoad(src, 0, k);
+    color.c[1] = image_colorLoad(src, 1, k);
+    color.c[2] = image_colorLoad(src, 2, k);
     return color;
 }
 
 // Utility
 /**
  * Resets every pixel to a default value (Black, alpha value
- * of 1.0, z value of 1.0)
+ * of 1.0, z value of 1.0). Only the tiles written since the last
+ * reset are rewritten; see DirtyTiles.
  * @param src the source image
  */
 void image_reset(Image *src)
@@ -541,17 +1170,37 @@ void image_reset(Image *src)
         fprintf(stderr, "Null pointer provided\n");
         exit(-1);
     }
-    int size = src->rows * src->cols;
-    // Iterate every every pixel in the image
-    for (int i = 0; i < size; i++)
+    int tr, tc, tEnd, t;
+    unsigned char *tile;
+
+    src->maxval = 1.0;
+    // only the tiles written since the last reset can differ from the reset values
+    for (tr = 0; tr < src->hiz.rows; tr++)
     {
-        // Set each channel to 0
-        src->data[0][i].rgb[0] = 0;
-        src->data[0][i].rgb[1] = 0;
-        src->data[0][i].rgb[2] = 0;
-        src->a[i] = 1.0;
-        src->z[i] = 1.0;
-        src->maxval = 1.0;
+        if (!src->dirty.row[tr])
+        {
+            continue;
+        }
+        tile = &(src->dirty.tile[tr * src->hiz.cols]);
+        for (tc = 0; tc < src->hiz.cols; tc = tEnd)
+        {
+            if (!tile[tc])
+            {
+                tEnd = tc + 1;
+                continue;
+            }
+            // clear a run of dirty tiles together
+            for (tEnd = tc + 1; tEnd < src->hiz.cols && tile[tEnd]; tEnd++)
+                ;
+            image_clearTiles(src, tr, tc, tEnd);
+            for (t = tr * src->hiz.cols + tc; t < tr * src->hiz.cols + tEnd; t++)
+            {
+                src->hiz.z[t] = 1.0;
+                src->hiz.dirty[t] = 0;
+            }
+            memset(&(tile[tc]), 0, tEnd - tc);
+        }
+        src->dirty.row[tr] = 0;
     }
 };
 
@@ -567,13 +1216,10 @@ void image_fill(Image *src, FPixel val)
         fprintf(stderr, "Null pointer provided\n");
         exit(-1);
     }
-    int size = src->rows * src->cols;
-    for (int i = 0; i < size; i++)
-    {
-        src->data[0][i].rgb[0] = val.rgb[0];
-        src->data[0][i].rgb[1] = val.rgb[1];
-        src->data[0][i].rgb[2] = val.rgb[2];
-    }
+    image_fillRange(src, 0, 0, src->nPixels, val.rgb[0]);
+    image_fillRange(src, 1, 0, src->nPixels, val.rgb[1]);
+    image_fillRange(src, 2, 0, src->nPixels, val.rgb[2]);
+    image_touchAll(src);
 };
 
 /**
@@ -588,13 +1234,10 @@ void image_fillc(Image *src, Color c)
         fprintf(stderr, "Null pointer provided\n");
         exit(-1);
     }
-    int size = src->rows * src->cols;
-    for (int i = 0; i < size; i++)
-    {
-        src->data[0][i].rgb[0] = c.c[0];
-        src->data[0][i].rgb[1] = c.c[1];
-        src->data[0][i].rgb[2] = c.c[2];
-    }
+    image_fillRange(src, 0, 0, src->nPixels, c.c[0]);
+    image_fillRange(src, 1, 0, src->nPixels, c.c[1]);
+    image_fillRange(src, 2, 0, src->nPixels, c.c[2]);
+    image_touchAll(src);
 };
 
 /**
@@ -611,12 +1254,11 @@ void image_fillrgb(Image *src, float r, float g, float b)
         fprintf(stderr, "Null pointer provided\n");
         exit(-1);
     }
-    if (!src->data)
+    if (!src->plane[0] && !src->pix)
     {
         fprintf(stderr, "No data in the image\n");
         exit(-1);
     }
-    int size = src->rows * src->cols;
     // Check values and ensure within min/max
     if (r < 0)
     {
@@ -643,12 +1285,10 @@ void image_fillrgb(Image *src, float r, float g, float b)
         b = src->maxval;
     }
 
-    for (int i = 0; i < size; i++)
-    {
-        src->data[0][i].rgb[0] = r;
-        src->data[0][i].rgb[1] = g;
-        src->data[0][i].rgb[2] = b;
-    }
+    image_fillRange(src, 0, 0, src->nPixels, r);
+    image_fillRange(src, 1, 0, src->nPixels, g);
+    image_fillRange(src, 2, 0, src->nPixels, b);
+    image_touchAll(src);
 };
 
 /**
@@ -663,7 +1303,6 @@ void image_filla(Image *src, float a)
         fprintf(stderr, "Null pointer provided\n");
         exit(-1);
     }
-    int size = src->rows * src->cols;
     // Value check and clip illegal values to the respective min/max
     if (a < 0)
     {
@@ -673,10 +1312,8 @@ void image_filla(Image *src, float a)
     {
         a = 1.0;
     }
-    for (int i = 0; i < size; i++)
-    {
-        src->a[i] = a;
-    }
+    image_fillRange(src, 3, 0, src->nPixels, a);
+    image_touchAll(src);
 }
 
 /**
@@ -691,7 +1328,6 @@ void image_fillz(Image *src, float z)
         fprintf(stderr, "Null pointer provided\n");
         exit(-1);
     }
-    int size = src->rows * src->cols;
     // Value check and clip illegal values to the respective min/max
     if (z < 0)
     {
@@ -701,8 +1337,522 @@ void image_fillz(Image *src, float z)
     {
         z = 1.0;
     }
+    image_zFill(src, 0, src->nPixels, z);
+    image_touchAll(src);
+    image_hizFill(src, image_depthRound(src->depth, z));
+};
+
+/**
+ * Sets channel k (0-2 color, 3 alpha, 4 z) of the pixels at storage indices [i0, i1) to val.
+ * Over [0, nPixels) this includes the padding of a tiled image.
+ * @param src the image
+ * @param k the channel index
+ * @param i0 the first storage index
+ * @param i1 one past the last storage index
+ * @param val the value to store
+ */
+static void image_fillRange(Image *src, int k, int i0, int i1, float val)
+{
+    if (k < 3 && src->pix)
+    {
+        unsigned char v = image_colorByte(val);
+        for (int i = i0; i < i1; i++)
+            ((unsigned char *)&(src->pix[i]))[k] = v;
+        return;
+    }
+    int stride = src->stride[k];
+    float *p = src->plane[k] + i0 * stride;
+    int n = i1 - i0;
+    if (stride == 1)
+    {
+        for (int i = 0; i < n; i++)
+            p[i] = val;
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        p[i * stride] = val;
+}
+
+/**
+ * Sets the pixels at storage indices [i0, i1) to the reset values.
+ * @param src the image
+ * @param i0 the first storage index
+ * @param i1 one past the last storage index
+ */
+static void image_clearRange(Image *src, int i0, int i1)
+{
+    // the color channels of Rows and Tiled images are packed FPixels
+    if (src->pix)
+    {
+        memset(src->pix + i0, 0, sizeof(Pixel) * (i1 - i0));
+    }
+    else if (src->stride[0] == 3)
+    {
+        memset(src->plane[0] + 3 * i0, 0, sizeof(float) * 3 * (i1 - i0));
+    }
+    else
+    {
+        image_fillRange(src, 0, i0, i1, 0);
+        image_fillRange(src, 1, i0, i1, 0);
+        image_fillRange(src, 2, i0, i1, 0);
+    }
+    image_fillRange(src, 3, i0, i1, 1.0);
+    image_zFill(src, i0, i1, 1.0);
+}
+
+/**
+ * Sets the pixels of dirty tiles [tc0, tc1) in tile row tr to the reset values.
+ * @param src the image
+ * @param tr the tile row
+ * @param tc0 the first tile
+ * @param tc1 one past the last tile
+ */
+static void image_clearTiles(Image *src, int tr, int tc0, int tc1)
+{
+    int r, rEnd, c0, c1;
+
+    if (src->layout == ImageLayoutTiled)
+    {
+        // storage tiles are the same 8x8 tiles, so the run is one block of memory
+        r = tr * src->tileCols;
+        image_clearRange(src, (r + tc0) << (2 * IMAGE_TILE_SHIFT), (r + tc1) << (2 * IMAGE_TILE_SHIFT));
+        return;
+    }
+
+    r = tr << HIZ_SHIFT;
+    rEnd = (tr + 1) << HIZ_SHIFT;
+    rEnd = rEnd < src->rows ? rEnd : src->rows;
+    c0 = tc0 << HIZ_SHIFT;
+    c1 = tc1 << HIZ_SHIFT;
+    c1 = c1 < src->cols ? c1 : src->cols;
+    if (c0 == 0 && c1 == src->cols)
+    {
+        // whole rows are one block of memory
+        image_clearRange(src, r * src->cols, rEnd * src->cols);
+        return;
+    }
+    for (; r < rEnd; r++)
+    {
+        image_clearRange(src, r * src->cols + c0, r * src->cols + c1);
+    }
+}
+
+/**
+ * Returns the 1/z stored at storage index i, whatever the depth format.
+ * @param src the image
+ * @param i the storage index
+ * @return 1/z at the index
+ */
+static float image_zLoad(Image *src, int i)
+{
+    unsigned char *p;
+
+    switch (src->depth)
+    {
+    case ImageDepth16:
+        return image_depthValue(src->z16[i], IMAGE_DEPTH16_MAX);
+    case ImageDepth24:
+        p = &(src->z24[3 * i]);
+        return image_depthValue(p[0] | (p[1] << 8) | ((unsigned)p[2] << 16), IMAGE_DEPTH24_MAX);
+    default:
+        return IMAGE_PIXEL(src, 4, i);
+    }
+}
+
+/**
+ * Stores 1/z of zinv at storage index i in the depth format.
+ * @param src the image
+ * @param i the storage index
+ * @param zinv the 1/z to store
+ */
+static void image_zStore(Image *src, int i, float zinv)
+{
+    unsigned q;
+
+    switch (src->depth)
+    {
+    case ImageDepth16:
+        src->z16[i] = (unsigned short)image_depthQuantize(zinv, IMAGE_DEPTH16_MAX);
+        break;
+    case ImageDepth24:
+        q = image_depthQuantize(zinv, IMAGE_DEPTH24_MAX);
+        src->z24[3 * i] = q & 0xff;
+        src->z24[3 * i + 1] = (q >> 8) & 0xff;
+        src->z24[3 * i + 2] = q >> 16;
+        break;
+    default:
+        IMAGE_PIXEL(src, 4, i) = zinv;
+        break;
+    }
+}
+
+/**
+ * Stores 1/z of zinv at storage indices [i0, i1) in the depth format.
+ * @param src the image
+ * @param i0 the first storage index
+ * @param i1 one past the last storage index
+ * @param zinv the 1/z to store
+ */
+static void image_zFill(Image *src, int i0, int i1, float zinv)
+{
+    unsigned q;
+
+    switch (src->depth)
+    {
+    case ImageDepth16:
+        q = image_depthQuantize(zinv, IMAGE_DEPTH16_MAX);
+        for (int i = i0; i < i1; i++)
+            src->z16[i] = (unsigned short)q;
+        break;
+    case ImageDepth24:
+        q = image_depthQuantize(zinv, IMAGE_DEPTH24_MAX);
+        if (q == 0)
+        {
+            memset(&(src->z24[3 * i0]), 0, 3 * (i1 - i0));
+            break;
+        }
+        for (int i = i0; i < i1; i++)
+            image_zStore(src, i, zinv);
+        break;
+    default:
+        image_fillRange(src, 4, i0, i1, zinv);
+        break;
+    }
+}
+
+/**
+ * Returns color channel k of the pixel at storage index i, in either color format.
+ * @param src the image
+ * @param k the color channel index [0, 2]
+ * @param i the storage index
+ * @return the channel value
+ */
+static float image_colorLoad(Image *src, int k, int i)
+{
+    if (src->pix)
+        return uc_to_float(((unsigned char *)&(src->pix[i]))[k]);
+    return IMAGE_PIXEL(src, k, i);
+}
+
+/**
+ * Stores val in color channel k of the pixel at storage index i, in either color format.
+ * @param src the image
+ * @param k the color channel index [0, 2]
+ * @param i the storage index
+ * @param val the channel value
+ */
+static void image_colorStore(Image *src, int k, int i, float val)
+{
+    if (src->pix)
+        ((unsigned char *)&(src->pix[i]))[k] = image_colorByte(val);
+    else
+        IMAGE_PIXEL(src, k, i) = val;
+}
+
+/**
+ * Returns the storage index of pixel (r, c): channel k of the pixel is at
+ * src->plane[k][index * src->stride[k]].
+ * @param src the image
+ * @param r the row index
+ * @param c the col index
+ * @return the storage index of the pixel
+ */
+int image_index(Image *src, int r, int c)
+{
+    if (src->layout == ImageLayoutTiled)
+    {
+        int mask = (1 << IMAGE_TILE_SHIFT) - 1;
+        return (((r >> IMAGE_TILE_SHIFT) * src->tileCols + (c >> IMAGE_TILE_SHIFT)) << (2 * IMAGE_TILE_SHIFT)) +
+               ((r & mask) << IMAGE_TILE_SHIFT) + (c & mask);
+    }
+    return r * src->cols + c;
+}
+
+/**
+ * Fills in a view of row r for the span fill loops. Pixel c of the row has its
+ * color at v->r[IMAGE_ROW_INDEX(v, c) * v->cs] (same for g and b) and its
+ * depth at v->z[IMAGE_ROW_INDEX(v, c) * v->zs].
+ * @param src the image
+ * @param r the row index
+ * @param v the view to fill in
+ */
+void image_row(Image *src, int r, ImageRow *v)
+{
+    int base = image_index(src, r, 0);
+    v->r = src->plane[0] ? src->plane[0] + base * src->stride[0] : NULL;
+    v->g = src->plane[1] ? src->plane[1] + base * src->stride[1] : NULL;
+    v->b = src->plane[2] ? src->plane[2] + base * src->stride[2] : NULL;
+    v->z = src->plane[4] ? src->plane[4] + base * src->stride[4] : NULL;
+    v->cs = src->stride[0];
+    v->zs = src->stride[4];
+    v->tiled = src->layout == ImageLayoutTiled;
+    v->depth = src->depth;
+    v->z16 = src->z16 ? src->z16 + base : NULL;
+    v->z24 = src->z24 ? src->z24 + 3 * base : NULL;
+    v->pix = src->pix ? src->pix + base : NULL;
+}
+
+/**
+ * Sets every HiZ tile to the depth z and marks it clean.
+ * @param src the image
+ * @param z the depth the whole z channel was set to
+ */
+static void image_hizFill(Image *src, float z)
+{
+    int n = src->hiz.rows * src->hiz.cols;
+    for (int i = 0; i < n; i++)
+    {
+        src->hiz.z[i] = z;
+    }
+    memset(src->hiz.dirty, 0, n);
+}
+
+/**
+ * Marks the HiZ tiles under columns [c0, c1) of row r as drawn into. Called by the polygon fills
+ * after they write depth.
+ * @param src the image
+ * @param r the row
+ * @param c0 the first column written
+ * @param c1 one past the last column written
+ */
+void image_hizMark(Image *src, int r, int c0, int c1)
+{
+    if (c0 >= c1)
+    {
+        return;
+    }
+    unsigned char *dirty = &(src->hiz.dirty[(r >> HIZ_SHIFT) * src->hiz.cols]);
+    for (int t = c0 >> HIZ_SHIFT; t <= (c1 - 1) >> HIZ_SHIFT; t++)
+    {
+        dirty[t] = 1;
+    }
+    image_touch(src, r, c0, c1);
+}
+
+/**
+ * Marks the tiles under columns [c0, c1) of row r as written, so the next image_reset clears
+ * them. The setters and fills do this themselves; code that writes pixels some other way, such
+ * as through image_row or the data, a, and z fields, calls it for what it wrote.
+ * @param src the image
+ * @param r the row
+ * @param c0 the first column written
+ * @param c1 one past the last column written
+ */
+void image_touch(Image *src, int r, int c0, int c1)
+{
+    if (c0 >= c1)
+    {
+        return;
+    }
+    int tr = r >> HIZ_SHIFT;
+    unsigned char *tile = &(src->dirty.tile[tr * src->hiz.cols]);
+    for (int t = c0 >> HIZ_SHIFT; t <= (c1 - 1) >> HIZ_SHIFT; t++)
+    {
+        tile[t] = 1;
+    }
+    // the tile workers share rows of tiles, so the row flag is stored atomically
+    if (!__atomic_load_n(&(src->dirty.row[tr]), __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&(src->dirty.row[tr]), 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Marks every tile as written, after a fill or read replaced the whole image.
+ * @param src the image
+ */
+void image_touchAll(Image *src)
+{
+    memset(src->dirty.tile, 1, src->hiz.rows * src->hiz.cols);
+    memset(src->dirty.row, 1, src->hiz.rows);
+}
+
+/**
+ * Tests whether everything at 1/z of zinv or farther is hidden in rows [r0, r1) and columns
+ * [c0, c1): returns 1 if every pixel there already has a 1/z greater than zinv. Tiles that were
+ * drawn into are brought up to date only when their stored value cannot decide, and only the
+ * tiles in the rectangle are touched, so threads may test disjoint tile-aligned rectangles.
+ * @param src the image
+ * @param r0 the first row
+ * @param c0 the first column
+ * @param r1 one past the last row
+ * @param c1 one past the last column
+ * @param zinv the nearest 1/z of the thing being drawn
+ * @return 1 if it is hidden everywhere in the rectangle, 0 otherwise
+ */
+int image_hizOccluded(Image *src, int r0, int c0, int r1, int c1, float zinv)
+{
+    int tr, tc, t, r, c, rEnd, cEnd;
+    float m, z;
+
+    if (!src)
+    {
+        fprintf(stderr, "Null pointer provided to image_hizOccluded\n");
+        exit(-1);
+    }
+    if (r0 >= r1 || c0 >= c1 || !(zinv == zinv))
+    {
+        return 0;
+    }
+
+    for (tr = r0 >> HIZ_SHIFT; tr <= (r1 - 1) >> HIZ_SHIFT; tr++)
+    {
+        for (tc = c0 >> HIZ_SHIFT; tc <= (c1 - 1) >> HIZ_SHIFT; tc++)
+        {
+            t = tr * src->hiz.cols + tc;
+            if (src->hiz.z[t] > zinv)
+                continue;
+            if (!src->hiz.dirty[t])
+                return 0;
+
+            // recompute the farthest depth of the tile from the z channel
+            rEnd = (tr + 1) << HIZ_SHIFT;
+            rEnd = rEnd < src->rows ? rEnd : src->rows;
+            cEnd = (tc + 1) << HIZ_SHIFT;
+            cEnd = cEnd < src->cols ? cEnd : src->cols;
+            m = image_zLoad(src, image_index(src, tr << HIZ_SHIFT, tc << HIZ_SHIFT));
+            for (r = tr << HIZ_SHIFT; r < rEnd; r++)
+            {
+                for (c = tc << HIZ_SHIFT; c < cEnd; c++)
+                {
+                    z = image_zLoad(src, image_index(src, r, c));
+                    if (z < m)
+                        m = z;
+                }
+            }
+            src->hiz.z[t] = m;
+            src->hiz.dirty[t] = 0;
+            if (m <= zinv)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Allocates the G-buffer used for deferred shading, if the image does not
+ * have one yet, and clears it.
+ * @param src the image
+ */
+void image_allocGBuffer(Image *src)
+{
+    if (!src)
+    {
+        fprintf(stderr, "Null pointer provided to image_allocGBuffer\n");
+        exit(-1);
+    }
+    if (src->gbuffer)
+    {
+        image_clearGBuffer(src);
+        return;
+    }
+    int size = src->rows * src->cols;
+    GBuffer *gb = (GBuffer *)malloc(sizeof(GBuffer));
+    if (!gb)
+    {
+        fprintf(stderr, "G-buffer allocation failed\n");
+        exit(-1);
+    }
+    gb->z = (float *)malloc(sizeof(float) * size);
+    gb->normal = (float *)malloc(sizeof(float) * 3 * size);
+    gb->position = (float *)malloc(sizeof(float) * 3 * size);
+    gb->material = (int *)malloc(sizeof(int) * size);
+    gb->nMaterials = 0;
+    gb->maxMaterials = 16;
+    gb->materials = (Material *)malloc(sizeof(Material) * gb->maxMaterials);
+    gb->active = 0;
+    if (!gb->z || !gb->normal || !gb->position || !gb->material || !gb->materials)
+    {
+        fprintf(stderr, "G-buffer allocation failed\n");
+        exit(-1);
+    }
+    src->gbuffer = gb;
+    image_clearGBuffer(src);
+}
+
+/**
+ * Frees the G-buffer of an image, if it has one.
+ * @param src the image
+ */
+void image_freeGBuffer(Image *src)
+{
+    if (!src || !src->gbuffer)
+    {
+        return;
+    }
+    free(src->gbuffer->z);
+    free(src->gbuffer->normal);
+    free(src->gbuffer->position);
+    free(src->gbuffer->material);
+    free(src->gbuffer->materials);
+    free(src->gbuffer);
+    src->gbuffer = NULL;
+}
+
+/**
+ * Marks every pixel of the G-buffer as empty and empties the material table.
+ * @param src the image
+ */
+void image_clearGBuffer(Image *src)
+{
+    if (!src || !src->gbuffer)
+    {
+        fprintf(stderr, "Null pointer provided to image_clearGBuffer\n");
+        exit(-1);
+    }
+    int size = src->rows * src->cols;
     for (int i = 0; i < size; i++)
     {
-        src->z[i] = z;
+        src->gbuffer->material[i] = -1;
     }
-};
+    src->gbuffer->nMaterials = 0;
+}
+
+/**
+ * Returns the index of a material in the G-buffer material table, adding
+ * it if it is not the most recently added material.
+ * @param src the image
+ * @param body the body color
+ * @param surface the surface color
+ * @param surfaceCoeff the specular coefficient
+ * @param oneSided 1 for one sided surfaces, 0 for two sided
+ * @return the material index
+ */
+int image_gbufferMaterial(Image *src, Color *body, Color *surface, float surfaceCoeff, int oneSided)
+{
+    if (!src || !src->gbuffer || !body || !surface)
+    {
+        fprintf(stderr, "Null pointer provided to image_gbufferMaterial\n");
+        exit(-1);
+    }
+    GBuffer *gb = src->gbuffer;
+    Material *m;
+
+    // Polygons come in runs with the same material, so only check the last one
+    if (gb->nMaterials > 0)
+    {
+        m = &(gb->materials[gb->nMaterials - 1]);
+        if (m->surfaceCoeff == surfaceCoeff && m->oneSided == oneSided &&
+            memcmp(&(m->body), body, sizeof(Color)) == 0 &&
+            memcmp(&(m->surface), surface, sizeof(Color)) == 0)
+        {
+            return gb->nMaterials - 1;
+        }
+    }
+    if (gb->nMaterials == gb->maxMaterials)
+    {
+        gb->maxMaterials *= 2;
+        gb->materials = (Material *)realloc(gb->materials, sizeof(Material) * gb->maxMaterials);
+        if (!gb->materials)
+        {
+            fprintf(stderr, "G-buffer material allocation failed\n");
+            exit(-1);
+        }
+    }
+    m = &(gb->materials[gb->nMaterials]);
+    color_copy(&(m->body), body);
+    color_copy(&(m->surface), surface);
+    m->surfaceCoeff = surfaceCoeff;
+    m->oneSided = oneSided;
+    return gb->nMaterials++;
+}
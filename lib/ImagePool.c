@@ -0,0 +1,162 @@
+/**
+ * A pool of allocated images for code that creates and frees scratch images repeatedly.
+ *
+ * Creating an image allocates every channel and writes every pixel, and freeing it gives all of
+ * that back; a loop that does both for each frame or each job spends its time in malloc and in
+ * page faults on memory it just released. The pool keeps the images instead, keyed by size and
+ * format. Giving an image back costs nothing, and the clear is put off until the image is handed
+ * out again, where image_reset only rewrites the tiles that were drawn into.
+ *
+ * The pool is locked, so threads may share one.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ImagePool.h"
+
+/**
+ * Creates an empty pool.
+ *
+ * @return Pointer to the new ImagePool.
+ */
+ImagePool *imagepool_create(void)
+{
+    ImagePool *pool = (ImagePool *)malloc(sizeof(ImagePool));
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Error creating the image pool\n");
+        exit(-1);
+    }
+    pool->images = NULL;
+    pool->nImages = 0;
+    pool->maxImages = 0;
+    pthread_mutex_init(&(pool->lock), NULL);
+    return pool;
+}
+
+/**
+ * Returns an image of the given size in the default depth and color formats, like
+ * image_createLayout. See imagepool_getFormat.
+ *
+ * @param pool Pointer to the ImagePool.
+ * @param rows The number of rows in the image.
+ * @param cols The number of cols in the image.
+ * @param layout The memory layout of the channels.
+ * @return Pointer to the Image, owned by the caller until imagepool_put.
+ */
+Image *imagepool_get(ImagePool *pool, int rows, int cols, ImageLayout layout)
+{
+    return imagepool_getFormat(pool, rows, cols, layout, ImageDepthFloat, ImageColorFloat);
+}
+
+/**
+ * Returns an image of the given size and format holding the reset values, like a new image from
+ * image_createFormat. An image of the pool that matches is reset and reused; if there is none, a
+ * new one is created.
+ *
+ * @param pool Pointer to the ImagePool.
+ * @param rows The number of rows in the image.
+ * @param cols The number of cols in the image.
+ * @param layout The memory layout of the channels.
+ * @param depth The format of the z channel.
+ * @param color The format of the color channels.
+ * @return Pointer to the Image, owned by the caller until imagepool_put.
+ */
+Image *imagepool_getFormat(ImagePool *pool, int rows, int cols, ImageLayout layout, ImageDepth depth, ImageColor color)
+{
+    Image *src = NULL;
+    int i;
+
+    if (!pool)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    for (i = pool->nImages - 1; i >= 0; i--)
+    {
+        src = pool->images[i];
+        if (src->rows == rows && src->cols == cols && src->layout == layout && src->depth == depth && src->color == color)
+        {
+            pool->images[i] = pool->images[--pool->nImages];
+            break;
+        }
+        src = NULL;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+
+    if (src == NULL)
+        return image_createFormat(rows, cols, layout, depth, color);
+
+    // the clear put off by imagepool_put
+    image_reset(src);
+    return src;
+}
+
+/**
+ * Gives an image back to the pool. The image does not have to have come from the pool, but it
+ * must not be used again by the caller.
+ *
+ * @param pool Pointer to the ImagePool.
+ * @param src Pointer to the Image.
+ */
+void imagepool_put(ImagePool *pool, Image *src)
+{
+    Image **images;
+
+    if (!pool || !src)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    if (pool->nImages == pool->maxImages)
+    {
+        pool->maxImages = pool->maxImages ? 2 * pool->maxImages : 8;
+        images = (Image **)realloc(pool->images, sizeof(Image *) * pool->maxImages);
+        if (images == NULL)
+        {
+            fprintf(stderr, "Error growing the image pool\n");
+            exit(-1);
+        }
+        pool->images = images;
+    }
+    pool->images[pool->nImages++] = src;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/**
+ * Frees every image waiting in the pool.
+ *
+ * @param pool Pointer to the ImagePool.
+ */
+void imagepool_clear(ImagePool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&(pool->lock));
+    for (i = 0; i < pool->nImages; i++)
+        image_free(pool->images[i]);
+    pool->nImages = 0;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/**
+ * Frees the pool and every image waiting in it. Images handed out and not given back are the
+ * caller's to free.
+ *
+ * @param pool Pointer to the ImagePool.
+ */
+void imagepool_free(ImagePool *pool)
+{
+    if (!pool)
+        return;
+    imagepool_clear(pool);
+    pthread_mutex_destroy(&(pool->lock));
+    free(pool->images);
+    free(pool);
+}
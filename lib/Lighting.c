@@ -401,3 +401,81 @@ void lighting_shadingSingle(Light *l, Vector *N, Vector *V, Point *p, Color *Cb,
     color_set(c, tmpR, tmpG, tmpB);
     // exit(-1);
 }
+
+/**
+ * Second pass of deferred shading. Lights every pixel of the image whose
+ * G-buffer entry is still the front-most surface, using the stored normal,
+ * point, and material, and writes the result into the image. Only the tiles
+ * written since the last image_reset are visited, which covers every pixel
+ * a fill wrote to the G-buffer, and the entries visited are emptied, so the
+ * G-buffer is left empty for the next deferred pass without a clear over
+ * the whole image.
+ *
+ * @param l the lighting to shade with
+ * @param src the image, with a filled G-buffer
+ * @param viewer the location of the viewer
+ */
+void lighting_shadeGBuffer(Lighting *l, Image *src, Point *viewer)
+{
+    if (!l || !src || !src->gbuffer || !viewer)
+    {
+        fprintf(stderr, "Null pointer provided to lighting_shadeGBuffer\n");
+        exit(-1);
+    }
+    GBuffer *gb = src->gbuffer;
+    Material *m;
+    Vector N, V;
+    Point P;
+    Color c;
+    int i, r, col, tr, tc, rEnd, cEnd;
+
+    N.val[3] = 0.0;
+    P.val[3] = 1.0;
+    for (tr = 0; tr < src->hiz.rows; tr++)
+    {
+        if (!src->dirty.row[tr])
+        {
+            continue;
+        }
+        rEnd = (tr + 1) << HIZ_SHIFT;
+        rEnd = rEnd < src->rows ? rEnd : src->rows;
+        for (tc = 0; tc < src->hiz.cols; tc++)
+        {
+            if (!src->dirty.tile[tr * src->hiz.cols + tc])
+            {
+                continue;
+            }
+            cEnd = (tc + 1) << HIZ_SHIFT;
+            cEnd = cEnd < src->cols ? cEnd : src->cols;
+            for (r = tr << HIZ_SHIFT; r < rEnd; r++)
+            {
+                for (col = tc << HIZ_SHIFT; col < cEnd; col++)
+                {
+                    i = r * src->cols + col;
+                    if (gb->material[i] < 0)
+                    {
+                        continue;
+                    }
+                    // skip ones something else was drawn over
+                    if (gb->z[i] == image_getz(src, r, col))
+                    {
+                        m = &(gb->materials[gb->material[i]]);
+                        N.val[0] = gb->normal[3 * i];
+                        N.val[1] = gb->normal[3 * i + 1];
+                        N.val[2] = gb->normal[3 * i + 2];
+                        P.val[0] = gb->position[3 * i];
+                        P.val[1] = gb->position[3 * i + 1];
+                        P.val[2] = gb->position[3 * i + 2];
+
+                        vector_setPoints(&V, &P, viewer);
+                        vector_normalize(&V);
+                        vector_normalize(&N);
+                        lighting_shading(l, &N, &V, &P, &(m->body), &(m->surface), m->surfaceCoeff, m->oneSided, &c);
+                        image_setColor(src, r, col, c);
+                    }
+                    gb->material[i] = -1;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,352 @@
+/**
+ * An indexed triangle mesh, whose vertices are shared by the triangles that use them.
+ *
+ * A closed surface built from separate polygons stores each vertex once for every face around
+ * it, and module_draw transforms, lights, and projects every one of those copies. A mesh keeps
+ * each vertex once, and module_draw does that work once per vertex, then fills the triangles
+ * from the results.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "Mesh.h"
+
+/**
+ * Returns an allocated, empty Mesh.
+ *
+ * @return Mesh pointer
+ */
+Mesh *mesh_create(void)
+{
+    Mesh *m = (Mesh *)malloc(sizeof(Mesh));
+    if (!m)
+    {
+        fprintf(stderr, "Memory allocation failed in mesh_create\n");
+        exit(-1);
+    }
+    mesh_init(m);
+    return m;
+}
+
+/**
+ * Initializes an existing Mesh to an empty, one-sided, z-buffered mesh.
+ *
+ * @param m the mesh to initialize
+ */
+void mesh_init(Mesh *m)
+{
+    if (!m)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_init\n");
+        exit(-1);
+    }
+    m->nVertex = 0;
+    m->maxVertex = 0;
+    m->vertex = NULL;
+    m->normal = NULL;
+    m->color = NULL;
+    m->nTriangle = 0;
+    m->maxTriangle = 0;
+    m->index = NULL;
+    m->oneSided = 1;
+    m->zBuffer = 1;
+}
+
+/**
+ * Frees the arrays of a mesh and makes it empty.
+ *
+ * @param m the mesh to clear
+ */
+void mesh_clear(Mesh *m)
+{
+    if (!m)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_clear\n");
+        exit(-1);
+    }
+    free(m->vertex);
+    free(m->normal);
+    free(m->color);
+    free(m->index);
+    mesh_init(m);
+}
+
+/**
+ * Frees the arrays of a mesh and the Mesh pointer.
+ *
+ * @param m the mesh to free
+ */
+void mesh_free(Mesh *m)
+{
+    if (m)
+    {
+        mesh_clear(m);
+        free(m);
+    }
+}
+
+/**
+ * Makes room for n vertices in the vertex arrays.
+ */
+static void mesh_reserveVertices(Mesh *m, int n)
+{
+    if (n <= m->maxVertex)
+        return;
+    m->maxVertex = 2 * m->maxVertex > n ? 2 * m->maxVertex : (n > 16 ? n : 16);
+    m->vertex = (Point *)realloc(m->vertex, sizeof(Point) * m->maxVertex);
+    m->normal = (Vector *)realloc(m->normal, sizeof(Vector) * m->maxVertex);
+    if (m->color)
+        m->color = (Color *)realloc(m->color, sizeof(Color) * m->maxVertex);
+    if (!m->vertex || !m->normal)
+    {
+        fprintf(stderr, "mesh vertex memory allocation failed\n");
+        exit(-1);
+    }
+}
+
+/**
+ * Adds the color array to a mesh that has none, with white for the vertices it already has.
+ */
+static void mesh_addColors(Mesh *m)
+{
+    int i;
+
+    m->color = (Color *)malloc(sizeof(Color) * (m->maxVertex > 0 ? m->maxVertex : 1));
+    if (!m->color)
+    {
+        fprintf(stderr, "mesh color memory allocation failed\n");
+        exit(-1);
+    }
+    for (i = 0; i < m->nVertex; i++)
+    {
+        color_set(&(m->color[i]), 1.0, 1.0, 1.0);
+    }
+}
+
+/**
+ * Makes room for n triangles in the index array.
+ */
+static void mesh_reserveTriangles(Mesh *m, int n)
+{
+    if (n <= m->maxTriangle)
+        return;
+    m->maxTriangle = 2 * m->maxTriangle > n ? 2 * m->maxTriangle : (n > 16 ? n : 16);
+    m->index = (int *)realloc(m->index, sizeof(int) * 3 * m->maxTriangle);
+    if (!m->index)
+    {
+        fprintf(stderr, "mesh triangle memory allocation failed\n");
+        exit(-1);
+    }
+}
+
+/**
+ * Copies the vertices, triangles, and flags of one mesh to another.
+ *
+ * @param to the destination mesh, whose arrays are replaced
+ * @param from the source mesh
+ */
+void mesh_copy(Mesh *to, Mesh *from)
+{
+    if (!to || !from)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_copy\n");
+        exit(-1);
+    }
+    if (to == from)
+        return;
+    mesh_clear(to);
+    mesh_reserveVertices(to, from->nVertex);
+    mesh_reserveTriangles(to, from->nTriangle);
+    if (from->color)
+        mesh_addColors(to);
+    memcpy(to->vertex, from->vertex, sizeof(Point) * from->nVertex);
+    memcpy(to->normal, from->normal, sizeof(Vector) * from->nVertex);
+    if (from->color)
+        memcpy(to->color, from->color, sizeof(Color) * from->nVertex);
+    memcpy(to->index, from->index, sizeof(int) * 3 * from->nTriangle);
+    to->nVertex = from->nVertex;
+    to->nTriangle = from->nTriangle;
+    to->oneSided = from->oneSided;
+    to->zBuffer = from->zBuffer;
+}
+
+/**
+ * Adds a vertex to the mesh. The normal is normalized, as polygon_setNormals does. A mesh gets
+ * colors with the first vertex that is given one; the vertices before it are white.
+ *
+ * @param m the mesh
+ * @param p the position
+ * @param n the normal, or NULL to leave it zero for mesh_calculateNormals
+ * @param c the color, or NULL for white in a mesh with colors
+ * @return the index of the new vertex
+ */
+int mesh_addVertex(Mesh *m, Point *p, Vector *n, Color *c)
+{
+    int k;
+
+    if (!m || !p)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_addVertex\n");
+        exit(-1);
+    }
+    mesh_reserveVertices(m, m->nVertex + 1);
+    if (c && !m->color)
+        mesh_addColors(m);
+    k = m->nVertex++;
+    point_copy(&(m->vertex[k]), p);
+    if (n)
+    {
+        vector_copy(&(m->normal[k]), n);
+        if (vector_length(n) > 0.0)
+            vector_normalize(&(m->normal[k]));
+    }
+    else
+    {
+        vector_set(&(m->normal[k]), 0.0, 0.0, 0.0);
+    }
+    if (m->color)
+    {
+        if (c)
+            color_copy(&(m->color[k]), c);
+        else
+            color_set(&(m->color[k]), 1.0, 1.0, 1.0);
+    }
+    return k;
+}
+
+/**
+ * Adds a triangle made of three vertices already in the mesh.
+ *
+ * @param m the mesh
+ * @param a the index of the first vertex
+ * @param b the index of the second vertex
+ * @param c the index of the third vertex
+ */
+void mesh_addTriangle(Mesh *m, int a, int b, int c)
+{
+    int *t;
+
+    if (!m)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_addTriangle\n");
+        exit(-1);
+    }
+    if (a < 0 || b < 0 || c < 0 || a >= m->nVertex || b >= m->nVertex || c >= m->nVertex)
+    {
+        fprintf(stderr, "Vertex index out of range in mesh_addTriangle\n");
+        exit(-1);
+    }
+    mesh_reserveTriangles(m, m->nTriangle + 1);
+    t = &(m->index[3 * m->nTriangle++]);
+    t[0] = a;
+    t[1] = b;
+    t[2] = c;
+}
+
+/**
+ * Sets whether the triangles are lit on the front side only.
+ *
+ * @param m the mesh
+ * @param oneSided 1 for one sided, 0 for two-sided
+ */
+void mesh_setSided(Mesh *m, int oneSided)
+{
+    if (!m)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_setSided\n");
+        exit(-1);
+    }
+    if (oneSided == 0 || oneSided == 1)
+        m->oneSided = oneSided;
+}
+
+/**
+ * Sets the z-buffer flag of the mesh.
+ *
+ * @param m the mesh
+ * @param flag 1 for true, 0 for false
+ */
+void mesh_zBuffer(Mesh *m, int flag)
+{
+    if (!m)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_zBuffer\n");
+        exit(-1);
+    }
+    if (flag == 0 || flag == 1)
+        m->zBuffer = flag;
+}
+
+/**
+ * Sets the normal of every vertex to the average of the normals of the triangles around it,
+ * weighted by their areas. A triangle a, b, c faces along (a - b) x (c - b), the orientation
+ * readPLY and module_terrain give their faces.
+ *
+ * @param m the mesh
+ */
+void mesh_calculateNormals(Mesh *m)
+{
+    Vector ba, bc, n;
+    Point *a, *b, *c;
+    int i, j;
+
+    if (!m)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_calculateNormals\n");
+        exit(-1);
+    }
+    for (i = 0; i < m->nVertex; i++)
+    {
+        vector_set(&(m->normal[i]), 0.0, 0.0, 0.0);
+    }
+    for (i = 0; i < m->nTriangle; i++)
+    {
+        a = &(m->vertex[m->index[3 * i]]);
+        b = &(m->vertex[m->index[3 * i + 1]]);
+        c = &(m->vertex[m->index[3 * i + 2]]);
+        vector_set(&ba, a->val[0] - b->val[0], a->val[1] - b->val[1], a->val[2] - b->val[2]);
+        vector_set(&bc, c->val[0] - b->val[0], c->val[1] - b->val[1], c->val[2] - b->val[2]);
+        vector_cross(&ba, &bc, &n); // its length is twice the area
+        for (j = 0; j < 3; j++)
+        {
+            Vector *v = &(m->normal[m->index[3 * i + j]]);
+            v->val[0] += n.val[0];
+            v->val[1] += n.val[1];
+            v->val[2] += n.val[2];
+        }
+    }
+    for (i = 0; i < m->nVertex; i++)
+    {
+        if (vector_length(&(m->normal[i])) > 0.0)
+            vector_normalize(&(m->normal[i]));
+    }
+}
+
+/**
+ * Prints the mesh to the stream designated by the file pointer.
+ *
+ * @param m the mesh to print
+ * @param fp the output stream
+ */
+void mesh_print(Mesh *m, FILE *fp)
+{
+    int i;
+
+    if (!m || !fp)
+    {
+        fprintf(stderr, "A null pointer was provided to mesh_print\n");
+        exit(-1);
+    }
+    fprintf(fp, "Mesh: %d vertices, %d triangles, one sided %d, z-buffer %d\n", m->nVertex, m->nTriangle, m->oneSided, m->zBuffer);
+    for (i = 0; i < m->nVertex; i++)
+    {
+        fprintf(fp, "  v%d ", i);
+        point_print(&(m->vertex[i]), fp);
+    }
+    for (i = 0; i < m->nTriangle; i++)
+    {
+        fprintf(fp, "  t%d %d %d %d\n", i, m->index[3 * i], m->index[3 * i + 1], m->index[3 * i + 2]);
+    }
+}
@@ -5,10 +5,35 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
+#include <pthread.h>
 #include "Module.h"
+#include "Tiles.h"
 #define M_PI 3.14159265358979323846
 
+static void module_drawElements(Module *md, Matrix *VTM, Matrix *GTM, DrawState *ds, Lighting *lighting, Image *src, TileRenderer *tr, Arena *arena, unsigned long long path);
+static void module_drawPasses(Module *md, DrawList *dl, Matrix *VTM, Matrix *GTM, DrawState *ds, Lighting *lighting, Image *src);
+static void drawlist_drawItems(DrawList *dl, Matrix *VTM, DrawState *ds, Lighting *lighting, Image *src, TileRenderer *tr, Arena *arena);
+
+// bumped whenever any module changes; a module's cached bounds are good while its boundsStamp matches
+static unsigned boundsCounter = 1;
+
+// the copies and scratch of the frame being drawn on this thread, given back at the start of the next
+static _Thread_local Arena *frameArena = NULL;
+
+// holds each thread's frameArena too, so it is freed when the thread exits
+static pthread_key_t frameArenaKey;
+static pthread_once_t frameArenaOnce = PTHREAD_ONCE_INIT;
+
+// counts the module_draw calls; drawStamp is the count of the call this thread is in
+static unsigned drawCounter = 0;
+static _Thread_local unsigned drawStamp = 0;
+
+// the path of the module given to module_draw, see module_path
+#define MODULE_PATH_ROOT 0x84222325cbf29ce4ULL
+
 /**
  * Allocate and return an initialized but empty Element.
  *
@@ -26,6 +51,8 @@ Element *element_create()
     e->type = ObjNone;
     e->obj.module = NULL; // Temp use the module field to allow a pointer
     e->next = NULL;
+    e->visibleFrames = 0;
+    e->visibleStamp = 0;
     return e;
 }
 
@@ -70,6 +97,46 @@ Element *element_init(ObjectType type, void *obj)
             polygon_init(&(e->obj.polygon));
             polygon_copy(&(e->obj.polygon), (Polygon *)obj);
             break;
+        case ObjMesh:
+            mesh_init(&(e->obj.mesh));
+            mesh_copy(&(e->obj.mesh), (Mesh *)obj);
+            break;
+        case ObjInstances:
+        {
+            MeshInstances *from = (MeshInstances *)obj, *to = &(e->obj.instances);
+            *to = *from;
+            mesh_init(&(to->mesh));
+            mesh_copy(&(to->mesh), &(from->mesh));
+            to->xform = (Matrix *)malloc(sizeof(Matrix) * from->nInstance);
+            to->material = from->material ? (DrawMaterial *)malloc(sizeof(DrawMaterial) * from->nInstance) : NULL;
+            if (!to->xform || (from->material && !to->material))
+            {
+                fprintf(stderr, "Malloc failed in element_init\n");
+                exit(-1);
+            }
+            memcpy(to->xform, from->xform, sizeof(Matrix) * from->nInstance);
+            if (from->material)
+                memcpy(to->material, from->material, sizeof(DrawMaterial) * from->nInstance);
+            break;
+        }
+        case ObjLOD:
+        {
+            LOD *from = (LOD *)obj, *to = &(e->obj.lod);
+            *to = *from;
+            to->level = (void **)malloc(sizeof(void *) * from->nLevel);
+            to->minSize = (double *)malloc(sizeof(double) * from->nLevel);
+            if (!to->level || !to->minSize)
+            {
+                fprintf(stderr, "Malloc failed in element_init\n");
+                exit(-1);
+            }
+            memcpy(to->level, from->level, sizeof(void *) * from->nLevel);
+            memcpy(to->minSize, from->minSize, sizeof(double) * from->nLevel);
+            to->state = NULL;
+            to->nState = to->maxState = 0;
+            to->drawn[0] = to->drawn[1] = 0;
+            break;
+        }
         case ObjMatrix:
             matrix_copy(&(e->obj.matrix), (Matrix *)obj);
             break;
@@ -122,6 +189,24 @@ void element_delete(Element *e)
         if (&(e->obj.polygon))
             polygon_clear(&(e->obj.polygon));
         break;
+    case ObjMesh:
+        mesh_clear(&(e->obj.mesh));
+        break;
+    case ObjInstances:
+        mesh_clear(&(e->obj.instances.mesh));
+        free(e->obj.instances.xform);
+        free(e->obj.instances.material);
+        break;
+    case ObjLOD:
+        if (e->obj.lod.own)
+        {
+            for (int i = 0; i < e->obj.lod.nLevel; i++)
+                module_delete(e->obj.lod.level[i]);
+        }
+        free(e->obj.lod.level);
+        free(e->obj.lod.minSize);
+        free(e->obj.lod.state);
+        break;
     default:
         // For the rest, do nothing, as no mallocs occurred for these types
         // Point, Line, Matrix, Color, BodyColor, SurfaceColor, SurfaceCoeff, Light
@@ -146,6 +231,7 @@ Module *module_create()
     }
     m->head = NULL;
     m->tail = NULL;
+    m->boundsStamp = 0;
     return m;
 }
 
@@ -178,6 +264,7 @@ void module_clear(Module *md)
     }
     md->head = NULL; // Reset the head and tail
     md->tail = NULL;
+    boundsCounter++;
 }
 
 /**
@@ -221,6 +308,24 @@ void module_insert(Module *md, Element *e)
         md->tail->next = e;
         md->tail = e;
     }
+    boundsCounter++;
+}
+
+/**
+ * Marks the cached bounding boxes of the modules as out of date. module_insert and module_clear do
+ * this already; call it after changing the elements of a module in place when modules are drawn
+ * with occlusion culling.
+ *
+ * @param md Pointer to the Module that was changed.
+ */
+void module_invalidateBounds(Module *md)
+{
+    if (!md)
+    {
+        fprintf(stderr, "Null pointer provided to module_invalidateBounds\n");
+        exit(-1);
+    }
+    boundsCounter++;
 }
 
 /**
@@ -313,6 +418,113 @@ void module_polygon(Module *md, Polygon *p)
     module_insert(md, e);
 }
 
+/**
+ * Adds a copy of a triangle mesh to the tail of the module's list.
+ *
+ * @param md Pointer to the Module.
+ * @param m Pointer to the Mesh to add.
+ */
+void module_mesh(Module *md, Mesh *m)
+{
+    if (!md || !m) // Null check
+    {
+        fprintf(stderr, "Null pointer provided to module_mesh\n");
+        exit(-1);
+    }
+
+    Element *e = element_init(ObjMesh, m);
+    module_insert(md, e);
+}
+
+/**
+ * Adds n copies of a triangle mesh to the tail of the module's list. Copy i is transformed by
+ * xform[i] and then by the module's current transform, and drawn with material[i]. The module
+ * stores one copy of the mesh's vertices, and module_draw culls and draws the copies in one loop
+ * over the instances instead of walking a sub-module for each, so a formation of n ships costs
+ * about n times the visible triangles of one.
+ *
+ * @param md Pointer to the Module.
+ * @param m Pointer to the Mesh to add.
+ * @param n The number of copies.
+ * @param xform Array of the n transforms of the copies.
+ * @param material Array of the n materials of the copies, or NULL to draw them all with the
+ * DrawState's material, as for module_mesh.
+ */
+void module_meshInstances(Module *md, Mesh *m, int n, Matrix *xform, DrawMaterial *material)
+{
+    MeshInstances inst;
+    int i;
+
+    if (!md || !m || !xform || n < 1) // Null check
+    {
+        fprintf(stderr, "Invalid parameter provided to module_meshInstances\n");
+        exit(-1);
+    }
+
+    // element_init copies the mesh and the arrays
+    inst.mesh = *m;
+    inst.nInstance = n;
+    inst.xform = xform;
+    inst.material = material;
+    point_set3D(&(inst.boundsMin), HUGE_VAL, HUGE_VAL, HUGE_VAL);
+    point_set3D(&(inst.boundsMax), -HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+    for (i = 0; i < m->nVertex; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            inst.boundsMin.val[j] = fmin(inst.boundsMin.val[j], m->vertex[i].val[j]);
+            inst.boundsMax.val[j] = fmax(inst.boundsMax.val[j], m->vertex[i].val[j]);
+        }
+    }
+
+    Element *e = element_init(ObjInstances, &inst);
+    module_insert(md, e);
+}
+
+/**
+ * Adds a level-of-detail element to the tail of the module's list.
+ */
+static void module_lodInsert(Module *md, int n, Module **levels, double *minSize, double hysteresis, int own)
+{
+    LOD lod;
+
+    lod.nLevel = n;
+    lod.level = (void **)levels;
+    lod.minSize = minSize;
+    lod.hysteresis = hysteresis;
+    lod.own = own;
+    Element *e = element_init(ObjLOD, &lod);
+    module_insert(md, e);
+}
+
+/**
+ * Adds a level-of-detail node to the tail of the module's list: n versions of one object, like
+ * n sub-modules of which module_draw draws one. Each time the node is drawn, the bounding box of
+ * the finest level is projected to the screen, and the first level whose minSize its larger side
+ * in pixels reaches is drawn, or the last level if it reaches none. To switch to another level,
+ * the size has to pass that level's threshold by the fraction hysteresis, so an object near a
+ * threshold does not flicker between two levels. A module drawn from several places in the
+ * hierarchy is a different object on the screen at each, so each place keeps its own level, and
+ * the level is picked once per module_draw call, so a depth pre-pass and the shading pass draw the
+ * same one. Like module_module, the levels are referenced, not copied. module_compile and the ray
+ * tracer use the finest level.
+ *
+ * @param md Pointer to the Module.
+ * @param n The number of levels.
+ * @param levels Array of the n modules, from the finest to the coarsest.
+ * @param minSize Array of the n sizes in pixels, decreasing, at or above which each level is drawn.
+ * @param hysteresis The fraction, 0 for none.
+ */
+void module_lod(Module *md, int n, Module **levels, double *minSize, double hysteresis)
+{
+    if (!md || !levels || !minSize || n < 1 || hysteresis < 0) // Null check
+    {
+        fprintf(stderr, "Invalid parameter provided to module_lod\n");
+        exit(-1);
+    }
+    module_lodInsert(md, n, levels, minSize, hysteresis, 0);
+}
+
 /**
  * Object that sets the current transform to the identity, placed at the tail of the module’s list.
  *
@@ -422,6 +634,25 @@ void module_shear2D(Module *md, double shx, double shy)
 /**
  * Draw the module into the image using the given view transformation matrix [VTM], Lighting, and DrawState.
  *
+ * If ds->deferred is set and the shading is ShadePhong, the polygons are first rasterized into the
+ * image's G-buffer and then every visible pixel is lit once by lighting_shadeGBuffer. Only this
+ * pass writes the G-buffer; polygons drawn directly with ShadePhong are always lit as they are
+ * drawn.
+ *
+ * If ds->threads is more than 1, filled polygons are binned into screen tiles and the tiles are
+ * rasterized in parallel by that many threads (see Tiles.h). The image is the same as drawing
+ * with one thread.
+ *
+ * If ds->depthPrepass is set and the shading is ShadeGouraud or non-deferred ShadePhong, the
+ * filled polygons are first drawn depth-only, and then drawn again with ZCompareEqual so that
+ * only the nearest surface at each pixel is shaded. The DrawState is changed by the elements as
+ * if the module had been drawn once.
+ *
+ * The transformed copies of the elements, and the tile bins, come from an Arena kept for the
+ * calling thread and reset at the start of each call, so once the arena has grown to the size of
+ * a frame, drawing makes no heap calls. The arena is freed when the thread exits, or by
+ * module_freeFrameArena.
+ *
  * @param md Pointer to the Module.
  * @param VTM Pointer to the view transformation matrix.
  * @param GTM Pointer to the global transformation matrix.
@@ -436,139 +667,1439 @@ void module_draw(Module *md, Matrix *VTM, Matrix *GTM, DrawState *ds, Lighting *
         fprintf(stderr, "Null pointer provided to module_draw\n");
         exit(-1);
     }
+    module_drawPasses(md, NULL, VTM, GTM, ds, lighting, src);
+}
+
+/**
+ * Frees the calling thread's draw arena, as a thread that called module_draw does on exit. The
+ * main thread calls this before the program ends, since returning from main does not run the
+ * thread exit destructors. The next module_draw on the thread creates a new arena.
+ */
+void module_freeFrameArena(void)
+{
+    if (!frameArena)
+        return;
+    pthread_setspecific(frameArenaKey, NULL);
+    arena_free(frameArena);
+    frameArena = NULL;
+}
+
+/**
+ * Frees the frameArena of a thread that is exiting.
+ */
+static void module_frameArenaExit(void *arena)
+{
+    arena_free((Arena *)arena);
+}
+
+/**
+ * Creates the key that frees each thread's frameArena when the thread exits.
+ */
+static void module_frameArenaKey(void)
+{
+    if (pthread_key_create(&frameArenaKey, module_frameArenaExit) != 0)
+    {
+        fprintf(stderr, "Unable to create the draw arena key\n");
+        exit(-1);
+    }
+}
+
+/**
+ * Draws a module or a compiled DrawList with the passes the DrawState asks for: sets up the
+ * G-buffer and the TileRenderer, runs the depth pre-pass and the shading pass, and lights the
+ * G-buffer. Exactly one of md and dl is drawn.
+ *
+ * @param md Pointer to the Module, or NULL to draw dl.
+ * @param dl Pointer to the DrawList, or NULL to draw md.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param GTM Pointer to the global transformation matrix of md.
+ * @param ds Pointer to the DrawState.
+ * @param lighting Pointer to the Lighting structure.
+ * @param src Pointer to the Image.
+ */
+static void module_drawPasses(Module *md, DrawList *dl, Matrix *VTM, Matrix *GTM, DrawState *ds, Lighting *lighting, Image *src)
+{
+    TileRenderer tiles, *tr = NULL;
+    DrawState zds;
+    ZCompare zCompare;
+    Arena *arena;
+    int deferred, prepass;
+
+    if (!frameArena)
+    {
+        pthread_once(&frameArenaOnce, module_frameArenaKey);
+        frameArena = arena_create(0);
+        pthread_setspecific(frameArenaKey, frameArena);
+    }
+    arena = frameArena;
+    arena_reset(arena);
+    drawStamp = __atomic_add_fetch(&drawCounter, 1, __ATOMIC_RELAXED);
+
+    deferred = ds->shade == ShadePhong && ds->deferred && lighting;
+    if (deferred)
+    {
+        // the last deferred pass left the G-buffer empty, see lighting_shadeGBuffer
+        if (!src->gbuffer)
+            image_allocGBuffer(src);
+        src->gbuffer->nMaterials = 0;
+        src->gbuffer->active = 1;
+    }
+    if (ds->threads > 1)
+    {
+        tr = &tiles;
+        tiles_begin(tr, src, lighting, ds->threads, arena);
+    }
+    prepass = ds->depthPrepass && !deferred && (ds->shade == ShadeGouraud || ds->shade == ShadePhong);
+    if (prepass)
+    {
+        // the pre-pass works on a copy so the shading pass sees the DrawState it was given
+        drawstate_copy(&zds, ds);
+        zds.zCompare = ZCompareDepthOnly;
+        if (dl)
+            drawlist_drawItems(dl, VTM, &zds, lighting, src, tr, arena);
+        else
+            module_drawElements(md, VTM, GTM, &zds, lighting, src, tr, arena, MODULE_PATH_ROOT);
+        if (tr)
+            tiles_flush(tr);
+        zCompare = ds->zCompare;
+        ds->zCompare = ZCompareEqual;
+        if (dl)
+            drawlist_drawItems(dl, VTM, ds, lighting, src, tr, arena);
+        else
+            module_drawElements(md, VTM, GTM, ds, lighting, src, tr, arena, MODULE_PATH_ROOT);
+        ds->zCompare = zCompare;
+    }
+    else if (dl)
+    {
+        drawlist_drawItems(dl, VTM, ds, lighting, src, tr, arena);
+    }
+    else
+    {
+        module_drawElements(md, VTM, GTM, ds, lighting, src, tr, arena, MODULE_PATH_ROOT);
+    }
+    if (tr)
+    {
+        tiles_end(tr);
+    }
+    if (deferred)
+    {
+        src->gbuffer->active = 0;
+        lighting_shadeGBuffer(lighting, src, &(ds->viewer));
+    }
+}
+
+/**
+ * Grows the box lo, hi to hold the point p transformed by the matrix m.
+ */
+static void module_boundsAdd(Matrix *m, Point *p, Point *lo, Point *hi)
+{
+    Point t;
+    matrix_xformPoint(m, p, &t);
+    for (int i = 0; i < 3; i++)
+    {
+        lo->val[i] = fmin(lo->val[i], t.val[i]);
+        hi->val[i] = fmax(hi->val[i], t.val[i]);
+    }
+}
 
-    // if (!lighting)
-    // {
-    //     printf("null lighting pointer here\n");
-    //     exit(-1);
-    // }
+/**
+ * Brings the cached bounding box and solid flag of the module up to date, computing those of its
+ * sub-modules along the way. The box holds every vertex and control point the module draws, in
+ * the module's own coordinates; it is empty (boundsMin above boundsMax) if the module draws
+ * nothing.
+ *
+ * @param md Pointer to the Module.
+ */
+static void module_bounds(Module *md)
+{
     Matrix LTM;
-    matrix_identity(&LTM);
+    Point lo, hi, c;
+    Module *sub;
+    int i;
 
-    Element *e = md->head;
-    while (e) // Iterate through the list until you get to NULL (end of list)
+    if (md->boundsStamp == boundsCounter)
+    {
+        return;
+    }
+
+    matrix_identity(&LTM);
+    point_set3D(&lo, HUGE_VAL, HUGE_VAL, HUGE_VAL);
+    point_set3D(&hi, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+    md->solid = 1;
+    for (Element *e = md->head; e; e = e->next)
     {
         switch (e->type)
         {
-        case ObjBezier:
+        case ObjPolygon:
+            for (i = 0; i < e->obj.polygon.nVertex; i++)
+                module_boundsAdd(&LTM, &(e->obj.polygon.vertex[i]), &lo, &hi);
+            break;
+        case ObjMesh:
+            for (i = 0; i < e->obj.mesh.nVertex; i++)
+                module_boundsAdd(&LTM, &(e->obj.mesh.vertex[i]), &lo, &hi);
+            break;
+        case ObjInstances:
         {
-            Point cp[4], cpt[4];
-            BezierCurve b;
-            bezierCurve_init(&b);
-            // Iterate through the control point list
-            for (int i = 0; i < 4; i++)
+            MeshInstances *inst = &(e->obj.instances);
+            Matrix TM;
+            if (inst->boundsMin.val[0] > inst->boundsMax.val[0])
+                break;
+            for (int k = 0; k < inst->nInstance; k++)
             {
-                point_copy(&(cp[i]), &(e->obj.bezierCurve.cp[i]));
-                // Transform the point by each matrix, but alternate the destination to avoid
-                // using the same point for cp and q
-                matrix_xformPoint(&LTM, &(cp[i]), &(cpt[i]));
-                matrix_xformPoint(GTM, &(cpt[i]), &(cp[i]));
-                matrix_xformPoint(VTM, &(cp[i]), &(cpt[i]));
-                point_normalize(&(cpt[i]));
+                matrix_multiply(&LTM, &(inst->xform[k]), &TM);
+                for (i = 0; i < 8; i++)
+                {
+                    point_set3D(&c, (i & 1 ? inst->boundsMax : inst->boundsMin).val[0],
+                                (i & 2 ? inst->boundsMax : inst->boundsMin).val[1],
+                                (i & 4 ? inst->boundsMax : inst->boundsMin).val[2]);
+                    module_boundsAdd(&TM, &c, &lo, &hi);
+                }
             }
-            bezierCurve_set(&b, cpt);
-            bezierCurve_draw(&b, src, ds->color);
+            break;
         }
-        break;
-        case ObjColor:
-            drawstate_setColor(ds, e->obj.color);
+        case ObjLOD:
+            for (int k = 0; k < e->obj.lod.nLevel; k++)
+            {
+                sub = e->obj.lod.level[k];
+                module_bounds(sub);
+                md->solid = md->solid && sub->solid;
+                if (sub->boundsMin.val[0] > sub->boundsMax.val[0])
+                    continue;
+                for (i = 0; i < 8; i++)
+                {
+                    point_set3D(&c, (i & 1 ? sub->boundsMax : sub->boundsMin).val[0],
+                                (i & 2 ? sub->boundsMax : sub->boundsMin).val[1],
+                                (i & 4 ? sub->boundsMax : sub->boundsMin).val[2]);
+                    module_boundsAdd(&LTM, &c, &lo, &hi);
+                }
+            }
             break;
-        case ObjBodyColor:
-            drawstate_setBody(ds, e->obj.color);
+        case ObjLine:
+            module_boundsAdd(&LTM, &(e->obj.line.a), &lo, &hi);
+            module_boundsAdd(&LTM, &(e->obj.line.b), &lo, &hi);
+            md->solid = 0;
             break;
-        case ObjSurfaceColor:
-            drawstate_setSurface(ds, e->obj.color);
+        case ObjPolyline:
+            for (i = 0; i < e->obj.polyline.numVertex; i++)
+                module_boundsAdd(&LTM, &(e->obj.polyline.vertex[i]), &lo, &hi);
+            md->solid = 0;
+            break;
+        case ObjBezier:
+            for (i = 0; i < 4; i++)
+                module_boundsAdd(&LTM, &(e->obj.bezierCurve.cp[i]), &lo, &hi);
+            md->solid = 0;
             break;
-        case ObjSurfaceCoeff:
-            drawstate_setSurfaceCoeff(ds, e->obj.coeff);
         case ObjPoint:
-        {
-            Point p, pt;
-            point_copy(&p, &(e->obj.point));
-            // Transform the point by each matrix, but alternate the destination to avoid
-            // using the same point for p and q
-            matrix_xformPoint(&LTM, &p, &pt);
-            matrix_xformPoint(GTM, &pt, &p);
-            matrix_xformPoint(VTM, &p, &pt);
-            point_normalize(&pt);
-            point_draw(&pt, src, ds->color);
+            module_boundsAdd(&LTM, &(e->obj.point), &lo, &hi);
+            md->solid = 0;
+            break;
+        case ObjSurfaceCoeff:
+            // module_drawElements draws a point for these too; it is not depth tested
+            md->solid = 0;
+            break;
+        case ObjMatrix:
+            matrix_multiply(&(e->obj.matrix), &LTM, &LTM);
+            break;
+        case ObjIdentity:
+            matrix_identity(&LTM);
+            break;
+        case ObjModule:
+            sub = e->obj.module;
+            module_bounds(sub);
+            md->solid = md->solid && sub->solid;
+            if (sub->boundsMin.val[0] > sub->boundsMax.val[0])
+                break;
+            for (i = 0; i < 8; i++)
+            {
+                point_set3D(&c, (i & 1 ? sub->boundsMax : sub->boundsMin).val[0],
+                            (i & 2 ? sub->boundsMax : sub->boundsMin).val[1],
+                            (i & 4 ? sub->boundsMax : sub->boundsMin).val[2]);
+                module_boundsAdd(&LTM, &c, &lo, &hi);
+            }
+            break;
+        default:
+            break;
         }
-        break;
-        case ObjLine:
+    }
+    md->boundsMin = lo;
+    md->boundsMax = hi;
+    md->boundsStamp = boundsCounter;
+}
+
+/**
+ * Projects a box to the screen: finds the rectangle around its projected corners and the nearest
+ * 1/z among them.
+ *
+ * @param lo The low corner of the box.
+ * @param hi The high corner of the box.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param TM Pointer to the matrix that takes the box to world coordinates.
+ * @param r The rectangle, as xMin, yMin, xMax, yMax in pixels.
+ * @param zinv The nearest 1/z.
+ * @return 0 if a corner is at or behind the eye, which projects nowhere useful, 1 otherwise.
+ */
+static int module_boxProject(Point *lo, Point *hi, Matrix *VTM, Matrix *TM, double r[4], double *zinv)
+{
+    Point c, t;
+    int i;
+
+    r[0] = r[1] = HUGE_VAL;
+    r[2] = r[3] = -HUGE_VAL;
+    *zinv = -HUGE_VAL;
+    for (i = 0; i < 8; i++)
+    {
+        point_set3D(&c, (i & 1 ? hi : lo)->val[0], (i & 2 ? hi : lo)->val[1], (i & 4 ? hi : lo)->val[2]);
+        matrix_xformPoint(TM, &c, &t);
+        matrix_xformPoint(VTM, &t, &c);
+        if (!(c.val[3] > 0 && c.val[2] > 0))
         {
-            Line line;
-            line_copy(&line, &(e->obj.line));
-            matrix_xformLine(&LTM, &line);
-            matrix_xformLine(GTM, &line);
-            matrix_xformLine(VTM, &line);
-            line_normalize(&line);
-            line_draw(&line, src, ds->color);
+            return 0;
+        }
+        r[0] = fmin(r[0], c.val[0] / c.val[3]);
+        r[1] = fmin(r[1], c.val[1] / c.val[3]);
+        r[2] = fmax(r[2], c.val[0] / c.val[3]);
+        r[3] = fmax(r[3], c.val[1] / c.val[3]);
+        *zinv = fmax(*zinv, 1.0 / c.val[2]);
+    }
+    return 1;
+}
+
+/**
+ * Returns 1 if nothing inside a box can be seen: the box projects entirely off the image or, if
+ * hiz is set, behind the depths already in the image's HiZ. A box reaching to or behind the eye is
+ * always taken to be visible.
+ *
+ * @param lo The low corner of the box.
+ * @param hi The high corner of the box.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param TM Pointer to the matrix that takes the box to world coordinates.
+ * @param src Pointer to the Image.
+ * @param hiz 1 to test against the HiZ, 0 to test against the image's edges only.
+ * @return 1 if the box is hidden, 0 if what it holds has to be drawn.
+ */
+static int module_boxHidden(Point *lo, Point *hi, Matrix *VTM, Matrix *TM, Image *src, int hiz)
+{
+    double r[4], xMin, xMax, yMin, yMax, zinv;
+
+    if (!module_boxProject(lo, hi, VTM, TM, r, &zinv))
+    {
+        return 0;
+    }
+
+    // the box widened by a pixel and clipped to the image; off the image nothing is drawn
+    xMin = fmax(floor(r[0]) - 1, 0);
+    yMin = fmax(floor(r[1]) - 1, 0);
+    xMax = fmin(ceil(r[2]) + 1, src->cols);
+    yMax = fmin(ceil(r[3]) + 1, src->rows);
+    if (xMin >= xMax || yMin >= yMax)
+    {
+        return 1;
+    }
+    if (!hiz)
+    {
+        return 0;
+    }
+    // the fills interpolate 1/z between vertices, so no pixel is nearer than the nearest corner
+    return image_hizOccluded(src, (int)yMin, (int)xMin, (int)yMax, (int)xMax, (float)(zinv + zinv * 1e-4));
+}
+
+/**
+ * Extends the path of a module by one of its elements. A path is a hash of the chain of ObjModule
+ * and ObjLOD elements module_drawElements went through from the module given to module_draw, so
+ * it tells apart the places a shared module is drawn from. It is never 0.
+ *
+ * @param path The path of the module holding e.
+ * @param e Pointer to the Element.
+ * @return The path of what e draws.
+ */
+static unsigned long long module_path(unsigned long long path, Element *e)
+{
+    return ((path ^ (unsigned long long)(uintptr_t)e) * 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+/**
+ * Finds the slot of a table of LODStates that holds path, or the empty slot it would go in.
+ */
+static LODState *module_lodSlot(LODState *state, int maxState, unsigned long long path)
+{
+    int i = (int)(path >> 40) & (maxState - 1);
+
+    while (state[i].path && state[i].path != path)
+        i = (i + 1) & (maxState - 1);
+    return &(state[i]);
+}
+
+/**
+ * Returns the state of an LOD at the place path, adding it with level -1 if the LOD was never
+ * drawn there. When the table fills up, it is rebuilt with only the places drawn by this
+ * module_draw call and the one before it, so modules that come and go do not grow it forever.
+ *
+ * @param lod Pointer to the LOD.
+ * @param path The path of the ObjLOD element.
+ * @return Pointer to the LODState.
+ */
+static LODState *module_lodState(LOD *lod, unsigned long long path)
+{
+    LODState *old = lod->state, *s;
+    int i, n, keep;
+
+    if (lod->drawn[1] != drawStamp)
+    {
+        lod->drawn[0] = lod->drawn[1];
+        lod->drawn[1] = drawStamp;
+    }
+    if (old)
+    {
+        s = module_lodSlot(old, lod->maxState, path);
+        if (s->path)
+            return s;
+    }
+    if (2 * (lod->nState + 1) > lod->maxState)
+    {
+        for (i = keep = 0; i < lod->maxState; i++)
+            if (old[i].path && old[i].stamp >= lod->drawn[0])
+                keep++;
+        n = lod->maxState;
+        for (lod->maxState = 8; lod->maxState < 4 * (keep + 1); lod->maxState *= 2)
+            ;
+        lod->state = (LODState *)calloc(lod->maxState, sizeof(LODState));
+        if (!lod->state)
+        {
+            fprintf(stderr, "Calloc failed in module_lodState\n");
+            exit(-1);
+        }
+        lod->nState = 0;
+        for (i = 0; i < n; i++)
+        {
+            if (old[i].path && old[i].stamp >= lod->drawn[0])
+            {
+                *module_lodSlot(lod->state, lod->maxState, old[i].path) = old[i];
+                lod->nState++;
+            }
+        }
+        free(old);
+    }
+    s = module_lodSlot(lod->state, lod->maxState, path);
+    s->path = path;
+    s->stamp = 0;
+    s->level = -1;
+    lod->nState++;
+    return s;
+}
+
+/**
+ * Picks the level of an ObjLOD element to draw at the place path from the projected size of its
+ * finest level, as module_lod describes. The pick is kept for the rest of the module_draw call,
+ * and for the hysteresis of the next call.
+ *
+ * @param lod Pointer to the LOD.
+ * @param path The path of the ObjLOD element.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param TM Pointer to the matrix that takes the levels to world coordinates.
+ * @return Pointer to the level's Module.
+ */
+static Module *module_lodLevel(LOD *lod, unsigned long long path, Matrix *VTM, Matrix *TM)
+{
+    LODState *s = module_lodState(lod, path);
+    Module *finest = lod->level[0];
+    double r[4], zinv, size;
+    int want;
+
+    if (s->stamp == drawStamp)
+        return lod->level[s->level];
+    s->stamp = drawStamp;
+
+    module_bounds(finest);
+    if (finest->boundsMin.val[0] > finest->boundsMax.val[0])
+    {
+        s->level = s->level < 0 ? 0 : s->level;
+        return lod->level[s->level];
+    }
+    // an object reaching to or behind the eye is as close as it gets
+    size = HUGE_VAL;
+    if (module_boxProject(&(finest->boundsMin), &(finest->boundsMax), VTM, TM, r, &zinv))
+        size = fmax(r[2] - r[0], r[3] - r[1]);
+
+    for (want = 0; want < lod->nLevel - 1 && size < lod->minSize[want]; want++)
+        ;
+    // a finer level only once the size is well above its threshold, a coarser one only once the
+    // size is well below the threshold of the level above it
+    if (s->level >= 0)
+    {
+        while (want < s->level && size < lod->minSize[want] * (1.0 + lod->hysteresis))
+            want++;
+        while (want > s->level && size >= lod->minSize[want - 1] * (1.0 - lod->hysteresis))
+            want--;
+    }
+    s->level = want;
+    return lod->level[want];
+}
+
+/**
+ * Occlusion test for an ObjModule element: returns 1 if nothing the sub-module draws can pass the
+ * depth test, so module_drawElements can skip it. The sub-module's bounding box is projected to
+ * the screen, and its nearest depth is tested against the image's HiZ. Only sub-modules made of
+ * depth-tested polygons are culled. A sub-module that was found visible is drawn without testing
+ * for the next OCCLUSION_REUSE_FRAMES module_draw calls, since it is likely still visible. The
+ * frames are counted by the stamp of the call, not by visits, so a depth pre-pass and the
+ * shading pass count as one frame and make the same choice.
+ *
+ * @param e Pointer to the ObjModule Element.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param TM Pointer to the matrix that takes the sub-module to world coordinates.
+ * @param ds Pointer to the DrawState.
+ * @param src Pointer to the Image.
+ * @return 1 if the sub-module is hidden, 0 if it has to be drawn.
+ */
+static int module_occluded(Element *e, Matrix *VTM, Matrix *TM, DrawState *ds, Image *src)
+{
+    Module *sub = e->obj.module;
+    int occluded;
+
+    // found visible, or drawn without a test, earlier in this call
+    if (e->visibleStamp == drawStamp)
+    {
+        return 0;
+    }
+    if (e->visibleFrames > 0)
+    {
+        e->visibleFrames--;
+        e->visibleStamp = drawStamp;
+        return 0;
+    }
+    module_bounds(sub);
+    if (!sub->solid || ds->shade == ShadeFrame)
+    {
+        return 0;
+    }
+    if (sub->boundsMin.val[0] > sub->boundsMax.val[0])
+    {
+        return 1; // draws nothing
+    }
+
+    occluded = module_boxHidden(&(sub->boundsMin), &(sub->boundsMax), VTM, TM, src, 1);
+    if (!occluded)
+    {
+        e->visibleFrames = OCCLUSION_REUSE_FRAMES;
+        e->visibleStamp = drawStamp;
+    }
+    return occluded;
+}
+
+/**
+ * Takes the vertices of a mesh to world coordinates with the same operations, in the same order,
+ * as module_drawElements applies to a polygon with the same vertices and normals.
+ *
+ * @param mesh Pointer to the Mesh.
+ * @param LTM Pointer to the local transformation matrix.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param world The world coordinates of each vertex.
+ * @param normal The world unit normals, lit by Gouraud shading.
+ * @param vertex3D The world vertices after the homogeneous divide, as the shading interpolates them.
+ * @param normalPhong The normals Phong shading interpolates.
+ */
+static void module_meshWorld(Mesh *mesh, Matrix *LTM, Matrix *GTM, Point *world, Vector *normal, Point *vertex3D, Vector *normalPhong)
+{
+    Point p;
+    Vector n, tn;
+    int i;
+
+    for (i = 0; i < mesh->nVertex; i++)
+    {
+        vector_copy(&n, &(mesh->normal[i]));
+        vector_normalize(&n); // polygon_copy normalizes the normals once more too
+        matrix_xformPoint(LTM, &(mesh->vertex[i]), &p);
+        matrix_xformVector(LTM, &n, &tn);
+        vector_normalize(&tn);
+        matrix_xformPoint(GTM, &p, &(world[i]));
+        matrix_xformVector(GTM, &tn, &(normal[i]));
+        vector_normalize(&(normal[i]));
+        point_copy(&(vertex3D[i]), &(world[i]));
+        point_normalize(&(vertex3D[i]));
+        vector_copy(&(normalPhong[i]), &(normal[i]));
+        vector_normalize(&(normalPhong[i]));
+    }
+}
+
+/**
+ * The post-transform cache of module_drawMesh: what it computes for each vertex of a mesh, in
+ * arrays indexed like the mesh's vertices.
+ */
+typedef struct MeshCache
+{
+    Point *world, *vertex3D, *screen;
+    Vector *normal, *normalPhong;
+    Color *shade;
+} MeshCache;
+
+/**
+ * Allocates a MeshCache for n vertices from the arena.
+ */
+static void module_meshCache(MeshCache *mc, int n, Arena *arena)
+{
+    mc->world = (Point *)arena_alloc(arena, sizeof(Point) * n);
+    mc->vertex3D = (Point *)arena_alloc(arena, sizeof(Point) * n);
+    mc->screen = (Point *)arena_alloc(arena, sizeof(Point) * n);
+    mc->normal = (Vector *)arena_alloc(arena, sizeof(Vector) * n);
+    mc->normalPhong = (Vector *)arena_alloc(arena, sizeof(Vector) * n);
+    mc->shade = (Color *)arena_alloc(arena, sizeof(Color) * n);
+}
+
+/**
+ * Draws a mesh. Each vertex is transformed, lit for Gouraud shading, and projected once, into a
+ * post-transform cache shared by every triangle that uses the vertex. The triangles are then
+ * filled from the cache, making the same image as one Polygon per triangle with the vertices'
+ * normals.
+ *
+ * @param mesh Pointer to the Mesh.
+ * @param LTM Pointer to the local transformation matrix.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param ds Pointer to the DrawState.
+ * @param lighting Pointer to the Lighting structure.
+ * @param src Pointer to the Image.
+ * @param tr Pointer to the TileRenderer that queues filled polygons, or NULL to draw them directly.
+ * @param arena Pointer to the Arena for the copies the TileRenderer keeps.
+ * @param mc Pointer to a MeshCache with room for the mesh's vertices.
+ */
+static void module_drawMesh(Mesh *mesh, Matrix *LTM, Matrix *GTM, Matrix *VTM, DrawState *ds, Lighting *lighting, Image *src, TileRenderer *tr, Arena *arena, MeshCache *mc)
+{
+    int n = mesh->nVertex;
+    Point *world = mc->world, *vertex3D = mc->vertex3D, *screen = mc->screen, v[3], v3D[3];
+    Vector *normal = mc->normal, *normalPhong = mc->normalPhong, nPhong[3], view;
+    Color *shade = NULL, c[3];
+    Polygon plygn;
+    int i, j, *t;
+
+    if (n == 0 || mesh->nTriangle == 0)
+        return;
+
+    module_meshWorld(mesh, LTM, GTM, world, normal, vertex3D, normalPhong);
+    if (ds->shade == ShadeGouraud && ds->zCompare != ZCompareDepthOnly)
+    {
+        // polygon_shade, once per vertex
+        shade = mc->shade;
+        for (i = 0; i < n; i++)
+        {
+            vector_subtract(&(world[i]), &(ds->viewer), &view);
+            lighting_shading(lighting, &(normal[i]), &view, &(world[i]), mesh->color ? &(mesh->color[i]) : &(ds->body),
+                             &(ds->surface), ds->surfaceCoeff, mesh->oneSided, &(shade[i]));
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        matrix_xformPoint(VTM, &(world[i]), &(screen[i]));
+        point_normalize(&(screen[i]));
+    }
+    if (tr && ds->shade == ShadeFrame)
+        tiles_flush(tr);
+
+    for (i = 0; i < mesh->nTriangle; i++)
+    {
+        t = &(mesh->index[3 * i]);
+        polygon_init(&plygn);
+        plygn.arena = arena;
+        plygn.oneSided = mesh->oneSided;
+        plygn.zBuffer = mesh->zBuffer;
+        if (tr && ds->shade != ShadeFrame)
+        {
+            // the tile renderer keeps the triangle until it flushes
+            plygn.vertex = (Point *)arena_alloc(arena, sizeof(Point) * 3);
+            plygn.vertex3D = (Point *)arena_alloc(arena, sizeof(Point) * 3);
+            plygn.normalPhong = (Vector *)arena_alloc(arena, sizeof(Vector) * 3);
+            plygn.color = shade ? (Color *)arena_alloc(arena, sizeof(Color) * 3) : NULL;
+        }
+        else
+        {
+            plygn.vertex = v;
+            plygn.vertex3D = v3D;
+            plygn.normalPhong = nPhong;
+            plygn.color = shade ? c : NULL;
+        }
+        plygn.nVertex = 3;
+        for (j = 0; j < 3; j++)
+        {
+            plygn.vertex[j] = screen[t[j]];
+            plygn.vertex3D[j] = vertex3D[t[j]];
+            plygn.normalPhong[j] = normalPhong[t[j]];
+            if (shade)
+                plygn.color[j] = shade[t[j]];
+        }
+
+        if (ds->shade == ShadeFrame)
+            polygon_draw(&plygn, src, ds->color);
+        else if (tr)
+            tiles_polygon(tr, &plygn, ds); // takes over the arrays
+        else if (ds->shade == ShadeFlat)
+            polygon_drawFill(&plygn, src, ds->color);
+        else
+            polygon_drawShade(&plygn, src, ds, lighting);
+    }
+}
+
+/**
+ * Draws an ObjInstances element: one loop over the copies that skips each one whose bounding box
+ * is off the image, or hidden by the HiZ when the DrawState asks for occlusion culling, and draws
+ * the rest through one post-transform cache.
+ *
+ * @param inst Pointer to the MeshInstances.
+ * @param LTM Pointer to the local transformation matrix.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param ds Pointer to the DrawState.
+ * @param lighting Pointer to the Lighting structure.
+ * @param src Pointer to the Image.
+ * @param tr Pointer to the TileRenderer that queues filled polygons, or NULL to draw them directly.
+ * @param arena Pointer to the Arena the cache is allocated from.
+ */
+static void module_drawInstances(MeshInstances *inst, Matrix *LTM, Matrix *GTM, Matrix *VTM, DrawState *ds, Lighting *lighting, Image *src, TileRenderer *tr, Arena *arena)
+{
+    Matrix M, TM;
+    DrawState ids;
+    MeshCache mc;
+    DrawMaterial *mat;
+    int k, hiz = ds->occlusionCull && ds->shade != ShadeFrame && inst->mesh.zBuffer;
+
+    if (inst->mesh.nVertex == 0 || inst->mesh.nTriangle == 0)
+        return;
+    module_meshCache(&mc, inst->mesh.nVertex, arena);
+    drawstate_copy(&ids, ds);
+    for (k = 0; k < inst->nInstance; k++)
+    {
+        matrix_multiply(LTM, &(inst->xform[k]), &M);
+        matrix_multiply(GTM, &M, &TM);
+        if (module_boxHidden(&(inst->boundsMin), &(inst->boundsMax), VTM, &TM, src, hiz))
+            continue;
+        if (inst->material)
+        {
+            mat = &(inst->material[k]);
+            ids.color = mat->color;
+            ids.body = mat->body;
+            ids.surface = mat->surface;
+            ids.surfaceCoeff = mat->surfaceCoeff;
+        }
+        module_drawMesh(&(inst->mesh), &M, GTM, VTM, &ids, lighting, src, tr, arena, &mc);
+    }
+}
+
+/**
+ * Walks the module's elements and draws them into the image. Sub-modules are drawn recursively
+ * with a copy of the DrawState.
+ *
+ * @param md Pointer to the Module.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param ds Pointer to the DrawState.
+ * @param lighting Pointer to the Lighting structure.
+ * @param src Pointer to the Image.
+ * @param tr Pointer to the TileRenderer that queues filled polygons, or NULL to draw them directly.
+ * @param arena Pointer to the Arena the copies of the elements are allocated from.
+ * @param path The path of md, see module_path.
+ */
+static void module_drawElements(Module *md, Matrix *VTM, Matrix *GTM, DrawState *ds, Lighting *lighting, Image *src, TileRenderer *tr, Arena *arena, unsigned long long path)
+{
+    Matrix LTM;
+    matrix_identity(&LTM);
+
+    Element *e = md->head;
+    while (e) // Iterate through the list until you get to NULL (end of list)
+    {
+        switch (e->type)
+        {
+        case ObjBezier:
+        {
+            Point cp[4], cpt[4];
+            BezierCurve b;
+            if (ds->zCompare == ZCompareDepthOnly)
+                break;
+            bezierCurve_init(&b);
+            // Iterate through the control point list
+            for (int i = 0; i < 4; i++)
+            {
+                point_copy(&(cp[i]), &(e->obj.bezierCurve.cp[i]));
+                // Transform the point by each matrix, but alternate the destination to avoid
+                // using the same point for cp and q
+                matrix_xformPoint(&LTM, &(cp[i]), &(cpt[i]));
+                matrix_xformPoint(GTM, &(cpt[i]), &(cp[i]));
+                matrix_xformPoint(VTM, &(cp[i]), &(cpt[i]));
+                point_normalize(&(cpt[i]));
+            }
+            bezierCurve_set(&b, cpt);
+            if (tr)
+                tiles_flush(tr);
+            bezierCurve_draw(&b, src, ds->color);
+        }
+        break;
+        case ObjColor:
+            drawstate_setColor(ds, e->obj.color);
+            break;
+        case ObjBodyColor:
+            drawstate_setBody(ds, e->obj.color);
+            break;
+        case ObjSurfaceColor:
+            drawstate_setSurface(ds, e->obj.color);
+            break;
+        case ObjSurfaceCoeff:
+            drawstate_setSurfaceCoeff(ds, e->obj.coeff);
+        case ObjPoint:
+        {
+            Point p, pt;
+            if (ds->zCompare == ZCompareDepthOnly)
+                break; // points, lines, and curves are drawn in the shading pass
+            point_copy(&p, &(e->obj.point));
+            // Transform the point by each matrix, but alternate the destination to avoid
+            // using the same point for p and q
+            matrix_xformPoint(&LTM, &p, &pt);
+            matrix_xformPoint(GTM, &pt, &p);
+            matrix_xformPoint(VTM, &p, &pt);
+            point_normalize(&pt);
+            if (tr)
+                tiles_flush(tr);
+            point_draw(&pt, src, ds->color);
+        }
+        break;
+        case ObjLine:
+        {
+            Line line;
+            if (ds->zCompare == ZCompareDepthOnly)
+                break;
+            line_copy(&line, &(e->obj.line));
+            matrix_xformLine(&LTM, &line);
+            matrix_xformLine(GTM, &line);
+            matrix_xformLine(VTM, &line);
+            line_normalize(&line);
+            if (tr)
+                tiles_flush(tr);
+            line_draw(&line, src, ds->color);
+        }
+        break;
+        case ObjPolygon:
+        {
+            Polygon plygn;
+            polygon_init(&plygn);
+            plygn.arena = arena;
+            polygon_copy(&plygn, &(e->obj.polygon));
+            matrix_xformPolygon(&LTM, &plygn);
+            matrix_xformPolygon(GTM, &plygn);
+            polygon_setVertex3D(&plygn, plygn.nVertex, plygn.vertex); // for Phong Shading
+            polygon_setNormalsPhong(&plygn, plygn.nVertex, plygn.normal);
+            if (ds->shade == ShadeGouraud && ds->zCompare != ZCompareDepthOnly)
+            {
+                polygon_shade(&plygn, ds, lighting);
+            }
+            matrix_xformPolygon(VTM, &plygn);
+            polygon_normalize(&plygn);
+            if (ds->shade == ShadeFrame)
+            {
+                if (tr)
+                    tiles_flush(tr);
+                polygon_draw(&plygn, src, ds->color);
+            }
+            else if (tr)
+            {
+                tiles_polygon(tr, &plygn, ds); // takes over plygn's data
+            }
+            else if (ds->shade == ShadeFlat)
+            {
+                polygon_drawFill(&plygn, src, ds->color);
+            }
+            else
+            {
+                polygon_drawShade(&plygn, src, ds, lighting);
+            }
+
+            polygon_clear(&plygn);
+            break;
+        }
+        case ObjMesh:
+        {
+            MeshCache mc;
+            module_meshCache(&mc, e->obj.mesh.nVertex, arena);
+            module_drawMesh(&(e->obj.mesh), &LTM, GTM, VTM, ds, lighting, src, tr, arena, &mc);
+            break;
+        }
+        case ObjInstances:
+            module_drawInstances(&(e->obj.instances), &LTM, GTM, VTM, ds, lighting, src, tr, arena);
+            break;
+        case ObjPolyline:
+        {
+            Polyline plyln;
+            if (ds->zCompare == ZCompareDepthOnly)
+                break;
+            polyline_init(&plyln);
+            plyln.arena = arena;
+            polyline_copy(&plyln, &(e->obj.polyline));
+            matrix_xformPolyline(&LTM, &plyln);
+            matrix_xformPolyline(GTM, &plyln);
+            matrix_xformPolyline(VTM, &plyln);
+            polyline_normalize(&plyln);
+            if (tr)
+                tiles_flush(tr);
+            polyline_draw(&plyln, src, ds->color);
+            polyline_clear(&plyln);
+            break;
+        }
+        case ObjMatrix:
+            matrix_multiply(&(e->obj.matrix), &LTM, &LTM);
+            break;
+        case ObjIdentity:
+            matrix_identity(&LTM);
+            break;
+        case ObjModule:
+        {
+            Matrix TM;
+            DrawState tempDS;
+            matrix_multiply(GTM, &LTM, &TM);
+            if (ds->occlusionCull && module_occluded(e, VTM, &TM, ds, src))
+                break;
+            drawstate_copy(&tempDS, ds);
+            module_drawElements(e->obj.module, VTM, &TM, &tempDS, lighting, src, tr, arena, module_path(path, e));
+            break;
+        }
+        case ObjLOD:
+        {
+            Matrix TM;
+            DrawState tempDS;
+            unsigned long long at = module_path(path, e);
+            matrix_multiply(GTM, &LTM, &TM);
+            drawstate_copy(&tempDS, ds);
+            module_drawElements(module_lodLevel(&(e->obj.lod), at, VTM, &TM), VTM, &TM, &tempDS, lighting, src, tr, arena, at);
+            break;
+        }
+        case ObjNone:
+        case ObjLight:
+            break;
+        }
+        e = e->next; // Forward sequence to next element
+    }
+}
+
+/**
+ * Makes room for n more vertices in the DrawList's vertex arrays.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param n The number of vertices to add.
+ */
+static void drawlist_growVertices(DrawList *dl, int n)
+{
+    if (dl->nVertex + n <= dl->maxVertex)
+        return;
+    while (dl->nVertex + n > dl->maxVertex)
+        dl->maxVertex = dl->maxVertex ? dl->maxVertex * 2 : 1024;
+    dl->vertex = (Point *)realloc(dl->vertex, sizeof(Point) * dl->maxVertex);
+    dl->vertex3D = (Point *)realloc(dl->vertex3D, sizeof(Point) * dl->maxVertex);
+    dl->normal = (Vector *)realloc(dl->normal, sizeof(Vector) * dl->maxVertex);
+    dl->normalPhong = (Vector *)realloc(dl->normalPhong, sizeof(Vector) * dl->maxVertex);
+    dl->color = (Color *)realloc(dl->color, sizeof(Color) * dl->maxVertex);
+    if (!dl->vertex || !dl->vertex3D || !dl->normal || !dl->normalPhong || !dl->color)
+    {
+        fprintf(stderr, "Unable to grow the draw list\n");
+        exit(-1);
+    }
+}
+
+/**
+ * Appends an item to the DrawList with the given world coordinate vertices, drawn with the
+ * material mat. The caller fills in the polygon arrays of the new vertices.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param type The kind of primitive.
+ * @param n The number of vertices.
+ * @param vertex The vertices, in world coordinates.
+ * @param zBuffer The zBuffer flag of the primitive.
+ * @param mat Pointer to the material in effect.
+ * @return Pointer to the new item.
+ */
+static DrawItem *drawlist_add(DrawList *dl, ObjectType type, int n, Point *vertex, int zBuffer, DrawMaterial *mat)
+{
+    DrawMaterial *last = dl->nMaterial ? &(dl->material[dl->nMaterial - 1]) : NULL;
+    DrawItem *item;
+    int i;
+
+    // consecutive items mostly share a material, so only a change is stored
+    if (!last || memcmp(&(last->color), &(mat->color), sizeof(Color)) || memcmp(&(last->body), &(mat->body), sizeof(Color)) ||
+        memcmp(&(last->surface), &(mat->surface), sizeof(Color)) || last->surfaceCoeff != mat->surfaceCoeff)
+    {
+        if (dl->nMaterial == dl->maxMaterial)
+        {
+            dl->maxMaterial = dl->maxMaterial ? dl->maxMaterial * 2 : 16;
+            dl->material = (DrawMaterial *)realloc(dl->material, sizeof(DrawMaterial) * dl->maxMaterial);
+            if (!dl->material)
+            {
+                fprintf(stderr, "Unable to grow the draw list\n");
+                exit(-1);
+            }
+        }
+        dl->material[dl->nMaterial++] = *mat;
+    }
+    if (dl->nItem == dl->maxItem)
+    {
+        dl->maxItem = dl->maxItem ? dl->maxItem * 2 : 256;
+        dl->item = (DrawItem *)realloc(dl->item, sizeof(DrawItem) * dl->maxItem);
+        if (!dl->item)
+        {
+            fprintf(stderr, "Unable to grow the draw list\n");
+            exit(-1);
+        }
+    }
+    drawlist_growVertices(dl, n);
+
+    item = &(dl->item[dl->nItem++]);
+    item->type = type;
+    item->first = dl->nVertex;
+    item->nVertex = n;
+    item->material = dl->nMaterial - 1;
+    item->zBuffer = zBuffer;
+    item->oneSided = 0;
+    item->colored = 0;
+    item->bodyColors = 0;
+    for (i = 0; i < n; i++)
+        point_copy(&(dl->vertex[dl->nVertex + i]), &(vertex[i]));
+    dl->nVertex += n;
+    dl->maxItemVertex = n > dl->maxItemVertex ? n : dl->maxItemVertex;
+    return item;
+}
+
+/**
+ * Appends the triangles of a mesh to the DrawList as polygon items, transforming each vertex to
+ * world coordinates once.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param mesh Pointer to the Mesh.
+ * @param LTM Pointer to the local transformation matrix.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param mat Pointer to the material in effect.
+ */
+static void module_compileMesh(DrawList *dl, Mesh *mesh, Matrix *LTM, Matrix *GTM, DrawMaterial *mat)
+{
+    Point *world, *vertex3D, pt[3];
+    Vector *normal, *normalPhong;
+    DrawItem *item;
+    int i, j, k, *t;
+
+    if (mesh->nVertex == 0)
+        return;
+    world = (Point *)malloc(sizeof(Point) * mesh->nVertex);
+    vertex3D = (Point *)malloc(sizeof(Point) * mesh->nVertex);
+    normal = (Vector *)malloc(sizeof(Vector) * mesh->nVertex);
+    normalPhong = (Vector *)malloc(sizeof(Vector) * mesh->nVertex);
+    if (!world || !vertex3D || !normal || !normalPhong)
+    {
+        fprintf(stderr, "Unable to allocate the mesh vertices in module_compile\n");
+        exit(-1);
+    }
+    module_meshWorld(mesh, LTM, GTM, world, normal, vertex3D, normalPhong);
+    for (i = 0; i < mesh->nTriangle; i++)
+    {
+        t = &(mesh->index[3 * i]);
+        for (j = 0; j < 3; j++)
+            pt[j] = world[t[j]];
+        item = drawlist_add(dl, ObjPolygon, 3, pt, mesh->zBuffer, mat);
+        item->oneSided = mesh->oneSided;
+        item->bodyColors = mesh->color != NULL;
+        for (j = 0; j < 3; j++)
+        {
+            k = item->first + j;
+            dl->vertex3D[k] = vertex3D[t[j]];
+            dl->normal[k] = normal[t[j]];
+            dl->normalPhong[k] = normalPhong[t[j]];
+            if (mesh->color)
+                dl->color[k] = mesh->color[t[j]];
+        }
+    }
+    free(world);
+    free(vertex3D);
+    free(normal);
+    free(normalPhong);
+}
+
+/**
+ * Appends what the module's elements draw to the DrawList, transforming each primitive to world
+ * coordinates with the same matrix operations, in the same order, as module_drawElements, so
+ * the compiled list draws the same image.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param md Pointer to the Module.
+ * @param GTM Pointer to the matrix that takes the module to world coordinates.
+ * @param mat The material in effect where the module is drawn; changes stay in the module.
+ */
+static void module_compileElements(DrawList *dl, Module *md, Matrix *GTM, DrawMaterial mat)
+{
+    Matrix LTM, TM;
+    DrawItem *item;
+    Point pt[4], tmp;
+    Polygon plygn;
+    Polyline plyln;
+    Line line;
+    int i, k;
+
+    matrix_identity(&LTM);
+    for (Element *e = md->head; e; e = e->next)
+    {
+        switch (e->type)
+        {
+        case ObjColor:
+            mat.color = e->obj.color;
+            break;
+        case ObjBodyColor:
+            mat.body = e->obj.color;
+            break;
+        case ObjSurfaceColor:
+            mat.surface = e->obj.color;
+            break;
+        case ObjSurfaceCoeff:
+            mat.surfaceCoeff = e->obj.coeff;
+            // module_drawElements draws the element as a point too
+        case ObjPoint:
+            matrix_xformPoint(&LTM, &(e->obj.point), &tmp);
+            matrix_xformPoint(GTM, &tmp, &(pt[0]));
+            drawlist_add(dl, ObjPoint, 1, pt, 1, &mat);
+            break;
+        case ObjLine:
+            line_copy(&line, &(e->obj.line));
+            matrix_xformLine(&LTM, &line);
+            matrix_xformLine(GTM, &line);
+            pt[0] = line.a;
+            pt[1] = line.b;
+            drawlist_add(dl, ObjLine, 2, pt, e->obj.line.zBuffer, &mat);
+            break;
+        case ObjBezier:
+            for (i = 0; i < 4; i++)
+            {
+                matrix_xformPoint(&LTM, &(e->obj.bezierCurve.cp[i]), &tmp);
+                matrix_xformPoint(GTM, &tmp, &(pt[i]));
+            }
+            drawlist_add(dl, ObjBezier, 4, pt, 1, &mat);
+            break;
+        case ObjPolyline:
+            polyline_init(&plyln);
+            polyline_copy(&plyln, &(e->obj.polyline));
+            matrix_xformPolyline(&LTM, &plyln);
+            matrix_xformPolyline(GTM, &plyln);
+            drawlist_add(dl, ObjPolyline, plyln.numVertex, plyln.vertex, plyln.zBuffer, &mat);
+            polyline_clear(&plyln);
+            break;
+        case ObjPolygon:
+            polygon_init(&plygn);
+            polygon_copy(&plygn, &(e->obj.polygon));
+            matrix_xformPolygon(&LTM, &plygn);
+            matrix_xformPolygon(GTM, &plygn);
+            polygon_setVertex3D(&plygn, plygn.nVertex, plygn.vertex);
+            polygon_setNormalsPhong(&plygn, plygn.nVertex, plygn.normal);
+            item = drawlist_add(dl, ObjPolygon, plygn.nVertex, plygn.vertex, plygn.zBuffer, &mat);
+            item->oneSided = plygn.oneSided;
+            item->colored = plygn.color != NULL;
+            for (i = 0; i < plygn.nVertex; i++)
+            {
+                k = item->first + i;
+                // polygon_normalize does this to the shading vertices of every drawn polygon
+                point_copy(&(dl->vertex3D[k]), &(plygn.vertex3D[i]));
+                point_normalize(&(dl->vertex3D[k]));
+                vector_copy(&(dl->normal[k]), &(plygn.normal[i]));
+                vector_copy(&(dl->normalPhong[k]), &(plygn.normalPhong[i]));
+                if (plygn.color)
+                    color_copy(&(dl->color[k]), &(plygn.color[i]));
+            }
+            polygon_clear(&plygn);
+            break;
+        case ObjMesh:
+            module_compileMesh(dl, &(e->obj.mesh), &LTM, GTM, &mat);
+            break;
+        case ObjInstances:
+        {
+            // the list holds every primitive in world coordinates, so each copy is compiled out
+            MeshInstances *inst = &(e->obj.instances);
+            DrawMaterial imat;
+            for (i = 0; i < inst->nInstance; i++)
+            {
+                matrix_multiply(&LTM, &(inst->xform[i]), &TM);
+                imat = inst->material ? inst->material[i] : mat;
+                module_compileMesh(dl, &(inst->mesh), &TM, GTM, &imat);
+            }
+            break;
+        }
+        case ObjMatrix:
+            matrix_multiply(&(e->obj.matrix), &LTM, &LTM);
+            break;
+        case ObjIdentity:
+            matrix_identity(&LTM);
+            break;
+        case ObjModule:
+            matrix_multiply(GTM, &LTM, &TM);
+            module_compileElements(dl, e->obj.module, &TM, mat);
+            break;
+        case ObjLOD:
+            // the list is drawn from any view, so it keeps the finest level
+            matrix_multiply(GTM, &LTM, &TM);
+            module_compileElements(dl, e->obj.lod.level[0], &TM, mat);
+            break;
+        case ObjNone:
+        case ObjLight:
+            break;
+        }
+    }
+}
+
+/**
+ * Flattens a module hierarchy into a DrawList: every primitive it draws, in drawing order, with
+ * its vertices transformed by the module's matrices and GTM, and the material set by the color
+ * elements in effect where it is drawn, starting from the material of ds. Drawing the list with
+ * drawlist_draw makes the same image as module_draw with the same GTM, for any VTM. The list is a
+ * snapshot: it does not change when the module does, so it is compiled again after an edit.
+ *
+ * @param md Pointer to the Module.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param ds Pointer to the DrawState whose color, body, surface, and surfaceCoeff the module starts with.
+ * @return Pointer to the new DrawList, freed with drawlist_free.
+ */
+DrawList *module_compile(Module *md, Matrix *GTM, DrawState *ds)
+{
+    DrawMaterial mat;
+    DrawList *dl;
+
+    if (!md || !GTM || !ds)
+    {
+        fprintf(stderr, "Null pointer provided to module_compile\n");
+        exit(-1);
+    }
+    dl = (DrawList *)calloc(1, sizeof(DrawList));
+    if (!dl)
+    {
+        fprintf(stderr, "Unable to allocate the draw list\n");
+        exit(-1);
+    }
+
+    mat.color = ds->color;
+    mat.body = ds->body;
+    mat.surface = ds->surface;
+    mat.surfaceCoeff = ds->surfaceCoeff;
+    module_compileElements(dl, md, GTM, mat);
+
+    // the per-frame scratch, big enough for any item
+    dl->screen = (Point *)malloc(sizeof(Point) * (dl->maxItemVertex + 1));
+    dl->shade = (Color *)malloc(sizeof(Color) * (dl->maxItemVertex + 1));
+    if (!dl->screen || !dl->shade)
+    {
+        fprintf(stderr, "Unable to allocate the draw list\n");
+        exit(-1);
+    }
+    return dl;
+}
+
+/**
+ * Draws a compiled DrawList into the image from the view transformation matrix, like module_draw
+ * draws the module it was compiled from: ds supplies the shading and the passes, and the list
+ * supplies the materials, so ds itself is not changed. Occlusion culling, which works on
+ * sub-modules, does not apply to the flat list.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param ds Pointer to the DrawState.
+ * @param lighting Pointer to the Lighting structure.
+ * @param src Pointer to the Image.
+ */
+void drawlist_draw(DrawList *dl, Matrix *VTM, DrawState *ds, Lighting *lighting, Image *src)
+{
+    if (!dl || !VTM || !ds || !src)
+    {
+        fprintf(stderr, "Null pointer provided to drawlist_draw\n");
+        exit(-1);
+    }
+    module_drawPasses(NULL, dl, VTM, NULL, ds, lighting, src);
+}
+
+/**
+ * Draws the items of a DrawList in order, with the per-item steps of module_drawElements after
+ * the model and global transforms: the VTM, the homogeneous divide, Gouraud lighting, and the
+ * fill or outline.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param VTM Pointer to the view transformation matrix.
+ * @param ds Pointer to the DrawState.
+ * @param lighting Pointer to the Lighting structure.
+ * @param src Pointer to the Image.
+ * @param tr Pointer to the TileRenderer that queues filled polygons, or NULL to draw them directly.
+ * @param arena Pointer to the Arena for the colors and the copies the TileRenderer keeps.
+ */
+static void drawlist_drawItems(DrawList *dl, Matrix *VTM, DrawState *ds, Lighting *lighting, Image *src, TileRenderer *tr, Arena *arena)
+{
+    DrawState ids;
+    DrawMaterial *mat;
+    DrawItem *item;
+    Point *v, *screen = dl->screen;
+    Polygon plygn, queued;
+    Polyline plyln;
+    BezierCurve b;
+    Line line;
+    Vector view;
+    int i, k, material = -1;
+    int depthOnly = ds->zCompare == ZCompareDepthOnly;
+
+    drawstate_copy(&ids, ds);
+    for (k = 0; k < dl->nItem; k++)
+    {
+        item = &(dl->item[k]);
+        if (depthOnly && item->type != ObjPolygon)
+            continue; // points, lines, and curves are drawn in the shading pass
+        if (item->material != material)
+        {
+            material = item->material;
+            mat = &(dl->material[material]);
+            ids.color = mat->color;
+            ids.body = mat->body;
+            ids.surface = mat->surface;
+            ids.surfaceCoeff = mat->surfaceCoeff;
         }
-        break;
-        case ObjPolygon:
+        v = &(dl->vertex[item->first]);
+        for (i = 0; i < item->nVertex; i++)
         {
-            Polygon plygn;
-            polygon_init(&plygn);
-            polygon_copy(&plygn, &(e->obj.polygon));
-            matrix_xformPolygon(&LTM, &plygn);
-            matrix_xformPolygon(GTM, &plygn);
-            polygon_setVertex3D(&plygn, plygn.nVertex, plygn.vertex); // for Phong Shading
-            polygon_setNormalsPhong(&plygn, plygn.nVertex, plygn.normal);
-            if (ds->shade == ShadeGouraud)
+            matrix_xformPoint(VTM, &(v[i]), &(screen[i]));
+            point_normalize(&(screen[i]));
+        }
+        if (item->type != ObjPolygon && tr)
+            tiles_flush(tr);
+
+        switch (item->type)
+        {
+        case ObjPoint:
+            point_draw(&(screen[0]), src, ids.color);
+            break;
+        case ObjLine:
+            line.zBuffer = item->zBuffer;
+            line.a = screen[0];
+            line.b = screen[1];
+            line_draw(&line, src, ids.color);
+            break;
+        case ObjBezier:
+            bezierCurve_init(&b);
+            bezierCurve_set(&b, screen);
+            bezierCurve_draw(&b, src, ids.color);
+            break;
+        case ObjPolyline:
+            plyln.zBuffer = item->zBuffer;
+            plyln.numVertex = item->nVertex;
+            plyln.vertex = screen;
+            polyline_draw(&plyln, src, ids.color);
+            break;
+        case ObjPolygon:
+            // a polygon that points into the list and its scratch, so nothing is copied
+            plygn.oneSided = item->oneSided;
+            plygn.nVertex = item->nVertex;
+            plygn.vertex = screen;
+            plygn.vertex3D = &(dl->vertex3D[item->first]);
+            plygn.color = item->colored ? &(dl->color[item->first]) : NULL;
+            plygn.normal = NULL;
+            plygn.normalPhong = &(dl->normalPhong[item->first]);
+            plygn.zBuffer = item->zBuffer;
+            plygn.arena = arena; // for the colors polygon_drawShade gives flat and Phong polygons
+            if (ids.shade == ShadeGouraud && !depthOnly)
             {
-                polygon_shade(&plygn, ds, lighting);
+                // polygon_shade, into the scratch colors
+                for (i = 0; i < item->nVertex; i++)
+                {
+                    vector_subtract(&(v[i]), &(ids.viewer), &view);
+                    lighting_shading(lighting, &(dl->normal[item->first + i]), &view, &(v[i]), item->bodyColors ? &(dl->color[item->first + i]) : &(ids.body),
+                                     &(ids.surface), ids.surfaceCoeff, item->oneSided, &(dl->shade[i]));
+                }
+                plygn.color = dl->shade;
             }
-            matrix_xformPolygon(VTM, &plygn);
-            polygon_normalize(&plygn);
-            if (ds->shade == ShadeFrame)
+
+            if (ids.shade == ShadeFrame)
             {
-                polygon_draw(&plygn, src, ds->color);
+                if (tr)
+                    tiles_flush(tr);
+                polygon_draw(&plygn, src, ids.color);
             }
-            else if (ds->shade == ShadeFlat)
+            else if (tr)
             {
-                polygon_drawFill(&plygn, src, ds->color);
+                // the tile renderer keeps the polygon until it flushes, so it gets a copy
+                polygon_init(&queued);
+                queued.arena = arena;
+                polygon_set(&queued, plygn.nVertex, plygn.vertex);
+                polygon_setVertex3D(&queued, plygn.nVertex, plygn.vertex3D);
+                if (plygn.color)
+                    polygon_setColors(&queued, plygn.nVertex, plygn.color);
+                // copied as they are: polygon_setNormalsPhong would normalize them again
+                queued.normalPhong = (Vector *)arena_alloc(arena, sizeof(Vector) * plygn.nVertex);
+                memcpy(queued.normalPhong, plygn.normalPhong, sizeof(Vector) * plygn.nVertex);
+                queued.zBuffer = plygn.zBuffer;
+                queued.oneSided = plygn.oneSided;
+                tiles_polygon(tr, &queued, &ids);
+                polygon_clear(&queued);
+            }
+            else if (ids.shade == ShadeFlat)
+            {
+                polygon_drawFill(&plygn, src, ids.color);
             }
             else
             {
-                polygon_drawShade(&plygn, src, ds, lighting);
+                polygon_drawShade(&plygn, src, &ids, lighting);
             }
-
-            polygon_clear(&plygn);
             break;
-        }
-        case ObjPolyline:
-        {
-            Polyline plyln;
-            polyline_init(&plyln);
-            polyline_copy(&plyln, &(e->obj.polyline));
-            matrix_xformPolyline(&LTM, &plyln);
-            matrix_xformPolyline(GTM, &plyln);
-            matrix_xformPolyline(VTM, &plyln);
-            polyline_normalize(&plyln);
-            polyline_draw(&plyln, src, ds->color);
-            polyline_clear(&plyln);
+        default:
             break;
         }
-        case ObjMatrix:
-            matrix_multiply(&(e->obj.matrix), &LTM, &LTM);
-            break;
-        case ObjIdentity:
-            matrix_identity(&LTM);
-            break;
-        case ObjModule:
+    }
+}
+
+/**
+ * Frees a DrawList and everything it holds.
+ *
+ * @param dl Pointer to the DrawList.
+ */
+void drawlist_free(DrawList *dl)
+{
+    if (!dl)
+        return;
+    free(dl->item);
+    free(dl->material);
+    free(dl->vertex);
+    free(dl->vertex3D);
+    free(dl->normal);
+    free(dl->normalPhong);
+    free(dl->color);
+    free(dl->screen);
+    free(dl->shade);
+    free(dl);
+}
+
+/**
+ * Builds a Mesh from the polygons of a DrawList, so a compiled module can be drawn many times with
+ * module_meshInstances. Each polygon is split into a fan of triangles, and each vertex is colored
+ * with the body color it is lit with. The surface colors and coefficients of the list are not
+ * kept, since the instances are drawn with their own, and its points, lines, and curves are left
+ * out. The mesh is two-sided if any polygon is.
+ *
+ * @param dl Pointer to the DrawList.
+ * @param mesh Pointer to the Mesh, whose contents are replaced.
+ */
+void drawlist_mesh(DrawList *dl, Mesh *mesh)
+{
+    DrawItem *item;
+    int i, k, first;
+
+    if (!dl || !mesh)
+    {
+        fprintf(stderr, "Null pointer provided to drawlist_mesh\n");
+        exit(-1);
+    }
+    mesh_clear(mesh);
+    mesh->zBuffer = 0;
+    for (k = 0; k < dl->nItem; k++)
+    {
+        item = &(dl->item[k]);
+        if (item->type != ObjPolygon || item->nVertex < 3)
+            continue;
+        first = mesh->nVertex;
+        for (i = 0; i < item->nVertex; i++)
         {
-            Matrix TM;
-            DrawState tempDS;
-            drawstate_copy(&tempDS, ds);
-            matrix_multiply(GTM, &LTM, &TM);
-            module_draw(e->obj.module, VTM, &TM, &tempDS, lighting, src);
-            break;
-        }
-        case ObjNone:
-        case ObjLight:
-            break;
+            mesh_addVertex(mesh, &(dl->vertex[item->first + i]), &(dl->normal[item->first + i]),
+                           item->bodyColors ? &(dl->color[item->first + i]) : &(dl->material[item->material].body));
         }
-        e = e->next; // Forward sequence to next element
+        for (i = 2; i < item->nVertex; i++)
+            mesh_addTriangle(mesh, first, first + i - 1, first + i);
+        mesh->oneSided = mesh->oneSided && item->oneSided;
+        mesh->zBuffer = mesh->zBuffer || item->zBuffer;
     }
 }
 
@@ -936,6 +2467,114 @@ void module_cylinder(Module *md, int sides)
     polygon_clear(&p);
 }
 
+/**
+ * Builds the cylinder of module_cylinder as a single Mesh and adds it to the module. The rim
+ * vertices are shared between the cap and the side faces around them, and the side quadrilaterals
+ * are split into two triangles each. Constant and flat shading draw the same pixels as
+ * module_cylinder, but the fill interpolates across each triangle instead of across the
+ * quadrilateral, so Gouraud and Phong shading differ on the sides, most near a highlight, with a
+ * seam along each diagonal, and depth differs by a shade or two along the diagonals. A Mesh only
+ * holds triangles, so where the images must match, use module_cylinder.
+ *
+ * @param md Pointer to the Module.
+ * @param sides The number of sides.
+ */
+void module_cylinderMesh(Module *md, int sides)
+{
+    Mesh mesh;
+    Point pt;
+    Vector up, down, N;
+    int i, i1, top, bot, rim;
+    double x, z;
+
+    if (!md || sides < 3)
+    {
+        fprintf(stderr, "Invalid parameter provided to module_cylinderMesh\n");
+        exit(-1);
+    }
+
+    mesh_init(&mesh);
+    vector_set(&up, 0, 1, 0);
+    vector_set(&down, 0, -1, 0);
+    point_set3D(&pt, 0, 1.0, 0.0);
+    top = mesh_addVertex(&mesh, &pt, &up, NULL);
+    point_set3D(&pt, 0, 0.0, 0.0);
+    bot = mesh_addVertex(&mesh, &pt, &down, NULL);
+    // four vertices per step around: top cap, bottom cap, and the side at the top and bottom
+    rim = mesh.nVertex;
+    for (i = 0; i < sides; i++)
+    {
+        x = cos(i * M_PI * 2.0 / sides);
+        z = sin(i * M_PI * 2.0 / sides);
+        vector_set(&N, x, 0.0, z);
+        point_set3D(&pt, x, 1.0, z);
+        mesh_addVertex(&mesh, &pt, &up, NULL);
+        mesh_addVertex(&mesh, &pt, &N, NULL);
+        point_set3D(&pt, x, 0.0, z);
+        mesh_addVertex(&mesh, &pt, &down, NULL);
+        mesh_addVertex(&mesh, &pt, &N, NULL);
+    }
+    for (i = 0; i < sides; i++)
+    {
+        i1 = rim + 4 * ((i + 1) % sides);
+        mesh_addTriangle(&mesh, top, rim + 4 * i, i1);
+        mesh_addTriangle(&mesh, bot, rim + 4 * i + 2, i1 + 2);
+        mesh_addTriangle(&mesh, rim + 4 * i + 3, i1 + 3, i1 + 1);
+        mesh_addTriangle(&mesh, rim + 4 * i + 3, i1 + 1, rim + 4 * i + 1);
+    }
+    module_mesh(md, &mesh);
+    mesh_clear(&mesh);
+}
+
+/**
+ * Adds an LOD chain for a curved primitive: levels built by build with detail, detail / 2, and so
+ * on down to minDetail, owned by the element. A primitive with d segments around is switched to
+ * once it is small enough on the screen that its edges are at most LOD_EDGE_PIXELS long, taking
+ * its outline as a circle as wide as its projected size.
+ *
+ * @param md Pointer to the Module.
+ * @param detail The segments around of the finest level.
+ * @param minDetail The fewest segments around of any level.
+ * @param build The function that adds the primitive with a given detail to a module.
+ */
+static void module_curveLOD(Module *md, int detail, int minDetail, void (*build)(Module *, int))
+{
+    Module *levels[32];
+    double minSize[32];
+    int n = 0;
+
+    while (n < 32)
+    {
+        levels[n] = module_create();
+        build(levels[n], detail);
+        if (detail / 2 < minDetail || n == 31)
+        {
+            minSize[n++] = 0.0;
+            break;
+        }
+        minSize[n++] = (detail / 2) * LOD_EDGE_PIXELS / M_PI;
+        detail /= 2;
+    }
+    module_lodInsert(md, n, levels, minSize, LOD_HYSTERESIS, 1);
+}
+
+/**
+ * Builds the cylinder of module_cylinderMesh as an LOD chain, with sides, sides / 2, and so on
+ * down to 6 sides, so a distant cylinder is drawn with fewer triangles.
+ *
+ * @param md Pointer to the Module.
+ * @param sides The number of sides of the finest level.
+ */
+void module_cylinderLOD(Module *md, int sides)
+{
+    if (!md || sides < 3)
+    {
+        fprintf(stderr, "Invalid parameter provided to module_cylinderLOD\n");
+        exit(-1);
+    }
+    module_curveLOD(md, sides, 6, module_cylinderMesh);
+}
+
 /**
  * This program will build a unit sphere with user provided resolution.
  */
@@ -1048,6 +2687,79 @@ void module_sphere(Module *md, int resolution)
     polygon_clear(&p);
 }
 
+/**
+ * Builds the sphere of module_sphere as a single Mesh and adds it to the module. Each vertex is
+ * stored once instead of once for each of the up to six triangles around it.
+ *
+ * @param md Pointer to the Module.
+ * @param resolution The number of rings and of vertices around each ring.
+ */
+void module_sphereMesh(Module *md, int resolution)
+{
+    Mesh mesh;
+    Point pt;
+    Vector N;
+    double center, radius;
+    int i, j, j1, top;
+
+    if (!md || resolution < 2)
+    {
+        fprintf(stderr, "Invalid parameter provided to module_sphereMesh\n");
+        exit(-1);
+    }
+
+    // the rings from the bottom up, each vertex its own normal, as in module_sphere
+    mesh_init(&mesh);
+    for (i = 0; i < resolution + 1; i++)
+    {
+        center = sin((float)i * M_PI / (float)resolution - M_PI * 0.5);
+        radius = cos((float)i * M_PI / (float)resolution - .5 * M_PI);
+        for (j = 0; j < resolution; j++)
+        {
+            point_set3D(&pt, cos((float)j * 2.0 * M_PI / (float)resolution) * radius, center, sin((float)j * 2.0 * M_PI / (float)resolution) * radius);
+            vector_set(&N, pt.val[0], pt.val[1], pt.val[2]);
+            mesh_addVertex(&mesh, &pt, &N, NULL);
+        }
+    }
+    point_set3D(&pt, 0.0, 1.0, 0.0);
+    vector_set(&N, 0.0, 1.0, 0.0);
+    top = mesh_addVertex(&mesh, &pt, &N, NULL);
+
+    // two triangles for each quadrilateral between neighboring rings, then the fan at the top
+    for (i = 0; i < resolution; i++)
+    {
+        for (j = 0; j < resolution; j++)
+        {
+            j1 = (j + 1) % resolution;
+            mesh_addTriangle(&mesh, (i + 1) * resolution + j, i * resolution + j, (i + 1) * resolution + j1);
+            mesh_addTriangle(&mesh, i * resolution + j, (i + 1) * resolution + j1, i * resolution + j1);
+        }
+    }
+    for (j = 0; j < resolution; j++)
+    {
+        mesh_addTriangle(&mesh, top, resolution * resolution + j, resolution * resolution + (j + 1) % resolution);
+    }
+    module_mesh(md, &mesh);
+    mesh_clear(&mesh);
+}
+
+/**
+ * Builds the sphere of module_sphereMesh as an LOD chain, with resolution, resolution / 2, and so
+ * on down to 4, so a distant sphere is drawn with fewer triangles.
+ *
+ * @param md Pointer to the Module.
+ * @param resolution The resolution of the finest level.
+ */
+void module_sphereLOD(Module *md, int resolution)
+{
+    if (!md || resolution < 2)
+    {
+        fprintf(stderr, "Invalid parameter provided to module_sphereLOD\n");
+        exit(-1);
+    }
+    module_curveLOD(md, resolution, 4, module_sphereMesh);
+}
+
 /**
  * Makes a unit pyramid of any size base. The height will be 1 and the number of sides is provided by the user.
  * Default will be 3 (tetrahedron)
@@ -1112,15 +2824,58 @@ void module_pyramid(Module *md, int sides)
 }
 
 /**
- * Builds a heightmap on a 1 x 1 grid that will be subdivided a given number of times. Adds a perturbation to each midpoint as it subdivides
+ * Adds a finished height map to the module as one Mesh, sharing each grid point between the six
+ * triangles around it. Each vertex is colored by its own height, in the bands module_buildHeightMap
+ * colors the squares by, and its normal is the average of the triangles around it.
  *
- * @param md the module to add the terrain submap to
- * @param prevMap The 2D matrix with the previous iteration's height values
- * @param count the current iteration number
- * @param maxIterations the total number of iterations desired
- * @param roughness the roughness factor for calculating the size of the perturbations
+ * @param md the module to add the terrain mesh to
+ * @param rows the number of rows of the height map
+ * @param cols the number of columns of the height map
+ * @param map the heights
  */
-void module_buildHeightMap(Module *md, DrawState *ds, int oldRows, int oldCols, double prevMap[oldRows][oldCols], int count, int maxIterations, double roughness)
+static void module_heightMapMesh(Module *md, int rows, int cols, double map[rows][cols])
+{
+    int i, j, k;
+    double h;
+    Point pt;
+    Mesh mesh;
+    Color White, Green, Blue, Brown;
+
+    color_set(&White, 1.0, 1.0, 1.0);
+    color_set(&Blue, 0.0, 0.0, 0.7);
+    color_set(&Green, 0.15, .5, 0.15);
+    color_set(&Brown, 0.55, 0.35, 0.0);
+
+    mesh_init(&mesh);
+    for (i = 0; i < rows; i++)
+    {
+        for (j = 0; j < cols; j++)
+        {
+            h = map[i][j];
+            point_set3D(&pt, (double)j / (double)cols, h, (double)i / (double)rows);
+            mesh_addVertex(&mesh, &pt, NULL, h > .4 ? &White : h > 0.2 ? &Brown : h > 0.0 ? &Green : &Blue);
+        }
+    }
+    // the same two triangles per square as module_buildHeightMap, both wound to face up
+    for (i = 0; i < rows - 1; i++)
+    {
+        for (j = 0; j < cols - 1; j++)
+        {
+            k = i * cols + j;
+            mesh_addTriangle(&mesh, k, k + 1, k + cols);
+            mesh_addTriangle(&mesh, k + cols, k + 1, k + cols + 1);
+        }
+    }
+    mesh_calculateNormals(&mesh);
+    module_mesh(md, &mesh);
+    mesh_clear(&mesh);
+}
+
+/**
+ * Subdivides the height map and adds the result to the module, as polygons or, if asMesh is set,
+ * as one Mesh.
+ */
+static void module_heightMap(Module *md, DrawState *ds, int asMesh, int oldRows, int oldCols, double prevMap[oldRows][oldCols], int count, int maxIterations, double roughness)
 {
     int i, j, newRows, newCols;
     double x1, x2, y, z1, z2, prev, next, avgHeight;
@@ -1145,7 +2900,11 @@ void module_buildHeightMap(Module *md, DrawState *ds, int oldRows, int oldCols,
     }
 
     // Base case: if iterations == count, then we're ready to draw
-    if (count == maxIterations)
+    if (count == maxIterations && asMesh)
+    {
+        module_heightMapMesh(md, oldRows, oldCols, prevMap);
+    }
+    else if (count == maxIterations)
     {
         // Initialize the polygon for drawing
         polygon_init(&p);
@@ -1295,10 +3054,24 @@ void module_buildHeightMap(Module *md, DrawState *ds, int oldRows, int oldCols,
             }
         }
         // Recursively call the heightmap again, with the new count and map
-        module_buildHeightMap(md, ds, newRows, newCols, newMap, count, maxIterations, roughness);
+        module_heightMap(md, ds, asMesh, newRows, newCols, newMap, count, maxIterations, roughness);
     }
 }
 
+/**
+ * Builds a heightmap on a 1 x 1 grid that will be subdivided a given number of times. Adds a perturbation to each midpoint as it subdivides
+ *
+ * @param md the module to add the terrain submap to
+ * @param prevMap The 2D matrix with the previous iteration's height values
+ * @param count the current iteration number
+ * @param maxIterations the total number of iterations desired
+ * @param roughness the roughness factor for calculating the size of the perturbations
+ */
+void module_buildHeightMap(Module *md, DrawState *ds, int oldRows, int oldCols, double prevMap[oldRows][oldCols], int count, int maxIterations, double roughness)
+{
+    module_heightMap(md, ds, 0, oldRows, oldCols, prevMap, count, maxIterations, roughness);
+}
+
 /**
  * Builds a fractal landscape using a height map and a pseudo- diamond-square algorithm to generate the subsequent heights.
  */
@@ -1325,6 +3098,34 @@ void module_terrain(Module *md, DrawState *ds, int iterations, double roughness)
     module_buildHeightMap(md, ds, 2, 2, heightMap, 0, iterations, roughness);
 }
 
+/**
+ * Builds the fractal landscape of module_terrain as a single Mesh with smooth normals, colored
+ * per vertex by height. Since the colors are lit as body colors, draw it with ShadeGouraud.
+ *
+ * @param md Pointer to the Module.
+ * @param iterations The number of times the 2 x 2 height map is subdivided.
+ * @param roughness The roughness factor for the size of the perturbations.
+ */
+void module_terrainMesh(Module *md, int iterations, double roughness)
+{
+    double heightMap[2][2];
+    int i, j;
+
+    if (!md || iterations < 0)
+    {
+        fprintf(stderr, "Invalid parameter provided to module_terrainMesh\n");
+        exit(-1);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            heightMap[i][j] = drand48();
+        }
+    }
+    module_heightMap(md, NULL, 1, 2, 2, heightMap, 0, iterations, roughness);
+}
+
 /**
  * Adds the foreground color value to the tail of the module’s list.
  *
@@ -1809,6 +3610,42 @@ Color module_rayIntersect(Lighting *l, DrawState *ds, Point *pt, Vector *Vij, Ra
     return c;
 }
 
+/**
+ * Adds the triangles of a mesh to the ray tracer's database. The ray tracer works on polygons, so
+ * each triangle becomes one.
+ *
+ * @param mesh Pointer to the Mesh.
+ * @param LTM Pointer to the local transformation matrix.
+ * @param GTM Pointer to the global transformation matrix.
+ * @param rt Pointer to the RayTracer.
+ */
+static void module_rayAddMesh(Mesh *mesh, Matrix *LTM, Matrix *GTM, RayTracer *rt)
+{
+    Polygon p;
+    Point pt[3];
+    Vector n[3];
+    int j, k;
+
+    polygon_init(&p);
+    for (k = 0; k < mesh->nTriangle; k++)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            point_copy(&pt[j], &(mesh->vertex[mesh->index[3 * k + j]]));
+            vector_copy(&n[j], &(mesh->normal[mesh->index[3 * k + j]]));
+        }
+        polygon_set(&p, 3, pt);
+        polygon_setNormals(&p, 3, n);
+        polygon_setSided(&p, mesh->oneSided);
+        matrix_xformPolygon(LTM, &p);
+        matrix_xformPolygon(GTM, &p);
+        polygon_setVertex3D(&p, p.nVertex, p.vertex);
+        polygon_setNormalsPhong(&p, p.nVertex, p.normal);
+        rayTracer_add(rt, &p);
+    }
+    polygon_clear(&p);
+}
+
 /**
  * Builds a polygon database in world coordinates to use in the ray tracer draw program
  *
@@ -1844,6 +3681,15 @@ void module_rayBuildDb(Module *md, Matrix *GTM, DrawState *ds, RayTracer *rt)
             module_rayBuildDb(e->obj.module, &TM, &tempDS, rt);
             break;
         }
+        case ObjLOD:
+        {
+            Matrix TM;
+            DrawState tempDS;
+            drawstate_copy(&tempDS, ds);
+            matrix_multiply(GTM, &LTM, &TM);
+            module_rayBuildDb(e->obj.lod.level[0], &TM, &tempDS, rt);
+            break;
+        }
         case ObjMatrix:
         {
             // printf("type: Matrix\n");
@@ -1869,6 +3715,19 @@ void module_rayBuildDb(Module *md, Matrix *GTM, DrawState *ds, RayTracer *rt)
             rayTracer_add(rt, &p);
             break;
         }
+        case ObjMesh:
+            module_rayAddMesh(&(e->obj.mesh), &LTM, GTM, rt);
+            break;
+        case ObjInstances:
+        {
+            Matrix M;
+            for (int k = 0; k < e->obj.instances.nInstance; k++)
+            {
+                matrix_multiply(&LTM, &(e->obj.instances.xform[k]), &M);
+                module_rayAddMesh(&(e->obj.instances.mesh), &M, GTM, rt);
+            }
+            break;
+        }
         default:
             printf("Other\n");
             break;
@@ -178,7 +178,7 @@ void add_noise(Image *dst, int noiseWidth)
         {
             dx = (float)i / (float)dst->cols;
             dy = (float)j / (float)dst->rows;
-            value = perlin(dx * noiseWidth, dy * noiseWidth, dst->z[i * dst->cols + j]);
+            value = perlin(dx * noiseWidth, dy * noiseWidth, image_getz(dst, i, j));
             value = (value + 1) / 2;
             // Red Noise only
             // pixel.rgb[0] = 1;
@@ -9,6 +9,23 @@
 #include "list.h"
 #include "Line.h"
 
+/**
+ * Allocates n bytes for one of the polygon's arrays, from its arena if it has one.
+ */
+static void *polygon_alloc(Polygon *p, size_t n)
+{
+    return p->arena ? arena_alloc(p->arena, n) : malloc(n);
+}
+
+/**
+ * Frees one of the polygon's arrays, unless the arena owns it.
+ */
+static void polygon_release(Polygon *p, void *mem)
+{
+    if (!p->arena)
+        free(mem);
+}
+
 // Constructors
 /**
  * Returns an allocate Polygon pointer
@@ -72,7 +89,7 @@ void polygon_free(Polygon *p)
     // Check for vertex data, free if found
     if (p->vertex)
     {
-        free(p->vertex);
+        polygon_release(p, p->vertex);
     }
     // free the Polygon
     free(p);
@@ -100,6 +117,7 @@ void polygon_init(Polygon *p)
     p->vertex3D = NULL;
     p->normalPhong = NULL;
     p->zBuffer = 1;
+    p->arena = NULL;
 }
 
 /**
@@ -132,7 +150,7 @@ void polygon_set(Polygon *p, int numV, Point *vlist)
     }
 
     // Allocate the memory for the vertex list in the polygon struct
-    p->vertex = (Point *)malloc(sizeof(Point) * numV);
+    p->vertex = (Point *)polygon_alloc(p, sizeof(Point) * numV);
 
     // Null check incase the malloc failed
     if (!p->vertex)
@@ -156,6 +174,8 @@ void polygon_set(Polygon *p, int numV, Point *vlist)
  */
 void polygon_clear(Polygon *p)
 {
+    Arena *arena;
+
     // Null check
     if (!p)
     {
@@ -165,24 +185,26 @@ void polygon_clear(Polygon *p)
 
     // Check for vertex, color, and normal data, free if found and reset to null
     if (p->vertex)
-        free(p->vertex);
+        polygon_release(p, p->vertex);
     p->vertex = NULL;
 
     if (p->color)
-        free(p->color);
+        polygon_release(p, p->color);
     p->color = NULL;
 
     if (p->normal)
-        free(p->normal);
+        polygon_release(p, p->normal);
     p->normal = NULL;
 
     if (p->vertex3D)
-        free(p->vertex3D);
+        polygon_release(p, p->vertex3D);
 
     if (p->normalPhong)
-        free(p->normalPhong);
-    // Reinitialize the polygon to default values
+        polygon_release(p, p->normalPhong);
+    // Reinitialize the polygon to default values, still allocating from the same arena
+    arena = p->arena;
     polygon_init(p);
+    p->arena = arena;
 }
 
 // setters/getters
@@ -232,9 +254,9 @@ void polygon_setColors(Polygon *p, int numV, Color *clist)
     // If there's already a colors list, then clear it out and reinitialize the memory
     if (p->color)
     {
-        free(p->color);
+        polygon_release(p, p->color);
     }
-    p->color = (Color *)malloc(sizeof(Color) * numV);
+    p->color = (Color *)polygon_alloc(p, sizeof(Color) * numV);
     // Null check incase memory failed
     if (!p->color)
     {
@@ -271,9 +293,9 @@ void polygon_setNormals(Polygon *p, int numV, Vector *nlist)
     // If there's already a Normals list, then clear it out and reinitialize the memory
     if (p->normal)
     {
-        free(p->normal);
+        polygon_release(p, p->normal);
     }
-    p->normal = (Vector *)malloc(sizeof(Vector) * numV);
+    p->normal = (Vector *)polygon_alloc(p, sizeof(Vector) * numV);
     // Null check incase memory failed
     if (!p->normal)
     {
@@ -305,9 +327,9 @@ void polygon_setNormalsPhong(Polygon *p, int numV, Vector *nlist)
     // If there's already a Normals list, then clear it out and reinitialize the memory
     if (p->normalPhong)
     {
-        free(p->normalPhong);
+        polygon_release(p, p->normalPhong);
     }
-    p->normalPhong = (Vector *)malloc(sizeof(Vector) * numV);
+    p->normalPhong = (Vector *)polygon_alloc(p, sizeof(Vector) * numV);
     // Null check incase memory failed
     if (!p->normalPhong)
     {
@@ -338,9 +360,9 @@ void polygon_setVertex3D(Polygon *p, int numV, Point *plist)
     }
 
     if (p->vertex3D)
-        free(p->vertex3D);
+        polygon_release(p, p->vertex3D);
 
-    p->vertex3D = (Point *)malloc(sizeof(Point) * numV);
+    p->vertex3D = (Point *)polygon_alloc(p, sizeof(Point) * numV);
 
     if (!p->vertex3D)
     {
@@ -420,7 +442,7 @@ void polygon_copy(Polygon *to, Polygon *from)
     // Check if destination has vertices to free. Set to 0.
     if (to->vertex)
     {
-        free(to->vertex);
+        polygon_release(to, to->vertex);
         to->nVertex = 0;
         to->vertex = NULL;
     }
@@ -550,137 +572,6 @@ void polygon_draw(Polygon *p, Image *src, Color c)
     line_draw(&line, src, c);
 }
 
-/**
- * Helper function to determine the minimum x or y value. Takes three double values
- * and returns the lowest value.
- */
-static double minDouble(double a, double b, double c)
-{
-    // Compare a to b, then compare the smaller of those to c
-    if (a < b) // case a < b
-    {
-        if (a < c) // Case a < b < c or a < c < b
-        {
-            return a;
-        }
-        else // Case c < a < b
-        {
-            return c;
-        }
-    }
-    else if (b < c) // case b < a
-    {
-        return b; // case b < c < a
-    }
-    return c; // case c < b < a
-};
-
-/**
- * Helper function to determine the maximum x or y value. Takes 3 double values and
- * returns the highest value
- */
-static double maxDouble(double a, double b, double c)
-{
-    // Compare a to b, then compare the smaller of those to c
-    if (a > b) // case a > b
-    {
-        if (a > c) // Case a > b > c or a > c > b
-        {
-            return a;
-        }
-        else // Case c > a > b
-        {
-            return c;
-        }
-    }
-    else if (b > c) // case b > a
-    {
-        return b; // case b > c > a
-    }
-    return c; // case c > b > a
-}
-
-/**
- * Draws and fills a polygon triangle with a color using barycentric triangle algorithm
- *
- * @param p the polygon to draw, must be only 3 vertices
- * @param src the image to draw it on
- * @param c the color of the polygon
- */
-void polygon_drawFillB(Polygon *p, Image *src, Color c)
-{
-    Point A, B, C;
-    double a, b, g, minX, maxX, minY, maxY, Xa, Ya, Xb, Yb, Xc, Yc, Px, Py;
-    int i, j;
-
-    // Null checks
-    if (!p || !src)
-    {
-        fprintf(stderr, "Null pointer provided to polygon_drawFillB\n");
-        exit(-1);
-    }
-
-    if (p->nVertex != 3)
-    {
-        printf("Incorrect number of vertices for a barycentric triangle!\n");
-        return;
-    }
-
-    // Assign initial points A, B, C
-    A = p->vertex[0];
-    B = p->vertex[1];
-    C = p->vertex[2];
-    // Assign to x and y components for readability
-    Xa = A.val[0];
-    Ya = A.val[1];
-    Xb = B.val[0];
-    Yb = B.val[1];
-    Xc = C.val[0];
-    Yc = C.val[1];
-
-    // Determine if the triangle is CCW - shoestring formula will be negative
-    double area = (Xa * Yb + Xb * Yc + Xc * Ya) - (Ya * Xb + Yb * Xc + Yc * Xa);
-
-    if (area > 0)
-    { // if positive, then order was clockwise
-        Point tmp = B;
-        B = C;
-        C = tmp;
-    }
-    else if (area == 0)
-    {
-        printf("Points are colinear\n");
-        return;
-    }
-
-    // Determine the boundary box dimensions.
-    // Min to max x, min to max y
-    minX = (int)(minDouble(Xa, Xb, Xc) + .5);
-    maxX = (int)(maxDouble(Xa, Xb, Xc) + .5);
-    minY = (int)(minDouble(Ya, Yb, Yc) + .5);
-    maxY = (int)(maxDouble(Ya, Yb, Yc) + .5);
-
-    // For each pixel in boundary box,
-    // if the pixel is in the triangle, color it
-    for (i = minY; i < maxY; i++)
-    {
-        for (j = minX; j < maxX; j++)
-        {
-            Px = (float)j + .5; // pixel x value
-            Py = (float)i + .5; // pixel y value
-            // Calculate beta nd gamma, then deduce alpha
-            b = (((Yc - Ya) * Px) + ((Xa - Xc) * Py) + (Xc * Ya) - (Xa * Yc)) / (((Yc - Ya) * Xb) + ((Xa - Xc) * Yb) + (Xc * Ya) - (Xa * Yc));
-            g = (((Ya - Yb) * Px) + ((Xb - Xa) * Py) + (Xa * Yb) - (Xb * Ya)) / (((Ya - Yb) * Xc) + ((Xb - Xa) * Yc) + (Xa * Yb) - (Xb * Ya));
-            a = 1 - b - g;
-
-            if (a >= 0 && a <= 1 && b >= 0 && b <= 1 && g >= 0 && g <= 1)
-            {
-                image_setColor(src, i, j, c);
-            }
-        }
-    }
-}
-
 /**
  * Calculates the shading at each vertex of a polygon
  *
@@ -74,6 +74,7 @@ void polyline_init(Polyline *p)
         p->zBuffer = 1;
         p->numVertex = 0;
         p->vertex = NULL;
+        p->arena = NULL;
     }
 }
 
@@ -97,7 +98,10 @@ void polyline_set(Polyline *p, int numV, Point *vlist)
     {
         polyline_clear(p);
     }
-    p->vertex = (Point *)malloc(sizeof(Point) * numV);
+    if (p->arena)
+        p->vertex = (Point *)arena_alloc(p->arena, sizeof(Point) * numV);
+    else
+        p->vertex = (Point *)malloc(sizeof(Point) * numV);
     for (int i = 0; i < numV; i++)
     {
         point_copy(&(p->vertex[i]), &(vlist[i]));
@@ -116,7 +120,7 @@ void polyline_clear(Polyline *p)
     // Null check
     if (p)
     {
-        if (p->vertex) // check there is already data before freeing
+        if (p->vertex && !p->arena) // check there is already data before freeing
             free(p->vertex);
         p->vertex = NULL;
         p->numVertex = 0;
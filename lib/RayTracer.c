@@ -35,6 +35,7 @@ void rayTracer_add(RayTracer *rt, Polygon *p)
 
     if (rt->size >= rt->max) // Check if database is full and needs to expand
         rayTracer_expand(rt);
+    polygon_init(&(rt->db[rt->size])); // the slot is uninitialized memory
     polygon_copy(&(rt->db[rt->size]), p);
     // printf("Adding polygon: ");
     // polygon_print(p, stdout);
@@ -50,6 +51,7 @@ void rayTracer_expand(RayTracer *rt)
     Polygon *tmp = (Polygon *)malloc(sizeof(Polygon) * rt->size * 2); // Double the size of the polygon array
     for (int i = 0; i < rt->size; i++)
     {
+        polygon_init(&tmp[i]);
         polygon_copy(&tmp[i], &rt->db[i]); // Copy the polygons to the new array
     }
     free(rt->db); // Free the old polygon array
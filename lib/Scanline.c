@@ -11,10 +11,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "Polygon.h"
-#include "List.h"
 #include "DrawState.h"
 
+// The SIMD span kernels are built for x86 with gcc/clang and chosen at
+// runtime from the CPU features. Everywhere else only the scalar kernels
+// exist.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCANLINE_SIMD 1
+#include <immintrin.h>
+#else
+#define SCANLINE_SIMD 0
+#endif
+
 /********************
 Scanline Fill Algorithm
 ********************/
@@ -31,49 +41,218 @@ typedef struct tEdge
 	Color cIntersect, dcPerScan;
 	Vector nIntersect, dnPerScan;
 	Point pIntersect, dpPerScan;
-	struct tEdge *next;
+	int material; /* G-buffer material index for deferred shading */
+	int next;	  /* index of the next edge starting on the same scanline, -1 ends the bucket */
+	/* fixed point mode only: the first column at or right of the edge on the
+	   current scanline is ceil(xq + xr / xDen), stepped exactly by xStepQ and
+	   xStepR each scanline with 0 <= xr < xDen */
+	long long xq, xr, xDen, xStepQ, xStepR;
+	float xInvDen;
+	int xCol;
+	/* the intersections on scanline yStart, which those on the later
+	   scanlines are computed from (see edgeAt) */
+	float xStart, zStart;
+	Color cStart;
+	Vector nStart;
+	Point pStart;
 } Edge;
 
 /*
-	This is a comparison function that returns a value < 0 if a < b, a
-	value > 0 if a > b, and 0 if a = b.  It uses the yStart field of the
-	Edge structure.  It is used to sort the overall edge list.
+	The edge table used by the scanline fill. All of the storage is kept
+	in flat arrays that are grown as needed and reused from one polygon to
+	the next, so drawing a polygon does no per-edge or per-node allocation.
+
+	edges holds every edge record of the current polygon. bucket is the
+	global edge table: bucket[y - yMin] is the index of the first edge that
+	starts on scanline y, and the rest of that row are chained through
+	Edge::next. active is the active edge table, an array of pointers into
+	edges kept sorted by xIntersect.
+ */
+typedef struct EdgeTable
+{
+	Edge *edges;
+	int nEdges, maxEdges;
+	int *bucket;
+	int yMin, nBuckets, maxBuckets;
+	Edge **active;
+	int nActive, maxActive;
+	int material;
+	int clipX0, clipY0, clipX1, clipY1; /* columns and rows the fill may write, end exclusive */
+	int fixed;							/* edges of the current polygon use makeEdgeRecFixed */
+} EdgeTable;
+
+// each thread that rasterizes gets its own edge table, so the tile
+// workers in Tiles.c can fill polygons at the same time
+static _Thread_local EdgeTable scanTable = {NULL, 0, 0, NULL, 0, 0, 0, NULL, 0, 0, -1, 0, 0, 0, 0, 0};
+
+// frees a thread's edge table arrays when the thread exits
+static pthread_key_t scanTableKey;
+static pthread_once_t scanTableOnce = PTHREAD_ONCE_INIT;
+
+/*
+	Whether the fill snaps vertices to 28.4 fixed point and steps edges in
+	integers (makeEdgeRecFixed) instead of rounding floats.
+ */
+static int fixedPoint = 0;
+
+/*
+	Frees the arrays of the edge table of a thread that is exiting.
  */
-static int compYStart(const void *a, const void *b)
+static void edgeTable_exit(void *table)
 {
-	Edge *ea = (Edge *)a;
-	Edge *eb = (Edge *)b;
+	EdgeTable *et = (EdgeTable *)table;
 
-	return (ea->yStart - eb->yStart);
+	free(et->edges);
+	free(et->active);
+	free(et->bucket);
 }
 
 /*
-	This is a comparison function that returns a value < 0 if a < b, a
-	value > 0 if a > b, and 0 if a = b.  It uses the xIntersect field of the
-	Edge structure.  It is used to sort the active edge list.
+	Creates the key that frees each thread's edge table when the thread
+	exits.
  */
-static int compXIntersect(const void *a, const void *b)
+static void edgeTable_key(void)
 {
-	Edge *ea = (Edge *)a;
-	Edge *eb = (Edge *)b;
+	if (pthread_key_create(&scanTableKey, edgeTable_exit) != 0)
+	{
+		fprintf(stderr, "Unable to create the edge table key\n");
+		exit(-1);
+	}
+}
 
-	if (ea->xIntersect < eb->xIntersect)
-		return (-1);
-	else if (ea->xIntersect > eb->xIntersect)
-		return (1);
+/*
+	Makes sure the edge table can hold nEdges edges spread over nBuckets
+	scanlines. Only grows the arrays, never shrinks them. The first time a
+	thread's table grows, the table is registered to be freed when the
+	thread exits.
+ */
+static void edgeTable_reserve(EdgeTable *et, int nEdges, int nBuckets)
+{
+	if (!et->edges && !et->bucket)
+	{
+		pthread_once(&scanTableOnce, edgeTable_key);
+		pthread_setspecific(scanTableKey, et);
+	}
+	if (nEdges > et->maxEdges)
+	{
+		et->edges = (Edge *)realloc(et->edges, sizeof(Edge) * nEdges);
+		et->active = (Edge **)realloc(et->active, sizeof(Edge *) * nEdges);
+		if (!et->edges || !et->active)
+		{
+			fprintf(stderr, "Edge table allocation failed\n");
+			exit(-1);
+		}
+		et->maxEdges = nEdges;
+		et->maxActive = nEdges;
+	}
+	if (nBuckets > et->maxBuckets)
+	{
+		et->bucket = (int *)realloc(et->bucket, sizeof(int) * nBuckets);
+		if (!et->bucket)
+		{
+			fprintf(stderr, "Edge table allocation failed\n");
+			exit(-1);
+		}
+		et->maxBuckets = nBuckets;
+	}
+}
 
-	return (0);
+/*
+	Inserts edge into the active edge table, keeping it sorted by
+	xIntersect. An edge goes in front of any edges with an equal
+	xIntersect.
+ */
+static void activeInsert(EdgeTable *et, Edge *edge)
+{
+	int j = et->nActive++;
+
+	while (j > 0 && et->active[j - 1]->xIntersect >= edge->xIntersect)
+	{
+		et->active[j] = et->active[j - 1];
+		j--;
+	}
+	et->active[j] = edge;
+}
+
+/*
+	Re-sorts the active edge table by xIntersect after the edges have been
+	stepped to the next scanline. The table is nearly sorted already, so an
+	insertion sort runs in close to linear time. Like activeInsert, each edge
+	moves in front of the edges it ties with.
+ */
+static void activeSort(EdgeTable *et)
+{
+	int i, j;
+	Edge *edge;
+
+	for (i = 1; i < et->nActive; i++)
+	{
+		edge = et->active[i];
+		j = i;
+		while (j > 0 && et->active[j - 1]->xIntersect >= edge->xIntersect)
+		{
+			et->active[j] = et->active[j - 1];
+			j--;
+		}
+		et->active[j] = edge;
+	}
+}
+
+/*
+	Keeps the intersections of a new edge on its first scanline.
+ */
+static inline void edgeSaveStart(Edge *edge)
+{
+	edge->xStart = edge->xIntersect;
+	edge->zStart = edge->zIntersect;
+	edge->cStart = edge->cIntersect;
+	edge->nStart = edge->nIntersect;
+	edge->pStart = edge->pIntersect;
+}
+
+/*
+	Sets the intersections of the edge on scanline scan as start + (scan -
+	yStart) * perScan. Computing each scanline from the start, instead of
+	adding perScan to the scanline before, gives an edge the same values on
+	a row whether the fill steps down to it or jumps straight there, as a
+	fill clipped to a tile does. A fixed point edge steps its exact x
+	itself, so only its other intersections are set here.
+ */
+static inline void edgeAt(Edge *edge, int scan, int fixed)
+{
+	float k = (float)(scan - edge->yStart);
+	int j;
+
+	if (!fixed)
+	{
+		edge->xIntersect = edge->xStart + k * edge->dxPerScan;
+	}
+	edge->zIntersect = edge->zStart + k * edge->dzPerScan;
+	for (j = 0; j < 3; j++)
+	{
+		edge->cIntersect.c[j] = edge->cStart.c[j] + k * edge->dcPerScan.c[j];
+		edge->nIntersect.val[j] = edge->nStart.val[j] + k * edge->dnPerScan.val[j];
+		edge->pIntersect.val[j] = edge->pStart.val[j] + k * edge->dpPerScan.val[j];
+	}
+	// adjust in the case of partial overlap
+	if (!fixed && ((edge->dxPerScan < 0.0 && edge->xIntersect < edge->x1) ||
+				   (edge->dxPerScan > 0.0 && edge->xIntersect > edge->x1)))
+	{
+		edge->xIntersect = edge->x1;
+		edge->zIntersect = edge->z1;
+	}
 }
 
 /*
-	Allocates, creates, fills out, and returns an Edge structure given
-	the inputs.
+	Fills out an Edge structure given the inputs, using the next free
+	record in the edge table. Returns NULL and leaves the table unchanged
+	if the edge is entirely outside of the image.
 
 	Current inputs are just the start and end location in image space.
 	Eventually, the points will be 3D and we'll add color and texture
 	coordinates.
  */
-static Edge *makeEdgeRec(Point start, Point end, Image *src, Color c1, Color c2, Point p1, Point p2, Vector n1, Vector n2, int oneSided)
+static Edge *makeEdgeRec(EdgeTable *et, Point start, Point end, Image *src, Color c1, Color c2, Point p1, Point p2, Vector n1, Vector n2, int oneSided)
 {
 	Edge *edge;
 	float dscan = end.val[1] - start.val[1];
@@ -95,8 +274,8 @@ static Edge *makeEdgeRec(Point start, Point end, Image *src, Color c1, Color c2,
 		return NULL;
 	}
 
-	// allocate an edge structure and set the x0, y0, x1, y1 values
-	edge = (Edge *)malloc(sizeof(Edge));
+	// take the next edge record and set the x0, y0, x1, y1 values
+	edge = &(et->edges[et->nEdges]);
 	edge->x0 = start.val[0];
 	edge->y0 = start.val[1];
 	edge->z0 = start.val[2];
@@ -104,6 +283,7 @@ static Edge *makeEdgeRec(Point start, Point end, Image *src, Color c1, Color c2,
 	edge->y1 = end.val[1];
 	edge->z1 = end.val[2];
 	edge->oneSided = oneSided;
+	edge->material = et->material;
 	// turn on an edge only if the edge starts in the top half of it or
 	// the lower half of the pixel above it.  In other words, round the
 	// start y value to the nearest integer and assign it to
@@ -212,53 +392,202 @@ static Edge *makeEdgeRec(Point start, Point end, Image *src, Color c1, Color c2,
 		edge->xIntersect = edge->x1;
 	}
 
-	// return the newly created edge data structure
+	// keep the record and return it
+	edgeSaveStart(edge);
+	et->nEdges++;
 	return (edge);
 }
 
 /*
-	Returns a list of all the edges in the polygon in sorted order by
-	smallest row.
+	Integer division rounding toward minus infinity, for d > 0.
+ */
+static inline long long floorDiv(long long n, long long d)
+{
+	long long q = n / d;
+
+	return (q * d > n ? q - 1 : q);
+}
+
+/*
+	Snaps a screen coordinate to the 28.4 fixed point grid.
+ */
+static inline long long snapFixed(double v)
+{
+	return ((long long)floor(v * POLYGON_SUBPIXEL + 0.5));
+}
+
+/*
+	Sets xCol and xIntersect of a fixed point edge from its exact x.
+ */
+static inline void edgeColumnFixed(Edge *edge)
+{
+	edge->xCol = (int)(edge->xq + (edge->xr != 0));
+	edge->xIntersect = (float)edge->xq + (float)edge->xr * edge->xInvDen + 0.5f;
+}
+
+/*
+	Moves a fixed point edge from its first scanline down to scanline scan
+	in one step, advancing its exact x by scan - yStart steps at once.
+ */
+static inline void edgeJumpFixed(Edge *edge, int scan)
+{
+	long long k = scan - edge->yStart;
+	long long r = edge->xr + edge->xStepR * k;
+
+	edge->xq += edge->xStepQ * k + r / edge->xDen;
+	edge->xr = r % edge->xDen;
+	edgeColumnFixed(edge);
+}
+
+/*
+	The fixed point version of makeEdgeRec. The end points are snapped to
+	1/16 of a pixel, and the edge is on every scanline whose center y + .5
+	is in [y0, y1), so a flat top edge is inside and a flat bottom edge is
+	not. On each scanline the span starts (or stops) at the first column
+	whose center is at or right of the edge, which is kept exactly with
+	integer steps. Edges shared by two polygons step identically in both,
+	so the pixels along them go to exactly one of the polygons.
+
+	Returns NULL if the edge crosses no scanline center in the image.
+ */
+static Edge *makeEdgeRecFixed(EdgeTable *et, Point start, Point end, Image *src, Color c1, Color c2, Point p1, Point p2, Vector n1, Vector n2, int oneSided)
+{
+	const long long half = POLYGON_SUBPIXEL / 2;
+	long long X0, Y0, X1, Y1, DX, DY, M;
+	int yStart, yEnd, i;
+	float dscan, off;
+	Edge *edge;
+
+	X0 = snapFixed(start.val[0]);
+	Y0 = snapFixed(start.val[1]);
+	X1 = snapFixed(end.val[0]);
+	Y1 = snapFixed(end.val[1]);
+	if (Y1 <= Y0)
+	{
+		return NULL;
+	}
+
+	// first and last scanlines whose centers are in [Y0, Y1)
+	yStart = (int)-floorDiv(half - Y0, POLYGON_SUBPIXEL);
+	yEnd = (int)-floorDiv(half - Y1, POLYGON_SUBPIXEL) - 1;
+	if (yStart > yEnd || yEnd < 0 || yStart >= src->rows)
+	{
+		return NULL;
+	}
+
+	edge = &(et->edges[et->nEdges]);
+	edge->x0 = (float)X0 / POLYGON_SUBPIXEL;
+	edge->y0 = (float)Y0 / POLYGON_SUBPIXEL;
+	edge->z0 = start.val[2];
+	edge->x1 = (float)X1 / POLYGON_SUBPIXEL;
+	edge->y1 = (float)Y1 / POLYGON_SUBPIXEL;
+	edge->z1 = end.val[2];
+	edge->oneSided = oneSided;
+	edge->material = et->material;
+	edge->yStart = yStart < 0 ? 0 : yStart;
+	edge->yEnd = yEnd >= src->rows ? src->rows - 1 : yEnd;
+
+	// with D = 16 dy, the first column on scanline y is ceil(M / D) for
+	// M = (x - 8) dy in 28.4 units, and M grows by 16 dx per scanline
+	DX = X1 - X0;
+	DY = Y1 - Y0;
+	edge->xDen = POLYGON_SUBPIXEL * DY;
+	M = X0 * DY + (POLYGON_SUBPIXEL * (long long)edge->yStart + half - Y0) * DX - half * DY;
+	edge->xq = floorDiv(M, edge->xDen);
+	edge->xr = M - edge->xq * edge->xDen;
+	edge->xStepQ = floorDiv(POLYGON_SUBPIXEL * DX, edge->xDen);
+	edge->xStepR = POLYGON_SUBPIXEL * DX - edge->xStepQ * edge->xDen;
+	edge->xInvDen = 1.0f / (float)edge->xDen;
+	edgeColumnFixed(edge);
+
+	// the attributes are stepped in float as in makeEdgeRec, starting at
+	// the center of the first scanline
+	dscan = edge->y1 - edge->y0;
+	off = (float)edge->yStart + .5f - edge->y0;
+	edge->dxPerScan = (edge->x1 - edge->x0) / dscan;
+	edge->dzPerScan = (1.0 / edge->z1 - 1.0 / edge->z0) / dscan;
+	edge->zIntersect = (1.0 / edge->z0) + off * edge->dzPerScan;
+	for (i = 0; i < 3; i++)
+	{
+		edge->dcPerScan.c[i] = (c2.c[i] / end.val[2] - c1.c[i] / start.val[2]) / dscan;
+		edge->dnPerScan.val[i] = (n2.val[i] / end.val[2] - n1.val[i] / start.val[2]) / dscan;
+		edge->cIntersect.c[i] = (c1.c[i] / start.val[2]) + off * edge->dcPerScan.c[i];
+		edge->nIntersect.val[i] = (n1.val[i] / start.val[2]) + off * edge->dnPerScan.val[i];
+	}
+	edge->nIntersect.val[3] = edge->zIntersect;
+	edge->dpPerScan.val[0] = (p2.val[0] / end.val[2] - p1.val[0] / start.val[2]) / dscan;
+	edge->dpPerScan.val[1] = (p2.val[1] / end.val[2] - p1.val[1] / start.val[2]) / dscan;
+	edge->dpPerScan.val[2] = edge->dzPerScan;
+	edge->pIntersect.val[0] = (p1.val[0] / start.val[2]) + off * edge->dpPerScan.val[0];
+	edge->pIntersect.val[1] = (p1.val[1] / start.val[2]) + off * edge->dpPerScan.val[1];
+	edge->pIntersect.val[2] = edge->zIntersect;
+
+	edgeSaveStart(edge);
+	et->nEdges++;
+	return (edge);
+}
+
+/*
+	Builds the global edge table for the polygon: every non-horizontal
+	edge that touches the image goes into the bucket of the scanline it
+	starts on. Returns the number of edges in the table.
 */
-static LinkedList *setupEdgeList(Polygon *p, Image *src)
+static int setupEdgeList(EdgeTable *et, Polygon *p, Image *src)
 {
-	LinkedList *edges = NULL;
 	Point v1, v2;
 	Color c1, c2;
 	Vector n1, n2;
 	Point p1, p2;
-	int i;
+	Vector zero;
+	int i, yMax, b;
+	Edge *edge;
+
+	// reserve one record per vertex and a bucket per image row
+	edgeTable_reserve(et, p->nVertex, src->rows);
+	et->nEdges = 0;
+	et->nActive = 0;
 
-	// create a linked list
-	edges = ll_new();
+	// polygons that were never through module_draw have no 3D data,
+	// so fall back on the screen vertices and an empty normal
+	vector_set(&zero, 0.0, 0.0, 0.0);
+
+	// fixed point edges only when every vertex is in range of the 28.4 math
+	et->fixed = __atomic_load_n(&fixedPoint, __ATOMIC_RELAXED);
+	for (i = 0; i < p->nVertex && et->fixed; i++)
+	{
+		if (!(fabs(p->vertex[i].val[0]) < POLYGON_FIXED_RANGE && fabs(p->vertex[i].val[1]) < POLYGON_FIXED_RANGE))
+			et->fixed = 0;
+	}
 
 	// walk around the polygon, starting with the last point
 	v1 = p->vertex[p->nVertex - 1];
 	color_copy(&c1, &(p->color[p->nVertex - 1]));
-	p1 = p->vertex3D[p->nVertex - 1];
-	n1 = p->normalPhong[p->nVertex - 1];
+	p1 = p->vertex3D ? p->vertex3D[p->nVertex - 1] : v1;
+	n1 = p->normalPhong ? p->normalPhong[p->nVertex - 1] : zero;
 	for (i = 0; i < p->nVertex; i++)
 	{
 
 		// the current point (i) is the end of the segment
 		v2 = p->vertex[i];
 		color_copy(&c2, &(p->color[i]));
-		p2 = p->vertex3D[i];
-		n2 = p->normalPhong[i];
+		p2 = p->vertex3D ? p->vertex3D[i] : v2;
+		n2 = p->normalPhong ? p->normalPhong[i] : zero;
+		// a fixed point edge drops itself if it crosses no scanline center
+		if (et->fixed)
+		{
+			if (v1.val[1] < v2.val[1])
+				makeEdgeRecFixed(et, v1, v2, src, c1, c2, p1, p2, n1, n2, p->oneSided);
+			else
+				makeEdgeRecFixed(et, v2, v1, src, c2, c1, p2, p1, n2, n1, p->oneSided);
+		}
 		// if it is not a horizontal line
-		if ((int)(v1.val[1] + 0.5) != (int)(v2.val[1] + 0.5))
+		else if ((int)(v1.val[1] + 0.5) != (int)(v2.val[1] + 0.5))
 		{
-			Edge *edge;
-
 			// if the first coordinate is smaller (top edge)
 			if (v1.val[1] < v2.val[1])
-				edge = makeEdgeRec(v1, v2, src, c1, c2, p1, p2, n1, n2, p->oneSided);
+				makeEdgeRec(et, v1, v2, src, c1, c2, p1, p2, n1, n2, p->oneSided);
 			else
-				edge = makeEdgeRec(v2, v1, src, c2, c1, p2, p1, n2, n1, p->oneSided);
-
-			// insert the edge into the list of edges if it's not null
-			if (edge)
-				ll_insert(edges, edge, compYStart);
+				makeEdgeRec(et, v2, v1, src, c2, c1, p2, p1, n2, n1, p->oneSided);
 		}
 		v1 = v2;
 		color_copy(&c1, &c2);
@@ -267,255 +596,891 @@ static LinkedList *setupEdgeList(Polygon *p, Image *src)
 	}
 
 	// check for empty edges (like nothing in the viewport)
-	if (ll_empty(edges))
+	if (et->nEdges == 0)
+	{
+		return (0);
+	}
+
+	// find the range of starting scanlines, ignoring edges below the image
+	et->yMin = src->rows;
+	yMax = -1;
+	for (i = 0; i < et->nEdges; i++)
+	{
+		if (et->edges[i].yStart < et->yMin)
+			et->yMin = et->edges[i].yStart;
+		if (et->edges[i].yStart > yMax && et->edges[i].yStart < src->rows)
+			yMax = et->edges[i].yStart;
+	}
+	if (yMax < et->yMin)
+	{
+		return (0);
+	}
+
+	// drop the edges into their buckets. Each edge goes in front of the
+	// others starting on the same row, so a bucket reads back in the
+	// reverse of the order the edges were made.
+	et->nBuckets = yMax - et->yMin + 1;
+	for (b = 0; b < et->nBuckets; b++)
+	{
+		et->bucket[b] = -1;
+	}
+	for (i = 0; i < et->nEdges; i++)
+	{
+		edge = &(et->edges[i]);
+		edge->next = -1;
+		if (edge->yStart < src->rows)
+		{
+			b = edge->yStart - et->yMin;
+			edge->next = et->bucket[b];
+			et->bucket[b] = i;
+		}
+	}
+
+	return (et->nEdges);
+}
+
+/*
+	A span kernel fills the pixels of one scanline between a pair of active
+	edges. There is one kernel for each ShadeMethod, and each kernel only
+	interpolates the attributes that it reads. The kernel is picked once per
+	polygon by selectSpan.
+
+	Every kernel evaluates column i directly as p1 + (i - origin) * delta
+	rather than stepping an accumulator, so a pixel gets the same value no
+	matter where the span was clipped. That lets the tile renderer clip a
+	span to each tile and still match a full-image fill exactly.
+ */
+typedef void (*SpanFunc)(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l);
+
+/*
+	Finds the first column and one past the last column of the span
+	between p1 and p2, clipped to the edge table's clip rectangle. Returns
+	the unclipped first column, which is the origin the kernels interpolate
+	from. Fixed point edges already know their columns exactly.
+ */
+static int spanColumns(EdgeTable *et, Edge *p1, Edge *p2, int *start, int *end)
+{
+	int origin;
+
+	// identify the starting column and clip it to the left side
+	origin = et->fixed ? p1->xCol : (int)(p1->xIntersect + .5);
+	*start = origin < et->clipX0 ? et->clipX0 : origin;
+	// identify the ending column and clip it to the right side
+	*end = et->fixed ? p2->xCol : (int)(p2->xIntersect + .5);
+	if (*end > et->clipX1)
+	{
+		*end = et->clipX1;
+	}
+	return (origin);
+}
+
+/*
+	Clamps a color channel to [0, 1] the same way color_set does.
+ */
+static inline float clampChannel(float v)
+{
+	if (v < 0)
+		return (0);
+	else if (v > 1)
+		return (1);
+	return (v);
+}
+
+/*
+	The scalar kernels z-test with image_rowDepthTest: nearer than the depth
+	buffer, or with equal set, exactly the 1/z a depth pre-pass left there.
+	Every kernel computes z at a column the same way, so a pixel's z in the
+	shading pass matches the pre-pass bit for bit.
+
+	Each kernel takes the depth format as its last argument and is compiled
+	once per ImageDepth by SPAN_DEPTH_VARIANTS, so the z-test in the pixel
+	loop is specialized to the format of the image.
+ */
+#define SPAN_DEPTH_VARIANTS(name)                                                                           \
+	static void name##Float(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l) \
+	{                                                                                                       \
+		name(scan, et, p1, p2, src, ds, l, ImageDepthFloat);                                                \
+	}                                                                                                       \
+	static void name##16(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l)    \
+	{                                                                                                       \
+		name(scan, et, p1, p2, src, ds, l, ImageDepth16);                                                   \
+	}                                                                                                       \
+	static void name##24(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l)    \
+	{                                                                                                       \
+		name(scan, et, p1, p2, src, ds, l, ImageDepth24);                                                   \
+	}                                                                                                       \
+	static const SpanFunc name##Formats[] = {name##Float, name##16, name##24};
+
+/*
+	Span kernel for ZCompareDepthOnly: writes the nearer 1/z into the depth
+	buffer and interpolates nothing else.
+ */
+static inline __attribute__((always_inline)) void spanZOnly(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l, ImageDepth fmt)
+{
+	ImageRow v;
+	float z0, dz, currZ;
+	int i, start, end, origin;
+
+	image_row(src, scan, &v);
+	dz = (p2->zIntersect - p1->zIntersect) / (p2->xIntersect - p1->xIntersect);
+	origin = spanColumns(et, p1, p2, &start, &end);
+	z0 = p1->zIntersect;
+
+	for (i = start; i < end; i++)
+	{
+		currZ = z0 + (float)(i - origin) * dz;
+		image_rowDepthTest(&v, IMAGE_ROW_INDEX(&v, i), currZ, 0, fmt);
+	}
+}
+
+/*
+	Span kernel for ShadeConstant, ShadeFlat, and ShadeFrame: a z-test and
+	a store of the DrawState color.
+ */
+static inline __attribute__((always_inline)) void spanConstant(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l, ImageDepth fmt)
+{
+	ImageRow v;
+	float z0, dz, currZ;
+	int i, k, start, end, origin;
+	int equal = ds->zCompare == ZCompareEqual;
+
+	image_row(src, scan, &v);
+
+	dz = (p2->zIntersect - p1->zIntersect) / (p2->xIntersect - p1->xIntersect);
+	origin = spanColumns(et, p1, p2, &start, &end);
+	z0 = p1->zIntersect;
+
+	for (i = start; i < end; i++)
 	{
-		ll_delete(edges, NULL);
-		edges = NULL;
+		currZ = z0 + (float)(i - origin) * dz;
+		k = IMAGE_ROW_INDEX(&v, i);
+		if (image_rowDepthTest(&v, k, currZ, equal, fmt))
+		{
+			image_rowSetColor(&v, k, ds->color.c[0], ds->color.c[1], ds->color.c[2]);
+		}
 	}
+}
+
+/*
+	Span kernel for ShadeDepth: a z-test and a store of the DrawState color
+	scaled by the depth of the pixel.
+ */
+static inline __attribute__((always_inline)) void spanDepth(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l, ImageDepth fmt)
+{
+	ImageRow v;
+	float sc[3];
+	float z0, dz, currZ, depth;
+	int i, k, start, end, origin;
+	int equal = ds->zCompare == ZCompareEqual;
 
-	return (edges);
+	image_row(src, scan, &v);
+
+	// for test8a the color is just (depth, depth, depth)
+	// For cubism/all other depth scaling
+	for (i = 0; i < 3; i++)
+	{
+		sc[i] = 1.4f * ds->color.c[i];
+	}
+
+	dz = (p2->zIntersect - p1->zIntersect) / (p2->xIntersect - p1->xIntersect);
+	origin = spanColumns(et, p1, p2, &start, &end);
+	z0 = p1->zIntersect;
+
+	for (i = start; i < end; i++)
+	{
+		currZ = z0 + (float)(i - origin) * dz;
+		k = IMAGE_ROW_INDEX(&v, i);
+		if (image_rowDepthTest(&v, k, currZ, equal, fmt))
+		{
+			depth = 1.0f - 1.0f / currZ;
+			image_rowSetColor(&v, k, clampChannel(sc[0] * depth), clampChannel(sc[1] * depth), clampChannel(sc[2] * depth));
+		}
+	}
+}
+
+/*
+	Span kernel for ShadeGouraud: interpolates z and the vertex colors,
+	both divided by z, and recovers the color at each pixel.
+ */
+static inline __attribute__((always_inline)) void spanGouraud(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l, ImageDepth fmt)
+{
+	ImageRow v;
+	float z0, dz, dx, t, currZ;
+	Color dc;
+	int i, j, k, start, end, origin;
+	int equal = ds->zCompare == ZCompareEqual;
+
+	image_row(src, scan, &v);
+
+	dx = p2->xIntersect - p1->xIntersect;
+	dz = (p2->zIntersect - p1->zIntersect) / dx;
+	for (j = 0; j < 3; j++)
+	{
+		dc.c[j] = clampChannel((p2->cIntersect.c[j] - p1->cIntersect.c[j]) / dx);
+	}
+	origin = spanColumns(et, p1, p2, &start, &end);
+	z0 = p1->zIntersect;
+
+	for (i = start; i < end; i++)
+	{
+		t = (float)(i - origin);
+		currZ = z0 + t * dz;
+		k = IMAGE_ROW_INDEX(&v, i);
+		if (image_rowDepthTest(&v, k, currZ, equal, fmt))
+		{
+			image_rowSetColor(&v, k, clampChannel((p1->cIntersect.c[0] + t * dc.c[0]) / currZ),
+							  clampChannel((p1->cIntersect.c[1] + t * dc.c[1]) / currZ),
+							  clampChannel((p1->cIntersect.c[2] + t * dc.c[2]) / currZ));
+		}
+	}
+}
+
+/*
+	Span kernel for ShadePhong: interpolates z, the surface normal, and the
+	3D point, and calls the lighting model at every pixel that passes the
+	z-test.
+ */
+static inline __attribute__((always_inline)) void spanPhong(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l, ImageDepth fmt)
+{
+	ImageRow v;
+	float z0, dz, dx, currZ;
+	double t;
+	Color tc;
+	Point tp, dp;
+	Vector tn, dn, V;
+	int i, j, start, end, origin;
+	int equal = ds->zCompare == ZCompareEqual;
+
+	image_row(src, scan, &v);
+
+	dx = p2->xIntersect - p1->xIntersect;
+	dz = (p2->zIntersect - p1->zIntersect) / dx;
+	for (j = 0; j < 3; j++)
+	{
+		dp.val[j] = (p2->pIntersect.val[j] - p1->pIntersect.val[j]) / dx;
+		dn.val[j] = (p2->nIntersect.val[j] - p1->nIntersect.val[j]) / dx;
+	}
+	origin = spanColumns(et, p1, p2, &start, &end);
+	z0 = p1->zIntersect;
+	tp.val[3] = 1.0;
+	tn.val[3] = 0.0;
+
+	for (i = start; i < end; i++)
+	{
+		currZ = z0 + (float)(i - origin) * dz;
+		if (image_rowDepthTest(&v, IMAGE_ROW_INDEX(&v, i), currZ, equal, fmt))
+		{
+			t = i - origin;
+			for (j = 0; j < 3; j++)
+			{
+				tn.val[j] = (p1->nIntersect.val[j] + t * dn.val[j]) / currZ;
+				tp.val[j] = (p1->pIntersect.val[j] + t * dp.val[j]) / currZ;
+			}
+
+			vector_setPoints(&V, &tp, &(ds->viewer)); // Get view vector from the ds
+			vector_normalize(&V);
+			vector_normalize(&tn);
+			lighting_shading(l, &tn, &V, &tp, &ds->body, &ds->surface, ds->surfaceCoeff, p1->oneSided, &tc);
+
+			image_setColor(src, scan, i, tc);
+		}
+	}
+}
+
+/*
+	Span kernel for deferred ShadePhong: interpolates z, the surface normal,
+	and the 3D point like spanPhong, but stores them and the material into
+	the G-buffer instead of lighting the pixel. lighting_shadeGBuffer lights
+	each visible pixel once afterwards.
+ */
+static inline __attribute__((always_inline)) void spanGBuffer(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l, ImageDepth fmt)
+{
+	GBuffer *gb = src->gbuffer;
+	int base = scan * src->cols;
+	ImageRow v;
+	float z0, dz, dx, currZ;
+	float *gn, *gp;
+	double t;
+	Point dp;
+	Vector dn;
+	int i, j, start, end, origin;
+	int equal = ds->zCompare == ZCompareEqual;
+
+	image_row(src, scan, &v);
+
+	dx = p2->xIntersect - p1->xIntersect;
+	dz = (p2->zIntersect - p1->zIntersect) / dx;
+	for (j = 0; j < 3; j++)
+	{
+		dp.val[j] = (p2->pIntersect.val[j] - p1->pIntersect.val[j]) / dx;
+		dn.val[j] = (p2->nIntersect.val[j] - p1->nIntersect.val[j]) / dx;
+	}
+	origin = spanColumns(et, p1, p2, &start, &end);
+	z0 = p1->zIntersect;
+
+	for (i = start; i < end; i++)
+	{
+		currZ = z0 + (float)(i - origin) * dz;
+		if (image_rowDepthTest(&v, IMAGE_ROW_INDEX(&v, i), currZ, equal, fmt))
+		{
+			t = i - origin;
+			gn = &(gb->normal[3 * (base + i)]);
+			gp = &(gb->position[3 * (base + i)]);
+			for (j = 0; j < 3; j++)
+			{
+				gn[j] = (p1->nIntersect.val[j] + t * dn.val[j]) / currZ;
+				gp[j] = (p1->pIntersect.val[j] + t * dp.val[j]) / currZ;
+			}
+			gb->material[base + i] = p1->material;
+			gb->z[base + i] = image_depthRound(fmt, currZ);
+		}
+	}
+}
+
+SPAN_DEPTH_VARIANTS(spanZOnly)
+SPAN_DEPTH_VARIANTS(spanConstant)
+SPAN_DEPTH_VARIANTS(spanDepth)
+SPAN_DEPTH_VARIANTS(spanGouraud)
+SPAN_DEPTH_VARIANTS(spanPhong)
+SPAN_DEPTH_VARIANTS(spanGBuffer)
+
+#if SCANLINE_SIMD
+/*
+	SIMD versions of the Gouraud and depth kernels. They use the same
+	p1 + (i - origin) * delta form as the scalar kernels, so each lane
+	computes exactly what the scalar code would. Pixels that pass the z-test
+	are found with a vector compare; z is written with a masked store and
+	the colors are scattered into the FPixel row one passing pixel at a
+	time. The leftover columns after the last whole vector run through a
+	scalar tail.
+ */
+
+/*
+	Span setup shared by the SIMD kernels. Fills in the clipped columns,
+	the per-column z delta, and, when dc is not NULL, the per-column
+	Gouraud color delta. Returns the origin column of the span.
+ */
+static int spanSetupSIMD(EdgeTable *et, Edge *p1, Edge *p2, int *start, int *end, float *dz, Color *dc)
+{
+	float dx = p2->xIntersect - p1->xIntersect;
+	int j;
+
+	*dz = (p2->zIntersect - p1->zIntersect) / dx;
+	if (dc)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			dc->c[j] = clampChannel((p2->cIntersect.c[j] - p1->cIntersect.c[j]) / dx);
+		}
+	}
+	return (spanColumns(et, p1, p2, start, end));
+}
+
+/*
+	Writes the colors of the pixels whose bit is set in mask, starting at
+	column i of the row.
+ */
+static inline void spanScatter(FPixel *row, int i, int mask, float *r, float *g, float *b)
+{
+	int j;
+
+	for (j = 0; mask; j++, mask >>= 1)
+	{
+		if (mask & 1)
+		{
+			row[i + j].rgb[0] = r[j];
+			row[i + j].rgb[1] = g[j];
+			row[i + j].rgb[2] = b[j];
+		}
+	}
+}
+
+/*
+	Scalar tail shared by the SIMD Gouraud kernels.
+ */
+static void spanGouraudTail(FPixel *row, float *zrow, int origin, int i, int end, float z0, float dz, Color *c0, Color *dc)
+{
+	float z, t;
+
+	for (; i < end; i++)
+	{
+		t = (float)(i - origin);
+		z = z0 + t * dz;
+		if (z > zrow[i])
+		{
+			row[i].rgb[0] = clampChannel((c0->c[0] + t * dc->c[0]) / z);
+			row[i].rgb[1] = clampChannel((c0->c[1] + t * dc->c[1]) / z);
+			row[i].rgb[2] = clampChannel((c0->c[2] + t * dc->c[2]) / z);
+			zrow[i] = z;
+		}
+	}
+}
+
+/*
+	Scalar tail shared by the SIMD depth kernels.
+ */
+static void spanDepthTail(FPixel *row, float *zrow, int origin, int i, int end, float z0, float dz, float *sc)
+{
+	float z, depth;
+
+	for (; i < end; i++)
+	{
+		z = z0 + (float)(i - origin) * dz;
+		if (z > zrow[i])
+		{
+			depth = 1.0f - 1.0f / z;
+			row[i].rgb[0] = clampChannel(sc[0] * depth);
+			row[i].rgb[1] = clampChannel(sc[1] * depth);
+			row[i].rgb[2] = clampChannel(sc[2] * depth);
+			zrow[i] = z;
+		}
+	}
+}
+
+/*
+	Gouraud span kernel, 4 columns per iteration with SSE.
+ */
+__attribute__((target("sse2"))) static void spanGouraudSSE(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l)
+{
+	FPixel *row = src->data[scan];
+	float *zrow = &(src->z[scan * src->cols]);
+	float z0, dz, r[4], g[4], b[4];
+	Color c0, dc;
+	int i, start, end, origin, mask;
+	__m128 lane, t, z, vz0, vdz, cr, cg, cb, zero, one;
+
+	origin = spanSetupSIMD(et, p1, p2, &start, &end, &dz, &dc);
+	z0 = p1->zIntersect;
+	c0 = p1->cIntersect;
+	lane = _mm_set_ps(3, 2, 1, 0);
+	vz0 = _mm_set1_ps(z0);
+	vdz = _mm_set1_ps(dz);
+	zero = _mm_setzero_ps();
+	one = _mm_set1_ps(1.0f);
+
+	for (i = start; i + 4 <= end; i += 4)
+	{
+		t = _mm_add_ps(_mm_set1_ps((float)(i - origin)), lane);
+		z = _mm_add_ps(vz0, _mm_mul_ps(t, vdz));
+		mask = _mm_movemask_ps(_mm_cmpgt_ps(z, _mm_loadu_ps(zrow + i)));
+		if (!mask)
+			continue;
+
+		cr = _mm_add_ps(_mm_set1_ps(c0.c[0]), _mm_mul_ps(t, _mm_set1_ps(dc.c[0])));
+		cg = _mm_add_ps(_mm_set1_ps(c0.c[1]), _mm_mul_ps(t, _mm_set1_ps(dc.c[1])));
+		cb = _mm_add_ps(_mm_set1_ps(c0.c[2]), _mm_mul_ps(t, _mm_set1_ps(dc.c[2])));
+		_mm_storeu_ps(r, _mm_min_ps(_mm_max_ps(_mm_div_ps(cr, z), zero), one));
+		_mm_storeu_ps(g, _mm_min_ps(_mm_max_ps(_mm_div_ps(cg, z), zero), one));
+		_mm_storeu_ps(b, _mm_min_ps(_mm_max_ps(_mm_div_ps(cb, z), zero), one));
+		spanScatter(row, i, mask, r, g, b);
+
+		// blend the new depths into the row where the test passed
+		_mm_storeu_ps(zrow + i, _mm_max_ps(z, _mm_loadu_ps(zrow + i)));
+	}
+	spanGouraudTail(row, zrow, origin, i, end, z0, dz, &c0, &dc);
+}
+
+/*
+	Gouraud span kernel, 8 columns per iteration with AVX2.
+ */
+__attribute__((target("avx2"))) static void spanGouraudAVX2(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l)
+{
+	FPixel *row = src->data[scan];
+	float *zrow = &(src->z[scan * src->cols]);
+	float z0, dz, r[8], g[8], b[8];
+	Color c0, dc;
+	int i, start, end, origin, mask;
+	__m256 lane, t, z, pass, vz0, vdz, cr, cg, cb, zero, one;
+
+	origin = spanSetupSIMD(et, p1, p2, &start, &end, &dz, &dc);
+	z0 = p1->zIntersect;
+	c0 = p1->cIntersect;
+	lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	vz0 = _mm256_set1_ps(z0);
+	vdz = _mm256_set1_ps(dz);
+	zero = _mm256_setzero_ps();
+	one = _mm256_set1_ps(1.0f);
+
+	for (i = start; i + 8 <= end; i += 8)
+	{
+		t = _mm256_add_ps(_mm256_set1_ps((float)(i - origin)), lane);
+		z = _mm256_add_ps(vz0, _mm256_mul_ps(t, vdz));
+		pass = _mm256_cmp_ps(z, _mm256_loadu_ps(zrow + i), _CMP_GT_OQ);
+		mask = _mm256_movemask_ps(pass);
+		if (!mask)
+			continue;
+
+		cr = _mm256_add_ps(_mm256_set1_ps(c0.c[0]), _mm256_mul_ps(t, _mm256_set1_ps(dc.c[0])));
+		cg = _mm256_add_ps(_mm256_set1_ps(c0.c[1]), _mm256_mul_ps(t, _mm256_set1_ps(dc.c[1])));
+		cb = _mm256_add_ps(_mm256_set1_ps(c0.c[2]), _mm256_mul_ps(t, _mm256_set1_ps(dc.c[2])));
+		_mm256_storeu_ps(r, _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(cr, z), zero), one));
+		_mm256_storeu_ps(g, _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(cg, z), zero), one));
+		_mm256_storeu_ps(b, _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(cb, z), zero), one));
+		spanScatter(row, i, mask, r, g, b);
+
+		_mm256_maskstore_ps(zrow + i, _mm256_castps_si256(pass), z);
+	}
+	// clear the upper halves so the scalar code after this avoids the
+	// AVX to SSE transition penalty
+	_mm256_zeroupper();
+	spanGouraudTail(row, zrow, origin, i, end, z0, dz, &c0, &dc);
+}
+
+/*
+	Depth span kernel, 4 columns per iteration with SSE.
+ */
+__attribute__((target("sse2"))) static void spanDepthSSE(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l)
+{
+	FPixel *row = src->data[scan];
+	float *zrow = &(src->z[scan * src->cols]);
+	float z0, dz, sc[3], r[4], g[4], b[4];
+	int i, start, end, origin, mask;
+	__m128 lane, t, z, depth, vz0, vdz, zero, one;
+
+	origin = spanSetupSIMD(et, p1, p2, &start, &end, &dz, NULL);
+	z0 = p1->zIntersect;
+	for (i = 0; i < 3; i++)
+	{
+		sc[i] = 1.4f * ds->color.c[i];
+	}
+	lane = _mm_set_ps(3, 2, 1, 0);
+	vz0 = _mm_set1_ps(z0);
+	vdz = _mm_set1_ps(dz);
+	zero = _mm_setzero_ps();
+	one = _mm_set1_ps(1.0f);
+
+	for (i = start; i + 4 <= end; i += 4)
+	{
+		t = _mm_add_ps(_mm_set1_ps((float)(i - origin)), lane);
+		z = _mm_add_ps(vz0, _mm_mul_ps(t, vdz));
+		mask = _mm_movemask_ps(_mm_cmpgt_ps(z, _mm_loadu_ps(zrow + i)));
+		if (!mask)
+			continue;
+
+		depth = _mm_sub_ps(one, _mm_div_ps(one, z));
+		_mm_storeu_ps(r, _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_set1_ps(sc[0]), depth), zero), one));
+		_mm_storeu_ps(g, _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_set1_ps(sc[1]), depth), zero), one));
+		_mm_storeu_ps(b, _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_set1_ps(sc[2]), depth), zero), one));
+		spanScatter(row, i, mask, r, g, b);
+
+		_mm_storeu_ps(zrow + i, _mm_max_ps(z, _mm_loadu_ps(zrow + i)));
+	}
+	spanDepthTail(row, zrow, origin, i, end, z0, dz, sc);
+}
+
+/*
+	Depth span kernel, 8 columns per iteration with AVX2.
+ */
+__attribute__((target("avx2"))) static void spanDepthAVX2(int scan, EdgeTable *et, Edge *p1, Edge *p2, Image *src, DrawState *ds, Lighting *l)
+{
+	FPixel *row = src->data[scan];
+	float *zrow = &(src->z[scan * src->cols]);
+	float z0, dz, sc[3], r[8], g[8], b[8];
+	int i, start, end, origin, mask;
+	__m256 lane, t, z, pass, depth, vz0, vdz, zero, one;
+
+	origin = spanSetupSIMD(et, p1, p2, &start, &end, &dz, NULL);
+	z0 = p1->zIntersect;
+	for (i = 0; i < 3; i++)
+	{
+		sc[i] = 1.4f * ds->color.c[i];
+	}
+	lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+	vz0 = _mm256_set1_ps(z0);
+	vdz = _mm256_set1_ps(dz);
+	zero = _mm256_setzero_ps();
+	one = _mm256_set1_ps(1.0f);
+
+	for (i = start; i + 8 <= end; i += 8)
+	{
+		t = _mm256_add_ps(_mm256_set1_ps((float)(i - origin)), lane);
+		z = _mm256_add_ps(vz0, _mm256_mul_ps(t, vdz));
+		pass = _mm256_cmp_ps(z, _mm256_loadu_ps(zrow + i), _CMP_GT_OQ);
+		mask = _mm256_movemask_ps(pass);
+		if (!mask)
+			continue;
+
+		depth = _mm256_sub_ps(one, _mm256_div_ps(one, z));
+		_mm256_storeu_ps(r, _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_set1_ps(sc[0]), depth), zero), one));
+		_mm256_storeu_ps(g, _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_set1_ps(sc[1]), depth), zero), one));
+		_mm256_storeu_ps(b, _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_set1_ps(sc[2]), depth), zero), one));
+		spanScatter(row, i, mask, r, g, b);
+
+		_mm256_maskstore_ps(zrow + i, _mm256_castps_si256(pass), z);
+	}
+	// clear the upper halves so the scalar code after this avoids the
+	// AVX to SSE transition penalty
+	_mm256_zeroupper();
+	spanDepthTail(row, zrow, origin, i, end, z0, dz, sc);
+}
+#endif // SCANLINE_SIMD
+
+/*
+	Which SIMD kernels to use: -1 until the CPU has been checked, then 0 for
+	scalar only, 1 for SSE, or 2 for AVX2.
+ */
+static int spanSIMD = -1;
+
+/*
+	Whether polygon_drawShadeClip sends triangles to the half-space
+	rasterizer in Triangle.c instead of the scanline fill.
+ */
+static int triangleFill = 0;
+
+/*
+	Returns the widest SIMD level the CPU supports, or 0 if none.
+ */
+static int detectSIMD(void)
+{
+#if SCANLINE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return (2);
+	if (__builtin_cpu_supports("sse2"))
+		return (1);
+#endif
+	return (0);
+}
+
+/*
+	Turns the SIMD span kernels on (non-zero, the default) or off (0). The
+	kernels are only used when the CPU supports them; otherwise the scalar
+	kernels are used either way.
+ */
+void polygon_setSIMD(int flag)
+{
+	__atomic_store_n(&spanSIMD, flag ? detectSIMD() : 0, __ATOMIC_RELAXED);
+}
+
+/*
+	Turns the half-space triangle rasterizer on (non-zero) or off (0, the
+	default). When it is on, three-vertex polygons drawn with
+	polygon_drawShade, polygon_drawFill, or through module_draw go to
+	polygon_drawTriangle; other polygons still use the scanline fill.
+ */
+void polygon_setTriangleFill(int flag)
+{
+	__atomic_store_n(&triangleFill, flag != 0, __ATOMIC_RELAXED);
+}
+
+/*
+	Turns fixed point rasterization on (non-zero) or off (0, the default).
+	With it on, both the scanline fill and polygon_drawTriangle snap the
+	vertices to 1/16 of a pixel and use a top-left fill rule: a pixel whose
+	center is exactly on an edge is drawn only by the polygon to the right
+	of or below that edge. Polygons that share edges then cover every pixel
+	between them exactly once, with no cracks and no double hits.
+ */
+void polygon_setFixedPoint(int flag)
+{
+	__atomic_store_n(&fixedPoint, flag != 0, __ATOMIC_RELAXED);
+}
+
+/*
+	Returns 1 if fixed point rasterization is on, 0 if not.
+ */
+int polygon_getFixedPoint(void)
+{
+	return (__atomic_load_n(&fixedPoint, __ATOMIC_RELAXED));
+}
+
+/*
+	Picks the span kernel for the DrawState shade method.
+ */
+static SpanFunc selectSpan(DrawState *ds, Lighting *l, Image *src)
+{
+	// the tile workers can get here at the same time, so the lazy check
+	// is done with atomic loads and stores
+	int simd = __atomic_load_n(&spanSIMD, __ATOMIC_RELAXED);
+
+	if (simd < 0)
+	{
+		simd = detectSIMD();
+		__atomic_store_n(&spanSIMD, simd, __ATOMIC_RELAXED);
+	}
+
+	// a depth pre-pass only needs z, and the equality pass after it runs
+	// the scalar kernels, which test for equality
+	if (ds->zCompare == ZCompareDepthOnly)
+		return (spanZOnlyFormats[src->depth]);
+	if (ds->zCompare == ZCompareEqual)
+		simd = 0;
+	// the SIMD kernels load and scatter FPixel rows and float depth directly
+	if (src->layout != ImageLayoutRows || src->depth != ImageDepthFloat || src->color != ImageColorFloat)
+		simd = 0;
+
+	switch (ds->shade)
+	{
+	case ShadeDepth:
+#if SCANLINE_SIMD
+		if (simd == 2)
+			return (spanDepthAVX2);
+		if (simd == 1)
+			return (spanDepthSSE);
+#endif
+		return (spanDepthFormats[src->depth]);
+	case ShadeGouraud:
+#if SCANLINE_SIMD
+		if (simd == 2)
+			return (spanGouraudAVX2);
+		if (simd == 1)
+			return (spanGouraudSSE);
+#endif
+		return (spanGouraudFormats[src->depth]);
+	case ShadePhong:
+		if (ds->deferred && src->gbuffer && src->gbuffer->active)
+			return (spanGBufferFormats[src->depth]);
+		if (!l)
+		{
+			fprintf(stderr, "Invalid lighting pointer sent to fillScan\n");
+			exit(-1);
+		}
+		return (spanPhongFormats[src->depth]);
+	default:
+		return (spanConstantFormats[src->depth]);
+	}
 }
 
 /*
 	Draw one scanline of a polygon given the scanline, the active edges,
-	a DrawState, the image, and some Lights (for Phong shading only).
+	the span kernel, a DrawState, the image, and some Lights (for Phong
+	shading only).
  */
-static void fillScan(int scan, LinkedList *active, Image *src, Color c, DrawState *ds, Lighting *l)
+static void fillScan(int scan, EdgeTable *et, Image *src, SpanFunc span, DrawState *ds, Lighting *l)
 {
+	float *hiz = &(src->hiz.z[(scan >> HIZ_SHIFT) * src->hiz.cols]);
 	Edge *p1, *p2;
-	int i, j, start, end;
-	float currZ, dzPerCol;
-	Color tc, currColor, dcPerCol;
-	Point tp, currPoint, dpPerCol;
-	Vector tn, currNorm, dnPerCol, V;
+	float dz, zs, ze;
+	int k, t, start, end, origin;
 
-	// loop over the list
-	p1 = ll_head(active);
-	while (p1)
+	// loop over the active edges
+	for (k = 0; k < et->nActive; k += 2)
 	{
 		// the edges have to come in pairs, draw from one to the next
-		p2 = ll_next(active);
-		if (!p2)
+		p1 = et->active[k];
+		if (k + 1 >= et->nActive)
 		{
 			// printf("bad bad bad (your edges are not coming in pairs)\n");
 			break;
 		}
-		currZ = p1->zIntersect;
-		dzPerCol = (p2->zIntersect - p1->zIntersect) / (p2->xIntersect - p1->xIntersect);
-
-		color_copy(&currColor, &p1->cIntersect);
-		color_set(&dcPerCol,
-				  (p2->cIntersect.c[0] - p1->cIntersect.c[0]) / (p2->xIntersect - p1->xIntersect),
-				  (p2->cIntersect.c[1] - p1->cIntersect.c[1]) / (p2->xIntersect - p1->xIntersect),
-				  (p2->cIntersect.c[2] - p1->cIntersect.c[2]) / (p2->xIntersect - p1->xIntersect));
-
-		// tp = p1->pIntersect;
-		point_copy(&currPoint, &(p1->pIntersect));
-		// tn = p1->nIntersect;
-		vector_copy(&currNorm, &(p1->nIntersect));
-		for (j = 0; j < 3; j++)
-		{
-			dpPerCol.val[j] = (p2->pIntersect.val[j] - p1->pIntersect.val[j]) / (p2->xIntersect - p1->xIntersect);
-			dnPerCol.val[j] = (p2->nIntersect.val[j] - p1->nIntersect.val[j]) / (p2->xIntersect - p1->xIntersect);
-		}
+		p2 = et->active[k + 1];
 
 		// if the xIntersect values are the same, don't draw anything.
 		// Just go to the next pair.
 		if (p2->xIntersect == p1->xIntersect)
 		{
-			p1 = ll_next(active);
 			continue;
 		}
 
-		/**** Your code goes here ****/
-		// identify the starting column
-		start = (int)(p1->xIntersect + .5);
-		// clip to the left side of the image
-		if (start < 0)
+		// skip the span if its nearest z, found the same way the kernels
+		// compute z, is behind the farthest z of every HiZ tile it crosses
+		origin = spanColumns(et, p1, p2, &start, &end);
+		if (start >= end)
 		{
-			currZ += (0 - start) * dzPerCol;
-			for (j = 0; j < 3; j++)
-			{
-				currColor.c[j] += (0 - start) * dcPerCol.c[j];
-				currPoint.val[j] += (0 - start) * dpPerCol.val[j];
-				currNorm.val[j] += (0 - start) * dnPerCol.val[j];
-			}
-			// currNorm.val[3] += (0 - start) * dnPerCol.val[3];
-			start = 0;
-		}
-		// identify the ending column
-		end = (int)(p2->xIntersect + .5);
-		// clip to the right side of the image
-		if (end > src->cols)
-		{
-			end = src->cols;
+			continue;
 		}
-		// loop from start to end and color in the pixels
-		for (i = start; i < end; i++)
+		dz = (p2->zIntersect - p1->zIntersect) / (p2->xIntersect - p1->xIntersect);
+		zs = p1->zIntersect + (float)(start - origin) * dz;
+		ze = p1->zIntersect + (float)(end - 1 - origin) * dz;
+		zs = ze > zs ? ze : zs;
+		for (t = start >> HIZ_SHIFT; t <= (end - 1) >> HIZ_SHIFT && hiz[t] > zs; t++)
+			;
+		if (t > (end - 1) >> HIZ_SHIFT)
 		{
-			if (currZ > image_getz(src, scan, i))
-			{
-				// printf("currZ was higher\n");
-				if (ds->shade == ShadeConstant)
-				{
-					image_setColor(src, scan, i, ds->color);
-				}
-				else if (ds->shade == ShadeDepth)
-				{
-					float scale = 1.4;
-					float depth = 1.0 - (1.0 / currZ);
-					color_copy(&tc, &(ds->color));
-					// for test8a
-					// color_set(&tc, depth, depth, depth);
-					// For cubism/all other depth scaling
-					color_set(&tc, scale * (ds->color.c[0] * depth), scale * (ds->color.c[1] * depth), scale * (ds->color.c[2] * depth));
-					image_setColor(src, scan, i, tc);
-				}
-				else if (ds->shade == ShadeGouraud)
-				{
-					color_set(&tc, currColor.c[0] / (currZ), currColor.c[1] / (currZ), currColor.c[2] / (currZ));
-					// printf("Drawing Gouraud shading, color: (%.5f, %.5f, %.5f)\n", tc.c[0], tc.c[1], tc.c[2]);
-					image_setColor(src, scan, i, tc);
-				}
-				else if (ds->shade == ShadePhong)
-				{
-					if (!l)
-					{
-						fprintf(stderr, "Invalid lighting pointer sent to fillScan\n");
-						exit(-1);
-					}
-					// color_set(&tc, currColor.c[0] / (currZ), currColor.c[1] / (currZ), currColor.c[2] / (currZ));
-					for (j = 0; j < 3; j++)
-					{
-						tn.val[j] = currNorm.val[j] / currZ;
-						tp.val[j] = currPoint.val[j] / currZ;
-					}
-					// tn.val[3] = currNorm.val[3] / currZ;
-
-					vector_setPoints(&V, &tp, &(ds->viewer)); // Get view vector from the ds
-					vector_normalize(&V);
-					// DEBUG
-					// printf("View is at: ");
-					// point_print(&ds->viewer, stdout);
-					// printf("View vector: ");
-					// vector_print(&V, stdout);
-					// printf("Normal is at: ");
-					// vector_print(&tn, stdout);
-
-					vector_normalize(&tn);
-					lighting_shading(l, &tn, &V, &tp, &ds->body, &ds->surface, ds->surfaceCoeff, p1->oneSided, &tc);
-
-					image_setColor(src, scan, i, tc);
-				}
-				else
-				{
-					image_setColor(src, scan, i, ds->color);
-				}
-				image_setz(src, scan, i, currZ);
-			}
-			// Increment the color and z
-			currZ += dzPerCol;
-			for (j = 0; j < 3; j++)
-			{
-				currColor.c[j] += dcPerCol.c[j];
-				currNorm.val[j] += dnPerCol.val[j];
-				currPoint.val[j] += dpPerCol.val[j];
-			}
-			// printf("Filled in the color at pixel %d, %d\n", scan, i);
+			continue;
 		}
-		// move ahead to the next pair of edges
-		p1 = ll_next(active);
+
+		span(scan, et, p1, p2, src, ds, l);
+		image_hizMark(src, scan, start, end);
 	}
 }
 
 /*
-	 Process the edge list, asmes the edges list has at least one entry
+	 Process the edge table, assumes the table has at least one entry
 */
-static int processEdgeList(LinkedList *edges, Image *src, DrawState *ds, Lighting *light)
+static int processEdgeList(EdgeTable *et, Image *src, DrawState *ds, Lighting *light)
 {
-	LinkedList *active = NULL;
-	LinkedList *tmplist = NULL;
-	LinkedList *transfer = NULL;
-	Edge *current;
+	SpanFunc span = selectSpan(ds, light, src);
 	Edge *tedge;
 	int scan = 0;
-
-	active = ll_new();
-	tmplist = ll_new();
-
-	// get a pointer to the first item on the list and reset the current pointer
-	current = ll_head(edges);
-
-	// start at the first scanline and go until the active list is empty
-	for (scan = current->yStart; scan < src->rows; scan++)
+	int i, n;
+
+	// start at the first scanline and go until the active table is empty.
+	// A fill clipped below the top of the polygon puts the edges that cross
+	// its first row straight on that row, with the same values a full-image
+	// fill reaches there, instead of stepping them down to it.
+	scan = et->yMin;
+	if (et->clipY0 > scan)
+	{
+		for (i = 0; i < et->nEdges; i++)
+		{
+			tedge = &(et->edges[i]);
+			if (tedge->yStart < et->clipY0 && tedge->yEnd >= et->clipY0)
+			{
+				if (et->fixed)
+				{
+					edgeJumpFixed(tedge, et->clipY0);
+				}
+				edgeAt(tedge, et->clipY0, et->fixed);
+				activeInsert(et, tedge);
+			}
+		}
+		scan = et->clipY0;
+	}
+	for (; scan < et->clipY1; scan++)
 	{
 
 		// grab all edges starting on this row
-		while (current != NULL && current->yStart == scan)
+		if (scan - et->yMin < et->nBuckets)
 		{
-			ll_insert(active, current, compXIntersect);
-			current = ll_next(edges);
+			for (i = et->bucket[scan - et->yMin]; i >= 0; i = et->edges[i].next)
+			{
+				activeInsert(et, &(et->edges[i]));
+			}
 		}
-		// current is either null, or the first edge to be handled on some future scanline
 
-		if (ll_empty(active))
+		if (et->nActive == 0)
 		{
 			break;
 		}
 
 		// if there are active edges
 		// fill out the scanline
-		fillScan(scan, active, src, ds->color, ds, light);
+		fillScan(scan, et, src, span, ds, light);
 
 		// remove any ending edges and update the rest
-		for (tedge = ll_pop(active); tedge != NULL; tedge = ll_pop(active))
+		n = 0;
+		for (i = 0; i < et->nActive; i++)
 		{
+			tedge = et->active[i];
 
 			// keep anything that's not ending
 			if (tedge->yEnd > scan)
 			{
-				float a = 1.0;
-
-				// update the edge information with the dPerScan values
-				tedge->xIntersect += tedge->dxPerScan;
-				tedge->zIntersect += tedge->dzPerScan;
-				for (int i = 0; i < 3; i++)
+				// move the edge to the next scanline. A fixed point edge
+				// steps its exact x and carries the remainder.
+				if (et->fixed)
 				{
-					tedge->cIntersect.c[i] += tedge->dcPerScan.c[i];
-					tedge->nIntersect.val[i] += tedge->dnPerScan.val[i];
-				}
-				tedge->pIntersect.val[0] += tedge->dpPerScan.val[0];
-				tedge->pIntersect.val[1] += tedge->dpPerScan.val[1];
-				tedge->pIntersect.val[2] += tedge->dzPerScan;
-
-				tedge->nIntersect.val[3] += tedge->dzPerScan;
-				// adjust in the case of partial overlap
-				if (tedge->dxPerScan < 0.0 && tedge->xIntersect < tedge->x1)
-				{
-					a = (tedge->xIntersect - tedge->x1) / tedge->dxPerScan;
-					tedge->xIntersect = tedge->x1;
-					tedge->zIntersect = tedge->z1;
-				}
-				else if (tedge->dxPerScan > 0.0 && tedge->xIntersect > tedge->x1)
-				{
-					a = (tedge->xIntersect - tedge->x1) / tedge->dxPerScan;
-					tedge->xIntersect = tedge->x1;
-					tedge->zIntersect = tedge->z1;
+					tedge->xq += tedge->xStepQ;
+					tedge->xr += tedge->xStepR;
+					if (tedge->xr >= tedge->xDen)
+					{
+						tedge->xr -= tedge->xDen;
+						tedge->xq++;
+					}
+					edgeColumnFixed(tedge);
 				}
+				edgeAt(tedge, scan + 1, et->fixed);
 
-				ll_insert(tmplist, tedge, compXIntersect);
+				et->active[n++] = tedge;
 			}
 		}
+		et->nActive = n;
 
-		transfer = active;
-		active = tmplist;
-		tmplist = transfer;
+		// the update can swap edges that cross, so restore the x order
+		activeSort(et);
 	}
 
-	// get rid of the lists, but not the edge records
-	ll_delete(active, NULL);
-	ll_delete(tmplist, NULL);
-
 	return (0);
 }
 
@@ -525,8 +1490,10 @@ static int processEdgeList(LinkedList *edges, Image *src, DrawState *ds, Lightin
 void polygon_drawFill(Polygon *p, Image *src, Color c)
 {
 	DrawState ds;
+	drawstate_init(&ds);
 	drawstate_setColor(&ds, c);
 	ds.shade = ShadeConstant;
+	ds.zCompare = ZCompareGreater;
 	polygon_drawShade(p, src, &ds, NULL);
 }
 
@@ -535,15 +1502,16 @@ void polygon_drawFill(Polygon *p, Image *src, Color c)
  */
 void polygon_drawShade(Polygon *p, Image *src, DrawState *ds, Lighting *light)
 {
+	int material = -1;
+
 	if (!p || !src || !ds)
 	{
 		fprintf(stderr, "Invalid pointer sent to polygon_drawShade\n");
 		exit(-1);
 	}
-	LinkedList *edges = NULL;
-
-	// Add the colors to the polygon
-	if (ds->shade != ShadeGouraud)
+	// Add the colors to the polygon. A depth-only pass skips the Gouraud
+	// lighting, so its polygons get colors here too.
+	if (ds->shade != ShadeGouraud || ds->zCompare == ZCompareDepthOnly)
 	{
 		Color tmp[p->nVertex];
 		for (int i = 0; i < p->nVertex; i++)
@@ -553,18 +1521,102 @@ void polygon_drawShade(Polygon *p, Image *src, DrawState *ds, Lighting *light)
 		polygon_setColors(p, p->nVertex, tmp);
 	}
 
-	// set up the edge list
-	edges = setupEdgeList(p, src);
-	if (!edges)
+	// deferred Phong polygons tag their pixels with the current material
+	if (ds->shade == ShadePhong && ds->deferred && src->gbuffer && src->gbuffer->active)
+	{
+		material = image_gbufferMaterial(src, &ds->body, &ds->surface, ds->surfaceCoeff, p->oneSided);
+	}
+
+	polygon_drawShadeClip(p, src, ds, light, 0, 0, src->rows, src->cols, material);
+}
+
+/*
+	Returns 1 if the HiZ says every pixel the polygon could touch inside the
+	clip rectangle is already nearer than the nearest point of the polygon.
+	1/z is linear across the polygon, so its nearest point is a vertex; the
+	small margin covers the rounding of the float interpolation.
+ */
+static int polygonHidden(Polygon *p, Image *src, int r0, int c0, int r1, int c1)
+{
+	double xMin, xMax, yMin, yMax, zinv, z;
+	int i;
+
+	xMin = xMax = p->vertex[0].val[0];
+	yMin = yMax = p->vertex[0].val[1];
+	zinv = -HUGE_VAL;
+	for (i = 0; i < p->nVertex; i++)
+	{
+		xMin = fmin(xMin, p->vertex[i].val[0]);
+		xMax = fmax(xMax, p->vertex[i].val[0]);
+		yMin = fmin(yMin, p->vertex[i].val[1]);
+		yMax = fmax(yMax, p->vertex[i].val[1]);
+		z = 1.0 / p->vertex[i].val[2];
+		if (!isfinite(z))
+			return (0);
+		zinv = fmax(zinv, z);
+	}
+	if (!(xMax - xMin < 1e7 && yMax - yMin < 1e7))
+	{
+		return (0);
+	}
+
+	// widen the box a pixel so it covers every center any fill rule takes
+	r0 = fmax(r0, floor(yMin) - 1);
+	c0 = fmax(c0, floor(xMin) - 1);
+	r1 = fmin(r1, ceil(yMax) + 1);
+	c1 = fmin(c1, ceil(xMax) + 1);
+	if (r0 >= r1 || c0 >= c1)
 	{
+		return (1);
+	}
+	return (image_hizOccluded(src, r0, c0, r1, c1, (float)(zinv + fabs(zinv) * 1e-4)));
+}
+
+/*
+	Fills the part of the polygon that falls in rows [r0, r1) and columns
+	[c0, c1) of the image. The polygon colors must already be set, and
+	material is the G-buffer material for deferred Phong (-1 otherwise).
+	Unlike polygon_drawShade this does not modify the polygon, and each
+	thread uses its own edge table, so different threads can fill the same
+	polygon into disjoint rectangles at once. The pixels written are exactly
+	the ones polygon_drawShade would write inside the rectangle.
+ */
+void polygon_drawShadeClip(Polygon *p, Image *src, DrawState *ds, Lighting *light, int r0, int c0, int r1, int c1, int material)
+{
+	if (!p || !src || !ds)
+	{
+		fprintf(stderr, "Invalid pointer sent to polygon_drawShadeClip\n");
+		exit(-1);
+	}
+
+	r0 = r0 < 0 ? 0 : r0;
+	c0 = c0 < 0 ? 0 : c0;
+	r1 = r1 > src->rows ? src->rows : r1;
+	c1 = c1 > src->cols ? src->cols : c1;
+	if (polygonHidden(p, src, r0, c0, r1, c1))
+	{
+		return;
+	}
+
+	if (p->nVertex == 3 && __atomic_load_n(&triangleFill, __ATOMIC_RELAXED))
+	{
+		polygon_drawTriangle(p, src, ds, light, r0, c0, r1, c1, material);
 		return;
 	}
-	// process the edge list (should be able to take an arbitrary edge list)
-	processEdgeList(edges, src, ds, light);
-	// clean up
-	ll_delete(edges, (void (*)(const void *))free);
 
-	return;
+	scanTable.material = material;
+	scanTable.clipY0 = r0;
+	scanTable.clipX0 = c0;
+	scanTable.clipY1 = r1;
+	scanTable.clipX1 = c1;
+
+	// set up the edge table, it is reused from one polygon to the next
+	if (!setupEdgeList(&scanTable, p, src))
+	{
+		return;
+	}
+	// process the edge table (should be able to take an arbitrary edge table)
+	processEdgeList(&scanTable, src, ds, light);
 }
 
 /****************************************
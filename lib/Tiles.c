@@ -0,0 +1,403 @@
+/**
+ * Tile-binned, multithreaded polygon rasterization for module_draw.
+ *
+ * module_draw hands every transformed polygon to tiles_polygon instead of filling it right away.
+ * The polygon is kept, with a copy of its DrawState, and its index is appended to the bin of
+ * every TILE_SIZE x TILE_SIZE tile its bounding box touches. tiles_flush then fills the tiles on
+ * a pool of worker threads. A tile only ever belongs to one thread, and it fills its polygons in
+ * the order they were submitted, so the z-test sees exactly the same sequence at every pixel as
+ * it would drawing one polygon at a time.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "Tiles.h"
+
+/*
+ * The worker pool is shared by every TileRenderer. Threads are started the first time they are
+ * needed and then wait on poolWake between flushes. Only one flush runs at a time.
+ */
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+static int poolSize = 0;              // worker threads started so far
+static unsigned poolGeneration = 0;   // bumped once per flush to wake the workers
+static int poolWanted = 0;            // workers taking part in the current flush
+static int poolBusy = 0;              // workers still filling tiles for the current flush
+static TileRenderer *poolJob = NULL;  // the renderer being flushed
+static int poolNextTile = 0;          // next tile index to hand out
+
+/**
+ * Fills every tile of the renderer that has not been claimed yet. Called by the workers and by
+ * the thread that called tiles_flush.
+ *
+ * @param tr Pointer to the TileRenderer.
+ */
+static void tiles_run(TileRenderer *tr)
+{
+    int nTiles = tr->tilesX * tr->tilesY;
+    int t, i, r0, c0;
+    TileBin *bin;
+    TileCommand *c;
+
+    while ((t = __atomic_fetch_add(&poolNextTile, 1, __ATOMIC_RELAXED)) < nTiles)
+    {
+        bin = &(tr->bins[t]);
+        r0 = (t / tr->tilesX) * TILE_SIZE;
+        c0 = (t % tr->tilesX) * TILE_SIZE;
+        for (i = 0; i < bin->nCmd; i++)
+        {
+            c = &(tr->cmds[bin->cmd[i]]);
+            polygon_drawShadeClip(&(c->poly), tr->src, &(c->ds), tr->lighting, r0, c0, r0 + TILE_SIZE, c0 + TILE_SIZE, c->material);
+        }
+    }
+}
+
+/**
+ * Body of a pool thread: waits for a flush, fills tiles until none are left, and reports back.
+ *
+ * @param arg The index of the thread in the pool.
+ * @return Never returns.
+ */
+static void *tiles_worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&poolLock);
+    for (;;)
+    {
+        while (poolGeneration == seen)
+        {
+            pthread_cond_wait(&poolWake, &poolLock);
+        }
+        seen = poolGeneration;
+        if (id >= poolWanted)
+        {
+            continue;
+        }
+        pthread_mutex_unlock(&poolLock);
+        tiles_run(poolJob);
+        pthread_mutex_lock(&poolLock);
+        if (--poolBusy == 0)
+        {
+            pthread_cond_signal(&poolDone);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Makes sure the pool has at least n worker threads.
+ *
+ * @param n The number of worker threads needed.
+ */
+static void tiles_startPool(int n)
+{
+    pthread_t thread;
+
+    pthread_mutex_lock(&poolLock);
+    while (poolSize < n)
+    {
+        if (pthread_create(&thread, NULL, tiles_worker, (void *)(intptr_t)poolSize) != 0)
+        {
+            fprintf(stderr, "Unable to start a tile rendering thread\n");
+            exit(-1);
+        }
+        pthread_detach(thread);
+        poolSize++;
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+/**
+ * Sets up a TileRenderer for drawing into src. Polygons are filled with nThreads threads,
+ * including the calling thread.
+ *
+ * @param tr Pointer to the TileRenderer.
+ * @param src Pointer to the Image being drawn into.
+ * @param lighting Pointer to the Lighting used for ShadePhong.
+ * @param nThreads The number of threads to fill tiles with.
+ * @param arena Pointer to the Arena to allocate the bins and commands from, which must not be
+ * reset before tiles_end, or NULL to use the heap.
+ */
+void tiles_begin(TileRenderer *tr, Image *src, Lighting *lighting, int nThreads, Arena *arena)
+{
+    size_t size;
+
+    if (!tr || !src)
+    {
+        fprintf(stderr, "Invalid pointer sent to tiles_begin\n");
+        exit(-1);
+    }
+
+    tr->src = src;
+    tr->lighting = lighting;
+    tr->nThreads = nThreads < 1 ? 1 : (nThreads > MAX_TILE_THREADS ? MAX_TILE_THREADS : nThreads);
+    tr->tilesX = (src->cols + TILE_SIZE - 1) / TILE_SIZE;
+    tr->tilesY = (src->rows + TILE_SIZE - 1) / TILE_SIZE;
+    tr->arena = arena;
+    size = sizeof(TileBin) * tr->tilesX * tr->tilesY;
+    if (arena)
+    {
+        tr->bins = (TileBin *)arena_alloc(arena, size);
+        memset(tr->bins, 0, size);
+    }
+    else
+    {
+        tr->bins = (TileBin *)calloc(1, size);
+    }
+    tr->cmds = NULL;
+    tr->nCmds = 0;
+    tr->maxCmds = 0;
+    if (!tr->bins && size > 0)
+    {
+        fprintf(stderr, "Unable to allocate tile bins\n");
+        exit(-1);
+    }
+}
+
+/**
+ * Grows an array of the renderer, from its arena or with realloc.
+ *
+ * @param tr Pointer to the TileRenderer.
+ * @param p Pointer to the array, or NULL.
+ * @param oldN The size of the array in bytes.
+ * @param newN The size it needs to be.
+ * @return Pointer to the grown array, or NULL if the heap is out of memory.
+ */
+static void *tiles_grow(TileRenderer *tr, void *p, size_t oldN, size_t newN)
+{
+    if (tr->arena)
+        return arena_grow(tr->arena, p, oldN, newN);
+    return realloc(p, newN);
+}
+
+/**
+ * Adds command index cmd to the bin.
+ *
+ * @param tr Pointer to the TileRenderer.
+ * @param bin Pointer to the TileBin.
+ * @param cmd The index of the command in the renderer.
+ */
+static void tiles_binAdd(TileRenderer *tr, TileBin *bin, int cmd)
+{
+    int maxCmd;
+
+    if (bin->nCmd == bin->maxCmd)
+    {
+        maxCmd = bin->maxCmd ? bin->maxCmd * 2 : 16;
+        bin->cmd = (int *)tiles_grow(tr, bin->cmd, sizeof(int) * bin->maxCmd, sizeof(int) * maxCmd);
+        bin->maxCmd = maxCmd;
+        if (!bin->cmd)
+        {
+            fprintf(stderr, "Unable to grow a tile bin\n");
+            exit(-1);
+        }
+    }
+    bin->cmd[bin->nCmd++] = cmd;
+}
+
+/**
+ * Converts a screen coordinate to a tile index, clamped to [0, nTiles - 1].
+ *
+ * @param v The coordinate in pixels.
+ * @param nTiles The number of tiles along that axis.
+ * @return The tile index.
+ */
+static int tiles_index(double v, int nTiles)
+{
+    if (v < 0)
+        return 0;
+    if (v >= (double)nTiles * TILE_SIZE)
+        return nTiles - 1;
+    return (int)v / TILE_SIZE;
+}
+
+/**
+ * Queues a polygon that has been through the view transformation and normalization. Takes
+ * over the polygon's data and leaves p empty, so the caller can still polygon_clear it. The
+ * DrawState is copied, so later changes to ds do not affect the queued polygon.
+ *
+ * @param tr Pointer to the TileRenderer.
+ * @param p Pointer to the screen space Polygon.
+ * @param ds Pointer to the DrawState to fill the polygon with.
+ */
+void tiles_polygon(TileRenderer *tr, Polygon *p, DrawState *ds)
+{
+    TileCommand *c;
+    double xmin = 1e30, xmax = -1e30, ymin = 1e30, ymax = -1e30;
+    int i, tx, ty, tx0, tx1, ty0, ty1;
+
+    if (!tr || !p || !ds)
+    {
+        fprintf(stderr, "Invalid pointer sent to tiles_polygon\n");
+        exit(-1);
+    }
+    if (p->nVertex < 3)
+    {
+        return;
+    }
+
+    if (tr->nCmds == tr->maxCmds)
+    {
+        i = tr->maxCmds ? tr->maxCmds * 2 : 256;
+        tr->cmds = (TileCommand *)tiles_grow(tr, tr->cmds, sizeof(TileCommand) * tr->maxCmds, sizeof(TileCommand) * i);
+        tr->maxCmds = i;
+        if (!tr->cmds)
+        {
+            fprintf(stderr, "Unable to grow the tile command list\n");
+            exit(-1);
+        }
+    }
+    c = &(tr->cmds[tr->nCmds]);
+
+    // ShadeFlat fills with the DrawState color, the same as polygon_drawFill
+    drawstate_copy(&(c->ds), ds);
+    if (c->ds.shade == ShadeFlat)
+    {
+        c->ds.shade = ShadeConstant;
+    }
+    if (c->ds.shade != ShadeGouraud || c->ds.zCompare == ZCompareDepthOnly)
+    {
+        Color tmp[p->nVertex];
+        for (i = 0; i < p->nVertex; i++)
+        {
+            color_copy(&(tmp[i]), &(ds->color));
+        }
+        polygon_setColors(p, p->nVertex, tmp);
+    }
+    // look the material up now, the workers cannot add to the G-buffer material table
+    c->material = -1;
+    if (c->ds.shade == ShadePhong && c->ds.deferred && tr->src->gbuffer && tr->src->gbuffer->active)
+    {
+        c->material = image_gbufferMaterial(tr->src, &ds->body, &ds->surface, ds->surfaceCoeff, p->oneSided);
+    }
+
+    // take the polygon's arrays
+    c->poly = *p;
+    polygon_init(p);
+
+    // bin by the bounding box, widened by a pixel for the rounding in the scanline fill
+    for (i = 0; i < c->poly.nVertex; i++)
+    {
+        if (c->poly.vertex[i].val[0] < xmin)
+            xmin = c->poly.vertex[i].val[0];
+        if (c->poly.vertex[i].val[0] > xmax)
+            xmax = c->poly.vertex[i].val[0];
+        if (c->poly.vertex[i].val[1] < ymin)
+            ymin = c->poly.vertex[i].val[1];
+        if (c->poly.vertex[i].val[1] > ymax)
+            ymax = c->poly.vertex[i].val[1];
+    }
+    tr->nCmds++;
+    if (xmax < -1 || ymax < -1 || xmin > tr->src->cols + 1 || ymin > tr->src->rows + 1)
+    {
+        return; // kept only so tiles_flush frees it
+    }
+    tx0 = tiles_index(xmin - 1, tr->tilesX);
+    tx1 = tiles_index(xmax + 1, tr->tilesX);
+    ty0 = tiles_index(ymin - 1, tr->tilesY);
+    ty1 = tiles_index(ymax + 1, tr->tilesY);
+    for (ty = ty0; ty <= ty1; ty++)
+    {
+        for (tx = tx0; tx <= tx1; tx++)
+        {
+            tiles_binAdd(tr, &(tr->bins[ty * tr->tilesX + tx]), tr->nCmds - 1);
+        }
+    }
+}
+
+/**
+ * Fills every queued polygon into the image and empties the queue. module_draw calls this
+ * before anything it draws directly, like lines, so that everything lands in submission order.
+ *
+ * @param tr Pointer to the TileRenderer.
+ */
+void tiles_flush(TileRenderer *tr)
+{
+    int i, nWorkers;
+
+    if (!tr)
+    {
+        fprintf(stderr, "Invalid pointer sent to tiles_flush\n");
+        exit(-1);
+    }
+    if (tr->nCmds == 0)
+    {
+        return;
+    }
+
+    // one thread per tile at most, and the calling thread does its share
+    nWorkers = tr->nThreads - 1;
+    if (nWorkers > tr->tilesX * tr->tilesY - 1)
+    {
+        nWorkers = tr->tilesX * tr->tilesY - 1;
+    }
+
+    pthread_mutex_lock(&flushLock);
+    poolNextTile = 0;
+    if (nWorkers > 0)
+    {
+        tiles_startPool(nWorkers);
+        pthread_mutex_lock(&poolLock);
+        poolJob = tr;
+        poolWanted = nWorkers;
+        poolBusy = nWorkers;
+        poolGeneration++;
+        pthread_cond_broadcast(&poolWake);
+        pthread_mutex_unlock(&poolLock);
+    }
+    tiles_run(tr);
+    if (nWorkers > 0)
+    {
+        pthread_mutex_lock(&poolLock);
+        while (poolBusy > 0)
+        {
+            pthread_cond_wait(&poolDone, &poolLock);
+        }
+        poolJob = NULL;
+        pthread_mutex_unlock(&poolLock);
+    }
+    pthread_mutex_unlock(&flushLock);
+
+    for (i = 0; i < tr->nCmds; i++)
+    {
+        polygon_clear(&(tr->cmds[i].poly));
+    }
+    tr->nCmds = 0;
+    for (i = 0; i < tr->tilesX * tr->tilesY; i++)
+    {
+        tr->bins[i].nCmd = 0;
+    }
+}
+
+/**
+ * Fills any polygons still queued and frees the renderer's memory, unless it came from an arena.
+ *
+ * @param tr Pointer to the TileRenderer.
+ */
+void tiles_end(TileRenderer *tr)
+{
+    int i;
+
+    tiles_flush(tr);
+    if (!tr->arena)
+    {
+        for (i = 0; i < tr->tilesX * tr->tilesY; i++)
+        {
+            free(tr->bins[i].cmd);
+        }
+        free(tr->bins);
+        free(tr->cmds);
+    }
+    tr->bins = NULL;
+    tr->cmds = NULL;
+    tr->maxCmds = 0;
+}
@@ -0,0 +1,536 @@
+/**
+ * Half-space triangle rasterizer. Each edge of the triangle is a linear function of the pixel
+ * position that is positive on the inside, so a pixel is covered when all three are
+ * non-negative. The screen is walked in 8x8 blocks: a block that is entirely outside one edge
+ * is skipped, a block entirely inside all three is filled without testing, and blocks on an
+ * edge fill the columns each edge function allows on each row. Along a row 1/z is stepped by
+ * adding its per-pixel delta.
+ *
+ * The edge functions are normalized by the area of the triangle, which makes them the
+ * barycentric weights of the vertices. 1/z and every attribute divided by z vary linearly
+ * across the screen, so they are set up as planes from the weights, and dividing by 1/z at a
+ * pixel gives perspective-correct values, the same quantities the scanline fill interpolates.
+ *
+ * With polygon_setFixedPoint on, the vertices are snapped to 1/16 of a pixel and coverage uses
+ * the unnormalized edge functions on that grid instead. They are integers small enough to be
+ * exact in a double, and a pixel center exactly on an edge belongs to the triangle only if the
+ * edge is a top or left edge, so triangles that share an edge never overlap or leave a crack.
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "Polygon.h"
+
+#define TRI_BLOCK 8
+
+/**
+ * A quantity that is linear in screen space, v = c + dx * rx + dy * ry, where (rx, ry) is the
+ * pixel center relative to the first vertex of the triangle.
+ */
+typedef struct TriPlane
+{
+    double c, dx, dy;
+} TriPlane;
+
+/**
+ * Everything the pixel loop needs about a triangle.
+ */
+typedef struct TriSetup
+{
+    double x0, y0;        // first vertex, the origin of the planes
+    TriPlane w[3];        // barycentric weight of each vertex
+    TriPlane edge[3];     // coverage test of each edge, evaluated at integer (column, row)
+    TriPlane z;           // 1/z
+    TriPlane color[3];    // color/z, for ShadeGouraud
+    TriPlane normal[3];   // normal/z, for ShadePhong
+    TriPlane point[3];    // world point/z, for ShadePhong
+    ShadeMethod shade;    // ds->shade, kept here so the pixel loop does not reload it
+    FPixel color0;        // the DrawState color for the constant shade methods
+    int oneSided;
+    int material;
+} TriSetup;
+
+/**
+ * Sets pl to the plane through the values q0, q1, q2 at the three vertices.
+ *
+ * @param t Pointer to the TriSetup holding the weight planes.
+ * @param pl Pointer to the plane to set.
+ * @param q0 The value at vertex 0.
+ * @param q1 The value at vertex 1.
+ * @param q2 The value at vertex 2.
+ */
+static void triPlane(TriSetup *t, TriPlane *pl, double q0, double q1, double q2)
+{
+    pl->c = q0;
+    pl->dx = (q1 - q0) * t->w[1].dx + (q2 - q0) * t->w[2].dx;
+    pl->dy = (q1 - q0) * t->w[1].dy + (q2 - q0) * t->w[2].dy;
+}
+
+/**
+ * Evaluates a plane at a pixel center given relative to the first vertex.
+ */
+static inline double triEval(TriPlane *pl, double rx, double ry)
+{
+    return pl->c + pl->dx * rx + pl->dy * ry;
+}
+
+/**
+ * Clamps a pixel coordinate to [lo, hi] before converting it to an int.
+ */
+static inline int triClamp(double v, int lo, int hi)
+{
+    if (v < lo)
+        return lo;
+    if (v > hi)
+        return hi;
+    return (int)v;
+}
+
+/**
+ * Snaps the vertices to the 28.4 grid in place. Returns 0 and leaves them alone if one is out
+ * of the range where the edge functions stay exact.
+ */
+static int triSnap(double *x, double *y)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (!(fabs(x[i]) < POLYGON_FIXED_RANGE && fabs(y[i]) < POLYGON_FIXED_RANGE))
+            return 0;
+    }
+    for (i = 0; i < 3; i++)
+    {
+        x[i] = floor(x[i] * POLYGON_SUBPIXEL + 0.5) / POLYGON_SUBPIXEL;
+        y[i] = floor(y[i] * POLYGON_SUBPIXEL + 0.5) / POLYGON_SUBPIXEL;
+    }
+    return 1;
+}
+
+/**
+ * Sets the coverage test of the edge facing vertex i from the snapped vertices, as the edge
+ * function on the 28.4 grid at the pixel centers. It is positive inside, and 1 is subtracted on
+ * edges that are not top or left edges so that a center exactly on one is outside.
+ *
+ * @param pl Pointer to the plane to set.
+ * @param x The snapped x coordinates of the vertices.
+ * @param y The snapped y coordinates of the vertices.
+ * @param i The vertex the edge faces.
+ * @param s 1 if the triangle has a positive area, -1 if negative.
+ */
+static void triEdgeFixed(TriPlane *pl, double *x, double *y, int i, double s)
+{
+    int j = (i + 1) % 3, k = (i + 2) % 3;
+    double a, b, xj, yj;
+
+    xj = x[j] * POLYGON_SUBPIXEL;
+    yj = y[j] * POLYGON_SUBPIXEL;
+    a = s * (y[j] - y[k]) * POLYGON_SUBPIXEL;
+    b = s * (x[k] - x[j]) * POLYGON_SUBPIXEL;
+
+    // the function grows toward the inside, so a left edge has a > 0 and a top edge (y
+    // grows down the image) is horizontal with b > 0
+    pl->dx = POLYGON_SUBPIXEL * a;
+    pl->dy = POLYGON_SUBPIXEL * b;
+    pl->c = a * (POLYGON_SUBPIXEL / 2 - xj) + b * (POLYGON_SUBPIXEL / 2 - yj);
+    if (!(a > 0 || (a == 0 && b > 0)))
+        pl->c -= 1;
+}
+
+/**
+ * Shades one pixel that passed the z-test and stores it. Only used for ShadeDepth, ShadeGouraud,
+ * and ShadePhong; the pixel loop stores the color of the constant shade methods itself.
+ *
+ * @param t Pointer to the TriSetup.
+ * @param src Pointer to the Image.
+ * @param ds Pointer to the DrawState.
+ * @param l Pointer to the Lighting, used by ShadePhong.
+ * @param row The view of row r.
+ * @param r The row of the pixel.
+ * @param c The column of the pixel.
+ * @param zinv 1/z at the pixel.
+ */
+static void triShade(TriSetup *t, Image *src, DrawState *ds, Lighting *l, ImageRow *row, int r, int c, double zinv)
+{
+    float px[3];
+    double rx, ry, depth, v;
+    GBuffer *gb;
+    Point tp;
+    Vector tn, V;
+    Color tc;
+    int j, k;
+
+    rx = c + 0.5 - t->x0;
+    ry = r + 0.5 - t->y0;
+
+    switch (t->shade)
+    {
+    case ShadeDepth:
+        // same scaling as the scanline fill
+        depth = 1.0 - 1.0 / zinv;
+        for (j = 0; j < 3; j++)
+        {
+            v = 1.4 * ds->color.c[j] * depth;
+            px[j] = v < 0 ? 0 : (v > 1 ? 1 : v);
+        }
+        break;
+    case ShadeGouraud:
+        for (j = 0; j < 3; j++)
+        {
+            v = triEval(&(t->color[j]), rx, ry) / zinv;
+            px[j] = v < 0 ? 0 : (v > 1 ? 1 : v);
+        }
+        break;
+    case ShadePhong:
+        if (ds->deferred && src->gbuffer && src->gbuffer->active)
+        {
+            gb = src->gbuffer;
+            k = r * src->cols + c;
+            for (j = 0; j < 3; j++)
+            {
+                gb->normal[3 * k + j] = triEval(&(t->normal[j]), rx, ry) / zinv;
+                gb->position[3 * k + j] = triEval(&(t->point[j]), rx, ry) / zinv;
+            }
+            gb->material[k] = t->material;
+            gb->z[k] = image_depthRound(src->depth, zinv);
+            return;
+        }
+        for (j = 0; j < 3; j++)
+        {
+            tn.val[j] = triEval(&(t->normal[j]), rx, ry) / zinv;
+            tp.val[j] = triEval(&(t->point[j]), rx, ry) / zinv;
+        }
+        tn.val[3] = 0.0;
+        tp.val[3] = 1.0;
+        vector_setPoints(&V, &tp, &(ds->viewer));
+        vector_normalize(&V);
+        vector_normalize(&tn);
+        lighting_shading(l, &tn, &V, &tp, &ds->body, &ds->surface, ds->surfaceCoeff, t->oneSided, &tc);
+        image_setColor(src, r, c, tc);
+        return;
+    default:
+        for (j = 0; j < 3; j++)
+            px[j] = t->color0.rgb[j];
+        break;
+    }
+    image_rowSetColor(row, IMAGE_ROW_INDEX(row, c), px[0], px[1], px[2]);
+}
+
+/**
+ * Rasterizes the triangle into the rows [r0, r1) and columns [c0, c1) of the image.
+ *
+ * @param p Pointer to the screen space Polygon, which must have 3 vertices.
+ * @param src Pointer to the Image.
+ * @param ds Pointer to the DrawState with the shade method.
+ * @param l Pointer to the Lighting, used by ShadePhong.
+ * @param r0 The first row to draw.
+ * @param c0 The first column to draw.
+ * @param r1 One past the last row to draw.
+ * @param c1 One past the last column to draw.
+ * @param material The G-buffer material for deferred ShadePhong, or -1.
+ * @param zTest 1 to z-test against and write the depth buffer as ds->zCompare says, 0 to just
+ * write colors.
+ */
+static void triangle_raster(Polygon *p, Image *src, DrawState *ds, Lighting *l, int r0, int c0, int r1, int c1, int material, int zTest)
+{
+    TriSetup t;
+    double x[3], y[3], zinv[3], q[3];
+    double d1x, d1y, d2x, d2y, area;
+    double e[3], lo[3], hi[3], invDx[3], k;
+    float zi, dz;
+    ImageRow row;
+    int ix;
+    int i, j, m, xs, xe, ys, ye, bx, by, r, rs, c, ca, cb, rEnd, cEnd, accept, flat, fixed, equal, zOnly;
+    int spanA[TRI_BLOCK], spanB[TRI_BLOCK];
+
+    if (ds->shade == ShadePhong && !(ds->deferred && src->gbuffer && src->gbuffer->active) && !l)
+    {
+        fprintf(stderr, "Invalid lighting pointer sent to polygon_drawTriangle\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        x[i] = p->vertex[i].val[0];
+        y[i] = p->vertex[i].val[1];
+        zinv[i] = zTest ? 1.0 / p->vertex[i].val[2] : 0.0;
+    }
+    // the planes below are set up from the snapped vertices too, so shading matches coverage
+    fixed = polygon_getFixedPoint() && triSnap(x, y);
+    d1x = x[1] - x[0];
+    d1y = y[1] - y[0];
+    d2x = x[2] - x[0];
+    d2y = y[2] - y[0];
+    area = d1x * d2y - d1y * d2x;
+    if (area == 0 || !isfinite(area))
+    {
+        return;
+    }
+
+    // the weights of vertices 1 and 2 are the edge functions of the edges facing them, divided
+    // by the area so both windings come out positive inside; the weights sum to one
+    t.x0 = x[0];
+    t.y0 = y[0];
+    t.w[1].c = 0;
+    t.w[1].dx = d2y / area;
+    t.w[1].dy = -d2x / area;
+    t.w[2].c = 0;
+    t.w[2].dx = -d1y / area;
+    t.w[2].dy = d1x / area;
+    t.w[0].c = 1;
+    t.w[0].dx = -(t.w[1].dx + t.w[2].dx);
+    t.w[0].dy = -(t.w[1].dy + t.w[2].dy);
+    for (i = 0; i < 3; i++)
+    {
+        if (fixed)
+        {
+            triEdgeFixed(&(t.edge[i]), x, y, i, area > 0 ? 1.0 : -1.0);
+            continue;
+        }
+        t.edge[i].c = triEval(&(t.w[i]), 0.5 - t.x0, 0.5 - t.y0);
+        t.edge[i].dx = t.w[i].dx;
+        t.edge[i].dy = t.w[i].dy;
+    }
+    t.shade = ds->shade;
+    for (j = 0; j < 3; j++)
+        t.color0.rgb[j] = ds->color.c[j];
+    t.oneSided = p->oneSided;
+    t.material = material;
+
+    triPlane(&t, &(t.z), zinv[0], zinv[1], zinv[2]);
+    if (zTest && ds->zCompare == ZCompareDepthOnly)
+        ; // a depth-only pass needs nothing but 1/z
+    else if (ds->shade == ShadeGouraud)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            for (i = 0; i < 3; i++)
+                q[i] = p->color[i].c[j] * zinv[i];
+            triPlane(&t, &(t.color[j]), q[0], q[1], q[2]);
+        }
+    }
+    else if (ds->shade == ShadePhong)
+    {
+        // polygons that were never through module_draw have no 3D data
+        for (j = 0; j < 3; j++)
+        {
+            for (i = 0; i < 3; i++)
+                q[i] = (p->normalPhong ? p->normalPhong[i].val[j] : 0.0) * zinv[i];
+            triPlane(&t, &(t.normal[j]), q[0], q[1], q[2]);
+            for (i = 0; i < 3; i++)
+                q[i] = (p->vertex3D ? p->vertex3D[i].val[j] : p->vertex[i].val[j]) * zinv[i];
+            triPlane(&t, &(t.point[j]), q[0], q[1], q[2]);
+        }
+    }
+
+    // bounding box of the pixel centers that can be inside, clipped to the rectangle
+    xs = triClamp(floor(fmin(x[0], fmin(x[1], x[2]))), c0, c1);
+    xe = triClamp(ceil(fmax(x[0], fmax(x[1], x[2]))), c0, c1);
+    ys = triClamp(floor(fmin(y[0], fmin(y[1], y[2]))), r0, r1);
+    ye = triClamp(ceil(fmax(y[0], fmax(y[1], y[2]))), r0, r1);
+    if (xs >= xe || ys >= ye)
+    {
+        return;
+    }
+
+    dz = t.z.dx;
+    flat = ds->shade != ShadeDepth && ds->shade != ShadeGouraud && ds->shade != ShadePhong;
+    equal = zTest && ds->zCompare == ZCompareEqual;
+    zOnly = zTest && ds->zCompare == ZCompareDepthOnly;
+
+    // the smallest and largest amount each edge function changes by across a block
+    for (i = 0; i < 3; i++)
+    {
+        lo[i] = fmin(0, (TRI_BLOCK - 1) * t.edge[i].dx) + fmin(0, (TRI_BLOCK - 1) * t.edge[i].dy);
+        hi[i] = fmax(0, (TRI_BLOCK - 1) * t.edge[i].dx) + fmax(0, (TRI_BLOCK - 1) * t.edge[i].dy);
+        invDx[i] = t.edge[i].dx != 0 ? 1.0 / t.edge[i].dx : 0;
+    }
+
+    // blocks are aligned to the image, and everything below is measured from column 0 or the
+    // start of a block, so the values at a pixel do not depend on the clipping rectangle
+    for (by = ys & ~(TRI_BLOCK - 1); by < ye; by += TRI_BLOCK)
+    {
+        rs = by < ys ? ys : by;
+        rEnd = by + TRI_BLOCK < ye ? by + TRI_BLOCK : ye;
+
+        // the covered columns of each row of the band. Along a row an edge function is
+        // e + c * dx, so each edge bounds c on one side. The division only estimates the
+        // bound, and the test at the column next to it makes the bound exact.
+        for (r = rs; r < rEnd; r++)
+        {
+            ca = xs;
+            cb = xe;
+            for (i = 0; i < 3; i++)
+            {
+                e[i] = t.edge[i].c + t.edge[i].dy * r;
+                if (t.edge[i].dx == 0)
+                {
+                    if (e[i] < 0)
+                        cb = ca;
+                    continue;
+                }
+                k = -e[i] * invDx[i];
+                if (t.edge[i].dx > 0)
+                {
+                    // first column with e >= 0
+                    if (k > cb + 1)
+                        cb = ca;
+                    else if (k > ca - 1)
+                    {
+                        m = (int)ceil(k);
+                        if (e[i] + (m - 1) * t.edge[i].dx >= 0)
+                            m--;
+                        else if (e[i] + m * t.edge[i].dx < 0)
+                            m++;
+                        ca = m > ca ? m : ca;
+                    }
+                }
+                else
+                {
+                    // one past the last column with e >= 0
+                    if (k < ca - 1)
+                        cb = ca;
+                    else if (k < cb + 1)
+                    {
+                        m = (int)floor(k);
+                        if (e[i] + (m + 1) * t.edge[i].dx >= 0)
+                            m++;
+                        else if (e[i] + m * t.edge[i].dx < 0)
+                            m--;
+                        cb = m + 1 < cb ? m + 1 : cb;
+                    }
+                }
+            }
+            spanA[r - by] = ca;
+            spanB[r - by] = cb;
+        }
+
+        for (bx = xs & ~(TRI_BLOCK - 1); bx < xe; bx += TRI_BLOCK)
+        {
+            // the extremes of each edge function over the block are at its corners
+            accept = 1;
+            for (i = 0; i < 3; i++)
+            {
+                e[i] = t.edge[i].c + t.edge[i].dx * bx + t.edge[i].dy * by;
+                if (e[i] + hi[i] < 0)
+                    break;
+                if (e[i] + lo[i] < 0)
+                    accept = 0;
+            }
+            if (i < 3)
+            {
+                continue; // trivially rejected
+            }
+
+            cEnd = bx + TRI_BLOCK < xe ? bx + TRI_BLOCK : xe;
+            for (r = rs; r < rEnd; r++)
+            {
+                // a trivially accepted block fills every column
+                ca = bx < xs ? xs : bx;
+                cb = cEnd;
+                if (!accept)
+                {
+                    ca = spanA[r - by] > ca ? spanA[r - by] : ca;
+                    cb = spanB[r - by] < cb ? spanB[r - by] : cb;
+                }
+                if (ca >= cb)
+                {
+                    continue;
+                }
+
+                zi = (float)triEval(&(t.z), ca + 0.5 - t.x0, r + 0.5 - t.y0);
+                image_row(src, r, &row);
+                for (c = ca; c < cb; c++, zi += dz)
+                {
+                    // zi is stepped the same way in every pass, so an equality test finds
+                    // exactly the pixels a depth pre-pass left this triangle's z in
+                    ix = IMAGE_ROW_INDEX(&row, c);
+                    if (zTest && !image_rowDepthTest(&row, ix, zi, equal, row.depth))
+                        continue;
+                    if (zOnly)
+                        continue;
+                    if (flat)
+                    {
+                        image_rowSetColor(&row, ix, t.color0.rgb[0], t.color0.rgb[1], t.color0.rgb[2]);
+                    }
+                    else
+                        triShade(&t, src, ds, l, &row, r, c, zi);
+                }
+                if (zTest)
+                    image_hizMark(src, r, ca, cb);
+                else
+                    image_touch(src, r, ca, cb);
+            }
+        }
+    }
+}
+
+/**
+ * Fills a triangle with the DrawState shade method, z-testing against the image's depth buffer,
+ * within rows [r0, r1) and columns [c0, c1). This is the triangle path of polygon_drawShadeClip
+ * when it is turned on with polygon_setTriangleFill. Like the scanline fill, the polygon colors
+ * must already be set and the polygon is not modified.
+ *
+ * @param p Pointer to the screen space Polygon, which must have 3 vertices.
+ * @param src Pointer to the Image.
+ * @param ds Pointer to the DrawState.
+ * @param l Pointer to the Lighting, used by ShadePhong.
+ * @param r0 The first row to draw.
+ * @param c0 The first column to draw.
+ * @param r1 One past the last row to draw.
+ * @param c1 One past the last column to draw.
+ * @param material The G-buffer material for deferred ShadePhong, or -1.
+ */
+void polygon_drawTriangle(Polygon *p, Image *src, DrawState *ds, Lighting *l, int r0, int c0, int r1, int c1, int material)
+{
+    if (!p || !src || !ds)
+    {
+        fprintf(stderr, "Null pointer provided to polygon_drawTriangle\n");
+        exit(-1);
+    }
+    if (p->nVertex != 3)
+    {
+        return;
+    }
+
+    r0 = r0 < 0 ? 0 : r0;
+    c0 = c0 < 0 ? 0 : c0;
+    r1 = r1 > src->rows ? src->rows : r1;
+    c1 = c1 > src->cols ? src->cols : c1;
+    triangle_raster(p, src, ds, l, r0, c0, r1, c1, material, 1);
+}
+
+/**
+ * Draws and fills a triangle with a color using the half-space rasterizer. The depth buffer is
+ * not used, so this works for 2D polygons too.
+ *
+ * @param p the polygon to draw, must be only 3 vertices
+ * @param src the image to draw it on
+ * @param c the color of the polygon
+ */
+void polygon_drawFillB(Polygon *p, Image *src, Color c)
+{
+    DrawState ds;
+
+    // Null checks
+    if (!p || !src)
+    {
+        fprintf(stderr, "Null pointer provided to polygon_drawFillB\n");
+        exit(-1);
+    }
+
+    if (p->nVertex != 3)
+    {
+        printf("Incorrect number of vertices for a barycentric triangle!\n");
+        return;
+    }
+
+    drawstate_init(&ds);
+    drawstate_setColor(&ds, c);
+    ds.shade = ShadeConstant;
+    ds.zCompare = ZCompareGreater;
+    triangle_raster(p, src, &ds, NULL, 0, 0, src->rows, src->cols, -1, 0);
+}
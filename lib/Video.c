@@ -0,0 +1,143 @@
+/**
+ * Streaming output of animation frames to a single Y4M or raw RGB file or pipe.
+ *
+ * Writing each frame of an animation to its own PPM costs an open, a header, and a close per
+ * frame and leaves a directory of files to be assembled afterwards. A VideoStream writes one
+ * header and then appends every frame to the same file, or to stdout so the frames can be piped
+ * straight into an encoder, e.g.
+ *
+ *     ./sphere 12 - | ffmpeg -i - sphere.mp4
+ *
+ * @author Benji Northrop
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "Convert.h"
+#include "Video.h"
+
+// stdio buffer of a stream, so a frame goes out in a few large writes
+#define VIDEO_BUFFER (1 << 20)
+
+/**
+ * Opens a stream and writes its header.
+ *
+ * @param filename The file to write, or NULL, "", or "-" for stdout.
+ * @param format The container.
+ * @param rows The rows of every frame.
+ * @param cols The columns of every frame.
+ * @param fps The frame rate recorded in a Y4M header.
+ * @return Pointer to the new VideoStream.
+ */
+VideoStream *video_open(char *filename, VideoFormat format, int rows, int cols, int fps)
+{
+    VideoStream *vs;
+    int toStdout = filename == NULL || filename[0] == 0 || strcmp(filename, "-") == 0;
+
+    if (rows <= 0 || cols <= 0)
+    {
+        fprintf(stderr, "Invalid input rows/cols\n");
+        exit(-1);
+    }
+    vs = (VideoStream *)malloc(sizeof(VideoStream));
+    if (vs == NULL)
+    {
+        fprintf(stderr, "Error creating the video stream\n");
+        exit(-1);
+    }
+
+    vs->fp = toStdout ? stdout : fopen(filename, "wb");
+    if (vs->fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filename);
+        exit(-1);
+    }
+    // stdout may already have been written to, which rules out changing its buffer
+    if (!toStdout)
+        setvbuf(vs->fp, NULL, _IOFBF, VIDEO_BUFFER);
+    vs->closeFile = !toStdout;
+    vs->format = format;
+    vs->rows = rows;
+    vs->cols = cols;
+    vs->frames = 0;
+    vs->yuv = NULL;
+
+    if (format == VideoY4M)
+    {
+        vs->yuv = (unsigned char *)malloc(rows * cols + 2 * ((rows + 1) / 2) * ((cols + 1) / 2));
+        if (vs->yuv == NULL)
+        {
+            fprintf(stderr, "Error creating the video stream\n");
+            exit(-1);
+        }
+        fprintf(vs->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", cols, rows, fps > 0 ? fps : 30);
+    }
+    return vs;
+}
+
+/**
+ * Appends an image to the stream as the next frame. The image is converted to 8 bits the way
+ * image_write converts it, and for Y4M on to YCbCr.
+ *
+ * @param vs Pointer to the VideoStream.
+ * @param src Pointer to the Image, which must have the size of the stream.
+ */
+void video_write(VideoStream *vs, Image *src)
+{
+    Pixel *pix;
+    unsigned char *y, *u, *v;
+    int r, cw, ch;
+
+    if (!vs || !src)
+    {
+        fprintf(stderr, "Invalid pointer provided\n");
+        exit(-1);
+    }
+    if (src->rows != vs->rows || src->cols != vs->cols)
+    {
+        fprintf(stderr, "Frame is %d x %d, the video stream is %d x %d\n", src->cols, src->rows, vs->cols, vs->rows);
+        exit(-1);
+    }
+
+    pix = image_pixels(src);
+    if (vs->format == VideoRGB)
+    {
+        fwrite(pix, sizeof(Pixel), vs->rows * vs->cols, vs->fp);
+        vs->frames++;
+        return;
+    }
+
+    cw = (vs->cols + 1) / 2;
+    ch = (vs->rows + 1) / 2;
+    y = vs->yuv;
+    u = y + vs->rows * vs->cols;
+    v = u + cw * ch;
+    for (r = 0; r < vs->rows; r += 2)
+    {
+        // the last row of an odd height pairs with itself
+        if (r + 1 < vs->rows)
+            convert_yuv420Rows(y + r * vs->cols, y + (r + 1) * vs->cols, u + (r / 2) * cw, v + (r / 2) * cw, pix + r * vs->cols, pix + (r + 1) * vs->cols, vs->cols);
+        else
+            convert_yuv420Rows(y + r * vs->cols, NULL, u + (r / 2) * cw, v + (r / 2) * cw, pix + r * vs->cols, pix + r * vs->cols, vs->cols);
+    }
+    fputs("FRAME\n", vs->fp);
+    fwrite(vs->yuv, 1, vs->rows * vs->cols + 2 * cw * ch, vs->fp);
+    vs->frames++;
+}
+
+/**
+ * Flushes and closes the stream and frees it. stdout is flushed but left open.
+ *
+ * @param vs Pointer to the VideoStream.
+ */
+void video_close(VideoStream *vs)
+{
+    if (!vs)
+        return;
+    if (vs->closeFile)
+        fclose(vs->fp);
+    else
+        fflush(vs->fp);
+    free(vs->yuv);
+    free(vs);
+}
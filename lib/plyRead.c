@@ -55,14 +55,18 @@ ply_type plyType(char *buffer)
 
 #define MaxVertices (10)
 
-int readPLY(char filename[], int *nPolygons, Polygon **plist, Color **clist, int estNormals)
+/*
+	Reads the header and the vertices of a PLY file, returning the file
+	positioned at the first face, or NULL if it could not be read.  The
+	vertex, normal, and color arrays are allocated for the caller to free.
+*/
+static FILE *plyOpen(char filename[], int *nVertices, int *nFaces, Point **vlist, Vector **nlist, Color **colors)
 {
 	char buffer[256];
 	Point *vertex;
 	Vector *normal;
 	//  Point *texture;
 	Color *color;
-	Polygon *p;
 	int numPoly;
 	int numVertex;
 	int vertexProp = 0;
@@ -71,10 +75,7 @@ int readPLY(char filename[], int *nPolygons, Polygon **plist, Color **clist, int
 	ply_property *vertexproptail = NULL;
 	ply_property *faceproplist = NULL;
 	ply_property *faceproptail = NULL;
-	int nv;
-	int vid[MaxVertices];
 	int i, j;
-	Color tcolor;
 
 	// first line ought to be "ply"
 	// format ought to be "ascii 1.0"
@@ -95,255 +96,332 @@ int readPLY(char filename[], int *nPolygons, Polygon **plist, Color **clist, int
 
 	int doneWithHeader = 0;
 	FILE *fp = fopen(filename, "r");
-	if (fp)
+	if (!fp)
 	{
-		// check if it's a .ply file
-		fscanf(fp, "%s", buffer);
-		if (strcmp(buffer, "ply"))
-		{
-			printf("%s doesn't look like a .ply file\n", filename);
-			fclose(fp);
-			return (-1);
-		}
+		printf("Unable to open %s\n", filename);
+		return (NULL);
+	}
+	// check if it's a .ply file
+	fscanf(fp, "%s", buffer);
+	if (strcmp(buffer, "ply"))
+	{
+		printf("%s doesn't look like a .ply file\n", filename);
+		fclose(fp);
+		return (NULL);
+	}
 
-		while (!doneWithHeader)
+	while (!doneWithHeader)
+	{
+		fscanf(fp, "%s", buffer);
+		switch (buffer[0])
 		{
-			fscanf(fp, "%s", buffer);
-			switch (buffer[0])
+		case 'f':
+			// format statement
+			for (; fgetc(fp) != '\n';)
+				;
+			break;
+
+		case 'c':
+			// comment
+			for (; fgetc(fp) != '\n';)
+				;
+			break;
+
+		case 'p':
+			// property statement
 			{
-			case 'f':
-				// format statement
-				for (; fgetc(fp) != '\n';)
-					;
-				break;
+				ply_property *prop = malloc(sizeof(ply_property));
+				prop->listCardType = type_none;
+				prop->listDataType = type_none;
+				prop->next = NULL;
+
+				fscanf(fp, "%s", buffer); // get the data type
+				prop->type = plyType(buffer);
+				if (prop->type == type_list)
+				{
+					fscanf(fp, "%s", buffer); // get the first data type
+					prop->listCardType = plyType(buffer);
+					fscanf(fp, "%s", buffer); // get the first data type
+					prop->listDataType = plyType(buffer);
+				}
+				else if (prop->type == type_none)
+				{
+					printf("Unrecognized property type %s", buffer);
+					fclose(fp);
+					return (NULL);
+				}
+				printf("Read property type %d\n", prop->type);
 
-			case 'c':
-				// comment
-				for (; fgetc(fp) != '\n';)
-					;
-				break;
+				fscanf(fp, "%s", prop->name);
+				printf("Read property name %s\n", prop->name);
 
-			case 'p':
-				// property statement
+				// add the property entry to the list
+				if (vertexProp)
 				{
-					ply_property *prop = malloc(sizeof(ply_property));
-					prop->listCardType = type_none;
-					prop->listDataType = type_none;
-					prop->next = NULL;
-
-					fscanf(fp, "%s", buffer); // get the data type
-					prop->type = plyType(buffer);
-					if (prop->type == type_list)
+					if (vertexproplist == NULL)
 					{
-						fscanf(fp, "%s", buffer); // get the first data type
-						prop->listCardType = plyType(buffer);
-						fscanf(fp, "%s", buffer); // get the first data type
-						prop->listDataType = plyType(buffer);
+						vertexproplist = prop;
+						vertexproptail = prop;
 					}
-					else if (prop->type == type_none)
+					else
 					{
-						printf("Unrecognized property type %s", buffer);
-						fclose(fp);
-						return (-1);
+						vertexproptail->next = prop;
+						vertexproptail = prop;
 					}
-					printf("Read property type %d\n", prop->type);
-
-					fscanf(fp, "%s", prop->name);
-					printf("Read property name %s\n", prop->name);
-
-					// add the property entry to the list
-					if (vertexProp)
+				}
+				else if (faceProp)
+				{
+					if (faceproplist == NULL)
 					{
-						if (vertexproplist == NULL)
-						{
-							vertexproplist = prop;
-							vertexproptail = prop;
-						}
-						else
-						{
-							vertexproptail->next = prop;
-							vertexproptail = prop;
-						}
+						faceproplist = prop;
+						faceproptail = prop;
 					}
-					else if (faceProp)
+					else
 					{
-						if (faceproplist == NULL)
-						{
-							faceproplist = prop;
-							faceproptail = prop;
-						}
-						else
-						{
-							faceproptail->next = prop;
-							faceproptail = prop;
-						}
+						faceproptail->next = prop;
+						faceproptail = prop;
 					}
 				}
-				break;
-
-			case 'e':
-				if (!strcmp(buffer, "end_header"))
-				{
-					doneWithHeader = 1;
-					break;
-				}
+			}
+			break;
 
-				// otherwise it's an element statement
-				fscanf(fp, "%s", buffer);
-				if (!strcmp(buffer, "vertex"))
-				{
-					printf("Read element vertex\n");
-					vertexProp = 1;
-					faceProp = 0;
-					fscanf(fp, "%d", &numVertex);
-				}
-				else if (!strcmp(buffer, "face"))
-				{
-					printf("Read element face\n");
-					faceProp = 1;
-					vertexProp = 0;
-					fscanf(fp, "%d", &numPoly);
-				}
+		case 'e':
+			if (!strcmp(buffer, "end_header"))
+			{
+				doneWithHeader = 1;
 				break;
+			}
 
-			default: // don't know what to do with it
-				for (; fgetc(fp) != '\n';)
-					;
-				break;
+			// otherwise it's an element statement
+			fscanf(fp, "%s", buffer);
+			if (!strcmp(buffer, "vertex"))
+			{
+				printf("Read element vertex\n");
+				vertexProp = 1;
+				faceProp = 0;
+				fscanf(fp, "%d", &numVertex);
+			}
+			else if (!strcmp(buffer, "face"))
+			{
+				printf("Read element face\n");
+				faceProp = 1;
+				vertexProp = 0;
+				fscanf(fp, "%d", &numPoly);
 			}
+			break;
+
+		default: // don't know what to do with it
+			for (; fgetc(fp) != '\n';)
+				;
+			break;
 		}
-		// finished with the header
-		vertex = malloc(sizeof(Point) * numVertex);
-		normal = malloc(sizeof(Vector) * numVertex);
-		// texture
-		color = malloc(sizeof(Color) * numVertex); // apparently not written by Blender
-
-		// read the vertices
-		for (i = 0; i < numVertex; i++)
+	}
+	// finished with the header
+	vertex = malloc(sizeof(Point) * numVertex);
+	normal = malloc(sizeof(Vector) * numVertex);
+	// texture
+	color = malloc(sizeof(Color) * numVertex); // apparently not written by Blender
+
+	// read the vertices
+	for (i = 0; i < numVertex; i++)
+	{
+		for (j = 0; j < 3; j++)
+			fscanf(fp, "%lf", &(vertex[i].val[j]));
+		vertex[i].val[3] = 1.0;
+
+		for (j = 0; j < 3; j++)
+			fscanf(fp, "%lf", &(normal[i].val[j]));
+		normal[i].val[3] = 0.0;
+
+		for (j = 0; j < 2; j++)
+			fscanf(fp, "%*f");
+
+		for (j = 0; j < 3; j++)
 		{
-			for (j = 0; j < 3; j++)
-				fscanf(fp, "%lf", &(vertex[i].val[j]));
-			vertex[i].val[3] = 1.0;
+			fscanf(fp, "%f", &(color[i].c[j]));
+			color[i].c[j] /= 255.0;
+		}
+	}
 
-			for (j = 0; j < 3; j++)
-				fscanf(fp, "%lf", &(normal[i].val[j]));
-			normal[i].val[3] = 0.0;
+	{
+		ply_property *q;
 
-			for (j = 0; j < 2; j++)
-				fscanf(fp, "%*f");
+		while (vertexproplist != NULL)
+		{
+			q = (ply_property *)vertexproplist->next;
+			free(vertexproplist);
+			vertexproplist = q;
+		}
 
-			for (j = 0; j < 3; j++)
-			{
-				fscanf(fp, "%f", &(color[i].c[j]));
-				color[i].c[j] /= 255.0;
-			}
+		while (faceproplist != NULL)
+		{
+			q = (ply_property *)faceproplist->next;
+			free(faceproplist);
+			faceproplist = q;
 		}
+	}
 
-		p = malloc(sizeof(Polygon) * numPoly);
-		*clist = malloc(sizeof(Color) * numPoly);
+	*nVertices = numVertex;
+	*nFaces = numPoly;
+	*vlist = vertex;
+	*nlist = normal;
+	*colors = color;
+	return (fp);
+}
 
-		// read the faces and build the polygons
-		for (i = 0; i < numPoly; i++)
+int readPLY(char filename[], int *nPolygons, Polygon **plist, Color **clist, int estNormals)
+{
+	Point *vertex;
+	Vector *normal;
+	Color *color;
+	Polygon *p;
+	int numPoly;
+	int numVertex;
+	int nv;
+	int vid[MaxVertices];
+	int i, j;
+	Color tcolor;
+	FILE *fp = plyOpen(filename, &numVertex, &numPoly, &vertex, &normal, &color);
+
+	if (!fp)
+		return (-1);
+
+	p = malloc(sizeof(Polygon) * numPoly);
+	*clist = malloc(sizeof(Color) * numPoly);
+
+	// read the faces and build the polygons
+	for (i = 0; i < numPoly; i++)
+	{
+		polygon_init(&(p[i]));
+
+		// read in the vertex indices
+		nv = 0;
+		fscanf(fp, "%d", &nv);
+
+		if (nv > MaxVertices)
+		{
+			printf("Number of vertices is greater than MaxVertices (%d), terminating\n", nv);
+			exit(-1);
+		}
+
+		for (j = 0; j < nv; j++)
 		{
-			polygon_init(&(p[i]));
+			fscanf(fp, "%d", &(vid[j]));
+		}
 
-			// read in the vertex indices
-			nv = 0;
-			fscanf(fp, "%d", &nv);
+		// assign the polygon vertices and surface normals
+		// not setting vertexWorld right now, because no Phong shading
 
-			if (nv > MaxVertices)
+		p[i].nVertex = nv;
+		//			p[i].zBufferFlag = 1;
+		p[i].normal = malloc(sizeof(Vector) * nv);
+		p[i].vertex = malloc(sizeof(Point) * nv);
+		tcolor.c[0] = tcolor.c[1] = tcolor.c[2] = 0.0;
+		//      printf("%d: ", nv);
+		for (j = 0; j < nv; j++)
+		{
+			//	printf("%d  ", vid[j]);
+			p[i].vertex[j] = vertex[vid[j]];
+			if (!estNormals)
 			{
-				printf("Number of vertices is greater than MaxVertices (%d), terminating\n", nv);
-				exit(-1);
+				p[i].normal[j] = normal[vid[j]];
 			}
+			tcolor.c[0] += color[vid[j]].c[0];
+			tcolor.c[1] += color[vid[j]].c[1];
+			tcolor.c[2] += color[vid[j]].c[2];
+		}
+		tcolor.c[0] /= (float)nv;
+		tcolor.c[1] /= (float)nv;
+		tcolor.c[2] /= (float)nv;
 
-			for (j = 0; j < nv; j++)
-			{
-				fscanf(fp, "%d", &(vid[j]));
-			}
+		if (estNormals)
+		{
+			Vector tx, ty, tn;
 
-			// assign the polygon vertices and surface normals
-			// not setting vertexWorld right now, because no Phong shading
+			tx.val[0] = p[i].vertex[0].val[0] - p[i].vertex[1].val[0];
+			tx.val[1] = p[i].vertex[0].val[1] - p[i].vertex[1].val[1];
+			tx.val[2] = p[i].vertex[0].val[2] - p[i].vertex[1].val[2];
+
+			ty.val[0] = p[i].vertex[2].val[0] - p[i].vertex[1].val[0];
+			ty.val[1] = p[i].vertex[2].val[1] - p[i].vertex[1].val[1];
+			ty.val[2] = p[i].vertex[2].val[2] - p[i].vertex[1].val[2];
+
+			vector_cross(&tx, &ty, &tn);
+			vector_normalize(&tn);
 
-			p[i].nVertex = nv;
-			//			p[i].zBufferFlag = 1;
-			p[i].normal = malloc(sizeof(Vector) * nv);
-			p[i].vertex = malloc(sizeof(Point) * nv);
-			tcolor.c[0] = tcolor.c[1] = tcolor.c[2] = 0.0;
-			//      printf("%d: ", nv);
 			for (j = 0; j < nv; j++)
-			{
-				//	printf("%d  ", vid[j]);
-				p[i].vertex[j] = vertex[vid[j]];
-				if (!estNormals)
-				{
-					p[i].normal[j] = normal[vid[j]];
-				}
-				tcolor.c[0] += color[vid[j]].c[0];
-				tcolor.c[1] += color[vid[j]].c[1];
-				tcolor.c[2] += color[vid[j]].c[2];
-			}
-			tcolor.c[0] /= (float)nv;
-			tcolor.c[1] /= (float)nv;
-			tcolor.c[2] /= (float)nv;
+				p[i].normal[j] = tn;
+		}
 
-			if (estNormals)
-			{
-				Vector tx, ty, tn;
+		printf("(%.2f %.2f %.2f)\n", tcolor.c[0], tcolor.c[1], tcolor.c[2]);
 
-				tx.val[0] = p[i].vertex[0].val[0] - p[i].vertex[1].val[0];
-				tx.val[1] = p[i].vertex[0].val[1] - p[i].vertex[1].val[1];
-				tx.val[2] = p[i].vertex[0].val[2] - p[i].vertex[1].val[2];
+		(*clist)[i] = tcolor;
+	}
 
-				ty.val[0] = p[i].vertex[2].val[0] - p[i].vertex[1].val[0];
-				ty.val[1] = p[i].vertex[2].val[1] - p[i].vertex[1].val[1];
-				ty.val[2] = p[i].vertex[2].val[2] - p[i].vertex[1].val[2];
+	*nPolygons = numPoly;
+	*plist = p;
 
-				vector_cross(&tx, &ty, &tn);
-				vector_normalize(&tn);
+	free(vertex);
+	free(normal);
+	//    free(texture);
+	free(color);
+	fclose(fp);
 
-				for (j = 0; j < nv; j++)
-					p[i].normal[j] = tn;
-			}
+	return (0);
+}
 
-			printf("(%.2f %.2f %.2f)\n", tcolor.c[0], tcolor.c[1], tcolor.c[2]);
+/*
+	Reads a PLY file into a Mesh, keeping each vertex once with its color
+	and splitting each face into a fan of triangles.  If estNormals is
+	set, the vertex normals are averaged from the faces around them
+	instead of read from the file.
+*/
+int readPLYMesh(char filename[], Mesh *mesh, int estNormals)
+{
+	Point *vertex;
+	Vector *normal;
+	Color *color;
+	int numPoly;
+	int numVertex;
+	int nv;
+	int vid[MaxVertices];
+	int i, j;
+	FILE *fp = plyOpen(filename, &numVertex, &numPoly, &vertex, &normal, &color);
 
-			(*clist)[i] = tcolor;
-		}
+	if (!fp)
+		return (-1);
 
-		*nPolygons = numPoly;
-		*plist = p;
+	mesh_clear(mesh);
+	for (i = 0; i < numVertex; i++)
+		mesh_addVertex(mesh, &(vertex[i]), estNormals ? NULL : &(normal[i]), &(color[i]));
 
-		free(vertex);
-		free(normal);
-		//    free(texture);
-		free(color);
+	for (i = 0; i < numPoly; i++)
+	{
+		nv = 0;
+		fscanf(fp, "%d", &nv);
 
+		if (nv > MaxVertices)
 		{
-			ply_property *q;
-
-			while (vertexproplist != NULL)
-			{
-				q = (ply_property *)vertexproplist->next;
-				free(vertexproplist);
-				vertexproplist = q;
-			}
+			printf("Number of vertices is greater than MaxVertices (%d), terminating\n", nv);
+			exit(-1);
+		}
 
-			while (faceproplist != NULL)
-			{
-				q = (ply_property *)faceproplist->next;
-				free(faceproplist);
-				faceproplist = q;
-			}
+		for (j = 0; j < nv; j++)
+		{
+			fscanf(fp, "%d", &(vid[j]));
 		}
 
-		fclose(fp);
-	}
-	else
-	{
-		printf("Unable to open %s\n", filename);
-		return (-1);
+		for (j = 2; j < nv; j++)
+			mesh_addTriangle(mesh, vid[0], vid[j - 1], vid[j]);
 	}
 
+	if (estNormals)
+		mesh_calculateNormals(mesh);
+
+	free(vertex);
+	free(normal);
+	free(color);
+	fclose(fp);
+
 	return (0);
 }
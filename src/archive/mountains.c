@@ -43,7 +43,7 @@ int main(int argc, char *argv[])
 		{
 			dx = (float)i / (float)cols;
 			dy = (float)j / (float)rows;
-			value = perlin(dx * 30, dy * 30, src->z[i * src->cols + j]);
+			value = perlin(dx * 30, dy * 30, image_getz(src, i, j));
 			value = (value + 1) / 2; // Removes the negative values
 			noiseValue[i * rows + j] = value;
 		}
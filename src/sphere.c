@@ -3,6 +3,8 @@
 
 	Takes a single command line argument to specify the number of divisions of the sphere. (i.e. how many points to build a unit sphere)
 	More divisions = more sphere-like
+	An optional second argument names a Y4M file to stream the animation into instead of one
+	PPM per frame; "-" streams it to stdout, e.g. ./sphere 12 - | ffmpeg -i - sphere.mp4
 	@author Benji Northrop
 */
 #include <stdio.h>
@@ -24,7 +26,9 @@ int main(int argc, char *argv[])
 	Matrix VTM, GTM;
 	int divisions = 12;
 	int rows = 300, cols = 400;
-	Image *src = image_create(rows, cols);
+	Image *src;
+	VideoStream *video = NULL;
+	FrameSink *sink;
 
 	// grab the command line argument, if one exists
 	if (argc > 1)
@@ -33,6 +37,13 @@ int main(int argc, char *argv[])
 		if (tmp >= 0 && tmp < 100)
 			divisions = tmp;
 	}
+	if (argc > 2)
+	{
+		video = video_open(argv[2], VideoY4M, rows, cols, 30);
+		sink = framesink_createVideo(video, 2);
+	}
+	else
+		sink = framesink_create("sphere-frame%03d.ppm", rows, cols, 2);
 
 	color_set(&white, 1.0, 1.0, 1.0);
 	color_set(&blue, 0.0, 0.0, 1.0);
@@ -60,7 +71,8 @@ int main(int argc, char *argv[])
 	matrix_identity(&GTM);
 	point_copy(&(ds->viewer), &(view.vrp));
 
-	matrix_print(&VTM, stdout);
+	// stdout may be carrying the video
+	matrix_print(&VTM, video ? stderr : stdout);
 
 	// create a pyramid with user provided sides
 	scene = module_create();
@@ -110,17 +122,18 @@ int main(int argc, char *argv[])
 	// Create the animation by adjusting the GTM
 	for (frame = 0; frame < 40; frame++)
 	{
-		char buffer[256];
-
+		// the previous frame is written while this one is drawn
+		src = framesink_image(sink);
 		matrix_rotateY(&GTM, cos(M_PI / 30.0), sin(M_PI / 30.0));
 		module_draw(scene, &VTM, &GTM, ds, light, src);
-		sprintf(buffer, "sphere-frame%03d.ppm", frame);
-		image_write(src, buffer);
-		image_reset(src);
+		framesink_submit(sink, src);
 	}
-	printf("Images complete\n");
-	// clean up
-	image_free(src);
+	// clean up, after the last frames are written
+	framesink_free(sink);
+	if (video)
+		video_close(video);
+	else
+		printf("Images complete\n");
 
 	module_delete(scene);
 	free(ds);
@@ -261,7 +261,8 @@ int main(int argc, char *argv[])
     Lighting *light;
     Matrix VTM, GTM;
     int rows = 600, cols = 800;
-    Image *src = image_create(rows, cols);
+    Image *src;
+    FrameSink *sink = framesink_create("terrainFlying-frame%03d.ppm", rows, cols, 2);
     Point A, B, C;
     Color White, Grey, Black;
 
@@ -336,7 +337,8 @@ int main(int argc, char *argv[])
     // Create the animation by adjusting the GTM
     for (frame = 0; frame < nFrames; frame++)
     {
-        char buffer[256];
+        // the previous frame is written while this one is drawn
+        src = framesink_image(sink);
 
         // Add the lighting
         light = lighting_create();
@@ -359,13 +361,11 @@ int main(int argc, char *argv[])
         matrix_rotateY(&GTM, cos(M_PI / 60.0), sin(M_PI / 60.0));
         module_draw(scene, &VTM, &GTM, ds, light, src);
 
-        sprintf(buffer, "terrainFlying-frame%03d.ppm", frame);
-        image_write(src, buffer);
-        image_reset(src);
+        framesink_submit(sink, src);
     }
 
-    // clean up
-    image_free(src);
+    // clean up, after the last frames are written
+    framesink_free(sink);
 
     module_delete(scene);
     module_delete(xwing);
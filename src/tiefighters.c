@@ -247,6 +247,10 @@ int main(int argc, char *argv[])
     Module *formation2;
     Module *formation3;
     Module *xwing;
+    DrawList *dl;
+    Mesh tieMesh;
+    Matrix fighter[3];
+    DrawMaterial tieMaterial[3];
     DrawState *ds;
     Lighting *light;
     Image *src;
@@ -374,16 +378,35 @@ int main(int argc, char *argv[])
 
     module_module(tie, sphere);
 
+    // Create the drawstate
+    ds = drawstate_create();
+    point_copy(&(ds->viewer), &(view.vrp));
+    ds->shade = ShadeGouraud;
+    drawstate_setColor(ds, OffWhite);
+
+    // a formation is three copies of one tie fighter mesh, drawn in one loop
+    dl = module_compile(tie, &gtm, ds);
+    mesh_init(&tieMesh);
+    drawlist_mesh(dl, &tieMesh);
+    drawlist_free(dl);
+    matrix_identity(&fighter[0]);
+    matrix_identity(&fighter[1]);
+    matrix_translate(&fighter[1], -20, 3, 20);
+    matrix_identity(&fighter[2]);
+    matrix_translate(&fighter[2], -10, 6, 15);
+    for (int i = 0; i < 3; i++)
+    {
+        tieMaterial[i].color = OffWhite;
+        tieMaterial[i].body = Gray;
+        tieMaterial[i].surface = Gray;
+        tieMaterial[i].surfaceCoeff = .8;
+    }
+
     formation1 = module_create();
     formation2 = module_create();
     formation3 = module_create();
-    module_module(formation1, tie);
-
-    module_translate(formation1, -20, 3, 20);
-    module_module(formation1, tie);
-
-    module_translate(formation1, 10, 3, -5);
-    module_module(formation1, tie);
+    module_meshInstances(formation1, &tieMesh, 3, fighter, tieMaterial);
+    mesh_clear(&tieMesh);
 
     module_module(formation2, formation1);
     module_module(formation3, formation1);
@@ -391,12 +414,8 @@ int main(int argc, char *argv[])
     xwing = module_create();
     xwing_build(xwing);
 
-    // Create the image and drawstate
+    // Create the image
     src = image_create(720, 1024);
-    ds = drawstate_create();
-    point_copy(&(ds->viewer), &(view.vrp));
-    ds->shade = ShadeGouraud;
-    drawstate_setColor(ds, OffWhite);
 
     for (t = 0; t < nFrames; t++)
     {
@@ -0,0 +1,162 @@
+/*
+	Benchmark of the depth buffer formats.
+
+	Renders the sphere and terrain scenes from src/ with each ImageDepth
+	format and prints the fill time per frame and the z-fighting: the
+	number of pixels whose color differs from the float depth buffer
+	render of the same frame, and the heap calls per frame after the
+	first two, which grow the drawing Arena and should be the only ones.
+
+	usage: depthBench [rows] [cols] [frames]
+*/
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/graphics.h"
+#include "heapCount.h"
+#define M_PI 3.14159265358979323846
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+/*
+	Sets up the view of a scene, looking from vrp along vpn.
+ */
+static void setView(View3D *view, Matrix *VTM, int rows, int cols, double d, double vx, double vy, double vz, double nx, double ny, double nz)
+{
+	point_set3D(&(view->vrp), vx, vy, vz);
+	vector_set(&(view->vpn), nx, ny, nz);
+	vector_set(&(view->vup), 0.0, 1.0, 0.0);
+	view->d = d;
+	view->du = 1.0;
+	view->dv = 1.0 * rows / cols;
+	view->screeny = rows;
+	view->screenx = cols;
+	view->f = 0.0;
+	view->b = 15.0;
+	matrix_setView3D(VTM, view);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *names[] = {"float", "16-bit", "24-bit"};
+	const char *scenes[] = {"spheres", "terrain"};
+	int rows = 1080, cols = 1920, frames = 20;
+	Color blue, white, gray;
+	Module *scene[2];
+	View3D view[2];
+	Matrix VTM[2], GTM;
+	DrawState *ds;
+	Lighting *light[2];
+	Image *ref, *src;
+	double t0, fill;
+	long fight, heap, calls;
+	int s, fmt, frame, r, c, j;
+
+	if (argc > 1)
+		rows = atoi(argv[1]);
+	if (argc > 2)
+		cols = atoi(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+
+	color_set(&white, 1.0, 1.0, 1.0);
+	color_set(&blue, 0.0, 0.0, 1.0);
+	color_set(&gray, .4, .4, .4);
+	ds = drawstate_create();
+	drawstate_setColor(ds, white);
+	ds->shade = ShadeGouraud;
+
+	// the spheres of sphere.c
+	scene[0] = module_create();
+	module_bodyColor(scene[0], &blue);
+	module_surfaceColor(scene[0], &white);
+	module_surfaceCoeff(scene[0], 5.0);
+	module_scale(scene[0], 0.7, 0.7, 0.7);
+	module_sphere(scene[0], 12);
+	module_identity(scene[0]);
+	module_scale(scene[0], 0.7, 0.7, 0.7);
+	module_translate(scene[0], -1.1, -1.1, 0.0);
+	module_sphere(scene[0], 20);
+	module_identity(scene[0]);
+	module_scale(scene[0], 0.7, 0.7, 0.7);
+	module_translate(scene[0], 1.1, 1.1, -0.5);
+	module_sphere(scene[0], 20);
+	setView(&view[0], &VTM[0], rows, cols, 1.0, 1.0, 0.7, 5.0, -1.0, -0.7, -5.0);
+
+	// the fractal terrain of terrain.c, with a fixed seed
+	srand48(42);
+	scene[1] = module_create();
+	module_translate(scene[1], -0.5, 0.0, -0.5);
+	module_scale(scene[1], 3.0, 1.0, 3.0);
+	module_terrain(scene[1], ds, 6, 0.5);
+	setView(&view[1], &VTM[1], rows, cols, 1.5, 0.0, 3.0, -5.0, 0.0, -2.0, 3.0);
+
+	for (s = 0; s < 2; s++)
+	{
+		light[s] = lighting_create();
+		lighting_add(light[s], LightAmbient, &gray, NULL, NULL, 0, 0);
+		lighting_add(light[s], LightPoint, &white, NULL, &(view[s].vrp), 0, 0);
+		point_copy(&(ds->viewer), &(view[s].vrp));
+
+		printf("%s, %d x %d, %d frames\n", scenes[s], cols, rows, frames);
+		ref = image_createFormat(rows, cols, ImageLayoutRows, ImageDepthFloat, ImageColorFloat);
+		for (fmt = ImageDepthFloat; fmt <= ImageDepth24; fmt++)
+		{
+			src = image_createFormat(rows, cols, ImageLayoutRows, fmt, ImageColorFloat);
+			fill = 0;
+			fight = 0;
+			heap = 0;
+			matrix_identity(&GTM);
+			for (frame = 0; frame < frames; frame++)
+			{
+				matrix_rotateY(&GTM, cos(M_PI / 30.0), sin(M_PI / 30.0));
+				if (fmt != ImageDepthFloat)
+				{
+					module_draw(scene[s], &VTM[s], &GTM, ds, light[s], ref);
+				}
+				calls = heapCalls;
+				t0 = now();
+				module_draw(scene[s], &VTM[s], &GTM, ds, light[s], src);
+				fill += now() - t0;
+				if (frame > 1)
+					heap += heapCalls - calls;
+
+				// any pixel that differs from the float render lost a depth tie
+				for (r = 0; r < rows && fmt != ImageDepthFloat; r++)
+				{
+					for (c = 0; c < cols; c++)
+					{
+						for (j = 0; j < 3; j++)
+						{
+							if (image_getc(src, r, c, j) != image_getc(ref, r, c, j))
+							{
+								fight++;
+								break;
+							}
+						}
+					}
+				}
+				image_reset(ref);
+				image_reset(src);
+			}
+			printf("  %-7s %8.3f ms/frame  %8ld z-fighting px  %6.1f heap calls/frame\n", names[fmt], 1e3 * fill / frames, fight,
+				   frames > 2 ? (double)heap / (frames - 2) : 0.0);
+			image_free(src);
+		}
+		image_free(ref);
+	}
+
+	module_delete(scene[0]);
+	module_delete(scene[1]);
+	free(ds);
+	module_freeFrameArena();
+
+	return (0);
+}
@@ -0,0 +1,229 @@
+/*
+	Benchmark of compiled draw lists.
+
+	Builds the spheres of sphere.c as a hierarchy of sub-modules, then
+	orbits the camera around it, drawing every frame once with module_draw
+	and once with the DrawList from module_compile. Prints the time per
+	frame of each, the time to compile, and the number of pixels where
+	the two images differ, which should be 0. It also prints the heap
+	calls each makes per frame after the first two, which should be 0
+	too: the temporaries of a frame come from the drawing thread's Arena,
+	which the first two frames grow to size. Last, it starts render
+	threads that each draw a frame and exit, and prints the heap blocks
+	they leave behind, which should be 0 as well: a thread's Arena is
+	freed when it exits.
+
+	usage: drawListBench [rows] [cols] [frames]
+*/
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../include/graphics.h"
+#include "heapCount.h"
+#define M_PI 3.14159265358979323846
+
+static double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+/*
+	What a render thread draws: one frame of the scene into an image of its own.
+ */
+typedef struct RenderJob
+{
+	Module *scene;
+	Matrix *VTM, *GTM;
+	DrawState *ds;
+	Lighting *light;
+	int rows, cols;
+} RenderJob;
+
+static void *renderThread(void *arg)
+{
+	RenderJob *job = (RenderJob *)arg;
+	Image *src = image_create(job->rows, job->cols);
+	DrawState ds;
+
+	// the elements change the DrawState, so each thread draws with a copy
+	drawstate_copy(&ds, job->ds);
+	module_draw(job->scene, job->VTM, job->GTM, &ds, job->light, src);
+	image_free(src);
+	return (NULL);
+}
+
+static void *idleThread(void *arg)
+{
+	return (arg);
+}
+
+/*
+	Sets up the view of the scene from a point on a circle around the y axis.
+ */
+static void setView(View3D *view, Matrix *VTM, int rows, int cols, double angle)
+{
+	point_set3D(&(view->vrp), 5.0 * sin(angle), 0.7, 5.0 * cos(angle));
+	vector_set(&(view->vpn), -view->vrp.val[0], -0.7, -view->vrp.val[2]);
+	vector_set(&(view->vup), 0.0, 1.0, 0.0);
+	view->d = 1.0;
+	view->du = 1.0;
+	view->dv = 1.0 * rows / cols;
+	view->screeny = rows;
+	view->screenx = cols;
+	view->f = 0.0;
+	view->b = 15.0;
+	matrix_setView3D(VTM, view);
+}
+
+int main(int argc, char *argv[])
+{
+	const ShadeMethod modes[] = {ShadeFlat, ShadeGouraud, ShadePhong};
+	const char *names[] = {"flat", "gouraud", "phong"};
+	int rows = 1080, cols = 1920, frames = 20;
+	Color blue, white, gray;
+	Module *scene, *sphere[3];
+	View3D view;
+	Matrix VTM, GTM;
+	DrawState *ds;
+	DrawList *dl;
+	Lighting *light;
+	Image *ref, *src;
+	double t0, tDraw, tList, tCompile;
+	long diff, heapDraw, heapList, calls, live;
+	RenderJob job = {0};
+	pthread_t thread;
+	int m, i, frame, r, c, j;
+
+	if (argc > 1)
+		rows = atoi(argv[1]);
+	if (argc > 2)
+		cols = atoi(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+
+	color_set(&white, 1.0, 1.0, 1.0);
+	color_set(&blue, 0.0, 0.0, 1.0);
+	color_set(&gray, .4, .4, .4);
+	ds = drawstate_create();
+	drawstate_setColor(ds, white);
+
+	// three spheres, each referenced from the scene twice
+	scene = module_create();
+	module_bodyColor(scene, &blue);
+	module_surfaceColor(scene, &white);
+	module_surfaceCoeff(scene, 5.0);
+	for (i = 0; i < 3; i++)
+	{
+		sphere[i] = module_create();
+		module_scale(sphere[i], 0.7, 0.7, 0.7);
+		module_sphere(sphere[i], 8 + 6 * i);
+	}
+	for (i = 0; i < 6; i++)
+	{
+		module_identity(scene);
+		module_translate(scene, 1.1 * cos(i * M_PI / 3), 1.1 * sin(i * M_PI / 3), -0.3 * i);
+		module_module(scene, sphere[i % 3]);
+	}
+	matrix_identity(&GTM);
+
+	light = lighting_create();
+	lighting_add(light, LightAmbient, &gray, NULL, NULL, 0, 0);
+	setView(&view, &VTM, rows, cols, 0.0);
+	lighting_add(light, LightPoint, &white, NULL, &(view.vrp), 0, 0);
+
+	printf("spheres, %d x %d, %d frames\n", cols, rows, frames);
+	ref = image_create(rows, cols);
+	src = image_create(rows, cols);
+	for (m = 0; m < 3; m++)
+	{
+		ds->shade = modes[m];
+		t0 = now();
+		dl = module_compile(scene, &GTM, ds);
+		tCompile = now() - t0;
+		tDraw = tList = 0;
+		diff = heapDraw = heapList = 0;
+		for (frame = 0; frame < frames; frame++)
+		{
+			setView(&view, &VTM, rows, cols, 2 * M_PI * frame / frames);
+			point_copy(&(ds->viewer), &(view.vrp));
+
+			calls = heapCalls;
+			t0 = now();
+			module_draw(scene, &VTM, &GTM, ds, light, ref);
+			tDraw += now() - t0;
+			if (frame > 1)
+				heapDraw += heapCalls - calls;
+			calls = heapCalls;
+			t0 = now();
+			drawlist_draw(dl, &VTM, ds, light, src);
+			tList += now() - t0;
+			if (frame > 1)
+				heapList += heapCalls - calls;
+
+			for (r = 0; r < rows; r++)
+			{
+				for (c = 0; c < cols; c++)
+				{
+					for (j = 0; j < 3; j++)
+					{
+						if (image_getc(src, r, c, j) != image_getc(ref, r, c, j))
+						{
+							diff++;
+							break;
+						}
+					}
+				}
+			}
+			image_reset(ref);
+			image_reset(src);
+		}
+		printf("  %-8s module_draw %8.3f ms/frame  drawlist_draw %8.3f ms/frame  compile %7.3f ms  %ld px differ\n",
+			   names[m], 1e3 * tDraw / frames, 1e3 * tList / frames, 1e3 * tCompile, diff);
+		printf("  %-8s heap calls per frame: module_draw %.1f  drawlist_draw %.1f\n",
+			   "", frames > 2 ? (double)heapDraw / (frames - 2) : 0.0, frames > 2 ? (double)heapList / (frames - 2) : 0.0);
+		drawlist_free(dl);
+	}
+
+	// render threads one after another, each drawing a frame and exiting
+	job.scene = scene;
+	job.VTM = &VTM;
+	job.GTM = &GTM;
+	job.ds = ds;
+	job.light = light;
+	job.rows = rows;
+	job.cols = cols;
+	// glibc keeps a block from the first thread a program starts, so an idle one goes first
+	if (pthread_create(&thread, NULL, idleThread, NULL) != 0)
+	{
+		fprintf(stderr, "Unable to start a render thread\n");
+		exit(-1);
+	}
+	pthread_join(thread, NULL);
+	live = heapLive;
+	for (i = 0; i < 4; i++)
+	{
+		if (pthread_create(&thread, NULL, renderThread, &job) != 0)
+		{
+			fprintf(stderr, "Unable to start a render thread\n");
+			exit(-1);
+		}
+		pthread_join(thread, NULL);
+	}
+	printf("  heap blocks left by 4 render threads after they exited: %ld\n", heapLive - live);
+
+	image_free(ref);
+	image_free(src);
+	module_delete(scene);
+	for (i = 0; i < 3; i++)
+		module_delete(sphere[i]);
+	lighting_delete(light);
+	free(ds);
+	module_freeFrameArena();
+
+	return (0);
+}
@@ -0,0 +1,88 @@
+/*
+	Counts the calls a benchmark makes to the heap.
+
+	Include this in exactly one file of a program. It replaces malloc,
+	calloc, realloc, aligned_alloc, posix_memalign, and free with versions
+	that add one to heapCalls and pass the call on to glibc, so a
+	benchmark can read heapCalls before and after a frame to see how many
+	allocations the frame made, counting those of the tile threads. They
+	also keep heapLive, the blocks allocated and not yet freed, so a
+	benchmark can see what a piece of code leaves behind.
+*/
+#ifndef HEAPCOUNT_H
+#define HEAPCOUNT_H
+
+#include <stddef.h>
+#include <errno.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+static long heapCalls = 0;
+static long heapLive = 0;
+
+static void heapCount(void)
+{
+	__atomic_fetch_add(&heapCalls, 1, __ATOMIC_RELAXED);
+}
+
+static void *heapAdd(void *p)
+{
+	if (p)
+		__atomic_fetch_add(&heapLive, 1, __ATOMIC_RELAXED);
+	return (p);
+}
+
+void *malloc(size_t size)
+{
+	heapCount();
+	return (heapAdd(__libc_malloc(size)));
+}
+
+void *calloc(size_t n, size_t size)
+{
+	heapCount();
+	return (heapAdd(__libc_calloc(n, size)));
+}
+
+void *realloc(void *p, size_t size)
+{
+	void *q;
+
+	heapCount();
+	q = __libc_realloc(p, size);
+	// a new block from NULL, or the old block freed by a size of 0
+	if (!p && q)
+		__atomic_fetch_add(&heapLive, 1, __ATOMIC_RELAXED);
+	else if (p && !size)
+		__atomic_fetch_sub(&heapLive, 1, __ATOMIC_RELAXED);
+	return (q);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	heapCount();
+	return (heapAdd(__libc_memalign(align, size)));
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	heapCount();
+	*p = heapAdd(__libc_memalign(align, size));
+	return (*p || !size ? 0 : ENOMEM);
+}
+
+void free(void *p)
+{
+	if (p)
+	{
+		heapCount();
+		__atomic_fetch_sub(&heapLive, 1, __ATOMIC_RELAXED);
+	}
+	__libc_free(p);
+}
+
+#endif // HEAPCOUNT_H
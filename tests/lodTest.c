@@ -0,0 +1,152 @@
+/*
+	Regression test of level of detail with a depth pre-pass.
+
+	One sphereLOD module is drawn from four places in the scene, each a
+	little farther from the camera than the one before, so the places draw
+	different levels and switch at different times while the camera flies
+	away and back. Every frame is rendered with and without a depth
+	pre-pass, each with its own copy of the scene so both keep the same
+	hysteresis history. The shading pass only colors the pixels the
+	pre-pass left at equal depth, so a level picked differently in the two
+	passes shows up as missing pixels. Prints the pixels that differ in
+	each frame and exits with 1 if any do.
+
+	usage: lodTest [rows] [cols] [frames]
+*/
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include "../include/graphics.h"
+#define M_PI 3.14159265358979323846
+
+/*
+	Builds the scene: a pair of balls, one a bit farther than the other,
+	and the same pair again behind it. Fills in the three modules so they
+	can be deleted.
+ */
+static Module *buildScene(Module *part[3])
+{
+	Color white, red;
+	Module *ball, *pair, *scene;
+
+	color_set(&white, 1.0, 1.0, 1.0);
+	color_set(&red, .8, .2, .1);
+
+	ball = module_create();
+	module_surfaceColor(ball, &white);
+	module_sphereLOD(ball, 64);
+
+	pair = module_create();
+	module_bodyColor(pair, &red);
+	module_translate(pair, -1.2, 0.0, 0.0);
+	module_module(pair, ball);
+	module_identity(pair);
+	module_translate(pair, 1.2, 0.0, -2.0);
+	module_module(pair, ball);
+
+	scene = module_create();
+	module_translate(scene, 0.0, -1.0, -2.0);
+	module_module(scene, pair);
+	module_identity(scene);
+	module_translate(scene, 0.0, 1.5, -4.0);
+	module_module(scene, pair);
+
+	part[0] = ball;
+	part[1] = pair;
+	part[2] = scene;
+	return (scene);
+}
+
+int main(int argc, char *argv[])
+{
+	int rows = 240, cols = 320, frames = 120;
+	Color white, gray;
+	Module *scene[2], *part[2][3];
+	View3D view;
+	Matrix VTM, GTM;
+	DrawState *ds;
+	Lighting *light;
+	Image *ref, *src;
+	long differ, total = 0;
+	int frame, r, c, j;
+
+	if (argc > 1)
+		rows = atoi(argv[1]);
+	if (argc > 2)
+		cols = atoi(argv[2]);
+	if (argc > 3)
+		frames = atoi(argv[3]);
+
+	scene[0] = buildScene(part[0]);
+	scene[1] = buildScene(part[1]);
+
+	point_set3D(&(view.vrp), 0.0, 0.0, 0.0);
+	vector_set(&(view.vpn), 0.0, 0.0, -1.0);
+	vector_set(&(view.vup), 0.0, 1.0, 0.0);
+	view.d = 1.5;
+	view.du = 1.6;
+	view.dv = 1.6 * rows / cols;
+	view.screenx = cols;
+	view.screeny = rows;
+	view.f = 0.0;
+	view.b = 100.0;
+
+	color_set(&white, 1.0, 1.0, 1.0);
+	color_set(&gray, .3, .3, .3);
+	light = lighting_create();
+	lighting_add(light, LightAmbient, &gray, NULL, NULL, 0, 0);
+	lighting_add(light, LightPoint, &white, NULL, &(view.vrp), 0, 0);
+	ds = drawstate_create();
+	ds->shade = ShadeGouraud;
+	drawstate_setSurfaceCoeff(ds, 20.0);
+	matrix_identity(&GTM);
+
+	ref = image_create(rows, cols);
+	src = image_create(rows, cols);
+	for (frame = 0; frame < frames; frame++)
+	{
+		// fly away and back so every place switches levels both ways
+		view.vrp.val[2] = 22.0 - 20.0 * cos(2.0 * M_PI * frame / frames);
+		point_copy(&(ds->viewer), &(view.vrp));
+		matrix_setView3D(&VTM, &view);
+
+		image_reset(ref);
+		ds->depthPrepass = 0;
+		module_draw(scene[0], &VTM, &GTM, ds, light, ref);
+		image_reset(src);
+		ds->depthPrepass = 1;
+		module_draw(scene[1], &VTM, &GTM, ds, light, src);
+
+		differ = 0;
+		for (r = 0; r < rows; r++)
+		{
+			for (c = 0; c < cols; c++)
+			{
+				for (j = 0; j < 3; j++)
+				{
+					if (image_getc(src, r, c, j) != image_getc(ref, r, c, j))
+					{
+						differ++;
+						break;
+					}
+				}
+			}
+		}
+		printf("frame %3d  camera z %6.2f  %6ld px differ\n", frame, view.vrp.val[2], differ);
+		total += differ;
+	}
+
+	image_free(ref);
+	image_free(src);
+	for (j = 0; j < 2; j++)
+	{
+		for (c = 0; c < 3; c++)
+			module_delete(part[j][c]);
+	}
+	lighting_delete(light);
+	free(ds);
+	module_freeFrameArena();
+
+	printf("%s\n", total ? "FAILED: the pre-pass changed the image" : "passed");
+	return (total ? 1 : 0);
+}
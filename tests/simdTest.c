@@ -0,0 +1,177 @@
+/*
+	Regression test of the SIMD span kernels.
+
+	Draws the same polygons twice, once with polygon_setSIMD(0) and once
+	with polygon_setSIMD(1), with Gouraud and depth shading, with floating
+	and fixed point edges, and compares the colors and depths of every
+	pixel. The polygons are a mix of large overlapping ones, so the z-test
+	masks are exercised, small random triangles, and thin strips from a
+	quarter of a pixel to ten pixels wide starting at every column offset
+	within an AVX2 vector, so most spans are narrower than one vector or
+	end in a partial one. Prints the pixels that differ for each mode and
+	exits with 1 if any do. The scalar kernels are the reference; the SIMD
+	kernels compared are the widest the CPU supports.
+
+	usage: simdTest [rows] [cols] [triangles]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "../include/graphics.h"
+
+/*
+	Returns a random number in [lo, hi).
+ */
+static double uniform(double lo, double hi)
+{
+	return (lo + (hi - lo) * drand48());
+}
+
+/*
+	Draws a polygon with random vertex colors and depths in [0.1, 1).
+ */
+static void drawRandom(Polygon *p, int numV, Point *vlist, Image *src, DrawState *ds)
+{
+	Color clist[4];
+	int i;
+
+	for (i = 0; i < numV; i++)
+	{
+		vlist[i].val[2] = uniform(0.1, 1.0);
+		color_set(&(clist[i]), uniform(0.0, 1.0), uniform(0.0, 1.0), uniform(0.0, 1.0));
+	}
+	polygon_set(p, numV, vlist);
+	polygon_setColors(p, numV, clist);
+	color_set(&(ds->color), uniform(0.0, 1.0), uniform(0.0, 1.0), uniform(0.0, 1.0));
+	polygon_drawShade(p, src, ds, NULL);
+}
+
+/*
+	Draws the test scene. The same seed gives the same scene.
+ */
+static void drawScene(Image *src, DrawState *ds, int triangles)
+{
+	Polygon *p = polygon_create();
+	Point v[4];
+	double x, y, w, h;
+	int i, j;
+
+	srand48(11);
+	image_reset(src);
+
+	// large quads that cross each other in depth
+	for (i = 0; i < 12; i++)
+	{
+		x = uniform(-0.2, 0.8) * src->cols;
+		y = uniform(-0.2, 0.8) * src->rows;
+		w = uniform(0.2, 0.6) * src->cols;
+		h = uniform(0.2, 0.6) * src->rows;
+		point_set3D(&(v[0]), x, y, 0.0);
+		point_set3D(&(v[1]), x + w, y + uniform(-0.1, 0.1) * h, 0.0);
+		point_set3D(&(v[2]), x + w, y + h, 0.0);
+		point_set3D(&(v[3]), x + uniform(-0.1, 0.1) * w, y + h, 0.0);
+		drawRandom(p, 4, v, src, ds);
+	}
+
+	// small random triangles, a few pixels across
+	for (i = 0; i < triangles; i++)
+	{
+		x = uniform(0.0, src->cols);
+		y = uniform(0.0, src->rows);
+		for (j = 0; j < 3; j++)
+			point_set3D(&(v[j]), x + uniform(-6.0, 6.0), y + uniform(-6.0, 6.0), 0.0);
+		drawRandom(p, 3, v, src, ds);
+	}
+
+	// thin slanted strips at every column offset within a vector
+	for (i = 0; i < 320; i++)
+	{
+		w = 0.25 + (i % 40) * 0.25;
+		x = 8 * uniform(0.0, src->cols / 8 - 2) + (i % 8) + uniform(0.0, 1.0);
+		y = uniform(0.0, 0.7) * src->rows;
+		h = uniform(4.0, 0.3 * src->rows);
+		point_set3D(&(v[0]), x, y, 0.0);
+		point_set3D(&(v[1]), x + w, y, 0.0);
+		point_set3D(&(v[2]), x + w + uniform(-3.0, 3.0), y + h, 0.0);
+		point_set3D(&(v[3]), v[2].val[0] - w, y + h, 0.0);
+		drawRandom(p, 4, v, src, ds);
+	}
+
+	polygon_clear(p);
+	polygon_free(p);
+}
+
+/*
+	Returns the number of pixels whose color or depth differ.
+ */
+static long compare(Image *a, Image *b)
+{
+	long differ = 0;
+	int r, c, j;
+
+	for (r = 0; r < a->rows; r++)
+	{
+		for (c = 0; c < a->cols; c++)
+		{
+			if (image_getz(a, r, c) != image_getz(b, r, c))
+			{
+				differ++;
+				continue;
+			}
+			for (j = 0; j < 3; j++)
+			{
+				if (image_getc(a, r, c, j) != image_getc(b, r, c, j))
+				{
+					differ++;
+					break;
+				}
+			}
+		}
+	}
+	return (differ);
+}
+
+int main(int argc, char *argv[])
+{
+	int rows = 300, cols = 400, triangles = 4000;
+	ShadeMethod shade[2] = {ShadeGouraud, ShadeDepth};
+	const char *name[2] = {"Gouraud", "depth"};
+	DrawState *ds;
+	Image *ref, *src;
+	long differ, total = 0;
+	int i, fixed;
+
+	if (argc > 1)
+		rows = atoi(argv[1]);
+	if (argc > 2)
+		cols = atoi(argv[2]);
+	if (argc > 3)
+		triangles = atoi(argv[3]);
+
+	ds = drawstate_create();
+	ref = image_create(rows, cols);
+	src = image_create(rows, cols);
+	for (fixed = 0; fixed < 2; fixed++)
+	{
+		polygon_setFixedPoint(fixed);
+		for (i = 0; i < 2; i++)
+		{
+			ds->shade = shade[i];
+			polygon_setSIMD(0);
+			drawScene(ref, ds, triangles);
+			polygon_setSIMD(1);
+			drawScene(src, ds, triangles);
+
+			differ = compare(ref, src);
+			printf("%-7s %-14s %6ld px differ\n", name[i], fixed ? "fixed point" : "floating point", differ);
+			total += differ;
+		}
+	}
+	polygon_setFixedPoint(0);
+
+	image_free(ref);
+	image_free(src);
+	free(ds);
+
+	printf("%s\n", total ? "FAILED: the SIMD kernels changed the image" : "passed");
+	return (total ? 1 : 0);
+}